@@ -12,6 +12,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <lk/compiler.h>
+#include <lk/console_cmd.h>
+#include <arch/atomic.h>
+#include <kernel/event.h>
 #include <kernel/thread.h>
 #include <lib/minip.h>
 #include <lib/tftp.h>
@@ -83,39 +86,38 @@ static int chargen_server(void *arg) {
     }
 }
 
+/* the data stays in the pktbufs it arrived in */
 static int discard_worker(void *socket) {
     uint64_t count = 0;
     uint32_t crc = 0;
     tcp_socket_t *s = socket;
 
-#define DISCARD_BUFSIZE 1024
-
-    uint8_t *buf = malloc(DISCARD_BUFSIZE);
-    if (!buf) {
-        TRACEF("error allocating buffer\n");
-    }
-
     lk_time_t t = current_time();
     for (;;) {
-        ssize_t ret = tcp_read(s, buf, DISCARD_BUFSIZE);
+        pktbuf_t *p;
+        ssize_t ret = tcp_read_pktbuf(s, &p);
         if (ret <= 0)
             break;
 
-        crc = crc32(crc, buf, ret);
+        crc = crc32(crc, p->data, ret);
+        pktbuf_free(p, true);
 
         count += ret;
     }
     t = current_time() - t;
 
-    TRACEF("discard worker exiting, read %llu bytes in %u msecs (%llu bytes/sec), crc32 0x%x\n",
-           count, (uint32_t)t, count * 1000 / t, crc);
-    tcp_close(s);
+    tcp_copy_stats_t stats;
+    tcp_get_copy_stats(s, &stats);
 
-    free(buf);
+    TRACEF("discard worker exiting, read %llu bytes in %u msecs (%llu bytes/sec), crc32 0x%x, %llu bytes copied\n",
+           count, (uint32_t)t, t ? count * 1000 / t : 0, crc, stats.rx_copied);
+    tcp_close(s);
 
     return 0;
 }
 
+#define DISCARD_RX_BUFFER (256 * 1024)
+
 static int discard_server(void *arg) {
     status_t err;
     tcp_socket_t *listen_socket;
@@ -126,6 +128,9 @@ static int discard_server(void *arg) {
         return -1;
     }
 
+    /* a bigger window so bulk senders aren't held to a few segments per round trip */
+    tcp_set_buffer_sizes(listen_socket, DISCARD_RX_BUFFER, 0);
+
     for (;;) {
         tcp_socket_t *accept_socket;
 
@@ -194,6 +199,113 @@ static int echo_server(void *arg) {
     }
 }
 
+/* tcp_write_ref buffers the socket still points at */
+struct bench_refs {
+    volatile int pending;
+    event_t idle;
+};
+
+static void bench_write_done(void *arg) {
+    struct bench_refs *refs = arg;
+
+    if (atomic_add(&refs->pending, -1) == 1)
+        event_signal(&refs->idle, false);
+}
+
+/* push data at our own discard server through the minip loopback, dropping
+ * some of it on the way to exercise tcp loss recovery. With ref set the data
+ * is sent from the buffer it was written from instead of copied into the socket */
+static int cmd_inetsrv_bench(int argc, const console_cmd_args *argv) {
+    size_t len = 4 * 1024 * 1024;
+    uint loss = 1;
+    lk_time_t delay = 1;
+    bool ref = false;
+
+    if (argc > 1)
+        len = argv[1].u;
+    if (argc > 2)
+        loss = argv[2].u;
+    if (argc > 3)
+        delay = argv[3].u;
+    if (argc > 4)
+        ref = argv[4].u;
+
+    uint32_t addr = minip_get_ipaddr();
+    if (addr == IPV4_NONE) {
+        printf("no ip address configured\n");
+        return ERR_NOT_READY;
+    }
+
+#define BENCH_BUFSIZE 8192
+    uint8_t *buf = malloc(BENCH_BUFSIZE);
+    if (!buf)
+        return ERR_NO_MEMORY;
+    for (size_t i = 0; i < BENCH_BUFSIZE; i++)
+        buf[i] = i;
+
+    /* syn and fin aren't retransmitted, only lose data */
+    tcp_socket_t *s;
+    minip_set_loopback_loss(0, delay);
+    status_t err = tcp_connect(&s, addr, 9);
+    if (err < 0) {
+        printf("error %d connecting to the discard server\n", err);
+        free(buf);
+        return err;
+    }
+
+    /* enough queued to fill the window the discard server offers */
+    tcp_set_buffer_sizes(s, 0, DISCARD_RX_BUFFER);
+
+    printf("writing %zu bytes to the discard server, %u%% loss %u ms delay%s\n",
+           len, loss, (uint)delay, ref ? ", by reference" : "");
+    minip_set_loopback_loss(loss, delay);
+
+    /* the same buffer is queued over and over, it's free once none are left */
+    struct bench_refs refs = { .pending = 0 };
+    event_init(&refs.idle, false, EVENT_FLAG_AUTOUNSIGNAL);
+
+    lk_time_t t = current_time();
+    size_t written = 0;
+    while (written < len) {
+        size_t n = MIN(len - written, BENCH_BUFSIZE);
+        ssize_t ret;
+        if (ref) {
+            atomic_add(&refs.pending, 1);
+            ret = tcp_write_ref(s, buf, n, &bench_write_done, &refs);
+            if (ret < 0)
+                atomic_add(&refs.pending, -1);
+        } else {
+            ret = tcp_write(s, buf, n);
+        }
+        if (ret < 0) {
+            printf("tcp_write returns %zd\n", ret);
+            break;
+        }
+        written += ret;
+    }
+
+    /* close waits for the rest to be acked */
+    minip_set_loopback_loss(0, delay);
+    tcp_copy_stats_t stats;
+    tcp_get_copy_stats(s, &stats);
+    tcp_close(s);
+    t = current_time() - t;
+    minip_set_loopback_loss(0, 0);
+
+    printf("wrote %zu bytes in %u msecs (%llu bytes/sec), %llu bytes copied\n",
+           written, (uint)t, t ? (uint64_t)written * 1000 / t : 0, stats.tx_copied);
+
+    while (atomic_add(&refs.pending, 0) > 0)
+        event_wait(&refs.idle);
+    event_destroy(&refs.idle);
+    free(buf);
+    return NO_ERROR;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("inetsrv_bench", "tcp throughput over a lossy loopback: [bytes] [loss %] [delay ms] [ref]", &cmd_inetsrv_bench)
+STATIC_COMMAND_END(inetsrv);
+
 static void inetsrv_init(const struct app_descriptor *app) {
 }
 
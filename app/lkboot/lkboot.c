@@ -41,6 +41,11 @@
 #define LKBOOT_AUTOBOOT_TIMEOUT 5000
 #endif
 
+/* images come in over tcp, a big receive window keeps the link busy */
+#ifndef LKBOOT_TCP_RX_BUFFER
+#define LKBOOT_TCP_RX_BUFFER (1024 * 1024)
+#endif
+
 #define LOCAL_TRACE 0
 
 #define STATE_OPEN 0
@@ -223,6 +228,7 @@ static status_t lkboot_server(lk_time_t timeout) {
         printf("lkboot: error opening listen socket\n");
         return ERR_NO_MEMORY;
     }
+    tcp_set_buffer_sizes(listen_socket, LKBOOT_TCP_RX_BUFFER, 0);
 #endif
 
     /* run the main lkserver loop */
@@ -16,6 +16,10 @@
 #include <kernel/mutex.h>
 #include <kernel/semaphore.h>
 #include <kernel/event.h>
+#include <kernel/timer.h>
+#include <kernel/mp.h>
+#include <lib/heap.h>
+#include <lib/slab.h>
 #include <platform.h>
 
 const size_t BUFSIZE = (1024*1024);
@@ -195,6 +199,220 @@ __NO_INLINE static void arm_bench_multi_issue(void) {
 #endif // __CORTEX_M
 #endif // ARCH_ARM
 
+static enum handler_return bench_timer_callback(timer_t *t, lk_time_t now, void *arg) {
+    return INT_NO_RESCHEDULE;
+}
+
+__NO_INLINE static void bench_timers(void) {
+#define TIMER_COUNT 100000
+    timer_t *timers = malloc(sizeof(timer_t) * TIMER_COUNT);
+    if (!timers) {
+        printf("failed to allocate timers\n");
+        return;
+    }
+
+    /* spread the deadlines from a minute to a few hours out so none fire while we
+     * measure, and so they land on all levels of the timer wheel */
+    lk_time_t *delays = malloc(sizeof(lk_time_t) * TIMER_COUNT);
+    if (!delays) {
+        printf("failed to allocate delays\n");
+        free(timers);
+        return;
+    }
+    for (uint i = 0; i < TIMER_COUNT; i++) {
+        timer_initialize(&timers[i]);
+        delays[i] = 60000 + (rand() % (4 * 60 * 60 * 1000));
+    }
+
+    lk_bigtime_t t = current_time_hires();
+    ulong count = arch_cycle_count();
+    for (uint i = 0; i < TIMER_COUNT; i++) {
+        timer_set_oneshot(&timers[i], delays[i], &bench_timer_callback, NULL);
+    }
+    count = arch_cycle_count() - count;
+    t = current_time_hires() - t;
+
+    printf("took %llu usecs (%lu cycles, %lu cycles/timer) to arm %u timers\n",
+           t, count, count / TIMER_COUNT, TIMER_COUNT);
+
+    /* cancel in a different order than they were armed */
+    t = current_time_hires();
+    count = arch_cycle_count();
+    for (uint i = 0; i < TIMER_COUNT; i++) {
+        timer_cancel(&timers[(i * 7919) % TIMER_COUNT]);
+    }
+    count = arch_cycle_count() - count;
+    t = current_time_hires() - t;
+
+    printf("took %llu usecs (%lu cycles, %lu cycles/timer) to cancel %u timers\n",
+           t, count, count / TIMER_COUNT, TIMER_COUNT);
+
+    free(delays);
+    free(timers);
+#undef TIMER_COUNT
+}
+
+static mutex_t bench_mutex_lock = MUTEX_INITIAL_VALUE(bench_mutex_lock);
+static volatile bool bench_mutex_done;
+
+static int bench_mutex_thread(void *arg) {
+    ulong *ops = arg;
+
+    while (!bench_mutex_done) {
+        mutex_acquire(&bench_mutex_lock);
+        (*ops)++;
+        mutex_release(&bench_mutex_lock);
+    }
+
+    return 0;
+}
+
+__NO_INLINE static void bench_mutex(void) {
+#define MUTEX_ITERATIONS 100000
+#define MUTEX_THREADS 4
+#define MUTEX_RUN_MS 1000
+    /* nobody else wants the mutex, so every pair stays on the fast path */
+    lk_bigtime_t t = current_time_hires();
+    ulong count = arch_cycle_count();
+    for (uint i = 0; i < MUTEX_ITERATIONS; i++) {
+        mutex_acquire(&bench_mutex_lock);
+        mutex_release(&bench_mutex_lock);
+    }
+    count = arch_cycle_count() - count;
+    t = current_time_hires() - t;
+
+    printf("took %llu usecs (%lu cycles, %lu cycles/pair) to acquire and release an uncontended mutex %u times\n",
+           t, count, count / MUTEX_ITERATIONS, MUTEX_ITERATIONS);
+
+    /* a handful of threads hammering the same mutex */
+    static ulong ops[MUTEX_THREADS];
+    thread_t *threads[MUTEX_THREADS];
+
+    bench_mutex_done = false;
+    for (uint i = 0; i < MUTEX_THREADS; i++) {
+        ops[i] = 0;
+        threads[i] = thread_create("mutex bench", &bench_mutex_thread, &ops[i],
+                                   DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+        thread_resume(threads[i]);
+    }
+
+    thread_sleep(MUTEX_RUN_MS);
+    bench_mutex_done = true;
+
+    ulong total = 0;
+    for (uint i = 0; i < MUTEX_THREADS; i++) {
+        thread_join(threads[i], NULL, INFINITE_TIME);
+        total += ops[i];
+    }
+
+    printf("%u threads did %lu contended acquire/release pairs in %u msecs (%lu pairs/sec)\n",
+           MUTEX_THREADS, total, MUTEX_RUN_MS, total * 1000 / MUTEX_RUN_MS);
+#undef MUTEX_ITERATIONS
+#undef MUTEX_THREADS
+#undef MUTEX_RUN_MS
+}
+
+static volatile bool bench_malloc_done;
+
+static int bench_malloc_thread(void *arg) {
+    ulong *ops = arg;
+    void *ptrs[16] = { 0 };
+    uint seed = (uintptr_t)arg;
+
+    while (!bench_malloc_done) {
+        seed = seed * 1664525 + 1013904223;
+        uint i = (seed >> 16) % countof(ptrs);
+        free(ptrs[i]);
+        ptrs[i] = malloc(16 + (seed >> 8) % 240);
+        (*ops)++;
+    }
+
+    for (uint i = 0; i < countof(ptrs); i++)
+        free(ptrs[i]);
+
+    return 0;
+}
+
+__NO_INLINE static void bench_malloc(void) {
+#define MALLOC_RUN_MS 500
+    /* one thread per cpu churning small allocations, like pktbufs and sockets do */
+    for (uint cpus = 1; cpus <= active_cpu_count(); cpus *= 2) {
+        static ulong ops[SMP_MAX_CPUS];
+        thread_t *threads[SMP_MAX_CPUS];
+
+        bench_malloc_done = false;
+        for (uint i = 0; i < cpus; i++) {
+            ops[i] = 0;
+            threads[i] = thread_create("malloc bench", &bench_malloc_thread, &ops[i],
+                                       DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+            thread_set_pinned_cpu(threads[i], active_cpu(i));
+            thread_resume(threads[i]);
+        }
+
+        /* sleep at a higher priority so we get control back to stop them */
+        int old_priority = get_current_thread()->base_priority;
+        thread_set_priority(HIGH_PRIORITY);
+        thread_sleep(MALLOC_RUN_MS);
+        bench_malloc_done = true;
+        thread_set_priority(old_priority);
+
+        ulong total = 0;
+        for (uint i = 0; i < cpus; i++) {
+            thread_join(threads[i], NULL, INFINITE_TIME);
+            total += ops[i];
+        }
+
+        printf("%u cpu%s: %lu malloc/free pairs/sec\n", cpus, cpus > 1 ? "s" : "",
+               total * 1000 / MALLOC_RUN_MS);
+    }
+
+    /* give back whatever the run left in the per cpu caches */
+    heap_trim();
+#undef MALLOC_RUN_MS
+}
+
+/* allocate a batch of 64 byte objects and free them again, timing each half */
+static void bench_slab_pass(const char *name, slab_cache_t *cache) {
+#define SLAB_BATCH 256
+#define SLAB_PASSES 64
+    static void *ptrs[SLAB_BATCH];
+    ulong alloc_cycles = 0;
+    ulong free_cycles = 0;
+
+    for (uint pass = 0; pass < SLAB_PASSES; pass++) {
+        ulong count = arch_cycle_count();
+        for (uint i = 0; i < SLAB_BATCH; i++)
+            ptrs[i] = cache ? slab_cache_alloc(cache) : malloc(64);
+        alloc_cycles += arch_cycle_count() - count;
+
+        count = arch_cycle_count();
+        for (uint i = 0; i < SLAB_BATCH; i++) {
+            if (cache)
+                slab_cache_free(cache, ptrs[i]);
+            else
+                free(ptrs[i]);
+        }
+        free_cycles += arch_cycle_count() - count;
+    }
+
+    printf("%s: %lu cycles/alloc, %lu cycles/free\n", name,
+           alloc_cycles / (SLAB_BATCH * SLAB_PASSES), free_cycles / (SLAB_BATCH * SLAB_PASSES));
+#undef SLAB_BATCH
+#undef SLAB_PASSES
+}
+
+__NO_INLINE static void bench_slab(void) {
+    slab_cache_t *cache = slab_cache_create("bench", 64, 0, NULL, NULL);
+    if (!cache)
+        return;
+
+    bench_slab_pass("malloc(64)", NULL);
+    bench_slab_pass("slab cache (64)", cache);
+
+    slab_cache_destroy(cache);
+    heap_trim();
+}
+
 #if WITH_LIB_LIBM
 #include <math.h>
 
@@ -246,6 +464,11 @@ int benchmarks(int argc, const console_cmd_args *argv) {
     bench_cset_uint64_t();
     bench_cset_wide();
 
+    bench_timers();
+    bench_mutex();
+    bench_malloc();
+    bench_slab();
+
 #if ARCH_ARM
     arm_bench_cset_stm();
 
@@ -115,6 +115,38 @@ int cbuf_tests(int argc, const console_cmd_args *argv) {
         ASSERT_LEQ(pos_in, pos_out);
     }
 
+    printf("running write ahead tests...\n");
+    cbuf_reset(&cbuf);
+
+    // Leave the head near the end so the ahead writes wrap.
+    ASSERT_EQ(12UL, cbuf_write(&cbuf, "xxxxxxxxxxxx", 12, false));
+    ASSERT_EQ(12UL, cbuf_read(&cbuf, NULL, 12, false));
+    {
+        char buf[16];
+
+        // Park "efgh" behind a hole, nothing is readable yet.
+        ASSERT_EQ(4UL, cbuf_write_ahead(&cbuf, 4, "efgh", 4));
+        ASSERT_EQ(0UL, cbuf_space_used(&cbuf));
+
+        // Nothing lands past the free space.
+        ASSERT_EQ(3UL, cbuf_write_ahead(&cbuf, 12, "mnop", 4));
+        ASSERT_EQ(0UL, cbuf_write_ahead(&cbuf, 15, "p", 1));
+
+        // Fill the hole, then publish what was parked behind it.
+        ASSERT_EQ(4UL, cbuf_write(&cbuf, "abcd", 4, false));
+        ASSERT_EQ(4UL, cbuf_commit(&cbuf, 4, false));
+        ASSERT_EQ(8UL, cbuf_space_used(&cbuf));
+
+        ASSERT_EQ(8UL, cbuf_read(&cbuf, buf, sizeof(buf), false));
+        for (int i = 0; i < 8; ++i) {
+            ASSERT_EQ(buf[i], 'a' + i);
+        }
+
+        // Can't commit more than there is room for.
+        ASSERT_EQ(15UL, cbuf_commit(&cbuf, 32, false));
+        ASSERT_EQ(0UL, cbuf_space_avail(&cbuf));
+    }
+
     free(cbuf.buf);
 
     printf("cbuf tests passed\n");
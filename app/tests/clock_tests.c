@@ -87,6 +87,28 @@ int clock_tests(int argc, const console_cmd_args *argv) {
         }
     }
 
+    printf("measuring thread_sleep_ns() overshoot\n");
+    {
+        static const lk_time_ns_t delays[] = { 50000, 100000, 250000, 500000, 1000000, 2500000 };
+        for (uint i = 0; i < countof(delays); i++) {
+            lk_time_ns_t worst = 0;
+            lk_time_ns_t total = 0;
+            for (int j = 0; j < 20; j++) {
+                lk_time_ns_t start = current_time_ns();
+                thread_sleep_ns(delays[i]);
+                lk_time_ns_t slept = current_time_ns() - start;
+                if (slept < delays[i]) {
+                    printf("WARNING: thread_sleep_ns(%llu) woke early after %llu ns\n", delays[i], slept);
+                    continue;
+                }
+                total += slept - delays[i];
+                if (slept - delays[i] > worst)
+                    worst = slept - delays[i];
+            }
+            printf("%8llu ns sleep: avg overshoot %llu ns, worst %llu ns\n", delays[i], total / 20, worst);
+        }
+    }
+
     printf("counting to 5, in one second intervals\n");
     for (int i = 0; i < 5; i++) {
         thread_sleep(1000);
@@ -8,7 +8,10 @@
 #ifndef __APP_TESTS_H
 #define __APP_TESTS_H
 
+#include <assert.h>
 #include <lk/console_cmd.h>
+#include <kernel/mp.h>
+#include <sys/types.h>
 
 int cbuf_tests(int argc, const console_cmd_args *argv);
 int fibo(int argc, const console_cmd_args *argv);
@@ -20,5 +23,26 @@ int clock_tests(int argc, const console_cmd_args *argv);
 int printf_tests(int argc, const console_cmd_args *argv);
 int printf_tests_float(int argc, const console_cmd_args *argv);
 
+static inline uint active_cpu_count(void) {
+#if WITH_SMP
+    return __builtin_popcount(mp.active_cpus);
+#else
+    return 1;
+#endif
+}
+
+/* the nth active cpu, the numbers of the cpus that came up need not be contiguous */
+static inline uint active_cpu(uint n) {
+#if WITH_SMP
+    mp_cpu_mask_t mask = mp.active_cpus;
+    for (; n > 0; n--)
+        mask &= mask - 1;
+    DEBUG_ASSERT(mask);
+    return __builtin_ctz(mask);
+#else
+    return 0;
+#endif
+}
+
 #endif
 
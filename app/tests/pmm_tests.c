@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2014 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#include <arch/ops.h>
+#include <lk/console_cmd.h>
+#include <lk/debug.h>
+#include <lk/err.h>
+#include <lk/list.h>
+#include <rand.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#if WITH_KERNEL_VM
+#include <kernel/vm.h>
+
+#define PMM_STRESS_SLOTS 256
+#define PMM_STRESS_ITERATIONS 20000
+#define PMM_STRESS_MAX_ORDER 6
+
+struct pmm_stress_slot {
+    struct list_node pages;
+    uint count;
+};
+
+struct pmm_stress_stats {
+    ulong attempts;
+    ulong successes;
+    ulong cycles;
+    ulong max_cycles;
+};
+
+/*
+ * Pin one page in every <stride> of physical memory so no free run is longer
+ * than stride - 1 pages, then churn contiguous allocations of up to
+ * 2^PMM_STRESS_MAX_ORDER pages through what is left. Half of them are aligned
+ * on their size like a dma ring would be.
+ */
+static int pmm_stress(int argc, const console_cmd_args *argv) {
+    uint stride = (argc > 1) ? argv[1].u : 64;
+    if (stride < 2) {
+        printf("usage: %s [pin stride, default 64]\n", argv[0].str);
+        return ERR_INVALID_ARGS;
+    }
+
+    /* grab every free page, keep the ones we pin and give back the rest */
+    struct list_node all = LIST_INITIAL_VALUE(all);
+    struct list_node pinned = LIST_INITIAL_VALUE(pinned);
+    struct list_node rest = LIST_INITIAL_VALUE(rest);
+
+    size_t total = 0;
+    size_t got;
+    while ((got = pmm_alloc_pages(1024, &all)) > 0)
+        total += got;
+
+    vm_page_t *p;
+    size_t pin_count = 0;
+    while ((p = list_remove_head_type(&all, vm_page_t, node))) {
+        if ((vm_page_to_paddr(p) / PAGE_SIZE) % stride == 0) {
+            list_add_tail(&pinned, &p->node);
+            pin_count++;
+        } else {
+            list_add_tail(&rest, &p->node);
+        }
+    }
+    pmm_free(&rest);
+
+    printf("pinned %zu of %zu free pages, one every %u\n", pin_count, total, stride);
+
+    static struct pmm_stress_slot slots[PMM_STRESS_SLOTS];
+    struct pmm_stress_stats stats[PMM_STRESS_MAX_ORDER + 1] = { 0 };
+
+    for (uint i = 0; i < PMM_STRESS_SLOTS; i++) {
+        list_initialize(&slots[i].pages);
+        slots[i].count = 0;
+    }
+
+    for (uint iter = 0; iter < PMM_STRESS_ITERATIONS; iter++) {
+        struct pmm_stress_slot *slot = &slots[rand() % PMM_STRESS_SLOTS];
+
+        if (slot->count > 0) {
+            pmm_free(&slot->pages);
+            slot->count = 0;
+            continue;
+        }
+
+        uint order = rand() % (PMM_STRESS_MAX_ORDER + 1);
+        uint count = (rand() % (1U << order)) + 1;
+        uint8_t align_log2 = (rand() & 1) ? order + PAGE_SIZE_SHIFT : PAGE_SIZE_SHIFT;
+
+        ulong c = arch_cycle_count();
+        size_t ret = pmm_alloc_contiguous(count, align_log2, NULL, &slot->pages);
+        c = arch_cycle_count() - c;
+
+        struct pmm_stress_stats *s = &stats[order];
+        s->attempts++;
+        s->cycles += c;
+        s->max_cycles = MAX(s->max_cycles, c);
+        if (ret > 0) {
+            s->successes++;
+            slot->count = ret;
+        }
+    }
+
+    for (uint i = 0; i < PMM_STRESS_SLOTS; i++) {
+        if (slots[i].count > 0)
+            pmm_free(&slots[i].pages);
+    }
+    pmm_free(&pinned);
+
+    for (uint order = 0; order <= PMM_STRESS_MAX_ORDER; order++) {
+        const struct pmm_stress_stats *s = &stats[order];
+        if (s->attempts == 0)
+            continue;
+
+        printf("up to %3u pages: %lu/%lu succeeded (%lu%%), avg %lu cycles, max %lu cycles\n",
+               1U << order, s->successes, s->attempts, s->successes * 100 / s->attempts,
+               s->cycles / s->attempts, s->max_cycles);
+    }
+
+    return NO_ERROR;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("pmm_stress", "fragment the pmm and time contiguous allocations", &pmm_stress)
+STATIC_COMMAND_END(pmm_tests);
+
+#endif
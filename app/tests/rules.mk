@@ -12,6 +12,7 @@ MODULE_SRCS += \
     $(LOCAL_DIR)/float_instructions.S \
     $(LOCAL_DIR)/float_test_vec.c \
     $(LOCAL_DIR)/mem_tests.c \
+    $(LOCAL_DIR)/pmm_tests.c \
     $(LOCAL_DIR)/printf_tests.c \
     $(LOCAL_DIR)/tests.c \
     $(LOCAL_DIR)/thread_tests.c \
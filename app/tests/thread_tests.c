@@ -14,8 +14,10 @@
 #include <app/tests.h>
 #include <kernel/thread.h>
 #include <kernel/mutex.h>
+#include <kernel/rwlock.h>
 #include <kernel/semaphore.h>
 #include <kernel/event.h>
+#include <kernel/mp.h>
 #include <platform.h>
 #include <arch/atomic.h>
 
@@ -217,6 +219,127 @@ static int mutex_test(void) {
     return 0;
 }
 
+/*
+ * Classic three thread priority inversion: a low priority thread holds a mutex
+ * the high priority thread wants, while a medium priority thread hogs the cpu.
+ * Without priority inheritance the high priority thread waits out the whole
+ * medium burst, with it only the low thread's hold time.
+ */
+#define PI_TEST_ITERATIONS 20
+#define PI_TEST_HOLD_USECS 1000
+#define PI_TEST_BURST_USECS 20000
+
+static mutex_t pi_test_mutex;
+static event_t pi_test_low_go;
+static event_t pi_test_low_locked;
+static event_t pi_test_medium_go;
+static volatile bool pi_test_done;
+
+static int pi_test_low_thread(void *arg) {
+    for (;;) {
+        event_wait(&pi_test_low_go);
+        if (pi_test_done)
+            break;
+
+        mutex_acquire(&pi_test_mutex);
+        event_signal(&pi_test_low_locked, true);
+        spin(PI_TEST_HOLD_USECS);
+        mutex_release(&pi_test_mutex);
+    }
+
+    return 0;
+}
+
+static int pi_test_medium_thread(void *arg) {
+    for (;;) {
+        event_wait(&pi_test_medium_go);
+        if (pi_test_done)
+            break;
+
+        spin(PI_TEST_BURST_USECS);
+    }
+
+    return 0;
+}
+
+static int pi_test_high_thread(void *arg) {
+    lk_bigtime_t worst = 0;
+    lk_bigtime_t total = 0;
+
+    for (int i = 0; i < PI_TEST_ITERATIONS; i++) {
+        /* get the low thread into the mutex, then wake the hog */
+        event_signal(&pi_test_low_go, true);
+        event_wait(&pi_test_low_locked);
+        event_signal(&pi_test_medium_go, false);
+
+        lk_bigtime_t t = current_time_hires();
+        mutex_acquire(&pi_test_mutex);
+        t = current_time_hires() - t;
+        mutex_release(&pi_test_mutex);
+
+        total += t;
+        if (t > worst)
+            worst = t;
+
+        /* let the hog finish its burst before going again */
+        thread_sleep(PI_TEST_BURST_USECS / 1000 * 2);
+    }
+
+    printf("high priority mutex wait: avg %llu usecs, worst %llu usecs (hold %u usecs, medium burst %u usecs)\n",
+           total / PI_TEST_ITERATIONS, worst, PI_TEST_HOLD_USECS, PI_TEST_BURST_USECS);
+    if (worst < PI_TEST_BURST_USECS) {
+        printf("priority inversion bounded by the hold time\n");
+        return NO_ERROR;
+    }
+
+#if MUTEX_PRIORITY_INHERITANCE
+    printf("FAILED: high priority thread waited out the medium priority burst\n");
+    return ERR_GENERIC;
+#else
+    printf("high priority thread waited out the medium priority burst, no priority inheritance\n");
+    return NO_ERROR;
+#endif
+}
+
+static int priority_inversion_test(void) {
+    printf("testing priority inversion, low %d medium %d high %d\n",
+           LOW_PRIORITY, DEFAULT_PRIORITY, HIGH_PRIORITY);
+
+    mutex_init(&pi_test_mutex);
+    event_init(&pi_test_low_go, false, EVENT_FLAG_AUTOUNSIGNAL);
+    event_init(&pi_test_low_locked, false, EVENT_FLAG_AUTOUNSIGNAL);
+    event_init(&pi_test_medium_go, false, EVENT_FLAG_AUTOUNSIGNAL);
+    pi_test_done = false;
+
+    /* everyone shares one cpu, otherwise the medium thread just runs elsewhere */
+    __UNUSED uint cpu = arch_curr_cpu_num();
+    thread_t *low = thread_create("pi low", &pi_test_low_thread, NULL, LOW_PRIORITY, DEFAULT_STACK_SIZE);
+    thread_t *medium = thread_create("pi medium", &pi_test_medium_thread, NULL, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+    thread_t *high = thread_create("pi high", &pi_test_high_thread, NULL, HIGH_PRIORITY, DEFAULT_STACK_SIZE);
+    thread_set_pinned_cpu(low, cpu);
+    thread_set_pinned_cpu(medium, cpu);
+    thread_set_pinned_cpu(high, cpu);
+    thread_resume(low);
+    thread_resume(medium);
+    thread_resume(high);
+
+    int ret;
+    thread_join(high, &ret, INFINITE_TIME);
+
+    pi_test_done = true;
+    event_signal(&pi_test_low_go, true);
+    event_signal(&pi_test_medium_go, true);
+    thread_join(low, NULL, INFINITE_TIME);
+    thread_join(medium, NULL, INFINITE_TIME);
+
+    event_destroy(&pi_test_low_go);
+    event_destroy(&pi_test_low_locked);
+    event_destroy(&pi_test_medium_go);
+    mutex_destroy(&pi_test_mutex);
+
+    return ret;
+}
+
 static event_t e;
 
 static int event_signaler(void *arg) {
@@ -369,6 +492,238 @@ static void context_switch_test(void) {
     thread_sleep(100);
 }
 
+/* stress the scheduler with yielding threads on a growing number of cpus */
+#define CS_STRESS_THREADS_PER_CPU 2
+
+static event_t cs_stress_start_event;
+static volatile bool cs_stress_done;
+static ulong cs_stress_counts[SMP_MAX_CPUS * CS_STRESS_THREADS_PER_CPU];
+
+static int context_switch_stress_thread(void *arg) {
+    ulong *count = (ulong *)arg;
+
+    event_wait(&cs_stress_start_event);
+
+    while (!cs_stress_done) {
+        thread_yield();
+        (*count)++;
+    }
+
+    return 0;
+}
+
+static void context_switch_stress_run(uint cpus, bool pinned) {
+    thread_t *threads[SMP_MAX_CPUS * CS_STRESS_THREADS_PER_CPU];
+    uint thread_count = cpus * CS_STRESS_THREADS_PER_CPU;
+
+    event_init(&cs_stress_start_event, false, 0);
+    cs_stress_done = false;
+
+    for (uint i = 0; i < thread_count; i++) {
+        cs_stress_counts[i] = 0;
+        threads[i] = thread_create("cs stress", &context_switch_stress_thread, &cs_stress_counts[i],
+                                   DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+        if (pinned)
+            thread_set_pinned_cpu(threads[i], active_cpu(i % cpus));
+        thread_resume(threads[i]);
+    }
+
+    /* run the threads for a second at a higher priority than they are so we
+     * get control back to stop them */
+    int old_priority = get_current_thread()->base_priority;
+    thread_set_priority(HIGH_PRIORITY);
+    lk_bigtime_t start = current_time_hires();
+    event_signal(&cs_stress_start_event, false);
+    thread_sleep(1000);
+    cs_stress_done = true;
+    lk_bigtime_t elapsed = current_time_hires() - start;
+    thread_set_priority(old_priority);
+
+    for (uint i = 0; i < thread_count; i++)
+        thread_join(threads[i], NULL, INFINITE_TIME);
+
+    ulong total = 0;
+    for (uint i = 0; i < thread_count; i++)
+        total += cs_stress_counts[i];
+
+    printf("%u cpu%s, %u %s threads: %llu context switches/sec\n", cpus, cpus > 1 ? "s" : "",
+           thread_count, pinned ? "pinned" : "unpinned", (unsigned long long)total * 1000000ULL / elapsed);
+
+    event_destroy(&cs_stress_start_event);
+}
+
+static void context_switch_stress_test(void) {
+    uint max_cpus = active_cpu_count();
+
+    printf("context switch stress test, %u active cpus\n", max_cpus);
+
+    /* pinned threads stay on their per cpu run queues, unpinned ones are
+     * spread out by wakeup placement and work stealing */
+    for (uint cpus = 1; cpus <= max_cpus; cpus *= 2)
+        context_switch_stress_run(cpus, true);
+    if (max_cpus & (max_cpus - 1))
+        context_switch_stress_run(max_cpus, true);
+    context_switch_stress_run(max_cpus, false);
+}
+
+/* readers check that a table rewritten by a writer is always consistent, and
+ * lookups under a rwlock should scale with the number of cpus where lookups
+ * under a mutex do not */
+#define RWLOCK_TEST_ENTRIES 64
+#define RWLOCK_TEST_RUN_MS 500
+
+static rwlock_t rwlock_test_lock = RWLOCK_INITIAL_VALUE(rwlock_test_lock);
+static mutex_t rwlock_test_mutex = MUTEX_INITIAL_VALUE(rwlock_test_mutex);
+static int rwlock_test_table[RWLOCK_TEST_ENTRIES];
+static volatile bool rwlock_test_done;
+static volatile bool rwlock_test_failed;
+static bool rwlock_test_use_mutex;
+static ulong rwlock_test_counts[SMP_MAX_CPUS];
+
+static int rwlock_reader_thread(void *arg) {
+    ulong *count = (ulong *)arg;
+
+    while (!rwlock_test_done) {
+        if (rwlock_test_use_mutex)
+            mutex_acquire(&rwlock_test_mutex);
+        else
+            rwlock_acquire_read(&rwlock_test_lock);
+
+        int val = rwlock_test_table[0];
+        for (uint i = 1; i < RWLOCK_TEST_ENTRIES; i++) {
+            if (rwlock_test_table[i] != val)
+                rwlock_test_failed = true;
+        }
+
+        if (rwlock_test_use_mutex)
+            mutex_release(&rwlock_test_mutex);
+        else
+            rwlock_release_read(&rwlock_test_lock);
+
+        (*count)++;
+    }
+
+    return 0;
+}
+
+static int rwlock_writer_thread(void *arg) {
+    ulong *count = (ulong *)arg;
+
+    while (!rwlock_test_done) {
+        rwlock_acquire_write(&rwlock_test_lock);
+        for (uint i = 0; i < RWLOCK_TEST_ENTRIES; i++)
+            rwlock_test_table[i]++;
+        rwlock_release_write(&rwlock_test_lock);
+
+        (*count)++;
+        thread_sleep(1);
+    }
+
+    return 0;
+}
+
+static ulong rwlock_test_run(uint cpus, bool use_mutex, bool with_writer) {
+    thread_t *readers[SMP_MAX_CPUS];
+    thread_t *writer = NULL;
+    ulong writes = 0;
+
+    rwlock_test_done = false;
+    rwlock_test_use_mutex = use_mutex;
+
+    for (uint i = 0; i < cpus; i++) {
+        rwlock_test_counts[i] = 0;
+        readers[i] = thread_create("rwlock reader", &rwlock_reader_thread, &rwlock_test_counts[i],
+                                   DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+        thread_set_pinned_cpu(readers[i], active_cpu(i));
+        thread_resume(readers[i]);
+    }
+    if (with_writer) {
+        writer = thread_create("rwlock writer", &rwlock_writer_thread, &writes,
+                               DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+        thread_resume(writer);
+    }
+
+    /* run at a higher priority than the readers so we get control back */
+    int old_priority = get_current_thread()->base_priority;
+    thread_set_priority(HIGH_PRIORITY);
+    thread_sleep(RWLOCK_TEST_RUN_MS);
+    rwlock_test_done = true;
+    thread_set_priority(old_priority);
+
+    ulong total = 0;
+    for (uint i = 0; i < cpus; i++) {
+        thread_join(readers[i], NULL, INFINITE_TIME);
+        total += rwlock_test_counts[i];
+    }
+    if (writer) {
+        thread_join(writer, NULL, INFINITE_TIME);
+        printf("\t%lu writes\n", writes);
+    }
+
+    return total * 1000 / RWLOCK_TEST_RUN_MS;
+}
+
+static int rwlock_waiting_writer_thread(void *arg) {
+    rwlock_acquire_write(&rwlock_test_lock);
+    rwlock_release_write(&rwlock_test_lock);
+    return 0;
+}
+
+static int rwlock_try_read_thread(void *arg) {
+    status_t err = rwlock_acquire_read_timeout(&rwlock_test_lock, (lk_time_t)(uintptr_t)arg);
+    if (err == NO_ERROR)
+        rwlock_release_read(&rwlock_test_lock);
+    return err;
+}
+
+/* try for the read lock from another thread, the lock is not recursive */
+static status_t rwlock_try_read(lk_time_t timeout) {
+    int ret;
+    thread_t *t = thread_create("rwlock reader", &rwlock_try_read_thread, (void *)(uintptr_t)timeout,
+                                DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+    thread_resume(t);
+    thread_join(t, &ret, INFINITE_TIME);
+    return ret;
+}
+
+static void rwlock_test(void) {
+    printf("rwlock test\n");
+
+    /* a held write lock keeps out readers and writers */
+    rwlock_acquire_write(&rwlock_test_lock);
+    ASSERT(rwlock_try_read(10) == ERR_TIMED_OUT);
+    rwlock_release_write(&rwlock_test_lock);
+
+    /* readers share, a writer waits for them and new readers wait behind the writer */
+    rwlock_acquire_read(&rwlock_test_lock);
+    ASSERT(rwlock_try_read(0) == NO_ERROR);
+    thread_t *t = thread_create("rwlock writer", &rwlock_waiting_writer_thread, NULL,
+                                DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+    thread_resume(t);
+    thread_sleep(10);
+    ASSERT(rwlock_try_read(10) == ERR_TIMED_OUT);
+    rwlock_release_read(&rwlock_test_lock);
+    thread_join(t, NULL, INFINITE_TIME);
+
+    /* consistency with a writer running */
+    uint max_cpus = active_cpu_count();
+    rwlock_test_failed = false;
+    ulong ops = rwlock_test_run(max_cpus, false, true);
+    printf("%u readers with a writer: %lu lookups/sec\n", max_cpus, ops);
+    if (rwlock_test_failed)
+        panic("rwlock test: reader saw a partially written table\n");
+
+    /* read-only scaling */
+    for (uint cpus = 1; cpus <= max_cpus; cpus *= 2) {
+        ulong rw = rwlock_test_run(cpus, false, false);
+        ulong m = rwlock_test_run(cpus, true, false);
+        printf("%u cpu%s: rwlock %lu lookups/sec, mutex %lu lookups/sec\n",
+               cpus, cpus > 1 ? "s" : "", rw, m);
+    }
+
+    printf("rwlock test done\n");
+}
+
 static volatile int atomic;
 static volatile int atomic_count;
 
@@ -582,6 +937,10 @@ static void spinlock_test(void) {
 
 int thread_tests(int argc, const console_cmd_args *argv) {
     mutex_test();
+    int err = priority_inversion_test();
+    if (err < 0)
+        return err;
+    rwlock_test();
     semaphore_test();
     event_test();
 
@@ -590,6 +949,7 @@ int thread_tests(int argc, const console_cmd_args *argv) {
 
     thread_sleep(200);
     context_switch_test();
+    context_switch_stress_test();
 
     preempt_test();
 
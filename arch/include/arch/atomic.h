@@ -30,9 +30,13 @@ static inline int atomic_and(volatile int *ptr, int val) {
 static inline int atomic_swap(volatile int *ptr, int val) {
     return __atomic_exchange_n(ptr, val, __ATOMIC_RELAXED);
 }
+
+/* returns the previous value. unlike the others this is a full barrier so it
+ * can be used to build locks. */
 static inline int atomic_cmpxchg(volatile int *ptr, int oldval, int newval) {
-    // TODO: implement
-    return 0;
+    __atomic_compare_exchange_n(ptr, &oldval, newval, false,
+                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return oldval;
 }
 
 #else
@@ -27,6 +27,7 @@ RISCV_MODE ?= machine
 
 GLOBAL_DEFINES += SMP_MAX_CPUS=$(SMP_MAX_CPUS)
 GLOBAL_DEFINES += PLATFORM_HAS_DYNAMIC_TIMER=1
+GLOBAL_DEFINES += PLATFORM_HAS_HIRES_TIMER=1
 
 ifeq (true,$(call TOBOOL,$(WITH_SMP)))
 GLOBAL_DEFINES += WITH_SMP=1
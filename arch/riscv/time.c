@@ -22,9 +22,7 @@
 static platform_timer_callback timer_cb;
 static void *timer_arg;
 
-status_t platform_set_oneshot_timer (platform_timer_callback callback, void *arg, lk_time_t interval) {
-    LTRACEF("cb %p, arg %p, interval %u\n", callback, arg, interval);
-
+static void riscv_set_timer(platform_timer_callback callback, void *arg, uint64_t ticks) {
     // disable timer
     riscv_csr_clear(RISCV_CSR_XIE, RISCV_CSR_XIE_TIE);
 
@@ -34,18 +32,35 @@ status_t platform_set_oneshot_timer (platform_timer_callback callback, void *arg
     // enable the timer
     riscv_csr_set(RISCV_CSR_XIE, RISCV_CSR_XIE_TIE);
 
-    // convert interval to ticks
-    uint64_t ticks = riscv_get_time() + ((interval * ARCH_RISCV_MTIME_RATE) / 1000u);
+    ticks += riscv_get_time();
 #if RISCV_M_MODE
     extern void clint_set_timer(uint64_t ticks);
     clint_set_timer(ticks);
 #elif RISCV_S_MODE
     sbi_set_timer(ticks);
 #endif
+}
+
+status_t platform_set_oneshot_timer (platform_timer_callback callback, void *arg, lk_time_t interval) {
+    LTRACEF("cb %p, arg %p, interval %u\n", callback, arg, interval);
+
+    // convert interval to ticks
+    riscv_set_timer(callback, arg, (interval * ARCH_RISCV_MTIME_RATE) / 1000u);
 
     return NO_ERROR;
 }
 
+status_t platform_set_oneshot_timer_ns(platform_timer_callback callback, void *arg, lk_time_ns_t interval) {
+    LTRACEF("cb %p, arg %p, interval %llu ns\n", callback, arg, interval);
+
+    // convert interval to ticks, rounding up so the timer never fires early.
+    // split at the second boundary to keep the multiply from overflowing.
+    uint64_t ticks = (interval / 1000000000u) * ARCH_RISCV_MTIME_RATE;
+    ticks += ((interval % 1000000000u) * ARCH_RISCV_MTIME_RATE + 999999999u) / 1000000000u;
+    riscv_set_timer(callback, arg, ticks);
+
+    return NO_ERROR;
+}
 
 lk_bigtime_t current_time_hires(void) {
 #if ARCH_RISCV_MTIME_RATE < 10000000
@@ -59,6 +74,13 @@ lk_time_t current_time(void) {
     return riscv_get_time() / (ARCH_RISCV_MTIME_RATE / 1000u);
 }
 
+lk_time_ns_t current_time_ns(void) {
+    uint64_t ticks = riscv_get_time();
+
+    return (ticks / ARCH_RISCV_MTIME_RATE) * 1000000000u +
+           ((ticks % ARCH_RISCV_MTIME_RATE) * 1000000000u) / ARCH_RISCV_MTIME_RATE;
+}
+
 void platform_stop_timer(void) {
     riscv_csr_clear(RISCV_CSR_XIE, RISCV_CSR_XIE_TIE);
 }
@@ -115,6 +115,8 @@ static int timer_irq;
 struct fp_32_64 cntpct_per_ms;
 struct fp_32_64 ms_per_cntpct;
 struct fp_32_64 us_per_cntpct;
+struct fp_32_64 cntpct_per_ns;
+struct fp_32_64 ns_per_cntpct;
 
 static uint64_t lk_time_to_cntpct(lk_time_t lk_time) {
     return u64_mul_u32_fp32_64(lk_time, cntpct_per_ms);
@@ -128,6 +130,14 @@ static lk_bigtime_t cntpct_to_lk_bigtime(uint64_t cntpct) {
     return u64_mul_u64_fp32_64(cntpct, us_per_cntpct);
 }
 
+static uint64_t lk_time_ns_to_cntpct(lk_time_ns_t lk_time_ns) {
+    return u64_mul_u64_fp32_64(lk_time_ns, cntpct_per_ns);
+}
+
+static lk_time_ns_t cntpct_to_lk_time_ns(uint64_t cntpct) {
+    return u64_mul_u64_fp32_64(cntpct, ns_per_cntpct);
+}
+
 static uint32_t read_cntfrq(void) {
     uint32_t cntfrq;
 
@@ -175,17 +185,32 @@ static enum handler_return platform_tick(void *arg) {
     }
 }
 
+static void arm_generic_timer_program(uint64_t cntpct_interval) {
+    if (cntpct_interval <= INT_MAX)
+        write_cntp_tval(cntpct_interval);
+    else
+        write_cntp_cval(read_cntpct() + cntpct_interval);
+    write_cntp_ctl(1);
+}
+
 status_t platform_set_oneshot_timer(platform_timer_callback callback, void *arg, lk_time_t interval) {
     uint64_t cntpct_interval = lk_time_to_cntpct(interval);
 
     ASSERT(arg == NULL);
 
     t_callback = callback;
-    if (cntpct_interval <= INT_MAX)
-        write_cntp_tval(cntpct_interval);
-    else
-        write_cntp_cval(read_cntpct() + cntpct_interval);
-    write_cntp_ctl(1);
+    arm_generic_timer_program(cntpct_interval);
+
+    return 0;
+}
+
+status_t platform_set_oneshot_timer_ns(platform_timer_callback callback, void *arg, lk_time_ns_t interval) {
+    uint64_t cntpct_interval = lk_time_ns_to_cntpct(interval);
+
+    ASSERT(arg == NULL);
+
+    t_callback = callback;
+    arm_generic_timer_program(cntpct_interval);
 
     return 0;
 }
@@ -202,6 +227,10 @@ lk_time_t current_time(void) {
     return cntpct_to_lk_time(read_cntpct());
 }
 
+lk_time_ns_t current_time_ns(void) {
+    return cntpct_to_lk_time_ns(read_cntpct());
+}
+
 static uint32_t abs_int32(int32_t a) {
     return (a > 0) ? a : -a;
 }
@@ -278,9 +307,13 @@ static void arm_generic_timer_init_conversion_factors(uint32_t cntfrq) {
     fp_32_64_div_32_32(&cntpct_per_ms, cntfrq, 1000);
     fp_32_64_div_32_32(&ms_per_cntpct, 1000, cntfrq);
     fp_32_64_div_32_32(&us_per_cntpct, 1000 * 1000, cntfrq);
+    fp_32_64_div_32_32(&cntpct_per_ns, cntfrq, 1000 * 1000 * 1000);
+    fp_32_64_div_32_32(&ns_per_cntpct, 1000 * 1000 * 1000, cntfrq);
     LTRACEF("cntpct_per_ms: %08x.%08x%08x\n", cntpct_per_ms.l0, cntpct_per_ms.l32, cntpct_per_ms.l64);
     LTRACEF("ms_per_cntpct: %08x.%08x%08x\n", ms_per_cntpct.l0, ms_per_cntpct.l32, ms_per_cntpct.l64);
     LTRACEF("us_per_cntpct: %08x.%08x%08x\n", us_per_cntpct.l0, us_per_cntpct.l32, us_per_cntpct.l64);
+    LTRACEF("cntpct_per_ns: %08x.%08x%08x\n", cntpct_per_ns.l0, cntpct_per_ns.l32, cntpct_per_ns.l64);
+    LTRACEF("ns_per_cntpct: %08x.%08x%08x\n", ns_per_cntpct.l0, ns_per_cntpct.l32, ns_per_cntpct.l64);
 }
 
 void arm_generic_timer_init(int irq, uint32_t freq_override) {
@@ -3,7 +3,8 @@ LOCAL_DIR := $(GET_LOCAL_DIR)
 MODULE := $(LOCAL_DIR)
 
 GLOBAL_DEFINES += \
-	PLATFORM_HAS_DYNAMIC_TIMER=1
+	PLATFORM_HAS_DYNAMIC_TIMER=1 \
+	PLATFORM_HAS_HIRES_TIMER=1
 
 MODULE_SRCS += \
 	$(LOCAL_DIR)/arm_generic_timer.c
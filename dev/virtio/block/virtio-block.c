@@ -16,9 +16,10 @@
 #include <lk/err.h>
 #include <kernel/thread.h>
 #include <kernel/event.h>
-#include <kernel/mutex.h>
+#include <kernel/spinlock.h>
 #include <lib/bio.h>
 #include <inttypes.h>
+#include <string.h>
 
 #if WITH_KERNEL_VM
 #include <kernel/vm.h>
@@ -84,15 +85,31 @@ STATIC_ASSERT(sizeof(struct virtio_blk_req) == 16);
 #define VIRTIO_BLK_S_IOERR      1
 #define VIRTIO_BLK_S_UNSUPP     2
 
+#define VIRTIO_BLOCK_RING_LEN 256
+
+/* requests the device can have at once. each one takes at least three
+ * descriptors, header, data and status. */
+#define VIRTIO_BLOCK_MAX_TXNS (VIRTIO_BLOCK_RING_LEN / 4)
+
+#define VIRTIO_BLOCK_NO_TXN 0xff
+
 static enum handler_return virtio_block_irq_driver_callback(struct virtio_device *dev, uint ring, const struct vring_used_elem *e);
 static ssize_t virtio_bdev_read_block(struct bdev *bdev, void *buf, bnum_t block, uint count);
 static ssize_t virtio_bdev_write_block(struct bdev *bdev, const void *buf, bnum_t block, uint count);
+static status_t virtio_bdev_submit(struct bdev *bdev, bio_request_t *req);
+
+/* a request handed to the device */
+struct virtio_block_txn {
+    bio_request_t *req;
+    size_t len;
+    uint8_t next_free;
+};
 
 struct virtio_block_dev {
     struct virtio_device *dev;
 
-    mutex_t lock;
-    event_t io_event;
+    /* protects the ring, the transactions and the pending list */
+    spin_lock_t lock;
 
     /* bio block device */
     bdev_t bdev;
@@ -100,15 +117,32 @@ struct virtio_block_dev {
     /* our negotiated guest features */
     uint32_t guest_features;
 
-    /* one blk_req structure for io, not crossing a page boundary */
+    /* per transaction request headers and response words, read and written
+     * by the device. the headers are 16 byte aligned so none of them crosses
+     * a page boundary. */
     struct virtio_blk_req *blk_req;
     paddr_t blk_req_phys;
-
-    /* one uint8_t response word */
-    uint8_t blk_response;
+    uint8_t *blk_response;
     paddr_t blk_response_phys;
+
+    struct virtio_block_txn txn[VIRTIO_BLOCK_MAX_TXNS];
+    uint8_t free_txn;
+
+    /* which transaction a descriptor chain belongs to, by head index */
+    uint8_t desc_to_txn[VIRTIO_BLOCK_RING_LEN];
+
+    /* requests waiting for a transaction or descriptors */
+    struct list_node pending;
 };
 
+static paddr_t virtio_block_paddr(const void *ptr) {
+#if WITH_KERNEL_VM
+    return vaddr_to_paddr((void *)ptr);
+#else
+    return (paddr_t)(uintptr_t)ptr;
+#endif
+}
+
 static void dump_feature_bits(const char *name, uint32_t feature) {
     printf("virtio-block %s features (%#x):", name, feature);
     if (feature & VIRTIO_BLK_F_BARRIER) printf(" BARRIER");
@@ -134,25 +168,31 @@ status_t virtio_block_init(struct virtio_device *dev, uint32_t host_features) {
     if (!bdev)
         return ERR_NO_MEMORY;
 
-    mutex_init(&bdev->lock);
-    event_init(&bdev->io_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+    bdev->lock = SPIN_LOCK_INITIAL_VALUE;
+    list_initialize(&bdev->pending);
 
     bdev->dev = dev;
     dev->priv = bdev;
 
-    bdev->blk_req = memalign(sizeof(struct virtio_blk_req), sizeof(struct virtio_blk_req));
-#if WITH_KERNEL_VM
-    bdev->blk_req_phys = vaddr_to_paddr(bdev->blk_req);
-#else
-    bdev->blk_req_phys = (uint64_t)(uintptr_t)bdev->blk_req;
-#endif
-    LTRACEF("blk_req structure at %p (%#lx phys)\n", bdev->blk_req, bdev->blk_req_phys);
-
-#if WITH_KERNEL_VM
-    bdev->blk_response_phys = vaddr_to_paddr(&bdev->blk_response);
-#else
-    bdev->blk_response_phys = (uint64_t)(uintptr_t)&bdev->blk_response;
-#endif
+    bdev->blk_req = memalign(sizeof(struct virtio_blk_req), sizeof(struct virtio_blk_req) * VIRTIO_BLOCK_MAX_TXNS);
+    bdev->blk_response = malloc(VIRTIO_BLOCK_MAX_TXNS);
+    if (!bdev->blk_req || !bdev->blk_response) {
+        free(bdev->blk_req);
+        free(bdev->blk_response);
+        free(bdev);
+        return ERR_NO_MEMORY;
+    }
+    bdev->blk_req_phys = virtio_block_paddr(bdev->blk_req);
+    bdev->blk_response_phys = virtio_block_paddr(bdev->blk_response);
+    LTRACEF("blk_req structures at %p (%#lx phys)\n", bdev->blk_req, bdev->blk_req_phys);
+
+    /* chain up the free transactions */
+    for (uint i = 0; i < VIRTIO_BLOCK_MAX_TXNS; i++) {
+        bdev->txn[i].req = NULL;
+        bdev->txn[i].next_free = (i + 1 < VIRTIO_BLOCK_MAX_TXNS) ? i + 1 : VIRTIO_BLOCK_NO_TXN;
+    }
+    bdev->free_txn = 0;
+    memset(bdev->desc_to_txn, VIRTIO_BLOCK_NO_TXN, sizeof(bdev->desc_to_txn));
 
     /* make sure the device is reset */
     virtio_reset_device(dev);
@@ -183,7 +223,7 @@ status_t virtio_block_init(struct virtio_device *dev, uint32_t host_features) {
     /* TODO: handle a RO feature */
 
     /* allocate a virtio ring */
-    virtio_alloc_ring(dev, 0, 256);
+    virtio_alloc_ring(dev, 0, VIRTIO_BLOCK_RING_LEN);
 
     /* set our irq handler */
     dev->irq_driver_callback = &virtio_block_irq_driver_callback;
@@ -202,6 +242,7 @@ status_t virtio_block_init(struct virtio_device *dev, uint32_t host_features) {
     /* override our block device hooks */
     bdev->bdev.read_block = &virtio_bdev_read_block;
     bdev->bdev.write_block = &virtio_bdev_write_block;
+    bdev->bdev.submit = &virtio_bdev_submit;
 
     bio_register_device(&bdev->bdev);
 
@@ -232,13 +273,173 @@ status_t virtio_block_init(struct virtio_device *dev, uint32_t host_features) {
     return NO_ERROR;
 }
 
+/* descriptors needed to cover a buffer, one per page at worst */
+static uint virtio_block_desc_count(const void *buf, size_t len) {
+#if WITH_KERNEL_VM
+    vaddr_t va = (vaddr_t)buf;
+    return (ROUNDUP(va + len, PAGE_SIZE) - ROUNDDOWN(va, PAGE_SIZE)) / PAGE_SIZE;
+#else
+    /* non VM world simply queues a single buffer that transfers the whole thing */
+    return 1;
+#endif
+}
+
+/* descriptors needed for a request, including the header and response */
+static uint virtio_block_req_desc_count(const bio_request_t *req) {
+    uint needed = 2;
+    for (uint i = 0; i < req->iov_cnt; i++)
+        needed += virtio_block_desc_count(req->iov[i].iov_base, req->iov[i].iov_len);
+
+    return needed;
+}
+
+/* append a descriptor to the chain ending at last */
+static struct vring_desc *virtio_block_chain_desc(struct virtio_device *dev, struct vring_desc *last,
+                                                  paddr_t pa, size_t len, uint16_t flags) {
+    uint16_t i = virtio_alloc_desc(dev, 0);
+    struct vring_desc *desc = virtio_desc_index_to_desc(dev, 0, i);
+    DEBUG_ASSERT(desc);
+
+    desc->addr = (uint64_t)pa;
+    desc->len = len;
+    desc->flags = flags;
+    desc->next = 0;
+
+    last->flags |= VRING_DESC_F_NEXT;
+    last->next = i;
+
+    return desc;
+}
+
+/* hand a request to the device if there is room for it, with the lock held */
+static bool virtio_block_start_locked(struct virtio_block_dev *bdev, bio_request_t *req) {
+    struct virtio_device *dev = bdev->dev;
+
+    if (bdev->free_txn == VIRTIO_BLOCK_NO_TXN)
+        return false;
+    if (dev->ring[0].free_count < virtio_block_req_desc_count(req))
+        return false;
+
+    uint t = bdev->free_txn;
+    struct virtio_block_txn *txn = &bdev->txn[t];
+    bdev->free_txn = txn->next_free;
+
+    bool write = (req->op == BIO_OP_WRITE);
+    txn->req = req;
+    txn->len = (size_t)req->count << bdev->bdev.block_shift;
+
+    /* set up the request */
+    struct virtio_blk_req *blk_req = &bdev->blk_req[t];
+    blk_req->type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+    blk_req->ioprio = 0;
+    blk_req->sector = ((uint64_t)req->block << bdev->bdev.block_shift) / 512;
+    LTRACEF("txn %u type %u ioprio %u sector %llu\n",
+            t, blk_req->type, blk_req->ioprio, blk_req->sector);
+
+    // XXX not cache safe.
+    // At the moment only tested on arm qemu, which doesn't emulate cache.
+
+    /* the descriptor pointing to the header starts the chain */
+    uint16_t head = virtio_alloc_desc(dev, 0);
+    struct vring_desc *desc = virtio_desc_index_to_desc(dev, 0, head);
+    desc->addr = bdev->blk_req_phys + t * sizeof(struct virtio_blk_req);
+    desc->len = sizeof(struct virtio_blk_req);
+    desc->flags = 0;
+    desc->next = 0;
+
+    /* then the buffers, merging pages that are physically contiguous.
+     * mark them write-only if it's a block read */
+    uint16_t data_flags = write ? 0 : VRING_DESC_F_WRITE;
+    for (uint i = 0; i < req->iov_cnt; i++) {
+        vaddr_t va = (vaddr_t)req->iov[i].iov_base;
+        size_t remaining = req->iov[i].iov_len;
+        struct vring_desc *last_data = NULL;
+        paddr_t next_pa = 0;
+
+        while (remaining > 0) {
+#if WITH_KERNEL_VM
+            size_t chunk = MIN(remaining, PAGE_ALIGN(va + 1) - va);
+#else
+            size_t chunk = remaining;
+#endif
+            paddr_t pa = virtio_block_paddr((void *)va);
+
+            if (last_data && pa == next_pa) {
+                last_data->len += chunk;
+            } else {
+                desc = virtio_block_chain_desc(dev, desc, pa, chunk, data_flags);
+                last_data = desc;
+            }
+
+            next_pa = pa + chunk;
+            va += chunk;
+            remaining -= chunk;
+        }
+    }
+
+    /* and the response word */
+    bdev->blk_response[t] = 0xff;
+    virtio_block_chain_desc(dev, desc, bdev->blk_response_phys + t, 1, VRING_DESC_F_WRITE);
+
+    bdev->desc_to_txn[head] = t;
+
+    /* submit the transfer */
+    virtio_submit_chain(dev, 0, head);
+
+    return true;
+}
+
+/* start as many waiting requests as there is room for, with the lock held */
+static void virtio_block_start_pending_locked(struct virtio_block_dev *bdev) {
+    bool started = false;
+    bio_request_t *req;
+
+    while ((req = list_peek_head_type(&bdev->pending, bio_request_t, node))) {
+        if (!virtio_block_start_locked(bdev, req))
+            break;
+        list_delete(&req->node);
+        started = true;
+    }
+
+    if (started)
+        virtio_kick(bdev->dev, 0);
+}
+
+static status_t virtio_bdev_submit(struct bdev *_bdev, bio_request_t *req) {
+    struct virtio_block_dev *bdev = containerof(_bdev, struct virtio_block_dev, bdev);
+
+    LTRACEF("dev %p, req %p, block 0x%x, count %u\n", bdev, req, req->block, req->count);
+
+    /* it would never fit */
+    if (virtio_block_req_desc_count(req) > VIRTIO_BLOCK_RING_LEN)
+        return ERR_TOO_BIG;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&bdev->lock, state);
+
+    /* keep requests in order behind any that are already waiting */
+    list_add_tail(&bdev->pending, &req->node);
+    virtio_block_start_pending_locked(bdev);
+
+    spin_unlock_irqrestore(&bdev->lock, state);
+
+    return NO_ERROR;
+}
+
 static enum handler_return virtio_block_irq_driver_callback(struct virtio_device *dev, uint ring, const struct vring_used_elem *e) {
     struct virtio_block_dev *bdev = (struct virtio_block_dev *)dev->priv;
 
     LTRACEF("dev %p, ring %u, e %p, id %u, len %u\n", dev, ring, e, e->id, e->len);
 
-    /* parse our descriptor chain, add back to the free queue */
+    spin_lock(&bdev->lock);
+
+    /* find the request this chain belongs to */
     uint16_t i = e->id;
+    uint t = bdev->desc_to_txn[i];
+    DEBUG_ASSERT(t < VIRTIO_BLOCK_MAX_TXNS);
+    bdev->desc_to_txn[i] = VIRTIO_BLOCK_NO_TXN;
+
+    /* parse our descriptor chain, add back to the free queue */
     for (;;) {
         int next;
         struct vring_desc *desc = virtio_desc_index_to_desc(dev, ring, i);
@@ -259,8 +460,22 @@ static enum handler_return virtio_block_irq_driver_callback(struct virtio_device
         i = next;
     }
 
-    /* signal our event */
-    event_signal(&bdev->io_event, false);
+    struct virtio_block_txn *txn = &bdev->txn[t];
+    bio_request_t *req = txn->req;
+    ssize_t result = (bdev->blk_response[t] == VIRTIO_BLK_S_OK) ? (ssize_t)txn->len : ERR_IO;
+    LTRACEF("txn %u status 0x%hhx\n", t, bdev->blk_response[t]);
+
+    txn->req = NULL;
+    txn->next_free = bdev->free_txn;
+    bdev->free_txn = t;
+
+    /* the room we just freed up may let waiting requests go */
+    virtio_block_start_pending_locked(bdev);
+
+    spin_unlock(&bdev->lock);
+
+    /* outside the lock, the completion may queue another request */
+    bio_request_complete(req, result);
 
     return INT_RESCHEDULE;
 }
@@ -268,115 +483,25 @@ static enum handler_return virtio_block_irq_driver_callback(struct virtio_device
 ssize_t virtio_block_read_write(struct virtio_device *dev, void *buf, const off_t offset, const size_t len, const bool write) {
     struct virtio_block_dev *bdev = (struct virtio_block_dev *)dev->priv;
 
-    uint16_t i;
-    struct vring_desc *desc;
-
     LTRACEF("dev %p, buf %p, offset 0x%llx, len %zu\n", dev, buf, offset, len);
 
-    mutex_acquire(&bdev->lock);
-
-    /* set up the request */
-    bdev->blk_req->type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
-    bdev->blk_req->ioprio = 0;
-    bdev->blk_req->sector = offset / 512;
-    LTRACEF("blk_req type %u ioprio %u sector %llu\n",
-            bdev->blk_req->type, bdev->blk_req->ioprio, bdev->blk_req->sector);
-
-    /* put together a transfer */
-    desc = virtio_alloc_desc_chain(dev, 0, 3, &i);
-    LTRACEF("after alloc chain desc %p, i %u\n", desc, i);
-
-    // XXX not cache safe.
-    // At the moment only tested on arm qemu, which doesn't emulate cache.
-
-    /* set up the descriptor pointing to the head */
-    desc->addr = bdev->blk_req_phys;
-    desc->len = sizeof(struct virtio_blk_req);
-    desc->flags |= VRING_DESC_F_NEXT;
-
-    /* set up the descriptor pointing to the buffer */
-    desc = virtio_desc_index_to_desc(dev, 0, desc->next);
-#if WITH_KERNEL_VM
-    /* translate the first buffer */
-    vaddr_t va = (vaddr_t)buf;
-    paddr_t pa = vaddr_to_paddr((void *)va);
-    desc->addr = (uint64_t)pa;
-    /* desc->len is filled in below */
-#else
-    /* non VM world simply queues a single buffer that transfers the whole thing */
-    desc->addr = (uint64_t)(uintptr_t)buf;
-    desc->len = len;
-#endif
-    desc->flags |= write ? 0 : VRING_DESC_F_WRITE; /* mark buffer as write-only if its a block read */
-    desc->flags |= VRING_DESC_F_NEXT;
-
-#if WITH_KERNEL_VM
-    /* see if we need to add more descriptors due to scatter gather */
-    paddr_t next_pa = PAGE_ALIGN(pa + 1);
-    desc->len = MIN(next_pa - pa, len);
-    LTRACEF("first descriptor va 0x%lx desc->addr 0x%llx desc->len %u\n", va, desc->addr, desc->len);
-
-    size_t remaining_len = len;
-    remaining_len -= desc->len;
-    while (remaining_len > 0) {
-        /* amount of source buffer handled by this iteration of the loop */
-        size_t len_tohandle = MIN(remaining_len, PAGE_SIZE);
-
-        /* translate the next page in the buffer */
-        va = PAGE_ALIGN(va + 1);
-        pa = vaddr_to_paddr((void *)va);
-        LTRACEF("va now 0x%lx, pa 0x%lx, next_pa 0x%lx, remaining len %zu\n", va, pa, next_pa, remaining_len);
-
-        /* is the new translated physical address contiguous to the last one? */
-        if (next_pa == pa) {
-            /* we can simply extend the previous descriptor by another page */
-            LTRACEF("extending last one by %zu bytes\n", len_tohandle);
-            desc->len += len_tohandle;
-        } else {
-            /* new physical page needed, allocate a new descriptor and start again */
-            uint16_t next_i = virtio_alloc_desc(dev, 0);
-            struct vring_desc *next_desc = virtio_desc_index_to_desc(dev, 0, next_i);
-            DEBUG_ASSERT(next_desc);
-
-            LTRACEF("doesn't extend, need new desc, allocated desc %i (%p)\n", next_i, next_desc);
-
-            /* fill this descriptor in and put it after the last one but before the response descriptor */
-            next_desc->addr = (uint64_t)pa;
-            next_desc->len = len_tohandle;
-            next_desc->flags = write ? 0 : VRING_DESC_F_WRITE; /* mark buffer as write-only if its a block read */
-            next_desc->flags |= VRING_DESC_F_NEXT;
-            next_desc->next = desc->next;
-            desc->next = next_i;
-
-            desc = next_desc;
-        }
-        remaining_len -= len_tohandle;
-        next_pa += PAGE_SIZE;
-    }
-#endif
-
-    /* set up the descriptor pointing to the response */
-    desc = virtio_desc_index_to_desc(dev, 0, desc->next);
-    desc->addr = bdev->blk_response_phys;
-    desc->len = 1;
-    desc->flags = VRING_DESC_F_WRITE;
-
-    /* submit the transfer */
-    virtio_submit_chain(dev, 0, i);
-
-    /* kick it off */
-    virtio_kick(dev, 0);
-
-    /* wait for the transfer to complete */
-    event_wait(&bdev->io_event);
-
-    LTRACEF("status 0x%hhx\n", bdev->blk_response);
+    DEBUG_ASSERT(IS_ALIGNED(offset, bdev->bdev.block_size));
+    DEBUG_ASSERT(IS_ALIGNED(len, bdev->bdev.block_size));
 
-    /* TODO: handle transfer errors and return error */
+    /* queue it like any other request and wait for it, so any number of
+     * threads can have transfers outstanding at once */
+    iovec_t iov = { .iov_base = buf, .iov_len = len };
+    bio_request_t req;
+    bio_request_init(&req, write ? BIO_OP_WRITE : BIO_OP_READ,
+                     offset >> bdev->bdev.block_shift, len >> bdev->bdev.block_shift,
+                     &iov, 1, NULL, NULL);
+    req.dev = &bdev->bdev;
 
-    mutex_release(&bdev->lock);
+    status_t err = virtio_bdev_submit(&bdev->bdev, &req);
+    if (err < 0)
+        return err;
 
-    return len;
+    return bio_request_wait(&req);
 }
 
 static ssize_t virtio_bdev_read_block(struct bdev *bdev, void *buf, bnum_t block, uint count) {
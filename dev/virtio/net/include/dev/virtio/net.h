@@ -22,3 +22,6 @@ status_t virtio_net_get_mac_addr(uint8_t mac_addr[6]);
 struct pktbuf;
 extern status_t virtio_net_send_minip_pkt(void *arg, struct pktbuf *p);
 
+/* MINIP_ETH_FEATURE_* bits for minip_set_eth_features() */
+uint32_t virtio_net_get_minip_features(void);
+
@@ -41,6 +41,12 @@ struct virtio_net_hdr {
 };
 STATIC_ASSERT(sizeof(struct virtio_net_hdr) == 12);
 
+#define VIRTIO_NET_HDR_F_NEEDS_CSUM         (1<<0)
+#define VIRTIO_NET_HDR_F_DATA_VALID         (1<<1)
+
+#define VIRTIO_NET_HDR_GSO_NONE             0
+#define VIRTIO_NET_HDR_GSO_TCPV4            1
+
 #define VIRTIO_NET_F_CSUM                   (1<<0)
 #define VIRTIO_NET_F_GUEST_CSUM             (1<<1)
 #define VIRTIO_NET_F_CTRL_GUEST_OFFLOADS    (1<<2)
@@ -66,7 +72,8 @@ STATIC_ASSERT(sizeof(struct virtio_net_hdr) == 12);
 #define VIRTIO_NET_S_LINK_UP                (1<<0)
 #define VIRTIO_NET_S_ANNOUNCE               (1<<1)
 
-#define TX_RING_SIZE 16
+/* room for a few 64K tso packets, each gathered from up to a couple dozen pieces */
+#define TX_RING_SIZE 64
 #define RX_RING_SIZE 16
 
 #define RING_RX 0
@@ -80,6 +87,9 @@ struct virtio_net_dev {
 
     struct virtio_net_config *config;
 
+    /* our negotiated guest features */
+    uint32_t guest_features;
+
     spin_lock_t lock;
     event_t rx_event;
 
@@ -98,8 +108,8 @@ static status_t virtio_net_queue_rx(struct virtio_net_dev *ndev, pktbuf_t *p);
 // XXX remove need for this
 static struct virtio_net_dev *the_ndev;
 
-static void dump_feature_bits(uint32_t feature) {
-    printf("virtio-net host features (0x%x):", feature);
+static void dump_feature_bits(const char *name, uint32_t feature) {
+    printf("virtio-net %s features (0x%x):", name, feature);
     if (feature & VIRTIO_NET_F_CSUM) printf(" CSUM");
     if (feature & VIRTIO_NET_F_GUEST_CSUM) printf(" GUEST_CSUM");
     if (feature & VIRTIO_NET_F_CTRL_GUEST_OFFLOADS) printf(" CTRL_GUEST_OFFLOADS");
@@ -145,8 +155,23 @@ status_t virtio_net_init(struct virtio_device *dev, uint32_t host_features) {
     /* ack and set the driver status bit */
     virtio_status_acknowledge_driver(dev);
 
-    // XXX check features bits and ack/nak them
-    dump_feature_bits(host_features);
+    /* check features bits and ack/nak them */
+    ndev->guest_features = host_features;
+
+    /* keep the offloads minip can use. Large or merged receive buffers would
+     * need the rx path to take pktbuf chains, leave those off */
+    ndev->guest_features &= (VIRTIO_NET_F_CSUM |
+                             VIRTIO_NET_F_GUEST_CSUM |
+                             VIRTIO_NET_F_MAC |
+                             VIRTIO_NET_F_HOST_TSO4);
+
+    /* the device can't segment what it can't checksum */
+    if (!(ndev->guest_features & VIRTIO_NET_F_CSUM))
+        ndev->guest_features &= ~VIRTIO_NET_F_HOST_TSO4;
+    virtio_set_guest_features(dev, ndev->guest_features);
+
+    dump_feature_bits("host", host_features);
+    dump_feature_bits("guest", ndev->guest_features);
 
     /* set our irq handler */
     dev->irq_driver_callback = &virtio_net_irq_driver_callback;
@@ -191,6 +216,18 @@ static status_t virtio_net_queue_tx_pktbuf(struct virtio_net_dev *ndev, pktbuf_t
 
     DEBUG_ASSERT(ndev);
 
+    /* one descriptor for the header and one per buffer in the chain */
+    uint count = 1;
+    for (pktbuf_t *q = p2; q; q = q->next)
+        count++;
+
+    /* a super segment is too big to flatten, it has to fit as it is */
+    if (count > TX_RING_SIZE) {
+        if (pktbuf_linearize(p2) < 0)
+            return ERR_TOO_BIG;
+        count = 2;
+    }
+
     p = pktbuf_alloc();
     if (!p)
         return ERR_NO_MEMORY;
@@ -199,15 +236,30 @@ static status_t virtio_net_queue_tx_pktbuf(struct virtio_net_dev *ndev, pktbuf_t
     struct virtio_net_hdr *hdr = pktbuf_append(p, sizeof(struct virtio_net_hdr) - 2);
     memset(hdr, 0, p->dlen);
 
+    /* the offsets the stack left in the pktbuf are from the start of its
+     * buffer, the device counts from the ethernet header */
+    if (p2->flags & PKTBUF_FLAG_CKSUM_PARTIAL) {
+        DEBUG_ASSERT(ndev->guest_features & VIRTIO_NET_F_CSUM);
+        hdr->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        hdr->csum_start = p2->csum_start - pktbuf_avail_head(p2);
+        hdr->csum_offset = p2->csum_offset;
+    }
+    if (p2->flags & PKTBUF_FLAG_GSO_TCPV4) {
+        DEBUG_ASSERT(ndev->guest_features & VIRTIO_NET_F_HOST_TSO4);
+        hdr->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+        hdr->gso_size = p2->gso_size;
+        hdr->hdr_len = p2->dlen; // the headers, the payload is chained on
+    }
+
     spin_lock_saved_state_t state;
     spin_lock_irqsave(&ndev->lock, state);
 
     /* only queue if we have enough tx descriptors */
-    if (ndev->tx_pending_count + 2 > TX_RING_SIZE)
+    if (ndev->tx_pending_count + count > TX_RING_SIZE)
         goto nodesc;
 
     /* allocate a chain of descriptors for our transfer */
-    struct vring_desc *desc = virtio_alloc_desc_chain(vdev, RING_TX, 2, &i);
+    struct vring_desc *desc = virtio_alloc_desc_chain(vdev, RING_TX, count, &i);
     if (!desc) {
         spin_unlock_irqrestore(&ndev->lock, state);
 
@@ -218,9 +270,10 @@ nodesc:
         return ERR_NO_MEMORY;
     }
 
-    ndev->tx_pending_count += 2;
+    ndev->tx_pending_count += count;
 
-    /* save a pointer to our pktbufs for the irq handler to free */
+    /* save a pointer to our pktbufs for the irq handler to free. The whole
+     * chain hangs off the first data descriptor, the rest get NULL */
     LTRACEF("saving pointer to pkt in index %u and %u\n", i, desc->next);
     DEBUG_ASSERT(ndev->pending_tx_packet[i] == NULL);
     DEBUG_ASSERT(ndev->pending_tx_packet[desc->next] == NULL);
@@ -232,11 +285,13 @@ nodesc:
     desc->len = p->dlen;
     desc->flags |= VRING_DESC_F_NEXT;
 
-    /* set up the descriptor pointing to the buffer */
-    desc = virtio_desc_index_to_desc(vdev, RING_TX, desc->next);
-    desc->addr = pktbuf_data_phys(p2);
-    desc->len = p2->dlen;
-    desc->flags = 0;
+    /* set up a descriptor pointing to each buffer */
+    for (pktbuf_t *q = p2; q; q = q->next) {
+        desc = virtio_desc_index_to_desc(vdev, RING_TX, desc->next);
+        desc->addr = pktbuf_data_phys(q);
+        desc->len = q->dlen;
+        desc->flags = q->next ? VRING_DESC_F_NEXT : 0;
+    }
 
     /* submit the transfer */
     virtio_submit_chain(vdev, RING_TX, i);
@@ -353,15 +408,16 @@ static enum handler_return virtio_net_irq_driver_callback(struct virtio_device *
 
             list_add_tail(&ndev->completed_rx_queue, &p->list);
         } else { // ring == RING_TX
-            /* free the pktbuf associated with the tx packet we just consumed */
+            /* free the pktbuf associated with the tx packet we just consumed,
+             * descriptors for the rest of a chain have none */
             pktbuf_t *p = ndev->pending_tx_packet[i];
             ndev->pending_tx_packet[i] = NULL;
             ndev->tx_pending_count--;
 
-            DEBUG_ASSERT(p);
-            LTRACEF("freeing pktbuf %p\n", p);
-
-            pktbuf_free(p, false);
+            if (p) {
+                LTRACEF("freeing pktbuf %p\n", p);
+                pktbuf_free(p, false);
+            }
         }
 
         if (next < 0)
@@ -402,6 +458,12 @@ static int virtio_net_rx_worker(void *arg) {
             /* process our packet */
             struct virtio_net_hdr *hdr = pktbuf_consume(p, sizeof(struct virtio_net_hdr) - 2);
             if (hdr) {
+                /* the device checked the tcp or udp checksum, or the packet
+                 * came from the host with it left for us and never touched a wire */
+                p->flags &= ~(PKTBUF_FLAG_CKSUM_TCP_GOOD | PKTBUF_FLAG_CKSUM_UDP_GOOD);
+                if (hdr->flags & (VIRTIO_NET_HDR_F_NEEDS_CSUM | VIRTIO_NET_HDR_F_DATA_VALID))
+                    p->flags |= PKTBUF_FLAG_CKSUM_TCP_GOOD | PKTBUF_FLAG_CKSUM_UDP_GOOD;
+
                 /* call up into the stack */
                 minip_rx_driver_callback(p);
             }
@@ -413,6 +475,20 @@ static int virtio_net_rx_worker(void *arg) {
     return 0;
 }
 
+uint32_t virtio_net_get_minip_features(void) {
+    if (!the_ndev)
+        return 0;
+
+    /* tx takes pktbuf chains as descriptor chains */
+    uint32_t features = MINIP_ETH_FEATURE_SG;
+    if (the_ndev->guest_features & VIRTIO_NET_F_CSUM)
+        features |= MINIP_ETH_FEATURE_TX_CSUM;
+    if (the_ndev->guest_features & VIRTIO_NET_F_HOST_TSO4)
+        features |= MINIP_ETH_FEATURE_TSO4;
+
+    return features;
+}
+
 int virtio_net_found(void) {
     return the_ndev ? 1 : 0;
 }
@@ -431,13 +507,6 @@ status_t virtio_net_send_minip_pkt(void *arg, pktbuf_t *p) {
 
     DEBUG_ASSERT(p && p->dlen);
 
-    if ((p->flags & PKTBUF_FLAG_EOF) == 0) {
-        /* can't handle multi part packets yet */
-        PANIC_UNIMPLEMENTED;
-
-        return ERR_NOT_IMPLEMENTED;
-    }
-
     /* hand the pktbuf off to the nic, it owns the pktbuf from now on out unless it fails */
     status_t err = virtio_net_queue_tx_pktbuf(the_ndev, p);
     if (err < 0) {
@@ -20,21 +20,40 @@ __BEGIN_CDECLS
 typedef struct mutex {
     uint32_t magic;
     thread_t *holder;
-    int count;
+    int state; /* 0 unlocked, 1 locked, 2 locked with waiters */
     wait_queue_t wait;
+#if MUTEX_PRIORITY_INHERITANCE
+    struct list_node holder_node; /* in the holder's list of held mutexes */
+#endif
 } mutex_t;
 
+#if MUTEX_PRIORITY_INHERITANCE
 #define MUTEX_INITIAL_VALUE(m) \
 { \
     .magic = MUTEX_MAGIC, \
     .holder = NULL, \
-    .count = 0, \
+    .state = 0, \
     .wait = WAIT_QUEUE_INITIAL_VALUE((m).wait), \
+    .holder_node = LIST_INITIAL_CLEARED_VALUE, \
 }
+#else
+#define MUTEX_INITIAL_VALUE(m) \
+{ \
+    .magic = MUTEX_MAGIC, \
+    .holder = NULL, \
+    .state = 0, \
+    .wait = WAIT_QUEUE_INITIAL_VALUE((m).wait), \
+}
+#endif
 
 /* Rules for Mutexes:
  * - Mutexes are only safe to use from thread context.
  * - Mutexes are non-recursive.
+ * - An uncontended acquire or release is a single compare and swap and does
+ *   not take the thread lock.
+ * - With MUTEX_PRIORITY_INHERITANCE the holder runs at the priority of its
+ *   highest priority waiter, including waiters blocked further down a chain
+ *   of mutexes, and a release hands the mutex to the highest priority waiter.
 */
 
 void mutex_init(mutex_t *);
@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) 2008-2014 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#pragma once
+
+#include <arch/atomic.h>
+#include <arch/ops.h>
+#include <kernel/spinlock.h>
+#include <kernel/thread.h>
+#include <lk/compiler.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+__BEGIN_CDECLS
+
+#define RWLOCK_MAGIC (0x72776C6B)  // 'rwlk'
+
+/* state word shared by the blocking and spinning locks */
+#define RWLOCK_STATE_WRITER         (1 << 0)   /* held for write */
+#define RWLOCK_STATE_WAITERS        (1 << 1)   /* threads are blocked, release takes the slow path */
+#define RWLOCK_STATE_WRITER_WAITING (1 << 2)   /* a writer is waiting, new readers must wait too */
+#define RWLOCK_STATE_READER         (1 << 3)   /* one reader */
+#define RWLOCK_STATE_FLAGS          (RWLOCK_STATE_WAITERS | RWLOCK_STATE_WRITER_WAITING)
+
+typedef struct rwlock {
+    uint32_t magic;
+    int state;
+    thread_t *writer;
+    wait_queue_t read_wait;
+    wait_queue_t write_wait;
+} rwlock_t;
+
+#define RWLOCK_INITIAL_VALUE(l) \
+{ \
+    .magic = RWLOCK_MAGIC, \
+    .state = 0, \
+    .writer = NULL, \
+    .read_wait = WAIT_QUEUE_INITIAL_VALUE((l).read_wait), \
+    .write_wait = WAIT_QUEUE_INITIAL_VALUE((l).write_wait), \
+}
+
+/* Rules for reader/writer locks:
+ * - Only safe to use from thread context.
+ * - Non-recursive, a thread holding it for read must not take it again for
+ *   read or write.
+ * - Uncontended acquires and releases do not take the thread lock.
+ * - Writers are preferred: once a writer waits, new readers wait behind it.
+ * - Releasing a write lock hands the lock to every reader that queued while
+ *   it was held before the next writer, so neither side starves.
+ */
+
+void rwlock_init(rwlock_t *);
+void rwlock_destroy(rwlock_t *);
+status_t rwlock_acquire_read_timeout(rwlock_t *, lk_time_t);
+status_t rwlock_release_read(rwlock_t *);
+status_t rwlock_acquire_write_timeout(rwlock_t *, lk_time_t);
+status_t rwlock_release_write(rwlock_t *);
+
+static inline status_t rwlock_acquire_read(rwlock_t *l) {
+    return rwlock_acquire_read_timeout(l, INFINITE_TIME);
+}
+
+static inline status_t rwlock_acquire_write(rwlock_t *l) {
+    return rwlock_acquire_write_timeout(l, INFINITE_TIME);
+}
+
+/* does the current thread hold the lock for write? */
+static inline bool is_rwlock_write_held(const rwlock_t *l) {
+    return l->writer == get_current_thread();
+}
+
+/*
+ * Spinning reader/writer lock for short read-mostly critical sections,
+ * with the same writer preference as rwlock_t. Like spin_lock, interrupts
+ * should already be disabled or the _irqsave variants used.
+ */
+typedef int spin_rwlock_t;
+
+#define SPIN_RWLOCK_INITIAL_VALUE (0)
+
+static inline void spin_rwlock_init(spin_rwlock_t *lock) {
+    *lock = SPIN_RWLOCK_INITIAL_VALUE;
+}
+
+static inline void spin_read_lock(spin_rwlock_t *lock) {
+    for (;;) {
+        int old = *(volatile int *)lock;
+        if (!(old & (RWLOCK_STATE_WRITER | RWLOCK_STATE_WRITER_WAITING)) &&
+                atomic_cmpxchg(lock, old, old + RWLOCK_STATE_READER) == old)
+            return;
+    }
+}
+
+static inline void spin_read_unlock(spin_rwlock_t *lock) {
+    int old = *(volatile int *)lock;
+    int prev;
+
+    while ((prev = atomic_cmpxchg(lock, old, old - RWLOCK_STATE_READER)) != old)
+        old = prev;
+}
+
+static inline void spin_write_lock(spin_rwlock_t *lock) {
+    for (;;) {
+        int old = *(volatile int *)lock;
+        if ((old & ~RWLOCK_STATE_WRITER_WAITING) == 0) {
+            if (atomic_cmpxchg(lock, old, RWLOCK_STATE_WRITER) == old)
+                return;
+        } else if (!(old & RWLOCK_STATE_WRITER_WAITING)) {
+            /* hold off new readers until the current ones drain */
+            atomic_cmpxchg(lock, old, old | RWLOCK_STATE_WRITER_WAITING);
+        }
+    }
+}
+
+static inline void spin_write_unlock(spin_rwlock_t *lock) {
+    /* leave the writer waiting bit for whoever set it */
+    int old = *(volatile int *)lock;
+    int prev;
+
+    while ((prev = atomic_cmpxchg(lock, old, old & ~RWLOCK_STATE_WRITER)) != old)
+        old = prev;
+}
+
+#define spin_read_lock_irqsave(lock, statep) \
+    do { arch_interrupt_save(&(statep), SPIN_LOCK_FLAG_INTERRUPTS); spin_read_lock(lock); } while (0)
+#define spin_read_unlock_irqrestore(lock, statep) \
+    do { spin_read_unlock(lock); arch_interrupt_restore(statep, SPIN_LOCK_FLAG_INTERRUPTS); } while (0)
+#define spin_write_lock_irqsave(lock, statep) \
+    do { arch_interrupt_save(&(statep), SPIN_LOCK_FLAG_INTERRUPTS); spin_write_lock(lock); } while (0)
+#define spin_write_unlock_irqrestore(lock, statep) \
+    do { spin_write_unlock(lock); arch_interrupt_restore(statep, SPIN_LOCK_FLAG_INTERRUPTS); } while (0)
+
+__END_CDECLS
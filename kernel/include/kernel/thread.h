@@ -23,6 +23,8 @@
 typedef struct vmm_aspace vmm_aspace_t;
 #endif
 
+struct mutex;
+
 __BEGIN_CDECLS
 
 /* debug-enable runtime checks */
@@ -76,11 +78,14 @@ typedef struct thread {
     /* active bits */
     struct list_node queue_node;
     int priority;
+    int base_priority; /* priority before any inherited from mutex waiters */
     enum thread_state state;
     int remaining_quantum;
     unsigned int flags;
 #if WITH_SMP
     int curr_cpu;
+    int last_cpu; /* cpu this thread last ran on, used as a placement hint */
+    int queue_cpu; /* cpu whose run queue holds this thread while it is ready */
     int pinned_cpu; /* only run on pinned_cpu if >= 0 */
 #endif
 #if WITH_KERNEL_VM
@@ -91,6 +96,12 @@ typedef struct thread {
     struct wait_queue *blocking_wait_queue;
     status_t wait_queue_block_ret;
 
+#if MUTEX_PRIORITY_INHERITANCE
+    /* mutexes held, and the one being waited for, to track inherited priority */
+    struct list_node held_mutexes;
+    struct mutex *blocking_mutex;
+#endif
+
     /* architecture stuff */
     struct arch_thread arch;
 
@@ -154,6 +165,7 @@ thread_t *thread_create_etc(thread_t *t, const char *name, thread_start_routine
 status_t thread_resume(thread_t *);
 void thread_exit(int retcode) __NO_RETURN;
 void thread_sleep(lk_time_t delay);
+void thread_sleep_ns(lk_time_ns_t delay);
 status_t thread_detach(thread_t *t);
 status_t thread_join(thread_t *t, int *retcode, lk_time_t timeout);
 status_t thread_detach_and_resume(thread_t *t);
@@ -170,6 +182,12 @@ void thread_preempt(void); /* get preempted (inserted into head of run queue) */
 void thread_block(void); /* block on something and reschedule */
 void thread_unblock(thread_t *t, bool resched); /* go back in the run queue */
 
+#if MUTEX_PRIORITY_INHERITANCE
+/* priority inheritance hooks for the mutex code, called with the thread lock held */
+void thread_boost_mutex_holder(struct mutex *m, int priority);
+void thread_update_inherited_priority(thread_t *t);
+#endif
+
 #ifdef WITH_LIB_UTHREAD
 void uthread_context_switch(thread_t *oldthread, thread_t *newthread);
 #endif
@@ -226,9 +244,11 @@ struct thread_stats {
     ulong interrupts; /* platform code increment this */
     ulong timer_ints; /* timer code increment this */
     ulong timers; /* timer code increment this */
+    ulong timer_ints_avoided; /* skipped preempt ticks and coalesced timer deadlines */
 
 #if WITH_SMP
     ulong reschedule_ipis;
+    ulong steals; /* threads pulled from another cpu's run queue */
 #endif
 };
 
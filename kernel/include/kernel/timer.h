@@ -29,6 +29,12 @@ typedef struct timer {
 
     timer_callback callback;
     void *arg;
+
+    /* owned by the timer code */
+    uint cpu;
+    uint slot;
+    lk_time_ns_t deadline_ns;
+    lk_time_ns_t slack_ns;
 } timer_t;
 
 #define TIMER_INITIAL_VALUE(t) \
@@ -39,17 +45,36 @@ typedef struct timer {
     .periodic_time = 0, \
     .callback = NULL, \
     .arg = NULL, \
+    .cpu = 0, \
+    .slot = 0, \
+    .deadline_ns = 0, \
+    .slack_ns = 0, \
 }
 
 /* Rules for Timers:
  * - Timer callbacks occur from interrupt context
  * - Timers may be programmed or canceled from interrupt or thread context
  * - Timers may be canceled or reprogrammed from within their callback
- * - Timers currently are dispatched from a 10ms periodic tick
+ * - Timers are dispatched from a 10ms periodic tick, or a one-shot tick on
+ *   platforms with PLATFORM_HAS_DYNAMIC_TIMER
+ * - Arming and canceling a timer are O(1)
+ * - Nanosecond one-shots fire on their own deadline on platforms with
+ *   PLATFORM_HAS_HIRES_TIMER, and are rounded up to the next ms elsewhere
+ * - A one-shot given slack may fire up to that much late, so it can share
+ *   an interrupt with the timers around it. Thread sleeps and wait queue
+ *   timeouts use timer_default_slack()
 */
 void timer_initialize(timer_t *);
 void timer_set_oneshot(timer_t *, lk_time_t delay, timer_callback, void *arg);
+void timer_set_oneshot_slack(timer_t *, lk_time_t delay, lk_time_t slack,
+                             timer_callback, void *arg);
 void timer_set_periodic(timer_t *, lk_time_t period, timer_callback, void *arg);
+void timer_set_oneshot_ns(timer_t *, lk_time_ns_t delay, timer_callback, void *arg);
+void timer_set_oneshot_ns_slack(timer_t *, lk_time_ns_t delay, lk_time_ns_t slack,
+                                timer_callback, void *arg);
 void timer_cancel(timer_t *);
 
+void timer_set_default_slack(lk_time_ns_t slack);
+lk_time_ns_t timer_default_slack(void);
+
 __END_CDECLS
@@ -72,10 +72,12 @@ typedef struct vm_page {
     struct list_node node;
 
     uint flags : 8;
-    uint ref : 24;
+    uint order : 8;     /* order of the free block, if VM_PAGE_FLAG_FREE_HEAD */
+    uint ref : 16;
 } vm_page_t;
 
 #define VM_PAGE_FLAG_NONFREE  (0x1)
+#define VM_PAGE_FLAG_FREE_HEAD (0x2) /* first page of a free block in the pmm */
 
 /* kernel address space */
 #ifndef KERNEL_ASPACE_BASE
@@ -106,6 +108,12 @@ static inline bool is_user_address(vaddr_t va) {
 }
 
 /* physical allocator */
+
+/* free pages are kept in naturally aligned blocks of up to 2^PMM_MAX_ORDER pages */
+#ifndef PMM_MAX_ORDER
+#define PMM_MAX_ORDER 10
+#endif
+
 typedef struct pmm_arena {
     struct list_node node;
     const char *name;
@@ -119,7 +127,7 @@ typedef struct pmm_arena {
     size_t free_count;
 
     struct vm_page *page_array;
-    struct list_node free_list;
+    struct list_node free_list[PMM_MAX_ORDER + 1];  /* free blocks of each order */
 } pmm_arena_t;
 
 #define PMM_ARENA_FLAG_KMAP (0x1) /* this arena is already mapped and useful for kallocs */
@@ -166,6 +174,20 @@ static inline void *pmm_alloc_kpage(void) { return pmm_alloc_kpages(1, NULL); }
 
 size_t pmm_free_kpages(void *ptr, uint count);
 
+/* The number of pages currently free across all arenas. Only a snapshot,
+ * meant for sizing caches.
+ */
+size_t pmm_count_free_pages(void);
+
+/* A cache that can give pages back when an allocation comes up short, after
+ * the slab caches have given back theirs. Called with no pmm locks held,
+ * asking for about count pages, and returns how many it freed. It may be
+ * reached from any allocation, including ones made while the cache's own
+ * locks are held, so it must not wait on them.
+ */
+typedef size_t (*pmm_reclaim_hook_t)(size_t count);
+void pmm_set_reclaim_hook(pmm_reclaim_hook_t hook);
+
 /* physical to virtual */
 void *paddr_to_kvaddr(paddr_t pa);
 
@@ -232,6 +254,11 @@ __NONNULL((1));
 status_t vmm_alloc_physical(vmm_aspace_t *aspace, const char *name, size_t size, void **ptr, uint8_t align_log2, paddr_t paddr, uint vmm_flags, uint arch_mmu_flags)
 __NONNULL((1));
 
+/* same as above, but maps a list of physical pages that needn't be contiguous.
+   size must be paddr_count pages. */
+status_t vmm_alloc_physical_etc(vmm_aspace_t *aspace, const char *name, size_t size, void **ptr, uint8_t align_log2, const paddr_t *paddr, uint paddr_count, uint vmm_flags, uint arch_mmu_flags)
+__NONNULL((1)) __NONNULL((6));
+
 /* allocate a region of memory backed by newly allocated contiguous physical memory  */
 status_t vmm_alloc_contiguous(vmm_aspace_t *aspace, const char *name, size_t size, void **ptr, uint8_t align_log2, uint vmm_flags, uint arch_mmu_flags)
 __NONNULL((1));
@@ -240,6 +267,11 @@ __NONNULL((1));
 status_t vmm_alloc(vmm_aspace_t *aspace, const char *name, size_t size, void **ptr, uint8_t align_log2, uint vmm_flags, uint arch_mmu_flags)
 __NONNULL((1));
 
+/* look up the region containing va and return its base, size and mmu flags.
+   any of the out pointers may be NULL. */
+status_t vmm_query_region(vmm_aspace_t *aspace, vaddr_t va, vaddr_t *base, size_t *size, uint *arch_mmu_flags)
+__NONNULL((1));
+
 /* Unmap previously allocated region and free physical memory pages backing it (if any) */
 status_t vmm_free_region(vmm_aspace_t *aspace, vaddr_t va);
 
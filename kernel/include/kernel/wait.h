@@ -49,6 +49,9 @@ void wait_queue_destroy(wait_queue_t *, bool reschedule);
  */
 status_t wait_queue_block(wait_queue_t *, lk_time_t timeout);
 
+/* same as wait_queue_block() with the timeout in nanoseconds */
+status_t wait_queue_block_ns(wait_queue_t *, lk_time_ns_t timeout);
+
 /*
  * release one or more threads from the wait queue.
  * reschedule = should the system reschedule if any is released.
@@ -17,10 +17,79 @@
 
 #include <kernel/mutex.h>
 
+#include <arch/atomic.h>
 #include <assert.h>
 #include <kernel/thread.h>
 #include <lk/debug.h>
 #include <lk/err.h>
+#include <platform.h>
+
+/*
+ * The mutex state word is taken and released with a compare and swap when
+ * nobody else wants it, without touching the thread lock. Once a thread has
+ * to wait it marks the mutex contended, which pushes the eventual release
+ * onto the slow path where the thread lock is held and waiters are woken.
+ * A woken waiter races for the mutex again and re-marks it contended, since
+ * other threads may still be waiting behind it.
+ */
+#define MUTEX_UNLOCKED  0
+#define MUTEX_LOCKED    1
+#define MUTEX_CONTENDED 2
+
+/* how many times to look at a mutex whose holder is running on another cpu
+ * before giving up and blocking */
+#ifndef MUTEX_SPIN_COUNT
+#define MUTEX_SPIN_COUNT 1000
+#endif
+
+/* atomic_cmpxchg is a full barrier, which gives the fast paths their acquire
+ * and release ordering */
+static inline bool mutex_cmpxchg(mutex_t *m, int oldval, int newval) {
+    return atomic_cmpxchg(&m->state, oldval, newval) == oldval;
+}
+
+static int mutex_xchg(mutex_t *m, int newval) {
+    int oldval = m->state;
+    int prev;
+
+    while ((prev = atomic_cmpxchg(&m->state, oldval, newval)) != oldval)
+        oldval = prev;
+
+    return oldval;
+}
+
+static inline thread_t *mutex_holder(const mutex_t *m) {
+    return *(thread_t * const volatile *)&m->holder;
+}
+
+#if MUTEX_PRIORITY_INHERITANCE
+/* move the highest priority waiter to the head of the queue so it is the one
+ * woken, waiters of equal priority stay in fifo order */
+static void mutex_highest_waiter_first(mutex_t *m) {
+    thread_t *best = NULL;
+    thread_t *t;
+
+    list_for_every_entry(&m->wait.list, t, thread_t, queue_node) {
+        if (!best || t->priority > best->priority)
+            best = t;
+    }
+
+    if (best) {
+        list_delete(&best->queue_node);
+        list_add_head(&m->wait.list, &best->queue_node);
+    }
+}
+
+/* track the mutex in its holder's list and pick up the priority of whoever
+ * is waiting on it. only needed once the mutex has been contended. */
+static void mutex_inherit_locked(mutex_t *m, thread_t *holder) {
+    DEBUG_ASSERT(spin_lock_held(&thread_lock));
+
+    if (!list_in_list(&m->holder_node))
+        list_add_tail(&holder->held_mutexes, &m->holder_node);
+    thread_update_inherited_priority(holder);
+}
+#endif
 
 /**
  * @brief  Initialize a mutex_t
@@ -45,12 +114,99 @@ void mutex_destroy(mutex_t *m) {
 #endif
 
     THREAD_LOCK(state);
+#if MUTEX_PRIORITY_INHERITANCE
+    if (m->holder && list_in_list(&m->holder_node)) {
+        list_delete(&m->holder_node);
+        thread_update_inherited_priority(m->holder);
+    }
+#endif
     m->magic = 0;
-    m->count = 0;
+    m->state = MUTEX_UNLOCKED;
     wait_queue_destroy(&m->wait, true);
     THREAD_UNLOCK(state);
 }
 
+#if WITH_SMP
+/* spin for a little while as long as the holder is running on another cpu,
+ * it is likely to let go before blocking and waking would pay off */
+static bool mutex_spin(mutex_t *m) {
+    for (uint i = 0; i < MUTEX_SPIN_COUNT; i++) {
+        if (m->state == MUTEX_UNLOCKED) {
+            if (mutex_cmpxchg(m, MUTEX_UNLOCKED, MUTEX_LOCKED))
+                return true;
+            continue;
+        }
+
+        /* the holder may be between taking the state and recording itself */
+        thread_t *holder = mutex_holder(m);
+        if (holder && *(volatile enum thread_state *)&holder->state != THREAD_RUNNING)
+            return false;
+    }
+
+    return false;
+}
+#endif
+
+/* block on the mutex until it is ours, the deadline passes or it goes away */
+static status_t mutex_acquire_slow(mutex_t *m, lk_time_t timeout) {
+    thread_t *current_thread = get_current_thread();
+    lk_time_t deadline = current_time() + timeout;
+    status_t ret;
+
+    THREAD_LOCK(state);
+
+    for (;;) {
+        if (mutex_xchg(m, MUTEX_CONTENDED) == MUTEX_UNLOCKED) {
+            ret = NO_ERROR;
+            break;
+        }
+
+        /* we may have been woken and lost the race, only wait out what is left */
+        lk_time_t wait = timeout;
+        if (timeout != INFINITE_TIME) {
+            lk_time_t now = current_time();
+            wait = TIME_GT(deadline, now) ? deadline - now : 0;
+        }
+
+#if MUTEX_PRIORITY_INHERITANCE
+        /* lend our priority to the holder while we wait */
+        thread_t *holder = m->holder;
+        if (wait != 0 && holder) {
+            if (!list_in_list(&m->holder_node))
+                list_add_tail(&holder->held_mutexes, &m->holder_node);
+            current_thread->blocking_mutex = m;
+            thread_boost_mutex_holder(m, current_thread->priority);
+        }
+#endif
+
+        ret = wait_queue_block(&m->wait, wait);
+
+#if MUTEX_PRIORITY_INHERITANCE
+        current_thread->blocking_mutex = NULL;
+
+        /* take back the priority we lent */
+        if (ret == ERR_TIMED_OUT && m->holder)
+            thread_update_inherited_priority(m->holder);
+#endif
+
+        /* timed out, or the mutex was destroyed out from underneath us */
+        if (unlikely(ret < NO_ERROR))
+            break;
+    }
+
+    if (ret == NO_ERROR) {
+        m->holder = current_thread;
+#if MUTEX_PRIORITY_INHERITANCE
+        if (m->wait.count > 0)
+            mutex_inherit_locked(m, current_thread);
+#endif
+    }
+
+    THREAD_UNLOCK(state);
+
+    return ret;
+}
+
 /**
  * @brief  Mutex wait with timeout
  *
@@ -58,45 +214,46 @@ void mutex_destroy(mutex_t *m) {
  * Timeout may be zero, in which case this function returns immediately if
  * the mutex is not free.
  *
+ * An uncontended mutex is taken without the thread lock. On SMP a contended
+ * one is spun on for a short while if its holder is running on another cpu
+ * before the thread blocks.
+ *
  * @return  NO_ERROR on success, ERR_TIMED_OUT on timeout,
  * other values on error
  */
 status_t mutex_acquire_timeout(mutex_t *m, lk_time_t timeout) {
     DEBUG_ASSERT(m->magic == MUTEX_MAGIC);
 
+    thread_t *current_thread = get_current_thread();
+
 #if LK_DEBUGLEVEL > 0
-    if (unlikely(get_current_thread() == m->holder))
+    if (unlikely(current_thread == m->holder))
         panic("mutex_acquire_timeout: thread %p (%s) tried to acquire mutex %p it already owns.\n",
-              get_current_thread(), get_current_thread()->name, m);
+              current_thread, current_thread->name, m);
 #endif
 
-    THREAD_LOCK(state);
+    bool acquired = mutex_cmpxchg(m, MUTEX_UNLOCKED, MUTEX_LOCKED);
+#if WITH_SMP
+    if (!acquired && timeout != 0)
+        acquired = mutex_spin(m);
+#endif
+    if (unlikely(!acquired))
+        return mutex_acquire_slow(m, timeout);
 
-    status_t ret = NO_ERROR;
-    if (unlikely(++m->count > 1)) {
-        ret = wait_queue_block(&m->wait, timeout);
-        if (unlikely(ret < NO_ERROR)) {
-            /* if the acquisition timed out, back out the acquire and exit */
-            if (likely(ret == ERR_TIMED_OUT)) {
-                /*
-                 * race: the mutex may have been destroyed after the timeout,
-                 * but before we got scheduled again which makes messing with the
-                 * count variable dangerous.
-                 */
-                m->count--;
-            }
-            /* if there was a general error, it may have been destroyed out from
-             * underneath us, so just exit (which is really an invalid state anyway)
-             */
-            goto err;
-        }
-    }
+    m->holder = current_thread;
 
-    m->holder = get_current_thread();
+#if MUTEX_PRIORITY_INHERITANCE
+    /* a waiter that showed up before we recorded ourselves as the holder could
+     * not lend us its priority, pick it up now. the compare and swap orders the
+     * holder store above against the read of the state. */
+    if (unlikely(!mutex_cmpxchg(m, MUTEX_LOCKED, MUTEX_LOCKED))) {
+        THREAD_LOCK(state);
+        mutex_inherit_locked(m, current_thread);
+        THREAD_UNLOCK(state);
+    }
+#endif
 
-err:
-    THREAD_UNLOCK(state);
-    return ret;
+    return NO_ERROR;
 }
 
 /**
@@ -112,11 +269,28 @@ status_t mutex_release(mutex_t *m) {
     }
 #endif
 
+    m->holder = 0;
+
+    /* nobody has had to wait for it */
+    if (likely(mutex_cmpxchg(m, MUTEX_LOCKED, MUTEX_UNLOCKED)))
+        return NO_ERROR;
+
     THREAD_LOCK(state);
 
-    m->holder = 0;
+    mutex_xchg(m, MUTEX_UNLOCKED);
 
-    if (unlikely(--m->count >= 1)) {
+#if MUTEX_PRIORITY_INHERITANCE
+    /* drop whatever priority this mutex's waiters lent us */
+    if (list_in_list(&m->holder_node)) {
+        list_delete(&m->holder_node);
+        thread_update_inherited_priority(get_current_thread());
+    }
+#endif
+
+    if (m->wait.count > 0) {
+#if MUTEX_PRIORITY_INHERITANCE
+        mutex_highest_waiter_first(m);
+#endif
         /* release a thread */
         wait_queue_wake_one(&m->wait, true, NO_ERROR);
     }
@@ -124,4 +298,3 @@ status_t mutex_release(mutex_t *m) {
     THREAD_UNLOCK(state);
     return NO_ERROR;
 }
-
@@ -5,19 +5,27 @@ MODULE := $(LOCAL_DIR)
 MODULE_DEPS := \
 	lib/libc \
 	lib/debug \
-	lib/heap
+	lib/heap \
+	lib/slab
 
 MODULE_SRCS := \
 	$(LOCAL_DIR)/debug.c \
 	$(LOCAL_DIR)/event.c \
 	$(LOCAL_DIR)/init.c \
 	$(LOCAL_DIR)/mutex.c \
+	$(LOCAL_DIR)/rwlock.c \
 	$(LOCAL_DIR)/thread.c \
 	$(LOCAL_DIR)/timer.c \
 	$(LOCAL_DIR)/semaphore.c \
 	$(LOCAL_DIR)/mp.c \
 	$(LOCAL_DIR)/port.c
 
+# mutex holders inherit the priority of their highest priority waiter
+MUTEX_PRIORITY_INHERITANCE ?= true
+ifeq (true,$(call TOBOOL,$(MUTEX_PRIORITY_INHERITANCE)))
+GLOBAL_DEFINES += MUTEX_PRIORITY_INHERITANCE=1
+endif
+
 ifeq ($(WITH_KERNEL_VM),1)
 MODULE_DEPS += kernel/vm
 else
@@ -0,0 +1,296 @@
+/*
+ * Copyright (c) 2008-2014 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+
+/**
+ * @file
+ * @brief  Reader/writer lock functions
+ *
+ * @defgroup rwlock Reader/writer lock
+ * @{
+ */
+
+#include <kernel/rwlock.h>
+
+#include <arch/atomic.h>
+#include <assert.h>
+#include <kernel/thread.h>
+#include <lk/debug.h>
+#include <lk/err.h>
+
+/*
+ * Readers add RWLOCK_STATE_READER to the state and a writer sets
+ * RWLOCK_STATE_WRITER, both with a compare and swap while nobody is waiting.
+ * Threads that have to wait set the flag bits under the thread lock before
+ * blocking, which sends the release that would let them in down the slow
+ * path. The slow path hands the lock directly to the threads it wakes, so a
+ * woken thread never has to race for it again.
+ */
+#define READERS(state) ((state) / RWLOCK_STATE_READER)
+
+static inline int rwlock_cmpxchg(rwlock_t *l, int oldval, int newval) {
+    return atomic_cmpxchg(&l->state, oldval, newval);
+}
+
+/* hand the lock to whoever can have it now and recompute the flag bits.
+ * a released write lock goes to the readers that queued behind it first. */
+static void rwlock_grant_locked(rwlock_t *l, bool prefer_readers, bool resched) {
+    DEBUG_ASSERT(thread_lock_held());
+
+    int old = l->state;
+    int wake_readers;
+    bool wake_writer;
+
+    for (;;) {
+        int newval = old;
+        wake_readers = 0;
+        wake_writer = false;
+
+        if (!(old & RWLOCK_STATE_WRITER)) {
+            if (l->read_wait.count > 0 && (prefer_readers || l->write_wait.count == 0)) {
+                wake_readers = l->read_wait.count;
+                newval += wake_readers * RWLOCK_STATE_READER;
+            } else if (l->write_wait.count > 0 && READERS(old) == 0) {
+                wake_writer = true;
+                newval |= RWLOCK_STATE_WRITER;
+            }
+        }
+
+        int writers_left = l->write_wait.count - (wake_writer ? 1 : 0);
+        int waiters_left = l->read_wait.count - wake_readers + writers_left;
+
+        newval &= ~RWLOCK_STATE_FLAGS;
+        if (waiters_left > 0)
+            newval |= RWLOCK_STATE_WAITERS;
+        if (writers_left > 0)
+            newval |= RWLOCK_STATE_WRITER_WAITING;
+
+        int prev = rwlock_cmpxchg(l, old, newval);
+        if (prev == old)
+            break;
+        old = prev;
+    }
+
+    if (wake_readers)
+        wait_queue_wake_all(&l->read_wait, resched, NO_ERROR);
+    else if (wake_writer)
+        wait_queue_wake_one(&l->write_wait, resched, NO_ERROR);
+}
+
+/**
+ * @brief  Initialize a rwlock_t
+ */
+void rwlock_init(rwlock_t *l) {
+    *l = (rwlock_t)RWLOCK_INITIAL_VALUE(*l);
+}
+
+/**
+ * @brief  Destroy a rwlock_t
+ *
+ * Any threads still waiting on the lock are woken with ERR_OBJECT_DESTROYED.
+ * The rwlock_t object itself is not freed.
+ */
+void rwlock_destroy(rwlock_t *l) {
+    DEBUG_ASSERT(l->magic == RWLOCK_MAGIC);
+
+    THREAD_LOCK(state);
+    l->magic = 0;
+    l->state = 0;
+    l->writer = NULL;
+    wait_queue_destroy(&l->read_wait, false);
+    wait_queue_destroy(&l->write_wait, true);
+    THREAD_UNLOCK(state);
+}
+
+static status_t rwlock_acquire_read_slow(rwlock_t *l, lk_time_t timeout) {
+    status_t ret;
+
+    THREAD_LOCK(state);
+
+    for (;;) {
+        int old = l->state;
+
+        if (!(old & (RWLOCK_STATE_WRITER | RWLOCK_STATE_WRITER_WAITING))) {
+            if (rwlock_cmpxchg(l, old, old + RWLOCK_STATE_READER) == old) {
+                ret = NO_ERROR;
+                break;
+            }
+            continue;
+        }
+
+        if (timeout == 0) {
+            ret = ERR_TIMED_OUT;
+            break;
+        }
+
+        /* make sure whoever lets us in takes the slow path */
+        if (!(old & RWLOCK_STATE_WAITERS) &&
+                rwlock_cmpxchg(l, old, old | RWLOCK_STATE_WAITERS) != old)
+            continue;
+
+        /* on success the releasing thread has already counted us as a reader */
+        ret = wait_queue_block(&l->read_wait, timeout);
+        if (ret < NO_ERROR && ret != ERR_OBJECT_DESTROYED)
+            rwlock_grant_locked(l, false, false);
+        break;
+    }
+
+    THREAD_UNLOCK(state);
+
+    return ret;
+}
+
+/**
+ * @brief  Acquire a reader/writer lock for read with timeout
+ *
+ * Any number of readers may hold the lock at once. A reader waits while the
+ * lock is held for write or while a writer is waiting for it.
+ *
+ * @return  NO_ERROR on success, ERR_TIMED_OUT on timeout,
+ * other values on error
+ */
+status_t rwlock_acquire_read_timeout(rwlock_t *l, lk_time_t timeout) {
+    DEBUG_ASSERT(l->magic == RWLOCK_MAGIC);
+
+#if LK_DEBUGLEVEL > 0
+    if (unlikely(is_rwlock_write_held(l)))
+        panic("rwlock_acquire_read_timeout: thread %p (%s) tried to acquire rwlock %p it holds for write.\n",
+              get_current_thread(), get_current_thread()->name, l);
+#endif
+
+    int old = l->state;
+    while (!(old & (RWLOCK_STATE_WRITER | RWLOCK_STATE_WRITER_WAITING))) {
+        int prev = rwlock_cmpxchg(l, old, old + RWLOCK_STATE_READER);
+        if (prev == old)
+            return NO_ERROR;
+        old = prev;
+    }
+
+    return rwlock_acquire_read_slow(l, timeout);
+}
+
+/**
+ * @brief  Release a reader/writer lock held for read
+ */
+status_t rwlock_release_read(rwlock_t *l) {
+    DEBUG_ASSERT(l->magic == RWLOCK_MAGIC);
+
+    int old = l->state;
+    DEBUG_ASSERT(READERS(old) > 0);
+
+    /* only the last reader out has anyone to let in */
+    while (!(old & RWLOCK_STATE_WAITERS) || READERS(old) > 1) {
+        int prev = rwlock_cmpxchg(l, old, old - RWLOCK_STATE_READER);
+        if (prev == old)
+            return NO_ERROR;
+        old = prev;
+    }
+
+    THREAD_LOCK(state);
+
+    atomic_add(&l->state, -RWLOCK_STATE_READER);
+    rwlock_grant_locked(l, false, true);
+
+    THREAD_UNLOCK(state);
+
+    return NO_ERROR;
+}
+
+static status_t rwlock_acquire_write_slow(rwlock_t *l, lk_time_t timeout) {
+    status_t ret;
+
+    THREAD_LOCK(state);
+
+    for (;;) {
+        int old = l->state;
+
+        if ((old & ~RWLOCK_STATE_FLAGS) == 0) {
+            if (rwlock_cmpxchg(l, old, old | RWLOCK_STATE_WRITER) == old) {
+                ret = NO_ERROR;
+                break;
+            }
+            continue;
+        }
+
+        if (timeout == 0) {
+            ret = ERR_TIMED_OUT;
+            break;
+        }
+
+        /* keep new readers out and make sure whoever lets us in takes the slow path */
+        int want = old | RWLOCK_STATE_FLAGS;
+        if (old != want && rwlock_cmpxchg(l, old, want) != old)
+            continue;
+
+        /* on success the releasing thread has already set the writer bit for us */
+        ret = wait_queue_block(&l->write_wait, timeout);
+        if (ret < NO_ERROR && ret != ERR_OBJECT_DESTROYED) {
+            /* readers may have been held off only by us */
+            rwlock_grant_locked(l, false, false);
+        }
+        break;
+    }
+
+    if (ret == NO_ERROR)
+        l->writer = get_current_thread();
+
+    THREAD_UNLOCK(state);
+
+    return ret;
+}
+
+/**
+ * @brief  Acquire a reader/writer lock for write with timeout
+ *
+ * @return  NO_ERROR on success, ERR_TIMED_OUT on timeout,
+ * other values on error
+ */
+status_t rwlock_acquire_write_timeout(rwlock_t *l, lk_time_t timeout) {
+    DEBUG_ASSERT(l->magic == RWLOCK_MAGIC);
+
+#if LK_DEBUGLEVEL > 0
+    if (unlikely(is_rwlock_write_held(l)))
+        panic("rwlock_acquire_write_timeout: thread %p (%s) tried to acquire rwlock %p it already owns.\n",
+              get_current_thread(), get_current_thread()->name, l);
+#endif
+
+    if (likely(rwlock_cmpxchg(l, 0, RWLOCK_STATE_WRITER) == 0)) {
+        l->writer = get_current_thread();
+        return NO_ERROR;
+    }
+
+    return rwlock_acquire_write_slow(l, timeout);
+}
+
+/**
+ * @brief  Release a reader/writer lock held for write
+ */
+status_t rwlock_release_write(rwlock_t *l) {
+    DEBUG_ASSERT(l->magic == RWLOCK_MAGIC);
+
+#if LK_DEBUGLEVEL > 0
+    if (unlikely(!is_rwlock_write_held(l))) {
+        panic("rwlock_release_write: thread %p (%s) tried to release rwlock %p it doesn't own. owned by %p (%s)\n",
+              get_current_thread(), get_current_thread()->name, l, l->writer, l->writer ? l->writer->name : "none");
+    }
+#endif
+
+    l->writer = NULL;
+
+    if (likely(rwlock_cmpxchg(l, RWLOCK_STATE_WRITER, 0) == RWLOCK_STATE_WRITER))
+        return NO_ERROR;
+
+    THREAD_LOCK(state);
+
+    /* nothing else touches the state while the writer bit is set */
+    atomic_and(&l->state, ~RWLOCK_STATE_WRITER);
+    rwlock_grant_locked(l, true, true);
+
+    THREAD_UNLOCK(state);
+
+    return NO_ERROR;
+}
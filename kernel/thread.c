@@ -20,8 +20,10 @@
 #include <assert.h>
 #include <kernel/debug.h>
 #include <kernel/mp.h>
+#include <kernel/mutex.h>
 #include <kernel/timer.h>
 #include <lib/heap.h>
+#include <lib/slab.h>
 #include <lk/debug.h>
 #include <lk/err.h>
 #include <lk/list.h>
@@ -47,15 +49,44 @@ struct thread_stats thread_stats[SMP_MAX_CPUS];
 /* global thread list */
 static struct list_node thread_list;
 
+/* thread structures handed out by thread_create */
+static slab_cache_t thread_cache =
+    SLAB_CACHE_INITIAL_VALUE(thread_cache, "thread_t", sizeof(thread_t), __alignof(thread_t), NULL, NULL);
+
+/* detached threads that have exited but whose structure has not been freed.
+ * by the time anyone else holds the thread lock they have switched away.
+ * the reaper thread waits on reaper_wait for this to become non empty. */
+static struct list_node dead_thread_list = LIST_INITIAL_VALUE(dead_thread_list);
+static wait_queue_t reaper_wait = WAIT_QUEUE_INITIAL_VALUE(reaper_wait);
+
 /* master thread spinlock */
 spin_lock_t thread_lock = SPIN_LOCK_INITIAL_VALUE;
 
-/* the run queue */
-static struct list_node run_queue[NUM_PRIORITIES];
-static uint32_t run_queue_bitmap;
+/* the run queues, one per cpu. still protected by thread_lock. */
+struct run_queue {
+    struct list_node queue[NUM_PRIORITIES];
+    uint32_t bitmap;
+    uint count;
+
+#if WITH_SMP
+    /* the thread running on this cpu, so wakeups can tell whom to preempt */
+    thread_t *curr_thread;
+#endif
+
+#if PLATFORM_HAS_DYNAMIC_TIMER
+    /* the preemption tick only runs while the current thread has company */
+    bool preempt_armed;
+#if THREAD_STATS
+    bool tickless;
+    lk_time_t tickless_start;
+#endif
+#endif
+} __CPU_ALIGN;
+
+static struct run_queue run_queue[SMP_MAX_CPUS];
 
 /* make sure the bitmap is large enough to cover our number of priorities */
-STATIC_ASSERT(NUM_PRIORITIES <= sizeof(run_queue_bitmap) * 8);
+STATIC_ASSERT(NUM_PRIORITIES <= sizeof(run_queue[0].bitmap) * 8);
 
 /* the idle thread(s) (statically allocated) */
 #if WITH_SMP
@@ -73,46 +104,163 @@ static void idle_thread_routine(void) __NO_RETURN;
 #if PLATFORM_HAS_DYNAMIC_TIMER
 /* preemption timer */
 static timer_t preempt_timer[SMP_MAX_CPUS];
+
+#define PREEMPT_TICK_MS 10
+
+static void update_preempt_timer(uint cpu, thread_t *current);
+#endif
+
+/*
+ * Select the cpu whose run queue a thread that just became ready goes into.
+ *
+ * Pinned threads always go to their cpu. A thread that is currently running
+ * (the current thread being requeued) stays on its cpu. Otherwise prefer an
+ * idle cpu, starting with the one the thread last ran on, and claim a remote
+ * one by marking it busy so that a burst of wakeups spreads out over the idle
+ * cpus. If every cpu is busy the thread stays local, where idle cpus can later
+ * steal it, unless it outranks a thread running on another cpu: then it goes
+ * to the cpu running the lowest priority thread, which wakeup_cpu() kicks.
+ * Cpus running realtime threads are never picked for a thread from elsewhere.
+ */
+#if WITH_SMP
+static uint sched_pick_busy_cpu(thread_t *t, uint local_cpu) {
+    uint cpu = local_cpu;
+    int lowest = run_queue[local_cpu].curr_thread ? run_queue[local_cpu].curr_thread->priority : t->priority;
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        thread_t *curr = run_queue[i].curr_thread;
+        if (i == local_cpu || !curr || !(mp.active_cpus & ~mp.realtime_cpus & (1U << i)))
+            continue;
+        if (curr->priority < lowest) {
+            lowest = curr->priority;
+            cpu = i;
+        }
+    }
+
+    return (t->priority > lowest) ? cpu : local_cpu;
+}
+
+static uint sched_pick_cpu(thread_t *t) {
+    uint local_cpu = arch_curr_cpu_num();
+
+    if (t->pinned_cpu >= 0)
+        return t->pinned_cpu;
+    if (t->curr_cpu >= 0)
+        return t->curr_cpu;
+
+    mp_cpu_mask_t idle = mp_get_idle_mask() & mp.active_cpus & ~mp.realtime_cpus;
+    if (idle == 0)
+        return sched_pick_busy_cpu(t, local_cpu);
+
+    uint cpu;
+    if (t->last_cpu >= 0 && (idle & (1U << t->last_cpu)))
+        cpu = t->last_cpu;
+    else if (idle & (1U << local_cpu))
+        cpu = local_cpu;
+    else
+        cpu = __builtin_ctz(idle);
+
+    /* the local cpu reschedules on its own, remote ones get an ipi */
+    if (cpu != local_cpu)
+        mp_set_cpu_busy(cpu);
+    return cpu;
+}
+#else
+static inline uint sched_pick_cpu(thread_t *t) {
+    return 0;
+}
 #endif
 
-/* run queue manipulation */
-static void insert_in_run_queue_head(thread_t *t) {
+/* run queue manipulation, returns the cpu the thread was queued on */
+static uint insert_in_run_queue_head(thread_t *t) {
     DEBUG_ASSERT(t->magic == THREAD_MAGIC);
     DEBUG_ASSERT(t->state == THREAD_READY);
     DEBUG_ASSERT(!list_in_list(&t->queue_node));
     DEBUG_ASSERT(arch_ints_disabled());
     DEBUG_ASSERT(spin_lock_held(&thread_lock));
 
-    list_add_head(&run_queue[t->priority], &t->queue_node);
-    run_queue_bitmap |= (1<<t->priority);
+    uint cpu = sched_pick_cpu(t);
+    struct run_queue *rq = &run_queue[cpu];
+
+    list_add_head(&rq->queue[t->priority], &t->queue_node);
+    rq->bitmap |= (1U << t->priority);
+    rq->count++;
+#if WITH_SMP
+    t->queue_cpu = cpu;
+#endif
+
+#if PLATFORM_HAS_DYNAMIC_TIMER
+    /* the local running thread may now have to share the cpu. remote cpus
+     * sort this out when they reschedule on the ipi from wakeup_cpu() */
+    thread_t *current_thread = get_current_thread();
+    if (cpu == arch_curr_cpu_num() && t != current_thread)
+        update_preempt_timer(cpu, current_thread);
+#endif
+
+    return cpu;
 }
 
-static void insert_in_run_queue_tail(thread_t *t) {
+static uint insert_in_run_queue_tail(thread_t *t) {
     DEBUG_ASSERT(t->magic == THREAD_MAGIC);
     DEBUG_ASSERT(t->state == THREAD_READY);
     DEBUG_ASSERT(!list_in_list(&t->queue_node));
     DEBUG_ASSERT(arch_ints_disabled());
     DEBUG_ASSERT(spin_lock_held(&thread_lock));
 
-    list_add_tail(&run_queue[t->priority], &t->queue_node);
-    run_queue_bitmap |= (1<<t->priority);
+    uint cpu = sched_pick_cpu(t);
+    struct run_queue *rq = &run_queue[cpu];
+
+    list_add_tail(&rq->queue[t->priority], &t->queue_node);
+    rq->bitmap |= (1U << t->priority);
+    rq->count++;
+#if WITH_SMP
+    t->queue_cpu = cpu;
+#endif
+
+#if PLATFORM_HAS_DYNAMIC_TIMER
+    /* the local running thread may now have to share the cpu. remote cpus
+     * sort this out when they reschedule on the ipi from wakeup_cpu() */
+    thread_t *current_thread = get_current_thread();
+    if (cpu == arch_curr_cpu_num() && t != current_thread)
+        update_preempt_timer(cpu, current_thread);
+#endif
+
+    return cpu;
 }
 
-static void wakeup_cpu_for_thread(thread_t *t)
-{
-    /* Wake up the core to which this thread is pinned
-     * or wake up all if thread is unpinned */
-    int pinned_cpu = thread_pinned_cpu(t);
-    if (pinned_cpu < 0)
-        mp_reschedule(MP_CPU_ALL_BUT_LOCAL, 0);
-    else
-        mp_reschedule(1U << pinned_cpu, 0);
+static void remove_from_run_queue(struct run_queue *rq, thread_t *t) {
+    DEBUG_ASSERT(list_in_list(&t->queue_node));
+    DEBUG_ASSERT(rq->count > 0);
+
+    list_delete(&t->queue_node);
+    rq->count--;
+#if WITH_SMP
+    t->queue_cpu = -1;
+#endif
+    if (list_is_empty(&rq->queue[t->priority]))
+        rq->bitmap &= ~(1U << t->priority);
+}
+
+static inline uint highest_run_queue(uint32_t bitmap) {
+    return sizeof(bitmap) * 8 - 1 - __builtin_clz(bitmap);
+}
+
+/* kick the cpu a thread was just queued on, unless it is us */
+static void wakeup_cpu(uint cpu) {
+    mp_reschedule(1U << cpu, 0);
 }
 
 static void init_thread_struct(thread_t *t, const char *name) {
     memset(t, 0, sizeof(thread_t));
     t->magic = THREAD_MAGIC;
     thread_set_pinned_cpu(t, -1);
+#if WITH_SMP
+    t->last_cpu = -1;
+    t->queue_cpu = -1;
+#endif
+#if MUTEX_PRIORITY_INHERITANCE
+    list_initialize(&t->held_mutexes);
+#endif
     strlcpy(t->name, name, sizeof(t->name));
 }
 
@@ -147,7 +295,7 @@ thread_t *thread_create_etc(thread_t *t, const char *name, thread_start_routine
     unsigned int flags = 0;
 
     if (!t) {
-        t = malloc(sizeof(thread_t));
+        t = slab_cache_alloc(&thread_cache);
         if (!t)
             return NULL;
         flags |= THREAD_FLAG_FREE_STRUCT;
@@ -158,6 +306,7 @@ thread_t *thread_create_etc(thread_t *t, const char *name, thread_start_routine
     t->entry = entry;
     t->arg = arg;
     t->priority = priority;
+    t->base_priority = priority;
     t->state = THREAD_SUSPENDED;
     t->blocking_wait_queue = NULL;
     t->wait_queue_block_ret = NO_ERROR;
@@ -179,7 +328,7 @@ thread_t *thread_create_etc(thread_t *t, const char *name, thread_start_routine
         t->stack = malloc(stack_size);
         if (!t->stack) {
             if (flags & THREAD_FLAG_FREE_STRUCT)
-                free(t);
+                slab_cache_free(&thread_cache, t);
             return NULL;
         }
         flags |= THREAD_FLAG_FREE_STACK;
@@ -238,13 +387,13 @@ status_t thread_set_real_time(thread_t *t) {
     DEBUG_ASSERT(t->magic == THREAD_MAGIC);
 
     THREAD_LOCK(state);
+    t->flags |= THREAD_FLAG_REAL_TIME;
 #if PLATFORM_HAS_DYNAMIC_TIMER
     if (t == get_current_thread()) {
         /* if we're currently running, cancel the preemption timer. */
-        timer_cancel(&preempt_timer[arch_curr_cpu_num()]);
+        update_preempt_timer(arch_curr_cpu_num(), t);
     }
 #endif
-    t->flags |= THREAD_FLAG_REAL_TIME;
     THREAD_UNLOCK(state);
 
     return NO_ERROR;
@@ -262,6 +411,51 @@ static bool thread_is_real_time_or_idle(thread_t *t) {
     return !!(t->flags & (THREAD_FLAG_REAL_TIME | THREAD_FLAG_IDLE));
 }
 
+#if PLATFORM_HAS_DYNAMIC_TIMER
+/*
+ * Run the preemption tick on the local cpu only while the thread running on
+ * it is subject to time slicing and something else is waiting in the run
+ * queue. A lone thread, a real time thread or the idle thread runs tickless.
+ */
+static void update_preempt_timer(uint cpu, thread_t *current) {
+    struct run_queue *rq = &run_queue[cpu];
+
+    DEBUG_ASSERT(spin_lock_held(&thread_lock));
+    DEBUG_ASSERT(cpu == arch_curr_cpu_num());
+
+    bool sliced = !thread_is_real_time_or_idle(current);
+    bool needed = sliced && rq->count > 0;
+
+#if THREAD_STATS
+    /* account for the ticks the old scheme would have taken while a lone
+     * thread ran, idle and real time threads never had a tick */
+    bool tickless = sliced && !needed;
+    if (tickless != rq->tickless) {
+        lk_time_t now = current_time();
+        if (tickless)
+            rq->tickless_start = now;
+        else
+            thread_stats[cpu].timer_ints_avoided += (now - rq->tickless_start) / PREEMPT_TICK_MS;
+        rq->tickless = tickless;
+    }
+#endif
+
+    if (needed == rq->preempt_armed)
+        return;
+
+#if DEBUG_THREAD_CONTEXT_SWITCH
+    dprintf(ALWAYS, "%s preempt, cpu %d, thread %p (%s), run queue %u\n",
+            needed ? "start" : "stop", cpu, current, current->name, rq->count);
+#endif
+
+    rq->preempt_armed = needed;
+    if (needed)
+        timer_set_periodic(&preempt_timer[cpu], PREEMPT_TICK_MS, thread_timer_tick, NULL);
+    else
+        timer_cancel(&preempt_timer[cpu]);
+}
+#endif
+
 /**
  * @brief  Make a suspended thread executable.
  *
@@ -281,13 +475,11 @@ status_t thread_resume(thread_t *t) {
     THREAD_LOCK(state);
     if (t->state == THREAD_SUSPENDED) {
         t->state = THREAD_READY;
-        insert_in_run_queue_head(t);
+        wakeup_cpu(insert_in_run_queue_head(t));
         if (!ints_disabled) /* HACK, don't resced into bootstrap thread before idle thread is set up */
             resched = true;
     }
 
-    wakeup_cpu_for_thread(t);
-
     THREAD_UNLOCK(state);
 
     if (resched)
@@ -346,7 +538,7 @@ status_t thread_join(thread_t *t, int *retcode, lk_time_t timeout) {
         free(t->stack);
 
     if (t->flags & THREAD_FLAG_FREE_STRUCT)
-        free(t);
+        slab_cache_free(&thread_cache, t);
 
     return NO_ERROR;
 }
@@ -410,8 +602,11 @@ void thread_exit(int retcode) {
             current_thread->flags &= ~THREAD_FLAG_DEBUG_STACK_BOUNDS_CHECK;
         }
 
-        if (current_thread->flags & THREAD_FLAG_FREE_STRUCT)
-            heap_delayed_free(current_thread);
+        /* we're still running on it, the reaper frees it once we've switched away */
+        if (current_thread->flags & THREAD_FLAG_FREE_STRUCT) {
+            list_add_tail(&dead_thread_list, &current_thread->thread_list_node);
+            wait_queue_wake_one(&reaper_wait, false, NO_ERROR);
+        }
     } else {
         /* signal if anyone is waiting */
         wait_queue_wake_all(&current_thread->retcode_wait_queue, false, 0);
@@ -423,35 +618,103 @@ void thread_exit(int retcode) {
     panic("somehow fell through thread_exit()\n");
 }
 
+/* frees the structures of detached threads that have exited */
+static int reaper_thread_routine(void *arg) {
+    for (;;) {
+        struct list_node list = LIST_INITIAL_VALUE(list);
+        thread_t *t;
+
+        THREAD_LOCK(state);
+        while (list_is_empty(&dead_thread_list))
+            wait_queue_block(&reaper_wait, INFINITE_TIME);
+        while ((t = list_remove_head_type(&dead_thread_list, thread_t, thread_list_node)))
+            list_add_tail(&list, &t->thread_list_node);
+        THREAD_UNLOCK(state);
+
+        while ((t = list_remove_head_type(&list, thread_t, thread_list_node)))
+            slab_cache_free(&thread_cache, t);
+    }
+
+    return 0;
+}
+
 static void idle_thread_routine(void) {
     for (;;)
         arch_idle();
 }
 
-static thread_t *get_top_thread(int cpu) {
-    thread_t *newthread;
-    uint32_t local_run_queue_bitmap = run_queue_bitmap;
+#if WITH_SMP
+/*
+ * Called when a cpu's own run queue is empty. Look through the other cpus'
+ * run queues for the highest priority thread that is not pinned and pull it
+ * over, preferring the most loaded cpu when priorities tie. A cpu with only
+ * pinned threads queued is passed over for the next best one.
+ */
+static thread_t *steal_thread(uint cpu) {
+    uint32_t tried = 1U << cpu;
+
+    for (;;) {
+        struct run_queue *victim = NULL;
+        uint victim_cpu = 0;
+        uint victim_pri = 0;
+
+        for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+            struct run_queue *rq = &run_queue[i];
+            if ((tried & (1U << i)) || rq->bitmap == 0)
+                continue;
+
+            uint pri = highest_run_queue(rq->bitmap);
+            if (!victim || pri > victim_pri || (pri == victim_pri && rq->count > victim->count)) {
+                victim = rq;
+                victim_cpu = i;
+                victim_pri = pri;
+            }
+        }
 
-    while (local_run_queue_bitmap) {
-        /* find the first (remaining) queue with a thread in it */
-        uint next_queue = sizeof(run_queue_bitmap) * 8 - 1 - __builtin_clz(local_run_queue_bitmap);
+        if (!victim)
+            return NULL;
+        tried |= 1U << victim_cpu;
+
+        /* threads in another cpu's queue are either unpinned or pinned to that cpu */
+        uint32_t local_bitmap = victim->bitmap;
+        while (local_bitmap) {
+            uint next_queue = highest_run_queue(local_bitmap);
+
+            thread_t *t;
+            list_for_every_entry(&victim->queue[next_queue], t, thread_t, queue_node) {
+                if (t->pinned_cpu < 0) {
+                    remove_from_run_queue(victim, t);
+                    THREAD_STATS_INC(steals);
+                    return t;
+                }
+            }
 
-        list_for_every_entry(&run_queue[next_queue], newthread, thread_t, queue_node) {
-#if WITH_SMP
-            if (newthread->pinned_cpu < 0 || newthread->pinned_cpu == cpu)
+            local_bitmap &= ~(1U << next_queue);
+        }
+    }
+}
 #endif
-            {
-                list_delete(&newthread->queue_node);
 
-                if (list_is_empty(&run_queue[next_queue]))
-                    run_queue_bitmap &= ~(1<<next_queue);
+static thread_t *get_top_thread(int cpu) {
+    struct run_queue *rq = &run_queue[cpu];
 
-                return newthread;
-            }
-        }
+    if (rq->bitmap) {
+        /* find the first (remaining) queue with a thread in it. everything in
+         * our own queue is either unpinned or pinned to us, so take the head. */
+        uint next_queue = highest_run_queue(rq->bitmap);
+        thread_t *newthread = list_peek_head_type(&rq->queue[next_queue], thread_t, queue_node);
 
-        local_run_queue_bitmap &= ~(1<<next_queue);
+        remove_from_run_queue(rq, newthread);
+        return newthread;
     }
+
+#if WITH_SMP
+    /* nothing local to run, try to take work from a busier cpu */
+    thread_t *stolen = steal_thread(cpu);
+    if (stolen)
+        return stolen;
+#endif
+
     /* no threads to run, select the idle thread for this cpu */
     return idle_thread(cpu);
 }
@@ -487,6 +750,10 @@ void thread_resched(void) {
 
     oldthread = current_thread;
 
+#if PLATFORM_HAS_DYNAMIC_TIMER
+    update_preempt_timer(cpu, newthread);
+#endif
+
     if (newthread == oldthread)
         return;
 
@@ -496,10 +763,15 @@ void thread_resched(void) {
     }
 
     /* mark the cpu ownership of the threads */
+#if WITH_SMP
+    oldthread->last_cpu = cpu;
+#endif
     thread_set_curr_cpu(oldthread, -1);
     thread_set_curr_cpu(newthread, cpu);
 
 #if WITH_SMP
+    run_queue[cpu].curr_thread = newthread;
+
     if (thread_is_idle(newthread)) {
         mp_set_cpu_idle(cpu);
     } else {
@@ -527,28 +799,6 @@ void thread_resched(void) {
 
     KEVLOG_THREAD_SWITCH(oldthread, newthread);
 
-#if PLATFORM_HAS_DYNAMIC_TIMER
-    if (thread_is_real_time_or_idle(newthread)) {
-        if (!thread_is_real_time_or_idle(oldthread)) {
-            /* if we're switching from a non real time to a real time, cancel
-             * the preemption timer. */
-#if DEBUG_THREAD_CONTEXT_SWITCH
-            dprintf(ALWAYS, "arch_context_switch: stop preempt, cpu %d, old %p (%s), new %p (%s)\n",
-                    cpu, oldthread, oldthread->name, newthread, newthread->name);
-#endif
-            timer_cancel(&preempt_timer[cpu]);
-        }
-    } else if (thread_is_real_time_or_idle(oldthread)) {
-        /* if we're switching from a real time (or idle thread) to a regular one,
-         * set up a periodic timer to run our preemption tick. */
-#if DEBUG_THREAD_CONTEXT_SWITCH
-        dprintf(ALWAYS, "arch_context_switch: start preempt, cpu %d, old %p (%s), new %p (%s)\n",
-                cpu, oldthread, oldthread->name, newthread, newthread->name);
-#endif
-        timer_set_periodic(&preempt_timer[cpu], 10, thread_timer_tick, NULL);
-    }
-#endif
-
     /* set some optional target debug leds */
     target_set_debug_led(0, !thread_is_idle(newthread));
 
@@ -696,13 +946,111 @@ void thread_unblock(thread_t *t, bool resched) {
     DEBUG_ASSERT(!thread_is_idle(t));
 
     t->state = THREAD_READY;
-    insert_in_run_queue_head(t);
-    wakeup_cpu_for_thread(t);
+    wakeup_cpu(insert_in_run_queue_head(t));
 
     if (resched)
         thread_resched();
 }
 
+#if MUTEX_PRIORITY_INHERITANCE
+/* the run queue a ready thread is sitting in */
+static struct run_queue *run_queue_of(thread_t *t) {
+#if WITH_SMP
+    DEBUG_ASSERT(t->queue_cpu >= 0);
+    return &run_queue[t->queue_cpu];
+#else
+    return &run_queue[0];
+#endif
+}
+
+/* move a thread to a new priority in whatever state it is in */
+static void thread_change_priority(thread_t *t, int priority) {
+    DEBUG_ASSERT(spin_lock_held(&thread_lock));
+
+    if (t->priority == priority)
+        return;
+
+    switch (t->state) {
+        case THREAD_READY:
+            /* requeue it in its new priority queue */
+            remove_from_run_queue(run_queue_of(t), t);
+            t->priority = priority;
+            wakeup_cpu(insert_in_run_queue_head(t));
+            break;
+#if WITH_SMP
+        case THREAD_RUNNING:
+            /* a cpu running a thread that just lost its boost may have
+             * something better to do. the local cpu is rescheduled by the
+             * caller when it needs to be. */
+            if (priority < t->priority && (uint)thread_curr_cpu(t) != arch_curr_cpu_num())
+                wakeup_cpu(thread_curr_cpu(t));
+            t->priority = priority;
+            break;
+#endif
+        default:
+            t->priority = priority;
+            break;
+    }
+}
+
+/* the priority a thread should run at: its own or that of the highest
+ * priority thread waiting on a mutex it holds, whichever is higher */
+static int thread_inherited_priority(thread_t *t) {
+    int priority = t->base_priority;
+    mutex_t *m;
+
+    list_for_every_entry(&t->held_mutexes, m, mutex_t, holder_node) {
+        thread_t *waiter;
+        list_for_every_entry(&m->wait.list, waiter, thread_t, queue_node) {
+            if (waiter->priority > priority)
+                priority = waiter->priority;
+        }
+    }
+
+    return priority;
+}
+
+/**
+ * @brief  Lend a priority to the holder of a mutex
+ *
+ * Raises the holder of \a m to at least \a priority. If the holder is itself
+ * blocked on a mutex, the boost carries on to that mutex's holder and so on
+ * down the chain.
+ */
+void thread_boost_mutex_holder(mutex_t *m, int priority) {
+    DEBUG_ASSERT(spin_lock_held(&thread_lock));
+
+    thread_t *t = m->holder;
+    while (t && t->priority < priority) {
+        thread_change_priority(t, priority);
+        if (t->state != THREAD_BLOCKED || !t->blocking_mutex)
+            break;
+        t = t->blocking_mutex->holder;
+    }
+}
+
+/**
+ * @brief  Recompute a thread's inherited priority
+ *
+ * Called when the set of waiters on the mutexes a thread holds shrinks or
+ * changes hands. Any change is passed on down the chain of mutex holders the
+ * thread is blocked behind.
+ */
+void thread_update_inherited_priority(thread_t *t) {
+    DEBUG_ASSERT(spin_lock_held(&thread_lock));
+
+    while (t) {
+        int priority = thread_inherited_priority(t);
+        if (priority == t->priority)
+            break;
+        thread_change_priority(t, priority);
+        if (t->state != THREAD_BLOCKED || !t->blocking_mutex)
+            break;
+        t = t->blocking_mutex->holder;
+    }
+}
+#endif
+
 enum handler_return thread_timer_tick(struct timer *t, lk_time_t now, void *arg) {
     thread_t *current_thread = get_current_thread();
 
@@ -727,24 +1075,14 @@ static enum handler_return thread_sleep_handler(timer_t *timer, lk_time_t now, v
     THREAD_LOCK(state);
 
     t->state = THREAD_READY;
-    insert_in_run_queue_head(t);
+    wakeup_cpu(insert_in_run_queue_head(t));
 
     THREAD_UNLOCK(state);
 
     return INT_RESCHEDULE;
 }
 
-/**
- * @brief  Put thread to sleep; delay specified in ms
- *
- * This function puts the current thread to sleep until the specified
- * delay in ms has expired.
- *
- * Note that this function could sleep for longer than the specified delay if
- * other threads are running.  When the timer expires, this thread will
- * be placed at the head of the run queue.
- */
-void thread_sleep(lk_time_t delay) {
+static void thread_sleep_etc(lk_time_ns_t delay, bool ns) {
     timer_t timer;
 
     thread_t *current_thread = get_current_thread();
@@ -755,13 +1093,43 @@ void thread_sleep(lk_time_t delay) {
 
     timer_initialize(&timer);
 
+    lk_time_ns_t slack = timer_default_slack();
+
     THREAD_LOCK(state);
-    timer_set_oneshot(&timer, delay, thread_sleep_handler, (void *)current_thread);
+    if (ns)
+        timer_set_oneshot_ns_slack(&timer, delay, slack, thread_sleep_handler, (void *)current_thread);
+    else
+        timer_set_oneshot_slack(&timer, (lk_time_t)delay, (lk_time_t)(slack / 1000000),
+                                thread_sleep_handler, (void *)current_thread);
     current_thread->state = THREAD_SLEEPING;
     thread_resched();
     THREAD_UNLOCK(state);
 }
 
+/**
+ * @brief  Put thread to sleep; delay specified in ms
+ *
+ * This function puts the current thread to sleep until the specified
+ * delay in ms has expired.
+ *
+ * Note that this function could sleep for longer than the specified delay if
+ * other threads are running.  When the timer expires, this thread will
+ * be placed at the head of the run queue.
+ */
+void thread_sleep(lk_time_t delay) {
+    thread_sleep_etc(delay, false);
+}
+
+/**
+ * @brief  Put thread to sleep; delay specified in ns
+ *
+ * Like thread_sleep(), but the wakeup is not rounded to a millisecond on
+ * platforms that support nanosecond timers.
+ */
+void thread_sleep_ns(lk_time_ns_t delay) {
+    thread_sleep_etc(delay, true);
+}
+
 /**
  * @brief  Initialize threading system
  *
@@ -773,8 +1141,10 @@ void thread_init_early(void) {
     DEBUG_ASSERT(arch_curr_cpu_num() == 0);
 
     /* initialize the run queues */
-    for (i=0; i < NUM_PRIORITIES; i++)
-        list_initialize(&run_queue[i]);
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        for (i=0; i < NUM_PRIORITIES; i++)
+            list_initialize(&run_queue[cpu].queue[i]);
+    }
 
     /* initialize the thread list */
     list_initialize(&thread_list);
@@ -785,6 +1155,7 @@ void thread_init_early(void) {
 
     /* half construct this thread, since we're already running */
     t->priority = HIGHEST_PRIORITY;
+    t->base_priority = HIGHEST_PRIORITY;
     t->state = THREAD_RUNNING;
     t->flags = THREAD_FLAG_DETACHED;
     thread_set_curr_cpu(t, 0);
@@ -792,6 +1163,9 @@ void thread_init_early(void) {
     wait_queue_init(&t->retcode_wait_queue);
     list_add_head(&thread_list, &t->thread_list_node);
     set_current_thread(t);
+#if WITH_SMP
+    run_queue[0].curr_thread = t;
+#endif
 }
 
 /**
@@ -805,6 +1179,9 @@ void thread_init(void) {
         timer_initialize(&preempt_timer[i]);
     }
 #endif
+
+    thread_detach_and_resume(thread_create("reaper", &reaper_thread_routine, NULL,
+                                           LOW_PRIORITY, DEFAULT_STACK_SIZE));
 }
 
 /**
@@ -829,7 +1206,12 @@ void thread_set_priority(int priority) {
         priority = IDLE_PRIORITY + 1;
     if (priority > HIGHEST_PRIORITY)
         priority = HIGHEST_PRIORITY;
+    current_thread->base_priority = priority;
     current_thread->priority = priority;
+#if MUTEX_PRIORITY_INHERITANCE
+    /* keep anything inherited from threads waiting on our mutexes */
+    current_thread->priority = thread_inherited_priority(current_thread);
+#endif
 
     current_thread->state = THREAD_READY;
     insert_in_run_queue_head(current_thread);
@@ -860,6 +1242,7 @@ void thread_become_idle(void) {
 
     /* mark ourself as idle */
     t->priority = IDLE_PRIORITY;
+    t->base_priority = IDLE_PRIORITY;
     t->flags |= THREAD_FLAG_IDLE;
     thread_set_pinned_cpu(t, arch_curr_cpu_num());
 
@@ -889,6 +1272,7 @@ void thread_secondary_cpu_init_early(void) {
 
     /* half construct this thread, since we're already running */
     t->priority = HIGHEST_PRIORITY;
+    t->base_priority = HIGHEST_PRIORITY;
     t->state = THREAD_RUNNING;
     t->flags = THREAD_FLAG_DETACHED | THREAD_FLAG_IDLE;
     thread_set_curr_cpu(t, cpu);
@@ -899,6 +1283,9 @@ void thread_secondary_cpu_init_early(void) {
 
     list_add_head(&thread_list, &t->thread_list_node);
     set_current_thread(t);
+#if WITH_SMP
+    run_queue[cpu].curr_thread = t;
+#endif
 
     THREAD_UNLOCK(state);
 }
@@ -907,6 +1294,7 @@ void thread_secondary_cpu_entry(void) {
     uint cpu = arch_curr_cpu_num();
     thread_t *t = get_current_thread();
     t->priority = IDLE_PRIORITY;
+    t->base_priority = IDLE_PRIORITY;
 
     mp_set_curr_cpu_active(true);
     mp_set_cpu_idle(cpu);
@@ -1038,25 +1426,7 @@ static enum handler_return wait_queue_timeout_handler(timer_t *timer, lk_time_t
     return ret;
 }
 
-/**
- * @brief  Block until a wait queue is notified.
- *
- * This function puts the current thread at the end of a wait
- * queue and then blocks until some other thread wakes the queue
- * up again.
- *
- * @param  wait     The wait queue to enter
- * @param  timeout  The maximum time, in ms, to wait
- *
- * If the timeout is zero, this function returns immediately with
- * ERR_TIMED_OUT.  If the timeout is INFINITE_TIME, this function
- * waits indefinitely.  Otherwise, this function returns with
- * ERR_TIMED_OUT at the end of the timeout period.
- *
- * @return ERR_TIMED_OUT on timeout, else returns the return
- * value specified when the queue was woken by wait_queue_wake_one().
- */
-status_t wait_queue_block(wait_queue_t *wait, lk_time_t timeout) {
+static status_t wait_queue_block_etc(wait_queue_t *wait, bool infinite, lk_time_ns_t timeout, bool ns) {
     timer_t timer;
 
     thread_t *current_thread = get_current_thread();
@@ -1076,21 +1446,59 @@ status_t wait_queue_block(wait_queue_t *wait, lk_time_t timeout) {
     current_thread->wait_queue_block_ret = NO_ERROR;
 
     /* if the timeout is nonzero or noninfinite, set a callback to yank us out of the queue */
-    if (timeout != INFINITE_TIME) {
+    if (!infinite) {
+        lk_time_ns_t slack = timer_default_slack();
+
         timer_initialize(&timer);
-        timer_set_oneshot(&timer, timeout, wait_queue_timeout_handler, (void *)current_thread);
+        if (ns)
+            timer_set_oneshot_ns_slack(&timer, timeout, slack, wait_queue_timeout_handler, (void *)current_thread);
+        else
+            timer_set_oneshot_slack(&timer, (lk_time_t)timeout, (lk_time_t)(slack / 1000000),
+                                    wait_queue_timeout_handler, (void *)current_thread);
     }
 
     thread_resched();
 
     /* we don't really know if the timer fired or not, so it's better safe to try to cancel it */
-    if (timeout != INFINITE_TIME) {
+    if (!infinite) {
         timer_cancel(&timer);
     }
 
     return current_thread->wait_queue_block_ret;
 }
 
+/**
+ * @brief  Block until a wait queue is notified.
+ *
+ * This function puts the current thread at the end of a wait
+ * queue and then blocks until some other thread wakes the queue
+ * up again.
+ *
+ * @param  wait     The wait queue to enter
+ * @param  timeout  The maximum time, in ms, to wait
+ *
+ * If the timeout is zero, this function returns immediately with
+ * ERR_TIMED_OUT.  If the timeout is INFINITE_TIME, this function
+ * waits indefinitely.  Otherwise, this function returns with
+ * ERR_TIMED_OUT at the end of the timeout period.
+ *
+ * @return ERR_TIMED_OUT on timeout, else returns the return
+ * value specified when the queue was woken by wait_queue_wake_one().
+ */
+status_t wait_queue_block(wait_queue_t *wait, lk_time_t timeout) {
+    return wait_queue_block_etc(wait, timeout == INFINITE_TIME, timeout, false);
+}
+
+/**
+ * @brief  Block until a wait queue is notified, timeout in ns.
+ *
+ * Same as wait_queue_block(), but the timeout is given in nanoseconds
+ * and INFINITE_TIME_NS waits indefinitely.
+ */
+status_t wait_queue_block_ns(wait_queue_t *wait, lk_time_ns_t timeout) {
+    return wait_queue_block_etc(wait, timeout == INFINITE_TIME_NS, timeout, true);
+}
+
 /**
  * @brief  Wake up one thread sleeping on a wait queue
  *
@@ -1131,8 +1539,7 @@ int wait_queue_wake_one(wait_queue_t *wait, bool reschedule, status_t wait_queue
             current_thread->state = THREAD_READY;
             insert_in_run_queue_head(current_thread);
         }
-        insert_in_run_queue_head(t);
-        wakeup_cpu_for_thread(t);
+        wakeup_cpu(insert_in_run_queue_head(t));
         if (reschedule) {
             thread_resched();
         }
@@ -1185,14 +1592,7 @@ int wait_queue_wake_all(wait_queue_t *wait, bool reschedule, status_t wait_queue
         t->state = THREAD_READY;
         t->wait_queue_block_ret = wait_queue_error;
         t->blocking_wait_queue = NULL;
-        int pinned_cpu = thread_pinned_cpu(t);
-        if (pinned_cpu < 0) {
-            /* assumes MP_CPU_ALL_BUT_LOCAL is defined as all bits on */
-            cpu_mask = MP_CPU_ALL_BUT_LOCAL;
-        } else {
-            cpu_mask |= (1U << pinned_cpu);
-        }
-        insert_in_run_queue_head(t);
+        cpu_mask |= (1U << insert_in_run_queue_head(t));
         ret++;
     }
 
@@ -1251,8 +1651,7 @@ status_t thread_unblock_from_wait_queue(thread_t *t, status_t wait_queue_error)
     t->blocking_wait_queue = NULL;
     t->state = THREAD_READY;
     t->wait_queue_block_ret = wait_queue_error;
-    insert_in_run_queue_head(t);
-    wakeup_cpu_for_thread(t);
+    wakeup_cpu(insert_in_run_queue_head(t));
 
     return NO_ERROR;
 }
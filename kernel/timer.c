@@ -33,10 +33,84 @@
 
 #define LOCAL_TRACE 0
 
-spin_lock_t timer_lock;
+/*
+ * Each cpu keeps its timers in a hierarchical timing wheel. Level 0 has one
+ * slot per millisecond, every level above it has slots that are
+ * TIMER_WHEEL_SLOTS times coarser. A timer is dropped into the slot covering
+ * its deadline, which makes arming and canceling O(1). When the wheel time
+ * reaches the start of a coarse slot its timers are cascaded down into the
+ * finer levels. Timers further out than the wheel covers are parked in the
+ * furthest slot and re-sorted when it cascades.
+ *
+ * A bitmap per level tracks which slots are occupied, so finding the next
+ * event to program the one-shot timer for is a handful of bit scans.
+ */
+#ifndef TIMER_WHEEL_SLOT_BITS
+#define TIMER_WHEEL_SLOT_BITS 6
+#endif
+#ifndef TIMER_WHEEL_LEVELS
+#define TIMER_WHEEL_LEVELS 4
+#endif
+
+#define TIMER_WHEEL_SLOTS (1U << TIMER_WHEEL_SLOT_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_MAX_DELTA ((1U << (TIMER_WHEEL_SLOT_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+STATIC_ASSERT(TIMER_WHEEL_SLOT_BITS <= 6);
+STATIC_ASSERT(TIMER_WHEEL_SLOT_BITS * TIMER_WHEEL_LEVELS < 32);
+
+/*
+ * Nanosecond timers skip the wheel and go on a short per-cpu list sorted by
+ * deadline, which needs a platform one-shot that can be programmed in
+ * nanoseconds. Everywhere else they are rounded up onto the wheel.
+ */
+#if PLATFORM_HAS_DYNAMIC_TIMER && PLATFORM_HAS_HIRES_TIMER
+#define TIMER_HIRES 1
+#else
+#define TIMER_HIRES 0
+#endif
+
+/* timer->slot of a timer sitting on the hires list */
+#define TIMER_SLOT_HIRES UINT_MAX
+
+/*
+ * A nanosecond timer armed with slack may fire up to slack_ns after its
+ * deadline. The one-shot is programmed for the earliest end of any slack
+ * window and everything due by then runs off the same interrupt, so deadlines
+ * close together cost one wakeup instead of several. A wheel timer armed with
+ * slack has its deadline rounded up to a boundary within the slack instead,
+ * so that timers armed around the same time land in the same slot.
+ *
+ * Thread sleeps and wait queue timeouts get the default slack below, which
+ * can be changed with timer_set_default_slack(). Timers armed directly
+ * through timer_set_oneshot*() without a slack fire on their deadline.
+ */
+#ifndef TIMER_DEFAULT_SLACK_NS
+#define TIMER_DEFAULT_SLACK_NS (50 * 1000)
+#endif
+
+static lk_time_ns_t timer_slack_ns = TIMER_DEFAULT_SLACK_NS;
 
 struct timer_state {
-    struct list_node timer_queue;
+    spin_lock_t lock;
+
+    /* wheel time, every timer due before this has been dispatched */
+    lk_time_t base;
+    uint count;
+
+#if TIMER_HIRES
+    /* what the platform one-shot timer is currently programmed for */
+    bool deadline_armed;
+    lk_time_ns_t deadline;
+
+    struct list_node hires;
+#elif PLATFORM_HAS_DYNAMIC_TIMER
+    bool deadline_armed;
+    lk_time_t deadline;
+#endif
+
+    uint64_t pending[TIMER_WHEEL_LEVELS];
+    struct list_node slot[TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS];
 } __CPU_ALIGN;
 
 static struct timer_state timers[SMP_MAX_CPUS];
@@ -50,28 +124,215 @@ void timer_initialize(timer_t *timer) {
     *timer = (timer_t)TIMER_INITIAL_VALUE(*timer);
 }
 
-static void insert_timer_in_queue(uint cpu, timer_t *timer) {
-    timer_t *entry;
+static inline uint wheel_shift(uint level) {
+    return level * TIMER_WHEEL_SLOT_BITS;
+}
+
+static inline uint wheel_index(lk_time_t time, uint level) {
+    return (time >> wheel_shift(level)) & TIMER_WHEEL_MASK;
+}
 
+static void insert_timer_in_wheel(struct timer_state *ts, timer_t *timer) {
     DEBUG_ASSERT(arch_ints_disabled());
+    DEBUG_ASSERT(spin_lock_held(&ts->lock));
+
+    lk_time_t expires = timer->scheduled_time;
+    lk_time_t delta = expires - ts->base;
+    uint level = 0;
+    uint index;
+
+    LTRACEF("timer %p, base %u, scheduled %u, periodic %u\n", timer, ts->base, timer->scheduled_time, timer->periodic_time);
+
+    if (TIME_LT(expires, ts->base)) {
+        /* already due, fire it on the next tick */
+        index = wheel_index(ts->base, 0);
+    } else {
+        if (delta > TIMER_WHEEL_MAX_DELTA) {
+            /* beyond the end of the wheel, it will get re-sorted when it cascades */
+            delta = TIMER_WHEEL_MAX_DELTA;
+            expires = ts->base + delta;
+        }
+        while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (1U << wheel_shift(level + 1)))
+            level++;
+        index = wheel_index(expires, level);
+    }
+
+    timer->slot = level * TIMER_WHEEL_SLOTS + index;
+    list_add_tail(&ts->slot[timer->slot], &timer->node);
+    ts->pending[level] |= (1ULL << index);
+    ts->count++;
+}
+
+static void remove_timer_from_wheel(struct timer_state *ts, timer_t *timer) {
+    DEBUG_ASSERT(spin_lock_held(&ts->lock));
+    DEBUG_ASSERT(ts->count > 0);
+
+    list_delete(&timer->node);
+    ts->count--;
+
+    /* if the slot just emptied, clear its bit. a timer pulled onto the dispatch
+     * list in timer_tick() has had its bit cleared already. */
+    if (list_is_empty(&ts->slot[timer->slot])) {
+        uint level = timer->slot / TIMER_WHEEL_SLOTS;
+        ts->pending[level] &= ~(1ULL << (timer->slot % TIMER_WHEEL_SLOTS));
+    }
+}
+
+/* move the entire contents of a slot onto an empty list */
+static void take_wheel_slot(struct timer_state *ts, uint level, uint index, struct list_node *list) {
+    struct list_node *slot = &ts->slot[level * TIMER_WHEEL_SLOTS + index];
+
+    ts->pending[level] &= ~(1ULL << index);
+    if (list_is_empty(slot))
+        return;
+
+    list->next = slot->next;
+    list->prev = slot->prev;
+    list->next->prev = list;
+    list->prev->next = list;
+    list_initialize(slot);
+}
+
+/* re-sort the timers in the current slot of a level into the finer levels */
+static void cascade_wheel(struct timer_state *ts, uint level) {
+    struct list_node list = LIST_INITIAL_VALUE(list);
+    timer_t *timer;
+
+    take_wheel_slot(ts, level, wheel_index(ts->base, level), &list);
+    while ((timer = list_remove_head_type(&list, timer_t, node))) {
+        ts->count--;
+        insert_timer_in_wheel(ts, timer);
+    }
+}
 
-    LTRACEF("timer %p, cpu %u, scheduled %u, periodic %u\n", timer, cpu, timer->scheduled_time, timer->periodic_time);
+/*
+ * Find how far past the wheel time the next thing that needs the wheel's
+ * attention is: either a level 0 slot coming due or a coarser slot that has
+ * to be cascaded. Returns false if the wheel is empty.
+ */
+static bool next_wheel_event(struct timer_state *ts, lk_time_t *delta) {
+    bool found = false;
+    lk_time_t best = 0;
+
+    for (uint level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        uint64_t pending = ts->pending[level];
+        if (!pending)
+            continue;
+
+        /* the current slot is still to come if the wheel sits right at its
+         * start (always the case on level 0). otherwise it has already been
+         * cascaded and anything in it is a full revolution out. */
+        uint shift = wheel_shift(level);
+        uint cur = wheel_index(ts->base, level);
+        bool at_start = (ts->base & ((1U << shift) - 1)) == 0;
+        uint64_t ahead = at_start ? (pending >> cur) : ((pending >> cur) >> 1);
+        uint slots;
+        if (ahead)
+            slots = __builtin_ctzll(ahead) + (at_start ? 0 : 1);
+        else
+            slots = TIMER_WHEEL_SLOTS - cur + __builtin_ctzll(pending);
 
-    list_for_every_entry(&timers[cpu].timer_queue, entry, timer_t, node) {
-        if (TIME_GT(entry->scheduled_time, timer->scheduled_time)) {
-            list_add_before(&entry->node, &timer->node);
-            return;
+        lk_time_t event = ((ts->base >> shift) + slots) << shift;
+        lk_time_t event_delta = event - ts->base;
+        if (!found || event_delta < best) {
+            best = event_delta;
+            found = true;
         }
     }
 
-    /* walked off the end of the list */
-    list_add_tail(&timers[cpu].timer_queue, &timer->node);
+    *delta = best;
+    return found;
+}
+
+#if TIMER_HIRES
+/* make sure the platform one-shot fires no later than the next wheel event or
+ * the first hires timer, whichever comes first */
+static void update_oneshot_timer(struct timer_state *ts, lk_time_t now, bool force) {
+    lk_time_t delta;
+    bool wheel = next_wheel_event(ts, &delta);
+    timer_t *hires = list_peek_head_type(&ts->hires, timer_t, node);
+
+    if (!wheel && !hires) {
+        ts->deadline_armed = false;
+        return;
+    }
+
+    lk_time_ns_t now_ns = current_time_ns();
+    lk_time_ns_t deadline = INFINITE_TIME_NS;
+    if (wheel) {
+        lk_time_t wheel_deadline = ts->base + delta;
+        deadline = now_ns;
+        if (TIME_GT(wheel_deadline, now))
+            deadline += (lk_time_ns_t)(wheel_deadline - now) * 1000000;
+    }
+
+    /* the list is sorted by deadline, nothing past the window can shrink it */
+    lk_time_ns_t latest = deadline;
+    list_for_every_entry(&ts->hires, hires, timer_t, node) {
+        if (hires->deadline_ns >= latest)
+            break;
+        if (hires->deadline_ns < deadline)
+            deadline = hires->deadline_ns;
+        lk_time_ns_t end = hires->deadline_ns + MIN(hires->slack_ns, INFINITE_TIME_NS - hires->deadline_ns);
+        if (end < latest)
+            latest = end;
+    }
+
+    /* fire at the end of the slack window, unless the interrupt already
+     * programmed falls inside it */
+    if (!force && ts->deadline_armed && ts->deadline <= latest) {
+        if (ts->deadline > deadline)
+            THREAD_STATS_INC(timer_ints_avoided);
+        return;
+    }
+    deadline = latest;
+
+    lk_time_ns_t delay = (deadline > now_ns) ? deadline - now_ns : 0;
+
+    LTRACEF("setting new timer for %llu nsecs\n", delay);
+    ts->deadline = deadline;
+    ts->deadline_armed = true;
+    platform_set_oneshot_timer_ns(timer_tick, NULL, delay);
+}
+#elif PLATFORM_HAS_DYNAMIC_TIMER
+/* make sure the platform one-shot fires no later than the next wheel event */
+static void update_oneshot_timer(struct timer_state *ts, lk_time_t now, bool force) {
+    lk_time_t delta;
+
+    if (!next_wheel_event(ts, &delta)) {
+        ts->deadline_armed = false;
+        return;
+    }
+
+    /* leave it alone if the interrupt already programmed comes first */
+    lk_time_t deadline = ts->base + delta;
+    if (!force && ts->deadline_armed && TIME_LTE(ts->deadline, deadline))
+        return;
+
+    lk_time_t delay = TIME_GT(deadline, now) ? deadline - now : 0;
+
+    LTRACEF("setting new timer for %u msecs\n", (uint)delay);
+    ts->deadline = deadline;
+    ts->deadline_armed = true;
+    platform_set_oneshot_timer(timer_tick, NULL, delay);
+}
+#endif
+
+/* round a wheel deadline up to the coarsest power of two boundary within its slack */
+static lk_time_t wheel_slack_deadline(lk_time_t expires, lk_time_t slack) {
+    if (slack == 0)
+        return expires;
+
+    slack = MIN(slack, (lk_time_t)INT32_MAX);
+    lk_time_t align = 1U << (31 - __builtin_clz(slack + 1));
+    return (expires + align - 1) & ~(align - 1);
 }
 
-static void timer_set(timer_t *timer, lk_time_t delay, lk_time_t period, timer_callback callback, void *arg) {
+static void timer_set(timer_t *timer, lk_time_t delay, lk_time_t slack, lk_time_t period,
+                      timer_callback callback, void *arg) {
     lk_time_t now;
 
-    LTRACEF("timer %p, delay %u, period %u, callback %p, arg %p\n", timer, delay, period, callback, arg);
+    LTRACEF("timer %p, delay %u, slack %u, period %u, callback %p, arg %p\n", timer, delay, slack, period, callback, arg);
 
     DEBUG_ASSERT(timer->magic == TIMER_MAGIC);
 
@@ -80,28 +341,35 @@ static void timer_set(timer_t *timer, lk_time_t delay, lk_time_t period, timer_c
     }
 
     now = current_time();
-    timer->scheduled_time = now + delay;
+    timer->scheduled_time = wheel_slack_deadline(now + delay, slack);
     timer->periodic_time = period;
     timer->callback = callback;
     timer->arg = arg;
+    timer->slack_ns = (lk_time_ns_t)slack * 1000000;
 
     LTRACEF("scheduled time %u\n", timer->scheduled_time);
 
     spin_lock_saved_state_t state;
-    spin_lock_irqsave(&timer_lock, state);
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
 
     uint cpu = arch_curr_cpu_num();
-    insert_timer_in_queue(cpu, timer);
+    struct timer_state *ts = &timers[cpu];
+
+    spin_lock(&ts->lock);
+
+    /* an empty wheel can be moved up to the present for free */
+    if (ts->count == 0)
+        ts->base = now;
+
+    timer->cpu = cpu;
+    insert_timer_in_wheel(ts, timer);
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
-    if (list_peek_head_type(&timers[cpu].timer_queue, timer_t, node) == timer) {
-        /* we just modified the head of the timer queue */
-        LTRACEF("setting new timer for %u msecs\n", delay);
-        platform_set_oneshot_timer(timer_tick, NULL, delay);
-    }
+    update_oneshot_timer(ts, now, false);
 #endif
 
-    spin_unlock_irqrestore(&timer_lock, state);
+    spin_unlock(&ts->lock);
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
 }
 
 /**
@@ -119,9 +387,26 @@ static void timer_set(timer_t *timer, lk_time_t delay, lk_time_t period, timer_c
  *   enum handler_return callback(struct timer *, lk_time_t now, void *arg) { ... }
  */
 void timer_set_oneshot(timer_t *timer, lk_time_t delay, timer_callback callback, void *arg) {
+    timer_set_oneshot_slack(timer, delay, 0, callback, arg);
+}
+
+/**
+ * @brief  Set up a timer that executes once and may fire late
+ *
+ * Same as timer_set_oneshot(), but the callback may run up to slack ms
+ * past the deadline so it can share a tick with other timers due around then.
+ *
+ * @param  timer The timer to use
+ * @param  delay The delay, in ms, before the timer is executed
+ * @param  slack How much later than that, in ms, it may be executed
+ * @param  callback  The function to call when the timer expires
+ * @param  arg  The argument to pass to the callback
+ */
+void timer_set_oneshot_slack(timer_t *timer, lk_time_t delay, lk_time_t slack,
+                             timer_callback callback, void *arg) {
     if (delay == 0)
         delay = 1;
-    timer_set(timer, delay, 0, callback, arg);
+    timer_set(timer, delay, slack, 0, callback, arg);
 }
 
 /**
@@ -141,26 +426,129 @@ void timer_set_oneshot(timer_t *timer, lk_time_t delay, timer_callback callback,
 void timer_set_periodic(timer_t *timer, lk_time_t period, timer_callback callback, void *arg) {
     if (period == 0)
         period = 1;
-    timer_set(timer, period, period, callback, arg);
+    timer_set(timer, period, 0, period, callback, arg);
 }
 
 /**
- * @brief  Cancel a pending timer
+ * @brief  Set up a timer that executes once, with a delay in nanoseconds
+ *
+ * Same as timer_set_oneshot(), but on platforms with a nanosecond one-shot
+ * timer (PLATFORM_HAS_HIRES_TIMER) the callback runs as close to the deadline
+ * as the hardware allows instead of on a millisecond boundary. Elsewhere
+ * the delay is rounded up to the next millisecond.
+ *
+ * @param  timer The timer to use
+ * @param  delay The delay, in ns, before the timer is executed
+ * @param  callback  The function to call when the timer expires
+ * @param  arg  The argument to pass to the callback
  */
-void timer_cancel(timer_t *timer) {
+void timer_set_oneshot_ns(timer_t *timer, lk_time_ns_t delay, timer_callback callback, void *arg) {
+    timer_set_oneshot_ns_slack(timer, delay, 0, callback, arg);
+}
+
+/**
+ * @brief  Set up a nanosecond one-shot timer that may fire late
+ *
+ * Same as timer_set_oneshot_ns(), but the callback may run up to slack ns
+ * past the deadline so the interrupt can be shared with other timers due
+ * around then. Elsewhere the slack is rounded down to whole ms.
+ *
+ * @param  timer The timer to use
+ * @param  delay The delay, in ns, before the timer is executed
+ * @param  slack How much later than that, in ns, it may be executed
+ * @param  callback  The function to call when the timer expires
+ * @param  arg  The argument to pass to the callback
+ */
+void timer_set_oneshot_ns_slack(timer_t *timer, lk_time_ns_t delay, lk_time_ns_t slack,
+                                timer_callback callback, void *arg) {
+#if TIMER_HIRES
+    LTRACEF("timer %p, delay %llu ns, callback %p, arg %p\n", timer, delay, callback, arg);
+
     DEBUG_ASSERT(timer->magic == TIMER_MAGIC);
 
+    if (list_in_list(&timer->node)) {
+        panic("timer %p already in list\n", timer);
+    }
+
+    lk_time_ns_t now_ns = current_time_ns();
+    timer->deadline_ns = (delay < INFINITE_TIME_NS - now_ns) ? now_ns + delay : INFINITE_TIME_NS;
+    timer->scheduled_time = current_time() + (lk_time_t)((delay + 999999) / 1000000);
+    timer->periodic_time = 0;
+    timer->callback = callback;
+    timer->arg = arg;
+    timer->slack_ns = slack;
+
     spin_lock_saved_state_t state;
-    spin_lock_irqsave(&timer_lock, state);
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
 
-#if PLATFORM_HAS_DYNAMIC_TIMER
     uint cpu = arch_curr_cpu_num();
+    struct timer_state *ts = &timers[cpu];
 
-    timer_t *oldhead = list_peek_head_type(&timers[cpu].timer_queue, timer_t, node);
+    spin_lock(&ts->lock);
+
+    /* keep the list sorted, timers with the same deadline fire in order */
+    timer_t *entry;
+    struct list_node *before = &ts->hires;
+    list_for_every_entry(&ts->hires, entry, timer_t, node) {
+        if (entry->deadline_ns > timer->deadline_ns) {
+            before = &entry->node;
+            break;
+        }
+    }
+    list_add_before(before, &timer->node);
+    timer->cpu = cpu;
+    timer->slot = TIMER_SLOT_HIRES;
+
+    update_oneshot_timer(ts, current_time(), false);
+
+    spin_unlock(&ts->lock);
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+#else
+    /* round up so it never fires early, and stay within TIME_LT range */
+    lk_time_ns_t msecs = delay / 1000000 + ((delay % 1000000) ? 1 : 0);
+    if (msecs > INT32_MAX)
+        msecs = INT32_MAX;
+    timer_set_oneshot_slack(timer, (lk_time_t)msecs, (lk_time_t)MIN(slack / 1000000, INT32_MAX),
+                            callback, arg);
 #endif
+}
 
-    if (list_in_list(&timer->node))
-        list_delete(&timer->node);
+/**
+ * @brief  Set the slack given to thread sleeps and wait queue timeouts
+ *
+ * @param  slack How late, in ns, they may fire. 0 makes them exact.
+ */
+void timer_set_default_slack(lk_time_ns_t slack) {
+    timer_slack_ns = slack;
+}
+
+/**
+ * @brief  Get the slack given to thread sleeps and wait queue timeouts, in ns
+ */
+lk_time_ns_t timer_default_slack(void) {
+    return timer_slack_ns;
+}
+
+/**
+ * @brief  Cancel a pending timer
+ */
+void timer_cancel(timer_t *timer) {
+    DEBUG_ASSERT(timer->magic == TIMER_MAGIC);
+
+    /* the timer lives (or last lived) on the wheel of the cpu that armed it */
+    struct timer_state *ts = &timers[timer->cpu];
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&ts->lock, state);
+
+    if (list_in_list(&timer->node)) {
+#if TIMER_HIRES
+        if (timer->slot == TIMER_SLOT_HIRES)
+            list_delete(&timer->node);
+        else
+#endif
+            remove_timer_from_wheel(ts, timer);
+    }
 
     /* to keep it from being reinserted into the queue if called from
      * periodic timer callback.
@@ -170,26 +558,20 @@ void timer_cancel(timer_t *timer) {
     timer->arg = NULL;
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
-    /* see if we've just modified the head of the timer queue */
-    timer_t *newhead = list_peek_head_type(&timers[cpu].timer_queue, timer_t, node);
-    if (newhead == NULL) {
+    /* the one-shot is left alone if there is anything else on the wheel, at
+     * worst it fires early and gets reprogrammed from timer_tick() */
+    bool idle = ts->count == 0;
+#if TIMER_HIRES
+    idle = idle && list_is_empty(&ts->hires);
+#endif
+    if (idle && ts->deadline_armed && ts == &timers[arch_curr_cpu_num()]) {
         LTRACEF("clearing old hw timer, nothing in the queue\n");
+        ts->deadline_armed = false;
         platform_stop_timer();
-    } else if (newhead != oldhead) {
-        lk_time_t delay;
-        lk_time_t now = current_time();
-
-        if (TIME_LT(newhead->scheduled_time, now))
-            delay = 0;
-        else
-            delay = newhead->scheduled_time - now;
-
-        LTRACEF("setting new timer to %u\n", (uint) delay);
-        platform_set_oneshot_timer(timer_tick, NULL, delay);
     }
 #endif
 
-    spin_unlock_irqrestore(&timer_lock, state);
+    spin_unlock_irqrestore(&ts->lock, state);
 }
 
 /* called at interrupt time to process any pending timers */
@@ -203,73 +585,106 @@ static enum handler_return timer_tick(void *arg, lk_time_t now) {
 //  KEVLOG_TIMER_TICK(); // enable only if necessary
 
     uint cpu = arch_curr_cpu_num();
+    struct timer_state *ts = &timers[cpu];
 
     LTRACEF("cpu %u now %u, sp %p\n", cpu, now, __GET_FRAME());
 
-    spin_lock(&timer_lock);
+    spin_lock(&ts->lock);
 
-    for (;;) {
-        /* see if there's an event to process */
-        timer = list_peek_head_type(&timers[cpu].timer_queue, timer_t, node);
-        if (likely(timer == 0))
-            break;
-        LTRACEF("next item on timer queue %p at %u now %u (%p, arg %p)\n", timer, timer->scheduled_time, now, timer->callback, timer->arg);
-        if (likely(TIME_LT(now, timer->scheduled_time)))
+#if PLATFORM_HAS_DYNAMIC_TIMER
+    ts->deadline_armed = false;
+#endif
+
+    while (TIME_GTE(now, ts->base)) {
+        /* skip straight to the next slot that needs attention */
+        lk_time_t delta;
+        if (!next_wheel_event(ts, &delta) || TIME_GT(ts->base + delta, now)) {
+            ts->base = now + 1;
             break;
+        }
+        ts->base += delta;
+
+        /* at the start of a coarser slot, push its timers down a level */
+        for (uint level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+            if (wheel_index(ts->base, level - 1) != 0)
+                break;
+            cascade_wheel(ts, level);
+        }
+
+        /* pull everything due at this tick off the wheel before running any
+         * of it, so timers rearmed by the callbacks land in a later slot */
+        struct list_node due = LIST_INITIAL_VALUE(due);
+        take_wheel_slot(ts, 0, wheel_index(ts->base, 0), &due);
+        ts->base++;
 
-        /* process it */
-        LTRACEF("timer %p\n", timer);
-        DEBUG_ASSERT(timer && timer->magic == TIMER_MAGIC);
+        while ((timer = list_remove_head_type(&due, timer_t, node))) {
+            ts->count--;
+
+            LTRACEF("next item on timer queue %p at %u now %u (%p, arg %p)\n", timer, timer->scheduled_time, now, timer->callback, timer->arg);
+            DEBUG_ASSERT(timer && timer->magic == TIMER_MAGIC);
+
+            /* we pulled it off the list, release the list lock to handle it */
+            spin_unlock(&ts->lock);
+
+            LTRACEF("dequeued timer %p, scheduled %u periodic %u\n", timer, timer->scheduled_time, timer->periodic_time);
+
+            THREAD_STATS_INC(timers);
+
+            bool periodic = timer->periodic_time > 0;
+
+            LTRACEF("timer %p firing callback %p, arg %p\n", timer, timer->callback, timer->arg);
+            KEVLOG_TIMER_CALL(timer->callback, timer->arg);
+            if (timer->callback(timer, now, timer->arg) == INT_RESCHEDULE)
+                ret = INT_RESCHEDULE;
+
+            /* it may have been requeued or periodic, grab the lock so we can safely inspect it */
+            spin_lock(&ts->lock);
+
+            /* if it was a periodic timer and it hasn't been requeued
+             * by the callback put it back in the list
+             */
+            if (periodic && !list_in_list(&timer->node) && timer->periodic_time > 0) {
+                LTRACEF("periodic timer, period %u\n", timer->periodic_time);
+                timer->scheduled_time += timer->periodic_time;
+                if (unlikely(TIME_LT(timer->scheduled_time, now))) {
+                    timer->scheduled_time = now + timer->periodic_time;
+                }
+                timer->cpu = cpu;
+                insert_timer_in_wheel(ts, timer);
+            }
+        }
+    }
+
+#if TIMER_HIRES
+    /* run the nanosecond timers that have come due */
+    lk_time_ns_t now_ns = current_time_ns();
+    while ((timer = list_peek_head_type(&ts->hires, timer_t, node)) && timer->deadline_ns <= now_ns) {
         list_delete(&timer->node);
 
-        /* we pulled it off the list, release the list lock to handle it */
-        spin_unlock(&timer_lock);
+        LTRACEF("hires timer %p, deadline %llu now %llu\n", timer, timer->deadline_ns, now_ns);
+        DEBUG_ASSERT(timer->magic == TIMER_MAGIC);
 
-        LTRACEF("dequeued timer %p, scheduled %u periodic %u\n", timer, timer->scheduled_time, timer->periodic_time);
+        spin_unlock(&ts->lock);
 
         THREAD_STATS_INC(timers);
 
-        bool periodic = timer->periodic_time > 0;
-
-        LTRACEF("timer %p firing callback %p, arg %p\n", timer, timer->callback, timer->arg);
         KEVLOG_TIMER_CALL(timer->callback, timer->arg);
         if (timer->callback(timer, now, timer->arg) == INT_RESCHEDULE)
             ret = INT_RESCHEDULE;
 
-        /* it may have been requeued or periodic, grab the lock so we can safely inspect it */
-        spin_lock(&timer_lock);
-
-        /* if it was a periodic timer and it hasn't been requeued
-         * by the callback put it back in the list
-         */
-        if (periodic && !list_in_list(&timer->node) && timer->periodic_time > 0) {
-            LTRACEF("periodic timer, period %u\n", timer->periodic_time);
-            timer->scheduled_time += timer->periodic_time;
-            if (unlikely(TIME_LT(timer->scheduled_time, now))) {
-                timer->scheduled_time = now + timer->periodic_time;
-            }
-            insert_timer_in_queue(cpu, timer);
-        }
+        spin_lock(&ts->lock);
     }
+#endif
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
     /* reset the timer to the next event */
-    timer = list_peek_head_type(&timers[cpu].timer_queue, timer_t, node);
-    if (timer) {
-        /* has to be the case or it would have fired already */
-        DEBUG_ASSERT(TIME_GT(timer->scheduled_time, now));
-
-        lk_time_t delay = timer->scheduled_time - now;
-
-        LTRACEF("setting new timer for %u msecs for event %p\n", (uint)delay, timer);
-        platform_set_oneshot_timer(timer_tick, NULL, delay);
-    }
+    update_oneshot_timer(ts, now, true);
 
     /* we're done manipulating the timer queue */
-    spin_unlock(&timer_lock);
+    spin_unlock(&ts->lock);
 #else
     /* release the timer lock before calling the tick handler */
-    spin_unlock(&timer_lock);
+    spin_unlock(&ts->lock);
 
     /* let the scheduler have a shot to do quantum expiration, etc */
     /* in case of dynamic timer, the scheduler will set up a periodic timer */
@@ -281,9 +696,16 @@ static enum handler_return timer_tick(void *arg, lk_time_t now) {
 }
 
 void timer_init(void) {
-    timer_lock = SPIN_LOCK_INITIAL_VALUE;
+    lk_time_t now = current_time();
+
     for (uint i = 0; i < SMP_MAX_CPUS; i++) {
-        list_initialize(&timers[i].timer_queue);
+        spin_lock_init(&timers[i].lock);
+        timers[i].base = now;
+        for (uint j = 0; j < countof(timers[i].slot); j++)
+            list_initialize(&timers[i].slot[j]);
+#if TIMER_HIRES
+        list_initialize(&timers[i].hires);
+#endif
     }
 #if !PLATFORM_HAS_DYNAMIC_TIMER
     /* register for a periodic timer tick */
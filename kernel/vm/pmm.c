@@ -9,6 +9,7 @@
 
 #include <assert.h>
 #include <kernel/mutex.h>
+#include <lib/slab.h>
 #include <lk/console_cmd.h>
 #include <lk/err.h>
 #include <lk/list.h>
@@ -23,6 +24,7 @@
 
 static struct list_node arena_list = LIST_INITIAL_VALUE(arena_list);
 static mutex_t lock = MUTEX_INITIAL_VALUE(lock);
+static pmm_reclaim_hook_t reclaim_hook;
 
 #define PAGE_BELONGS_TO_ARENA(page, arena) \
     (((uintptr_t)(page) >= (uintptr_t)(arena)->page_array) && \
@@ -38,6 +40,155 @@ static inline bool page_is_free(const vm_page_t *page) {
     return !(page->flags & VM_PAGE_FLAG_NONFREE);
 }
 
+/*
+ * Free pages are kept in power of two sized blocks on per order free lists.
+ * Blocks are aligned on their size in physical page numbers, so a block's
+ * buddy is found by flipping one bit of its page number, and a block of order
+ * n satisfies any alignment up to 2^n pages. The first page of a free block
+ * is flagged and records the order, every page of it is not NONFREE.
+ */
+static inline size_t arena_page_count(const pmm_arena_t *a) {
+    return a->size / PAGE_SIZE;
+}
+
+static inline ulong arena_pfn(const pmm_arena_t *a, size_t index) {
+    return a->base / PAGE_SIZE + index;
+}
+
+static void arena_add_free_block(pmm_arena_t *a, size_t index, uint order) {
+    vm_page_t *p = &a->page_array[index];
+
+    p->flags |= VM_PAGE_FLAG_FREE_HEAD;
+    p->order = order;
+    list_add_head(&a->free_list[order], &p->node);
+}
+
+static void arena_remove_free_block(pmm_arena_t *a, size_t index) {
+    vm_page_t *p = &a->page_array[index];
+
+    DEBUG_ASSERT(p->flags & VM_PAGE_FLAG_FREE_HEAD);
+
+    list_delete(&p->node);
+    p->flags &= ~VM_PAGE_FLAG_FREE_HEAD;
+}
+
+/* give a block back, merging it with its buddy for as long as that is free */
+static void arena_free_block(pmm_arena_t *a, size_t index, uint order) {
+    for (size_t i = index; i < index + (1UL << order); i++)
+        a->page_array[i].flags &= ~VM_PAGE_FLAG_NONFREE;
+    a->free_count += 1UL << order;
+
+    while (order < PMM_MAX_ORDER) {
+        ulong buddy_pfn = arena_pfn(a, index) ^ (1UL << order);
+        if (buddy_pfn < arena_pfn(a, 0))
+            break;
+
+        size_t buddy = buddy_pfn - arena_pfn(a, 0);
+        if (buddy + (1UL << order) > arena_page_count(a))
+            break;
+
+        const vm_page_t *b = &a->page_array[buddy];
+        if (!(b->flags & VM_PAGE_FLAG_FREE_HEAD) || b->order != order)
+            break;
+
+        arena_remove_free_block(a, buddy);
+        index = MIN(index, buddy);
+        order++;
+    }
+
+    arena_add_free_block(a, index, order);
+}
+
+/* give back a run of pages in the biggest aligned blocks that fit */
+static void arena_free_run(pmm_arena_t *a, size_t index, size_t count) {
+    while (count > 0) {
+        uint order = MIN(log2_uint(count), PMM_MAX_ORDER);
+        while (order > 0 && (arena_pfn(a, index) & ((1UL << order) - 1)))
+            order--;
+
+        arena_free_block(a, index, order);
+        index += 1UL << order;
+        count -= 1UL << order;
+    }
+}
+
+/* take the smallest free block of at least the given order and split it down
+ * to size, returning the index of its first page or -1 */
+static ssize_t arena_alloc_block(pmm_arena_t *a, uint order) {
+    uint k;
+    vm_page_t *p = NULL;
+
+    for (k = order; k <= PMM_MAX_ORDER; k++) {
+        p = list_peek_head_type(&a->free_list[k], vm_page_t, node);
+        if (p)
+            break;
+    }
+    if (!p)
+        return -1;
+
+    size_t index = p - a->page_array;
+    arena_remove_free_block(a, index);
+
+    /* hand the upper halves back as we split */
+    while (k > order) {
+        k--;
+        arena_add_free_block(a, index + (1UL << k), k);
+    }
+
+    a->free_count -= 1UL << order;
+    return index;
+}
+
+/* pull one free page out of the block it is in, handing back the rest */
+static void arena_carve_page(pmm_arena_t *a, size_t index) {
+    DEBUG_ASSERT(page_is_free(&a->page_array[index]));
+
+    /* the block holding it starts at its page number rounded down to the
+     * block size, look for a head of matching order */
+    ssize_t head = -1;
+    uint order;
+    for (order = 0; order <= PMM_MAX_ORDER; order++) {
+        ulong head_pfn = ROUNDDOWN(arena_pfn(a, index), 1UL << order);
+        if (head_pfn < arena_pfn(a, 0))
+            break;
+
+        const vm_page_t *p = &a->page_array[head_pfn - arena_pfn(a, 0)];
+        if ((p->flags & VM_PAGE_FLAG_FREE_HEAD) && p->order == order) {
+            head = head_pfn - arena_pfn(a, 0);
+            break;
+        }
+    }
+    DEBUG_ASSERT(head >= 0);
+
+    arena_remove_free_block(a, head);
+
+    while (order > 0) {
+        order--;
+        size_t half = 1UL << order;
+        if (index < (size_t)head + half) {
+            arena_add_free_block(a, head + half, order);
+        } else {
+            arena_add_free_block(a, head, order);
+            head += half;
+        }
+    }
+
+    a->free_count--;
+}
+
+/* mark a run of pages allocated and append them to the list */
+static void arena_take_run(pmm_arena_t *a, size_t index, size_t count, struct list_node *list) {
+    for (size_t i = index; i < index + count; i++) {
+        vm_page_t *p = &a->page_array[i];
+
+        DEBUG_ASSERT(!(p->flags & (VM_PAGE_FLAG_NONFREE | VM_PAGE_FLAG_FREE_HEAD)));
+
+        p->flags |= VM_PAGE_FLAG_NONFREE;
+        if (list)
+            list_add_tail(list, &p->node);
+    }
+}
+
 paddr_t vm_page_to_paddr(const vm_page_t *page) {
     pmm_arena_t *a;
     list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
@@ -82,7 +233,8 @@ done_add:
 
     /* zero out some of the structure */
     arena->free_count = 0;
-    list_initialize(&arena->free_list);
+    for (uint i = 0; i <= PMM_MAX_ORDER; i++)
+        list_initialize(&arena->free_list[i]);
 
     /* allocate an array of pages to back this one */
     size_t page_count = arena->size / PAGE_SIZE;
@@ -91,16 +243,25 @@ done_add:
     /* initialize all of the pages */
     memset(arena->page_array, 0, page_count * sizeof(vm_page_t));
 
-    /* add them to the free list */
-    for (size_t i = 0; i < page_count; i++) {
-        vm_page_t *p = &arena->page_array[i];
+    /* add them to the free lists */
+    arena_free_run(arena, 0, page_count);
 
-        list_add_tail(&arena->free_list, &p->node);
+    return NO_ERROR;
+}
 
-        arena->free_count++;
-    }
+void pmm_set_reclaim_hook(pmm_reclaim_hook_t hook) {
+    reclaim_hook = hook;
+}
 
-    return NO_ERROR;
+/* ask everything holding on to pages it can do without to give them back */
+static size_t pmm_reclaim(size_t count) {
+    size_t pages = slab_reclaim();
+
+    pmm_reclaim_hook_t hook = reclaim_hook;
+    if (hook)
+        pages += hook(count);
+
+    return pages;
 }
 
 size_t pmm_alloc_pages(uint count, struct list_node *list) {
@@ -113,27 +274,38 @@ size_t pmm_alloc_pages(uint count, struct list_node *list) {
     if (count == 0)
         return 0;
 
+    bool reclaimed = false;
+retry:
     mutex_acquire(&lock);
 
-    /* walk the arenas in order, allocating as many pages as we can from each */
+    /* walk the arenas in order, allocating as many pages as we can from each.
+     * the pages needn't be contiguous, but taking them a block at a time
+     * is cheaper than one by one. */
     pmm_arena_t *a;
     list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
         while (allocated < count && a->free_count > 0) {
-            vm_page_t *page = list_remove_head_type(&a->free_list, vm_page_t, node);
-            if (!page)
-                goto done;
-
-            a->free_count--;
-
-            page->flags |= VM_PAGE_FLAG_NONFREE;
-            list_add_tail(list, &page->node);
+            uint order = MIN(log2_uint(count - allocated), PMM_MAX_ORDER);
+            ssize_t index;
+            while ((index = arena_alloc_block(a, order)) < 0 && order > 0)
+                order--;
+            if (index < 0)
+                break;
 
-            allocated++;
+            arena_take_run(a, index, 1UL << order, list);
+            allocated += 1U << order;
         }
     }
 
-done:
     mutex_release(&lock);
+
+    /* the slab caches and the page cache may be sitting on free pages, try
+     * once more after they've given them back */
+    if (allocated < count && !reclaimed) {
+        reclaimed = true;
+        if (pmm_reclaim(count - allocated) > 0)
+            goto retry;
+    }
+
     return allocated;
 }
 
@@ -177,13 +349,9 @@ size_t pmm_alloc_range(paddr_t address, uint count, struct list_node *list) {
                 break;
             }
 
-            DEBUG_ASSERT(list_in_list(&page->node));
-
-            list_delete(&page->node);
-            page->flags |= VM_PAGE_FLAG_NONFREE;
-            list_add_tail(list, &page->node);
+            arena_carve_page(a, index);
+            arena_take_run(a, index, 1, list);
 
-            a->free_count--;
             allocated++;
             address += PAGE_SIZE;
         }
@@ -214,10 +382,7 @@ size_t pmm_free(struct list_node *list) {
         pmm_arena_t *a;
         list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
             if (PAGE_BELONGS_TO_ARENA(page, a)) {
-                page->flags &= ~VM_PAGE_FLAG_NONFREE;
-
-                list_add_head(&a->free_list, &page->node);
-                a->free_count++;
+                arena_free_block(a, page - a->page_array, 0);
                 count++;
                 break;
             }
@@ -280,6 +445,64 @@ size_t pmm_free_kpages(void *_ptr, uint count) {
     return pmm_free(&list);
 }
 
+size_t pmm_count_free_pages(void) {
+    size_t count = 0;
+
+    mutex_acquire(&lock);
+    pmm_arena_t *a;
+    list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
+        count += a->free_count;
+    }
+    mutex_release(&lock);
+
+    return count;
+}
+
+/* the slow way: walk the arena looking for a free run at each alignment
+ * boundary. finds runs that straddle buddy blocks when no single block fits. */
+static ssize_t arena_scan_contiguous(pmm_arena_t *a, uint count, uint8_t alignment_log2) {
+    /* calculate the starting offset into this arena, based on the
+     * base address of the arena to handle the case where the arena
+     * is not aligned on the same boundary requested.
+     */
+    paddr_t rounded_base = ROUNDUP(a->base, 1UL << alignment_log2);
+    if (rounded_base < a->base || rounded_base > a->base + a->size - 1)
+        return -1;
+
+    uint aligned_offset = (rounded_base - a->base) / PAGE_SIZE;
+    uint start = aligned_offset;
+    LTRACEF("starting search at aligned offset %u\n", start);
+    LTRACEF("arena base 0x%lx size %zu\n", a->base, a->size);
+
+retry:
+    /* search while we're still within the arena and have a chance of finding a slot
+       (start + count < end of arena) */
+    while ((start < a->size / PAGE_SIZE) &&
+            ((start + count) <= a->size / PAGE_SIZE)) {
+        vm_page_t *p = &a->page_array[start];
+        for (uint i = 0; i < count; i++) {
+            if (p->flags & VM_PAGE_FLAG_NONFREE) {
+                /* this run is broken, break out of the inner loop.
+                 * start over at the next alignment boundary
+                 */
+                start = ROUNDUP(start - aligned_offset + i + 1, 1UL << (alignment_log2 - PAGE_SIZE_SHIFT)) + aligned_offset;
+                goto retry;
+            }
+            p++;
+        }
+
+        /* we found a run */
+        LTRACEF("found run from pn %u to %u\n", start, start + count);
+
+        for (uint i = start; i < start + count; i++)
+            arena_carve_page(a, i);
+
+        return start;
+    }
+
+    return -1;
+}
+
 size_t pmm_alloc_contiguous(uint count, uint8_t alignment_log2, paddr_t *pa, struct list_node *list) {
     LTRACEF("count %u, align %u\n", count, alignment_log2);
 
@@ -288,86 +511,79 @@ size_t pmm_alloc_contiguous(uint count, uint8_t alignment_log2, paddr_t *pa, str
     if (alignment_log2 < PAGE_SIZE_SHIFT)
         alignment_log2 = PAGE_SIZE_SHIFT;
 
+    /* a block big enough for the run and aligned at least as well as asked */
+    uint order = (count > 1) ? log2_uint(count - 1) + 1 : 0;
+    order = MAX(order, (uint)(alignment_log2 - PAGE_SIZE_SHIFT));
+
+    bool reclaimed = false;
+retry:
     mutex_acquire(&lock);
 
     pmm_arena_t *a;
-    list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
-        // XXX make this a flag to only search kmap?
-        if (a->flags & PMM_ARENA_FLAG_KMAP) {
-            /* walk the list starting at alignment boundaries.
-             * calculate the starting offset into this arena, based on the
-             * base address of the arena to handle the case where the arena
-             * is not aligned on the same boundary requested.
-             */
-            paddr_t rounded_base = ROUNDUP(a->base, 1UL << alignment_log2);
-            if (rounded_base < a->base || rounded_base > a->base + a->size - 1)
+    ssize_t index = -1;
+    if (order <= PMM_MAX_ORDER) {
+        list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
+            // XXX make this a flag to only search kmap?
+            if (!(a->flags & PMM_ARENA_FLAG_KMAP))
                 continue;
 
-            uint aligned_offset = (rounded_base - a->base) / PAGE_SIZE;
-            uint start = aligned_offset;
-            LTRACEF("starting search at aligned offset %u\n", start);
-            LTRACEF("arena base 0x%lx size %zu\n", a->base, a->size);
-
-retry:
-            /* search while we're still within the arena and have a chance of finding a slot
-               (start + count < end of arena) */
-            while ((start < a->size / PAGE_SIZE) &&
-                    ((start + count) <= a->size / PAGE_SIZE)) {
-                vm_page_t *p = &a->page_array[start];
-                for (uint i = 0; i < count; i++) {
-                    if (p->flags & VM_PAGE_FLAG_NONFREE) {
-                        /* this run is broken, break out of the inner loop.
-                         * start over at the next alignment boundary
-                         */
-                        start = ROUNDUP(start - aligned_offset + i + 1, 1UL << (alignment_log2 - PAGE_SIZE_SHIFT)) + aligned_offset;
-                        goto retry;
-                    }
-                    p++;
-                }
-
-                /* we found a run */
-                LTRACEF("found run from pn %u to %u\n", start, start + count);
-
-                /* remove the pages from the run out of the free list */
-                for (uint i = start; i < start + count; i++) {
-                    p = &a->page_array[i];
-                    DEBUG_ASSERT(!(p->flags & VM_PAGE_FLAG_NONFREE));
-                    DEBUG_ASSERT(list_in_list(&p->node));
-
-                    list_delete(&p->node);
-                    p->flags |= VM_PAGE_FLAG_NONFREE;
-                    a->free_count--;
-
-                    if (list)
-                        list_add_tail(list, &p->node);
-                }
-
-                if (pa)
-                    *pa = a->base + start * PAGE_SIZE;
-
-                mutex_release(&lock);
-
-                return count;
+            index = arena_alloc_block(a, order);
+            if (index >= 0) {
+                /* trim the block down to the run */
+                arena_free_run(a, index + count, (1UL << order) - count);
+                goto found;
             }
         }
     }
 
+    /* too big for a block, or fragmented enough that no block is free */
+    list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
+        if (!(a->flags & PMM_ARENA_FLAG_KMAP))
+            continue;
+
+        index = arena_scan_contiguous(a, count, alignment_log2);
+        if (index >= 0)
+            goto found;
+    }
+
     mutex_release(&lock);
 
+    /* same as pmm_alloc_pages, cached pages may be what's in the way */
+    if (!reclaimed) {
+        reclaimed = true;
+        if (pmm_reclaim(count) > 0)
+            goto retry;
+    }
+
     LTRACEF("couldn't find run\n");
     return 0;
+
+found:
+    arena_take_run(a, index, count, list);
+
+    if (pa)
+        *pa = a->base + index * PAGE_SIZE;
+
+    mutex_release(&lock);
+
+    return count;
 }
 
 static void dump_page(const vm_page_t *page) {
     printf("page %p: address 0x%lx flags 0x%x\n", page, vm_page_to_paddr(page), page->flags);
 }
 
-static void dump_arena(const pmm_arena_t *arena, bool dump_pages) {
+static void dump_arena(pmm_arena_t *arena, bool dump_pages) {
     printf("arena %p: name '%s' base 0x%lx size 0x%zx priority %u flags 0x%x\n",
            arena, arena->name, arena->base, arena->size, arena->priority, arena->flags);
     printf("\tpage_array %p, free_count %zu\n",
            arena->page_array, arena->free_count);
 
+    printf("\tfree blocks by order:");
+    for (uint i = 0; i <= PMM_MAX_ORDER; i++)
+        printf(" %zu", list_length(&arena->free_list[i]));
+    printf("\n");
+
     /* dump all of the pages */
     if (dump_pages) {
         for (size_t i = 0; i < arena->size / PAGE_SIZE; i++) {
@@ -6,8 +6,9 @@
  * https://opensource.org/licenses/MIT
  */
 #include <assert.h>
-#include <kernel/mutex.h>
+#include <kernel/rwlock.h>
 #include <kernel/vm.h>
+#include <lib/slab.h>
 #include <lk/console_cmd.h>
 #include <lk/err.h>
 #include <lk/trace.h>
@@ -17,7 +18,12 @@
 #define LOCAL_TRACE 0
 
 static struct list_node aspace_list = LIST_INITIAL_VALUE(aspace_list);
-static mutex_t vmm_lock = MUTEX_INITIAL_VALUE(vmm_lock);
+/* lookups take this for read, anything that changes an aspace or the
+ * aspace list takes it for write */
+static rwlock_t vmm_lock = RWLOCK_INITIAL_VALUE(vmm_lock);
+
+static slab_cache_t region_cache =
+    SLAB_CACHE_INITIAL_VALUE(region_cache, "vmm_region_t", sizeof(vmm_region_t), __alignof(vmm_region_t), NULL, NULL);
 
 vmm_aspace_t _kernel_aspace;
 
@@ -91,10 +97,12 @@ static vmm_region_t *alloc_region_struct(const char *name, vaddr_t base, size_t
         uint flags, uint arch_mmu_flags) {
     DEBUG_ASSERT(name);
 
-    vmm_region_t *r = calloc(1, sizeof(vmm_region_t));
+    vmm_region_t *r = slab_cache_alloc(&region_cache);
     if (!r)
         return NULL;
 
+    memset(r, 0, sizeof(*r));
+
     strlcpy(r->name, name, sizeof(r->name));
     r->base = base;
     r->size = size;
@@ -258,7 +266,7 @@ static vmm_region_t *alloc_region(vmm_aspace_t *aspace, const char *name, size_t
         /* stick it in the list, checking to see if it fits */
         if (add_region_to_aspace(aspace, r) < 0) {
             /* didn't fit */
-            free(r);
+            slab_cache_free(&region_cache, r);
             return NULL;
         }
     } else {
@@ -270,7 +278,7 @@ static vmm_region_t *alloc_region(vmm_aspace_t *aspace, const char *name, size_t
 
         if (vaddr == (vaddr_t)-1) {
             LTRACEF("failed to find spot\n");
-            free(r);
+            slab_cache_free(&region_cache, r);
             return NULL;
         }
 
@@ -308,7 +316,7 @@ status_t vmm_reserve_space(vmm_aspace_t *aspace, const char *name, size_t size,
     /* trim the size */
     size = trim_to_aspace(aspace, vaddr, size);
 
-    mutex_acquire(&vmm_lock);
+    rwlock_acquire_write(&vmm_lock);
 
     /* lookup how it's already mapped */
     uint arch_mmu_flags = 0;
@@ -318,19 +326,24 @@ status_t vmm_reserve_space(vmm_aspace_t *aspace, const char *name, size_t size,
     vmm_region_t *r = alloc_region(aspace, name, size, vaddr, 0,
                                    VMM_FLAG_VALLOC_SPECIFIC, VMM_REGION_FLAG_RESERVED, arch_mmu_flags);
 
-    mutex_release(&vmm_lock);
+    rwlock_release_write(&vmm_lock);
     return r ? NO_ERROR : ERR_NO_MEMORY;
 }
 
 status_t vmm_alloc_physical(vmm_aspace_t *aspace, const char *name, size_t size,
                             void **ptr, uint8_t align_log2, paddr_t paddr, uint vmm_flags, uint arch_mmu_flags) {
+    return vmm_alloc_physical_etc(aspace, name, size, ptr, align_log2, &paddr, 1, vmm_flags, arch_mmu_flags);
+}
+
+status_t vmm_alloc_physical_etc(vmm_aspace_t *aspace, const char *name, size_t size, void **ptr,
+                                uint8_t align_log2, const paddr_t *paddr, uint paddr_count,
+                                uint vmm_flags, uint arch_mmu_flags) {
     status_t ret;
 
-    LTRACEF("aspace %p name '%s' size 0x%zx ptr %p paddr 0x%lx vmm_flags 0x%x arch_mmu_flags 0x%x\n",
-            aspace, name, size, ptr ? *ptr : 0, paddr, vmm_flags, arch_mmu_flags);
+    LTRACEF("aspace %p name '%s' size 0x%zx ptr %p paddr 0x%lx count %u vmm_flags 0x%x arch_mmu_flags 0x%x\n",
+            aspace, name, size, ptr ? *ptr : 0, paddr[0], paddr_count, vmm_flags, arch_mmu_flags);
 
     DEBUG_ASSERT(aspace);
-    DEBUG_ASSERT(IS_PAGE_ALIGNED(paddr));
     DEBUG_ASSERT(IS_PAGE_ALIGNED(size));
 
     if (!name)
@@ -340,9 +353,18 @@ status_t vmm_alloc_physical(vmm_aspace_t *aspace, const char *name, size_t size,
         return ERR_INVALID_ARGS;
     if (size == 0)
         return NO_ERROR;
-    if (!IS_PAGE_ALIGNED(paddr) || !IS_PAGE_ALIGNED(size))
+    if (!IS_PAGE_ALIGNED(size) || paddr_count == 0)
         return ERR_INVALID_ARGS;
 
+    /* either one contiguous run or one address per page */
+    size_t run = (paddr_count == 1) ? size : PAGE_SIZE;
+    if (paddr_count != 1 && paddr_count != size / PAGE_SIZE)
+        return ERR_INVALID_ARGS;
+    for (uint i = 0; i < paddr_count; i++) {
+        if (!IS_PAGE_ALIGNED(paddr[i]))
+            return ERR_INVALID_ARGS;
+    }
+
     vaddr_t vaddr = 0;
 
     /* if they're asking for a specific spot, copy the address */
@@ -354,7 +376,7 @@ status_t vmm_alloc_physical(vmm_aspace_t *aspace, const char *name, size_t size,
         vaddr = (vaddr_t)*ptr;
     }
 
-    mutex_acquire(&vmm_lock);
+    rwlock_acquire_write(&vmm_lock);
 
     /* allocate a region and put it in the aspace list */
     vmm_region_t *r = alloc_region(aspace, name, size, vaddr, align_log2, vmm_flags,
@@ -369,13 +391,15 @@ status_t vmm_alloc_physical(vmm_aspace_t *aspace, const char *name, size_t size,
         *ptr = (void *)r->base;
 
     /* map all of the pages */
-    int err = arch_mmu_map(&aspace->arch_aspace, r->base, paddr, size / PAGE_SIZE, arch_mmu_flags);
-    LTRACEF("arch_mmu_map returns %d\n", err);
+    for (uint i = 0; i < paddr_count; i++) {
+        int err = arch_mmu_map(&aspace->arch_aspace, r->base + i * run, paddr[i], run / PAGE_SIZE, arch_mmu_flags);
+        LTRACEF("arch_mmu_map returns %d\n", err);
+    }
 
     ret = NO_ERROR;
 
 err_alloc_region:
-    mutex_release(&vmm_lock);
+    rwlock_release_write(&vmm_lock);
     return ret;
 }
 
@@ -420,7 +444,7 @@ status_t vmm_alloc_contiguous(vmm_aspace_t *aspace, const char *name, size_t siz
         goto err;
     }
 
-    mutex_acquire(&vmm_lock);
+    rwlock_acquire_write(&vmm_lock);
 
     /* allocate a region and put it in the aspace list */
     vmm_region_t *r = alloc_region(aspace, name, size, vaddr, align_pow2, vmm_flags,
@@ -443,11 +467,11 @@ status_t vmm_alloc_contiguous(vmm_aspace_t *aspace, const char *name, size_t siz
         list_add_tail(&r->page_list, &p->node);
     }
 
-    mutex_release(&vmm_lock);
+    rwlock_release_write(&vmm_lock);
     return NO_ERROR;
 
 err1:
-    mutex_release(&vmm_lock);
+    rwlock_release_write(&vmm_lock);
     pmm_free(&page_list);
 err:
     return err;
@@ -496,7 +520,7 @@ status_t vmm_alloc(vmm_aspace_t *aspace, const char *name, size_t size, void **p
         goto err;
     }
 
-    mutex_acquire(&vmm_lock);
+    rwlock_acquire_write(&vmm_lock);
 
     /* allocate a region and put it in the aspace list */
     vmm_region_t *r = alloc_region(aspace, name, size, vaddr, align_pow2, vmm_flags,
@@ -529,11 +553,11 @@ status_t vmm_alloc(vmm_aspace_t *aspace, const char *name, size_t size, void **p
         va += PAGE_SIZE;
     }
 
-    mutex_release(&vmm_lock);
+    rwlock_release_write(&vmm_lock);
     return NO_ERROR;
 
 err1:
-    mutex_release(&vmm_lock);
+    rwlock_release_write(&vmm_lock);
     pmm_free(&page_list);
 err:
     return err;
@@ -556,12 +580,32 @@ static vmm_region_t *vmm_find_region(const vmm_aspace_t *aspace, vaddr_t vaddr)
     return NULL;
 }
 
+status_t vmm_query_region(vmm_aspace_t *aspace, vaddr_t vaddr, vaddr_t *base, size_t *size, uint *arch_mmu_flags) {
+    rwlock_acquire_read(&vmm_lock);
+
+    vmm_region_t *r = vmm_find_region(aspace, vaddr);
+    if (!r) {
+        rwlock_release_read(&vmm_lock);
+        return ERR_NOT_FOUND;
+    }
+
+    if (base)
+        *base = r->base;
+    if (size)
+        *size = r->size;
+    if (arch_mmu_flags)
+        *arch_mmu_flags = r->arch_mmu_flags;
+
+    rwlock_release_read(&vmm_lock);
+    return NO_ERROR;
+}
+
 status_t vmm_free_region(vmm_aspace_t *aspace, vaddr_t vaddr) {
-    mutex_acquire(&vmm_lock);
+    rwlock_acquire_write(&vmm_lock);
 
     vmm_region_t *r = vmm_find_region (aspace, vaddr);
     if (!r) {
-        mutex_release(&vmm_lock);
+        rwlock_release_write(&vmm_lock);
         return ERR_NOT_FOUND;
     }
 
@@ -571,13 +615,13 @@ status_t vmm_free_region(vmm_aspace_t *aspace, vaddr_t vaddr) {
     /* unmap it */
     arch_mmu_unmap(&aspace->arch_aspace, r->base, r->size / PAGE_SIZE);
 
-    mutex_release(&vmm_lock);
+    rwlock_release_write(&vmm_lock);
 
     /* return physical pages if any */
     pmm_free(&r->page_list);
 
     /* free it */
-    free(r);
+    slab_cache_free(&region_cache, r);
 
     return NO_ERROR;
 }
@@ -615,9 +659,9 @@ status_t vmm_create_aspace(vmm_aspace_t **_aspace, const char *name, uint flags)
     list_clear_node(&aspace->node);
     list_initialize(&aspace->region_list);
 
-    mutex_acquire(&vmm_lock);
+    rwlock_acquire_write(&vmm_lock);
     list_add_head(&aspace_list, &aspace->node);
-    mutex_release(&vmm_lock);
+    rwlock_release_write(&vmm_lock);
 
     *_aspace = aspace;
 
@@ -626,9 +670,9 @@ status_t vmm_create_aspace(vmm_aspace_t **_aspace, const char *name, uint flags)
 
 status_t vmm_free_aspace(vmm_aspace_t *aspace) {
     /* pop it out of the global aspace list */
-    mutex_acquire(&vmm_lock);
+    rwlock_acquire_write(&vmm_lock);
     if (!list_in_list(&aspace->node)) {
-        mutex_release(&vmm_lock);
+        rwlock_release_write(&vmm_lock);
         return ERR_INVALID_ARGS;
     }
     list_delete(&aspace->node);
@@ -644,7 +688,7 @@ status_t vmm_free_aspace(vmm_aspace_t *aspace) {
         /* unmap it */
         arch_mmu_unmap(&aspace->arch_aspace, r->base, r->size / PAGE_SIZE);
     }
-    mutex_release(&vmm_lock);
+    rwlock_release_write(&vmm_lock);
 
     /* without the vmm lock held, free all of the pmm pages and the structure */
     while ((r = list_remove_head_type(&region_list, vmm_region_t, node))) {
@@ -652,7 +696,7 @@ status_t vmm_free_aspace(vmm_aspace_t *aspace) {
         pmm_free(&r->page_list);
 
         /* free it */
-        free(r);
+        slab_cache_free(&region_cache, r);
     }
 
     /* make sure the current thread does not map the aspace */
@@ -735,10 +779,12 @@ usage:
         test_aspace = vmm_get_kernel_aspace();
 
     if (!strcmp(argv[1].str, "aspaces")) {
+        rwlock_acquire_read(&vmm_lock);
         vmm_aspace_t *a;
         list_for_every_entry(&aspace_list, a, vmm_aspace_t, node) {
             dump_aspace(a);
         }
+        rwlock_release_read(&vmm_lock);
     } else if (!strcmp(argv[1].str, "alloc")) {
         if (argc < 4) goto notenoughargs;
 
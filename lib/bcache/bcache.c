@@ -6,22 +6,60 @@
  * https://opensource.org/licenses/MIT
  */
 #include <lk/list.h>
+#include <lk/pow2.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
 #include <sys/types.h>
 #include <lk/debug.h>
+#include <lk/err.h>
 #include <lk/trace.h>
+#include <lk/console_cmd.h>
 #include <lib/bcache.h>
 #include <lib/bio.h>
+#include <kernel/event.h>
+#include <kernel/mutex.h>
+#include <kernel/thread.h>
+#if WITH_KERNEL_VM
+#include <kernel/vm.h>
+#endif
 
 #define LOCAL_TRACE 0
 
+/* auto sized caches take this fraction of free memory, within the limits */
+#define BCACHE_AUTO_SHIFT 6
+#define BCACHE_AUTO_MIN_BLOCKS 16
+#define BCACHE_AUTO_MAX_BLOCKS 4096
+#define BCACHE_AUTO_NOVM_BLOCKS 64
+
+/* dirty blocks are written back this long after the write-back thread sees
+ * them, or as soon as a quarter of the cache is dirty. a pass writes at most
+ * this many blocks. */
+#define BCACHE_WB_INTERVAL 1000
+#define BCACHE_WB_BATCH 32
+
+/* read-ahead windows start here and double up to the cache's limit, which
+ * defaults to this many bytes worth of blocks but no more than a quarter of
+ * the cache */
+#define BCACHE_RA_MIN_WINDOW 4
+#define BCACHE_RA_DEFAULT_BYTES (128 * 1024)
+
+/*
+ * Every block that holds data is in the hash table. Blocks nobody holds a
+ * reference to sit on the lru list, least recently used at the head, so
+ * eviction takes the head and a lookup moves a block to the tail. Referenced
+ * blocks are off the lru list entirely. Dirty blocks are also on the dirty
+ * list for the write-back thread, which takes a reference on the blocks it is
+ * writing so they can't be evicted underneath it.
+ */
 struct bcache_block {
-    struct list_node node;
+    struct list_node node;          /* in the lru or the free list */
+    struct list_node hash_node;
+    struct list_node dirty_node;
     bnum_t blocknum;
     int ref_count;
     bool is_dirty;
+    bool readahead;                 /* prefetched and not looked at yet */
     void *ptr;
 };
 
@@ -31,44 +69,126 @@ struct bcache_stats {
     uint32_t misses;
     uint32_t reads;
     uint32_t writes;
+    uint32_t evictions;
+    uint32_t dirty_evictions;
+    uint32_t writebacks;
+    uint32_t writeback_runs;
+    uint32_t writeback_passes;
+    uint32_t ra_ios;
+    uint32_t ra_blocks;
+    uint32_t ra_hits;
 };
 
 struct bcache {
     bdev_t *dev;
     size_t block_size;
     int count;
+    int dirty_count;
     struct bcache_stats stats;
 
+    mutex_t lock;
+
     struct list_node free_list;
     struct list_node lru_list;
+    struct list_node dirty_list;
 
-    struct bcache_block *blocks;
-};
+    struct list_node *hash;
+    uint hash_shift;
 
-bcache_t bcache_create(bdev_t *dev, size_t block_size, int block_count) {
-    struct bcache *cache;
+    /* write-back thread and the lock that serializes passes */
+    thread_t *wb_thread;
+    event_t wb_event;
+    mutex_t wb_lock;
+    bool wb_stop;
+    void *wb_buf;
 
-    cache = malloc(sizeof(struct bcache));
+    /* read-ahead limit in blocks and the buffer for prefetches. ra_lock
+     * serializes prefetches, which read into ra_buf without the cache lock */
+    uint ra_max;
+    void *ra_buf;
+    mutex_t ra_lock;
 
-    cache->dev = dev;
-    cache->block_size = block_size;
-    cache->count = block_count;
-    memset(&cache->stats, 0, sizeof(cache->stats));
+    struct list_node node;          /* in the list of all caches */
+};
 
-    list_initialize(&cache->free_list);
-    list_initialize(&cache->lru_list);
+static struct list_node bcache_list = LIST_INITIAL_VALUE(bcache_list);
+static mutex_t bcache_list_lock = MUTEX_INITIAL_VALUE(bcache_list_lock);
 
-    cache->blocks = malloc(sizeof(struct bcache_block) * block_count);
-    int i;
-    for (i=0; i < block_count; i++) {
-        cache->blocks[i].ref_count = 0;
-        cache->blocks[i].is_dirty = false;
-        cache->blocks[i].ptr = malloc(block_size);
-        // add to the free list
-        list_add_head(&cache->free_list, &cache->blocks[i].node);
+static uint hash_bucket(const struct bcache *cache, bnum_t blocknum) {
+    return (uint)(((uint32_t)blocknum * 0x9e3779b1U) >> (32 - cache->hash_shift));
+}
+
+/* pick a table size of around one bucket per block */
+static uint hash_shift_for(int count) {
+    uint shift = log2_uint(round_up_pow2_u32(MAX(count, 2)));
+    return MIN(shift, 31U);
+}
+
+static status_t rehash(struct bcache *cache, uint shift) {
+    struct list_node *hash = malloc(sizeof(struct list_node) << shift);
+    if (!hash)
+        return ERR_NO_MEMORY;
+    for (uint i = 0; i < (1U << shift); i++)
+        list_initialize(&hash[i]);
+
+    struct list_node *old = cache->hash;
+    uint old_shift = cache->hash_shift;
+    cache->hash = hash;
+    cache->hash_shift = shift;
+
+    if (old) {
+        for (uint i = 0; i < (1U << old_shift); i++) {
+            struct bcache_block *block;
+            while ((block = list_remove_head_type(&old[i], struct bcache_block, hash_node)))
+                list_add_head(&hash[hash_bucket(cache, block->blocknum)], &block->hash_node);
+        }
+        free(old);
     }
 
-    return (bcache_t)cache;
+    return NO_ERROR;
+}
+
+static int auto_block_count(size_t block_size) {
+#if WITH_KERNEL_VM
+    size_t bytes = (pmm_count_free_pages() * PAGE_SIZE) >> BCACHE_AUTO_SHIFT;
+    size_t count = bytes / block_size;
+    return (int)MIN(MAX(count, (size_t)BCACHE_AUTO_MIN_BLOCKS), (size_t)BCACHE_AUTO_MAX_BLOCKS);
+#else
+    return BCACHE_AUTO_NOVM_BLOCKS;
+#endif
+}
+
+static void ref_block(struct bcache *cache, struct bcache_block *block) {
+    if (block->ref_count++ == 0)
+        list_delete(&block->node);
+}
+
+static void unref_block(struct bcache *cache, struct bcache_block *block) {
+    DEBUG_ASSERT(block->ref_count > 0);
+    if (--block->ref_count == 0)
+        list_add_tail(&cache->lru_list, &block->node);
+}
+
+static void set_dirty(struct bcache *cache, struct bcache_block *block) {
+    if (block->is_dirty)
+        return;
+
+    block->is_dirty = true;
+    list_add_tail(&cache->dirty_list, &block->dirty_node);
+
+    /* the first dirty block arms the write-back timer */
+    int dirty = cache->dirty_count++;
+    if (dirty == 0 || dirty + 1 >= cache->count / 4)
+        event_signal(&cache->wb_event, false);
+}
+
+static void clear_dirty(struct bcache *cache, struct bcache_block *block) {
+    if (!block->is_dirty)
+        return;
+
+    block->is_dirty = false;
+    list_delete(&block->dirty_node);
+    cache->dirty_count--;
 }
 
 static int flush_block(struct bcache *cache, struct bcache_block *block) {
@@ -80,30 +200,287 @@ static int flush_block(struct bcache *cache, struct bcache_block *block) {
     if (rc < 0)
         goto exit;
 
-    block->is_dirty = false;
+    clear_dirty(cache, block);
     cache->stats.writes++;
     rc = 0;
 exit:
     return (rc);
 }
 
+static int compare_blocknum(const void *a, const void *b) {
+    const struct bcache_block *ba = *(const struct bcache_block * const *)a;
+    const struct bcache_block *bb = *(const struct bcache_block * const *)b;
+
+    if (ba->blocknum < bb->blocknum)
+        return -1;
+    return ba->blocknum > bb->blocknum;
+}
+
+/*
+ * Write out up to BCACHE_WB_BATCH dirty blocks, oldest first, sorted and
+ * coalesced so each run of adjacent blocks goes out in one bio_write.
+ * Called with wb_lock held. Returns the number of blocks taken off the dirty
+ * list or a negative error.
+ */
+static int writeback_pass(struct bcache *cache) {
+    struct bcache_block *batch[BCACHE_WB_BATCH];
+    int n = 0;
+    int err = 0;
+
+    DEBUG_ASSERT(is_mutex_held(&cache->wb_lock));
+
+    mutex_acquire(&cache->lock);
+    struct bcache_block *block;
+    while (n < BCACHE_WB_BATCH &&
+            (block = list_peek_head_type(&cache->dirty_list, struct bcache_block, dirty_node))) {
+        ref_block(cache, block);
+        clear_dirty(cache, block);
+        batch[n++] = block;
+    }
+    if (n > 0)
+        cache->stats.writeback_passes++;
+    mutex_release(&cache->lock);
+
+    if (n == 0)
+        return 0;
+
+    qsort(batch, n, sizeof(batch[0]), compare_blocknum);
+
+    /* references keep the blocks in place. whoever dirties one again while it
+     * is being written puts it back on the dirty list for the next pass. */
+    int failed = 0;
+    for (int start = 0; start < n; ) {
+        int end = start + 1;
+        while (end < n && batch[end]->blocknum == batch[end - 1]->blocknum + 1)
+            end++;
+
+        const void *buf;
+        size_t len = (size_t)(end - start) * cache->block_size;
+        if (end - start == 1) {
+            buf = batch[start]->ptr;
+        } else {
+            for (int i = start; i < end; i++)
+                memcpy((uint8_t *)cache->wb_buf + (size_t)(i - start) * cache->block_size,
+                       batch[i]->ptr, cache->block_size);
+            buf = cache->wb_buf;
+        }
+
+        ssize_t rc = bio_write(cache->dev, buf,
+                               (off_t)batch[start]->blocknum * cache->block_size, len);
+
+        mutex_acquire(&cache->lock);
+        if (rc < 0 || (size_t)rc != len) {
+            for (int i = start; i < end; i++)
+                set_dirty(cache, batch[i]);
+            failed += end - start;
+            err = (rc < 0) ? (int)rc : ERR_IO;
+        } else {
+            cache->stats.writes++;
+            cache->stats.writeback_runs++;
+            cache->stats.writebacks += end - start;
+        }
+        for (int i = start; i < end; i++)
+            unref_block(cache, batch[i]);
+        mutex_release(&cache->lock);
+
+        start = end;
+    }
+
+    return (failed == n) ? err : n;
+}
+
+static int writeback_thread(void *arg) {
+    struct bcache *cache = arg;
+
+    for (;;) {
+        /* sleep until something is dirtied, then give it BCACHE_WB_INTERVAL
+         * to gather more unless the cache fills up first */
+        mutex_acquire(&cache->lock);
+        int dirty = cache->dirty_count;
+        mutex_release(&cache->lock);
+
+        if (dirty == 0)
+            event_wait(&cache->wb_event);
+        else
+            event_wait_timeout(&cache->wb_event, BCACHE_WB_INTERVAL);
+        if (cache->wb_stop)
+            break;
+        if (dirty == 0)
+            continue;
+
+        mutex_acquire(&cache->wb_lock);
+        int budget = cache->count;
+        while (budget > 0) {
+            int n = writeback_pass(cache);
+            if (n <= 0)
+                break;
+            budget -= n;
+        }
+        mutex_release(&cache->wb_lock);
+    }
+
+    return 0;
+}
+
+static struct bcache_block *new_block(struct bcache *cache) {
+    struct bcache_block *block = malloc(sizeof(struct bcache_block));
+    if (!block)
+        return NULL;
+
+    block->ptr = malloc(cache->block_size);
+    if (!block->ptr) {
+        free(block);
+        return NULL;
+    }
+
+    block->ref_count = 0;
+    block->is_dirty = false;
+    list_clear_node(&block->hash_node);
+    return block;
+}
+
+static void free_block(struct bcache_block *block) {
+    free(block->ptr);
+    free(block);
+}
+
+bcache_t bcache_create(bdev_t *dev, size_t block_size, int block_count) {
+    struct bcache *cache;
+
+    if (block_count == BCACHE_SIZE_AUTO)
+        block_count = auto_block_count(block_size);
+
+    cache = calloc(1, sizeof(struct bcache));
+    if (!cache)
+        return NULL;
+
+    cache->dev = dev;
+    cache->block_size = block_size;
+    cache->count = 0;
+
+    mutex_init(&cache->lock);
+    mutex_init(&cache->wb_lock);
+    mutex_init(&cache->ra_lock);
+    event_init(&cache->wb_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+
+    list_initialize(&cache->free_list);
+    list_initialize(&cache->lru_list);
+    list_initialize(&cache->dirty_list);
+
+    cache->wb_buf = malloc(block_size * BCACHE_WB_BATCH);
+    if (!cache->wb_buf || rehash(cache, hash_shift_for(block_count)) < 0)
+        goto err;
+
+    for (int i = 0; i < block_count; i++) {
+        struct bcache_block *block = new_block(cache);
+        if (!block)
+            goto err;
+        // add to the free list
+        list_add_head(&cache->free_list, &block->node);
+        cache->count++;
+    }
+
+    cache->ra_max = MIN(BCACHE_RA_DEFAULT_BYTES / block_size, (size_t)cache->count / 4);
+    if (cache->ra_max > 0) {
+        cache->ra_buf = malloc(cache->ra_max * block_size);
+        if (!cache->ra_buf)
+            goto err;
+    }
+
+    cache->wb_thread = thread_create("bcache wb", &writeback_thread, cache,
+                                     LOW_PRIORITY, DEFAULT_STACK_SIZE);
+    if (!cache->wb_thread)
+        goto err;
+    thread_resume(cache->wb_thread);
+
+    mutex_acquire(&bcache_list_lock);
+    list_add_tail(&bcache_list, &cache->node);
+    mutex_release(&bcache_list_lock);
+
+    return (bcache_t)cache;
+
+err: {
+        struct bcache_block *block;
+        while ((block = list_remove_head_type(&cache->free_list, struct bcache_block, node)))
+            free_block(block);
+    }
+    event_destroy(&cache->wb_event);
+    mutex_destroy(&cache->ra_lock);
+    mutex_destroy(&cache->wb_lock);
+    mutex_destroy(&cache->lock);
+    free(cache->hash);
+    free(cache->wb_buf);
+    free(cache->ra_buf);
+    free(cache);
+    return NULL;
+}
+
+int bcache_flush(bcache_t priv) {
+    struct bcache *cache = priv;
+    int err = 0;
+
+    mutex_acquire(&cache->wb_lock);
+    for (;;) {
+        int n = writeback_pass(cache);
+        if (n < 0) {
+            err = n;
+            break;
+        }
+        if (n == 0)
+            break;
+    }
+    mutex_release(&cache->wb_lock);
+
+    return err;
+}
+
 void bcache_destroy(bcache_t _cache) {
     struct bcache *cache = _cache;
-    int i;
 
-    for (i=0; i < cache->count; i++) {
-        DEBUG_ASSERT(cache->blocks[i].ref_count == 0);
+    mutex_acquire(&bcache_list_lock);
+    list_delete(&cache->node);
+    mutex_release(&bcache_list_lock);
 
-        if (cache->blocks[i].is_dirty)
-            printf("warning: freeing dirty block %u\n",
-                   cache->blocks[i].blocknum);
+    cache->wb_stop = true;
+    event_signal(&cache->wb_event, true);
+    thread_join(cache->wb_thread, NULL, INFINITE_TIME);
 
-        free(cache->blocks[i].ptr);
-    }
+    if (bcache_flush(cache) < 0)
+        printf("warning: failed to write back dirty blocks\n");
 
+    struct bcache_block *block;
+    while ((block = list_remove_head_type(&cache->lru_list, struct bcache_block, node))) {
+        if (block->is_dirty)
+            printf("warning: freeing dirty block %u\n", block->blocknum);
+        free_block(block);
+    }
+    while ((block = list_remove_head_type(&cache->free_list, struct bcache_block, node)))
+        free_block(block);
+
+    event_destroy(&cache->wb_event);
+    mutex_destroy(&cache->ra_lock);
+    mutex_destroy(&cache->wb_lock);
+    mutex_destroy(&cache->lock);
+    free(cache->hash);
+    free(cache->wb_buf);
+    free(cache->ra_buf);
     free(cache);
 }
 
+/* look a block up without touching the stats or the lru */
+static struct bcache_block *lookup_block(struct bcache *cache, uint blocknum, uint32_t *depth) {
+    struct bcache_block *block;
+
+    list_for_every_entry(&cache->hash[hash_bucket(cache, blocknum)], block, struct bcache_block, hash_node) {
+        if (depth)
+            (*depth)++;
+        if (block->blocknum == blocknum)
+            return block;
+    }
+
+    return NULL;
+}
+
 /* find a block if it's already present */
 static struct bcache_block *find_block(struct bcache *cache, uint blocknum) {
     uint32_t depth = 0;
@@ -111,25 +488,27 @@ static struct bcache_block *find_block(struct bcache *cache, uint blocknum) {
 
     LTRACEF("num %u\n", blocknum);
 
-    block = NULL;
-    list_for_every_entry(&cache->lru_list, block, struct bcache_block, node) {
-        LTRACEF("looking at entry %p, num %u\n", block, block->blocknum);
-        depth++;
-
-        if (block->blocknum == blocknum) {
+    block = lookup_block(cache, blocknum, &depth);
+    if (block) {
+        if (block->ref_count == 0) {
             list_delete(&block->node);
             list_add_tail(&cache->lru_list, &block->node);
-            cache->stats.hits++;
-            cache->stats.depth += depth;
-            return block;
         }
+        if (block->readahead) {
+            block->readahead = false;
+            cache->stats.ra_hits++;
+        }
+        cache->stats.hits++;
+        cache->stats.depth += depth;
+        return block;
     }
 
     cache->stats.misses++;
     return NULL;
 }
 
-/* allocate a new block */
+/* allocate a new block, evicting the least recently used one if need be.
+ * the block comes back on the lru tail and out of the hash table. */
 static struct bcache_block *alloc_block(struct bcache *cache) {
     int err;
     struct bcache_block *block;
@@ -143,24 +522,42 @@ static struct bcache_block *alloc_block(struct bcache *cache) {
         return block;
     }
 
-    /* walk the lru, looking for a free block */
-    list_for_every_entry(&cache->lru_list, block, struct bcache_block, node) {
-        LTRACEF("looking at %p, num %u\n", block, block->blocknum);
-        if (block->ref_count == 0) {
-            if (block->is_dirty) {
-                err = flush_block(cache, block);
-                if (err)
-                    return NULL;
-            }
+    /* everything on the lru is unreferenced, the head is the oldest */
+    block = list_peek_head_type(&cache->lru_list, struct bcache_block, node);
+    if (!block)
+        return NULL;
 
-            // add it to the tail of the lru
-            list_delete(&block->node);
-            list_add_tail(&cache->lru_list, &block->node);
-            return block;
-        }
+    LTRACEF("evicting %p, num %u\n", block, block->blocknum);
+    if (block->is_dirty) {
+        err = flush_block(cache, block);
+        if (err)
+            return NULL;
+        cache->stats.dirty_evictions++;
     }
 
-    return NULL;
+    list_delete(&block->hash_node);
+    cache->stats.evictions++;
+
+    // add it to the tail of the lru
+    list_delete(&block->node);
+    list_add_tail(&cache->lru_list, &block->node);
+    return block;
+}
+
+static void insert_block(struct bcache *cache, struct bcache_block *block, uint blocknum) {
+    block->blocknum = blocknum;
+    block->readahead = false;
+    list_add_head(&cache->hash[hash_bucket(cache, blocknum)], &block->hash_node);
+}
+
+static void discard_block(struct bcache *cache, struct bcache_block *block) {
+    DEBUG_ASSERT(block->ref_count == 0);
+    DEBUG_ASSERT(!block->is_dirty);
+
+    if (list_in_list(&block->hash_node))
+        list_delete(&block->hash_node);
+    list_delete(&block->node);
+    list_add_tail(&cache->free_list, &block->node);
 }
 
 static struct bcache_block *find_or_fill_block(struct bcache *cache, uint blocknum) {
@@ -175,18 +572,19 @@ static struct bcache_block *find_or_fill_block(struct bcache *cache, uint blockn
 
         /* allocate a new block and fill it */
         block = alloc_block(cache);
-        DEBUG_ASSERT(block);
+        if (!block)
+            return NULL;
 
         LTRACEF("wasn't allocated, new block %p\n", block);
 
-        block->blocknum = blocknum;
         err = bio_read(cache->dev, block->ptr, (off_t)blocknum * cache->block_size, cache->block_size);
         if (err < 0) {
             /* free the block, return an error */
-            list_add_tail(&cache->free_list, &block->node);
+            discard_block(cache, block);
             return NULL;
         }
 
+        insert_block(cache, block, blocknum);
         cache->stats.reads++;
     }
 
@@ -200,13 +598,16 @@ int bcache_read_block(bcache_t _cache, void *buf, uint blocknum) {
 
     LTRACEF("buf %p, blocknum %u\n", buf, blocknum);
 
+    mutex_acquire(&cache->lock);
     struct bcache_block *block = find_or_fill_block(cache, blocknum);
     if (block == NULL) {
         /* error */
+        mutex_release(&cache->lock);
         return -1;
     }
 
     memcpy(buf, block->ptr, cache->block_size);
+    mutex_release(&cache->lock);
     return 0;
 }
 
@@ -217,15 +618,18 @@ int bcache_get_block(bcache_t _cache, void **ptr, uint blocknum) {
 
     DEBUG_ASSERT(ptr);
 
+    mutex_acquire(&cache->lock);
     struct bcache_block *block = find_or_fill_block(cache, blocknum);
     if (block == NULL) {
         /* error */
+        mutex_release(&cache->lock);
         return -1;
     }
 
-    /* increment the ref count to keep it from being freed */
-    block->ref_count++;
+    /* take a ref to keep it from being evicted */
+    ref_block(cache, block);
     *ptr = block->ptr;
+    mutex_release(&cache->lock);
 
     return 0;
 }
@@ -235,13 +639,15 @@ int bcache_put_block(bcache_t _cache, uint blocknum) {
 
     LTRACEF("blocknum %u\n", blocknum);
 
-    struct bcache_block *block = find_block(cache, blocknum);
+    mutex_acquire(&cache->lock);
+    struct bcache_block *block = lookup_block(cache, blocknum, NULL);
 
     /* be pretty hard on the caller for now */
     DEBUG_ASSERT(block);
     DEBUG_ASSERT(block->ref_count > 0);
 
-    block->ref_count--;
+    unref_block(cache, block);
+    mutex_release(&cache->lock);
 
     return 0;
 }
@@ -251,15 +657,17 @@ int bcache_mark_block_dirty(bcache_t priv, uint blocknum) {
     struct bcache *cache = priv;
     struct bcache_block *block;
 
-    block = find_block(cache, blocknum);
+    mutex_acquire(&cache->lock);
+    block = lookup_block(cache, blocknum, NULL);
     if (!block) {
         err = -1;
         goto exit;
     }
 
-    block->is_dirty = true;
+    set_dirty(cache, block);
     err = 0;
 exit:
+    mutex_release(&cache->lock);
     return (err);
 }
 
@@ -268,6 +676,7 @@ int bcache_zero_block(bcache_t priv, uint blocknum) {
     struct bcache *cache = priv;
     struct bcache_block *block;
 
+    mutex_acquire(&cache->lock);
     block = find_block(cache, blocknum);
     if (!block) {
         block = alloc_block(cache);
@@ -276,47 +685,293 @@ int bcache_zero_block(bcache_t priv, uint blocknum) {
             goto exit;
         }
 
-        block->blocknum = blocknum;
+        insert_block(cache, block, blocknum);
     }
 
     memset(block->ptr, 0, cache->block_size);
-    block->is_dirty = true;
+    set_dirty(cache, block);
     err = 0;
 exit:
+    mutex_release(&cache->lock);
     return (err);
 }
 
-int bcache_flush(bcache_t priv) {
-    int err;
+int bcache_prefetch(bcache_t priv, uint blocknum, uint count) {
     struct bcache *cache = priv;
+    struct list_node blocks = LIST_INITIAL_VALUE(blocks);
     struct bcache_block *block;
+    uint n;
+    int err = 0;
+
+    LTRACEF("blocknum %u, count %u\n", blocknum, count);
+
+    mutex_acquire(&cache->ra_lock);
+    mutex_acquire(&cache->lock);
+
+    /* stop at the first block we already have */
+    count = MIN(count, cache->ra_max);
+    for (n = 0; n < count; n++) {
+        if (lookup_block(cache, blocknum + n, NULL))
+            break;
+    }
+
+    /* the refs keep the new blocks from being evicted to make room for each
+     * other. they stay out of the hash table until they hold data. */
+    for (uint i = 0; i < n; i++) {
+        block = alloc_block(cache);
+        if (!block) {
+            n = i;
+            break;
+        }
+        ref_block(cache, block);
+        list_add_tail(&blocks, &block->node);
+    }
+
+    mutex_release(&cache->lock);
+
+    ssize_t rc = 0;
+    if (n > 0)
+        rc = bio_read(cache->dev, cache->ra_buf,
+                      (off_t)blocknum * cache->block_size, n * cache->block_size);
+    bool ok = (rc >= 0 && (size_t)rc == n * cache->block_size);
+
+    mutex_acquire(&cache->lock);
+
+    uint i = 0;
+    while ((block = list_remove_head_type(&blocks, struct bcache_block, node))) {
+        block->ref_count = 0;
 
-    list_for_every_entry(&cache->lru_list, block, struct bcache_block, node) {
-        if (block->is_dirty) {
-            err = flush_block(cache, block);
-            if (err)
+        /* someone may have read the block themselves while we weren't looking */
+        if (!ok || lookup_block(cache, blocknum + i, NULL)) {
+            list_add_tail(&cache->free_list, &block->node);
+        } else {
+            memcpy(block->ptr, (uint8_t *)cache->ra_buf + i * cache->block_size, cache->block_size);
+            insert_block(cache, block, blocknum + i);
+            block->readahead = true;
+            list_add_tail(&cache->lru_list, &block->node);
+        }
+        i++;
+    }
+
+    if (n == 0)
+        goto exit;
+    if (!ok) {
+        err = (rc < 0) ? (int)rc : ERR_IO;
+        goto exit;
+    }
+
+    cache->stats.ra_ios++;
+    cache->stats.ra_blocks += n;
+    err = n;
+
+exit:
+    mutex_release(&cache->lock);
+    mutex_release(&cache->ra_lock);
+    return err;
+}
+
+uint bcache_readahead(bcache_t priv, bcache_readahead_t *ra, uint fileblock, uint *start) {
+    struct bcache *cache = priv;
+
+    /* reading the rest of the block we're on */
+    if (fileblock + 1 == ra->next)
+        return 0;
+
+    /* anything but the next block in line turns read-ahead off until the
+     * reader goes sequential again */
+    if (fileblock != ra->next) {
+        ra->next = fileblock + 1;
+        ra->window = 0;
+        ra->ahead = fileblock + 1;
+        return 0;
+    }
+
+    ra->next = fileblock + 1;
+    if (ra->ahead < ra->next)
+        ra->ahead = ra->next;
+
+    /* top the window up once the reader is halfway into it */
+    if (ra->ahead - ra->next > ra->window / 2)
+        return 0;
+
+    uint max = cache->ra_max;
+    ra->window = MIN((ra->window == 0) ? BCACHE_RA_MIN_WINDOW : ra->window * 2, max);
+    if (ra->window == 0 || ra->next + ra->window <= ra->ahead)
+        return 0;
+
+    *start = ra->ahead;
+    uint count = ra->next + ra->window - ra->ahead;
+    ra->ahead += count;
+    return count;
+}
+
+status_t bcache_set_readahead(bcache_t priv, uint blocks) {
+    struct bcache *cache = priv;
+    status_t err = NO_ERROR;
+
+    mutex_acquire(&cache->ra_lock);
+    mutex_acquire(&cache->lock);
+
+    /* leave room in the cache for the blocks being read ahead of */
+    blocks = MIN(blocks, (uint)cache->count / 4);
+
+    void *buf = NULL;
+    if (blocks > 0) {
+        buf = malloc(blocks * cache->block_size);
+        if (!buf) {
+            err = ERR_NO_MEMORY;
+            goto exit;
+        }
+    }
+
+    free(cache->ra_buf);
+    cache->ra_buf = buf;
+    cache->ra_max = blocks;
+
+exit:
+    mutex_release(&cache->lock);
+    mutex_release(&cache->ra_lock);
+    return err;
+}
+
+int bcache_resize(bcache_t priv, int block_count) {
+    struct bcache *cache = priv;
+    int err = 0;
+
+    if (block_count == BCACHE_SIZE_AUTO)
+        block_count = auto_block_count(cache->block_size);
+
+    mutex_acquire(&cache->lock);
+
+    uint shift = hash_shift_for(block_count);
+    if (shift > cache->hash_shift) {
+        err = rehash(cache, shift);
+        if (err < 0)
+            goto exit;
+    }
+
+    while (cache->count < block_count) {
+        struct bcache_block *block = new_block(cache);
+        if (!block) {
+            err = ERR_NO_MEMORY;
+            goto exit;
+        }
+        list_add_head(&cache->free_list, &block->node);
+        cache->count++;
+    }
+
+    /* shrink from the free list first, then from the cold end of the lru */
+    while (cache->count > block_count) {
+        struct bcache_block *block;
+        block = list_remove_head_type(&cache->free_list, struct bcache_block, node);
+        if (!block) {
+            block = list_peek_head_type(&cache->lru_list, struct bcache_block, node);
+            if (!block) {
+                /* everything left is referenced */
+                err = ERR_BUSY;
                 goto exit;
+            }
+            if (block->is_dirty) {
+                err = flush_block(cache, block);
+                if (err < 0)
+                    goto exit;
+            }
+            list_delete(&block->hash_node);
+            list_delete(&block->node);
         }
+        free_block(block);
+        cache->count--;
     }
 
-    err = 0;
 exit:
-    return (err);
+    mutex_release(&cache->lock);
+    return err;
 }
 
 void bcache_dump(bcache_t priv, const char *name) {
     uint32_t finds;
     struct bcache *cache = priv;
 
-    finds = cache->stats.hits + cache->stats.misses;
+    mutex_acquire(&cache->lock);
+    struct bcache_stats stats = cache->stats;
+    int count = cache->count;
+    int dirty = cache->dirty_count;
+    uint ra_max = cache->ra_max;
+    mutex_release(&cache->lock);
+
+    finds = stats.hits + stats.misses;
 
     printf("%s: hits=%u(%u%%) depth=%u misses=%u(%u%%) reads=%u writes=%u\n",
            name,
-           cache->stats.hits,
-           finds ? (cache->stats.hits * 100) / finds : 0,
-           cache->stats.hits ? cache->stats.depth / cache->stats.hits : 0,
-           cache->stats.misses,
-           finds ? (cache->stats.misses * 100) / finds : 0,
-           cache->stats.reads,
-           cache->stats.writes);
+           stats.hits,
+           finds ? (stats.hits * 100) / finds : 0,
+           stats.hits ? stats.depth / stats.hits : 0,
+           stats.misses,
+           finds ? (stats.misses * 100) / finds : 0,
+           stats.reads,
+           stats.writes);
+    printf("%s: blocks=%d dirty=%d evictions=%u (dirty %u) writeback blocks=%u runs=%u passes=%u\n",
+           name,
+           count,
+           dirty,
+           stats.evictions,
+           stats.dirty_evictions,
+           stats.writebacks,
+           stats.writeback_runs,
+           stats.writeback_passes);
+    printf("%s: readahead max=%u ios=%u blocks=%u hits=%u(%u%%)\n",
+           name,
+           ra_max,
+           stats.ra_ios,
+           stats.ra_blocks,
+           stats.ra_hits,
+           stats.ra_blocks ? (stats.ra_hits * 100) / stats.ra_blocks : 0);
 }
+
+#if LK_DEBUGLEVEL > 0
+static int cmd_bcache(int argc, const console_cmd_args *argv) {
+    if (argc < 2) {
+usage:
+        printf("usage:\n");
+        printf("%s list\n", argv[0].str);
+        printf("%s readahead <device> <blocks>\n", argv[0].str);
+        return ERR_INVALID_ARGS;
+    }
+
+    mutex_acquire(&bcache_list_lock);
+
+    int err = NO_ERROR;
+    struct bcache *cache;
+    if (!strcmp(argv[1].str, "list")) {
+        list_for_every_entry(&bcache_list, cache, struct bcache, node) {
+            bcache_dump(cache, cache->dev->name);
+        }
+    } else if (!strcmp(argv[1].str, "readahead")) {
+        if (argc < 4) {
+            mutex_release(&bcache_list_lock);
+            goto usage;
+        }
+
+        err = ERR_NOT_FOUND;
+        list_for_every_entry(&bcache_list, cache, struct bcache, node) {
+            if (!strcmp(cache->dev->name, argv[2].str)) {
+                err = bcache_set_readahead(cache, argv[3].u);
+                break;
+            }
+        }
+        if (err < 0)
+            printf("error %d setting read-ahead\n", err);
+    } else {
+        mutex_release(&bcache_list_lock);
+        goto usage;
+    }
+
+    mutex_release(&bcache_list_lock);
+
+    return err;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("bcache", "block cache stats and tuning", &cmd_bcache)
+STATIC_COMMAND_END(bcache);
+#endif
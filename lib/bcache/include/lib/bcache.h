@@ -14,8 +14,14 @@ __BEGIN_CDECLS
 
 typedef void *bcache_t;
 
+// pass as the block count to size the cache from free memory
+#define BCACHE_SIZE_AUTO 0
+
+// dirty blocks are written back in the background by a thread per cache,
+// bcache_flush writes back everything dirty and waits for it.
 bcache_t bcache_create(bdev_t *dev, size_t block_size, int block_count);
 void bcache_destroy(bcache_t);
+int bcache_resize(bcache_t, int block_count);
 
 int bcache_read_block(bcache_t, void *, uint block);
 
@@ -27,4 +33,25 @@ int bcache_zero_block(bcache_t priv, uint blocknum);
 int bcache_flush(bcache_t priv);
 void bcache_dump(bcache_t priv, const char *name);
 
+// Sequential read-ahead. Keep one of these per open file, zeroed to start.
+// After reading each file block, bcache_readahead says which file blocks to
+// prefetch, if any. The window starts small and doubles for as long as the
+// reads stay sequential. The file system maps them to device blocks and hands
+// each contiguous run to bcache_prefetch.
+typedef struct bcache_readahead_state {
+    uint next;      // file block expected next
+    uint window;    // blocks to keep read ahead, 0 if not sequential
+    uint ahead;     // first file block not prefetched yet
+} bcache_readahead_t;
+
+uint bcache_readahead(bcache_t, bcache_readahead_t *ra, uint fileblock, uint *start);
+
+// read up to count blocks that aren't cached yet into the cache in one device
+// read, without holding up other users of the cache while it's in flight.
+// returns the number of blocks read.
+int bcache_prefetch(bcache_t, uint block, uint count);
+
+// the most blocks read ahead at once, 0 disables read-ahead
+status_t bcache_set_readahead(bcache_t, uint blocks);
+
 __END_CDECLS
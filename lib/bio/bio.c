@@ -16,8 +16,15 @@
 #include <lk/list.h>
 #include <lk/pow2.h>
 #include <kernel/mutex.h>
+#include <kernel/semaphore.h>
+#include <kernel/spinlock.h>
+#include <kernel/thread.h>
+#include <lib/heap.h>
+#include <platform.h>
 #include <lk/init.h>
 #include <arch/atomic.h>
+#include <iovec.h>
+#include <stdio.h>
 
 #define LOCAL_TRACE 0
 
@@ -29,6 +36,62 @@ static struct {
     .lock = MUTEX_INITIAL_VALUE(bdevs.lock),
 };
 
+/* devices without a submit hook with queued requests, serviced by a few worker threads */
+#ifndef BIO_WORKER_THREADS
+#define BIO_WORKER_THREADS 4
+#endif
+
+static struct {
+    spin_lock_t lock;
+    struct list_node queue;
+    semaphore_t sem;
+} bio_workers = {
+    .lock = SPIN_LOCK_INITIAL_VALUE,
+    .queue = LIST_INITIAL_VALUE(bio_workers.queue),
+    .sem = SEMAPHORE_INITIAL_VALUE(bio_workers.sem, 0),
+};
+
+/* transfers a scheduler keeps in flight on a device with a submit hook.
+ * devices without one get a single transfer at a time. */
+#ifndef BIO_SCHED_DEPTH
+#define BIO_SCHED_DEPTH 4
+#endif
+
+/* limits on what a merged transfer may grow to */
+#define BIO_SCHED_MAX_MERGE 8
+#define BIO_SCHED_MAX_SEGS 16
+#define BIO_SCHED_MAX_BYTES (128 * 1024)
+
+/* how long the deadline scheduler lets requests wait, in usecs */
+#define BIO_SCHED_READ_EXPIRE 50000
+#define BIO_SCHED_WRITE_EXPIRE 500000
+
+/* largest buffer a transfer is bounced through at once */
+#define BIO_BOUNCE_MAX (64 * 1024)
+
+struct bio_scheduler {
+    const char *name;
+    bool hold;                  /* keep requests queued while the device is busy */
+    bool merge;                 /* merge requests for neighbouring blocks */
+
+    /* add a request to the pending list, with the queue locked */
+    void (*add)(struct bio_queue *q, bio_request_t *req);
+    /* pick the next request to start, with the queue locked */
+    bio_request_t *(*next)(struct bio_queue *q, lk_bigtime_t now);
+};
+
+/* one or more requests for consecutive blocks, moved to the device as one */
+struct bio_batch {
+    bio_request_t req;
+    uint count;
+    uint bounced;
+    bio_request_t *members[BIO_SCHED_MAX_MERGE];
+    iovec_t iov[BIO_SCHED_MAX_SEGS];
+    struct bio_batch *next_free;
+};
+
+static ssize_t bio_queue_io(bdev_t *dev, enum bio_request_op op, void *buf, bnum_t block, uint count);
+
 /* default implementation is to use the read_block hook to 'deblock' the device */
 static ssize_t bio_default_read(struct bdev *dev, void *_buf, off_t offset, size_t len) {
     uint8_t *buf = (uint8_t *)_buf;
@@ -72,22 +135,36 @@ static ssize_t bio_default_read(struct bdev *dev, void *_buf, off_t offset, size
         (IS_ALIGNED((size_t)buf, CACHE_LINE) == false);
     /* handle middle blocks */
     if (requires_alignment) {
+        /* bounce as many blocks at a time as an aligned buffer holds */
+        size_t bounce_len = MIN(ROUNDDOWN(len, dev->block_size), BIO_BOUNCE_MAX);
+        uint8_t *bounce = (bounce_len > dev->block_size) ? memalign(CACHE_LINE, bounce_len) : NULL;
+        if (!bounce) {
+            bounce = temp;
+            bounce_len = dev->block_size;
+        }
+
         while (len >= dev->block_size) {
             /* do the middle reads */
-            err = bio_read_block(dev, temp, block, 1);
+            size_t chunk = MIN(ROUNDDOWN(len, dev->block_size), bounce_len);
+            err = bio_read_block(dev, bounce, block, chunk >> dev->block_shift);
             if (err < 0) {
-                goto err;
-            } else if ((size_t)err != dev->block_size) {
+                break;
+            } else if ((size_t)err != chunk) {
                 err = ERR_IO;
-                goto err;
+                break;
             }
-            memcpy(buf, temp, dev->block_size);
+            memcpy(buf, bounce, chunk);
 
-            buf += dev->block_size;
-            len -= dev->block_size;
-            bytes_read += dev->block_size;
-            block++;
+            buf += chunk;
+            len -= chunk;
+            bytes_read += chunk;
+            block += chunk >> dev->block_shift;
         }
+
+        if (bounce != temp)
+            free(bounce);
+        if (err < 0)
+            goto err;
     } else {
         uint32_t num_blocks = divpow2(len, dev->block_shift);
         err = bio_read_block(dev, buf, block, num_blocks);
@@ -178,22 +255,36 @@ static ssize_t bio_default_write(struct bdev *dev, const void *_buf, off_t offse
 
     /* handle middle blocks */
     if (requires_alignment) {
+        /* bounce as many blocks at a time as an aligned buffer holds */
+        size_t bounce_len = MIN(ROUNDDOWN(len, dev->block_size), BIO_BOUNCE_MAX);
+        uint8_t *bounce = (bounce_len > dev->block_size) ? memalign(CACHE_LINE, bounce_len) : NULL;
+        if (!bounce) {
+            bounce = temp;
+            bounce_len = dev->block_size;
+        }
+
         while (len >= dev->block_size) {
-            /* do the middle reads */
-            memcpy(temp, buf, dev->block_size);
-            err = bio_write_block(dev, temp, block, 1);
+            /* do the middle writes */
+            size_t chunk = MIN(ROUNDDOWN(len, dev->block_size), bounce_len);
+            memcpy(bounce, buf, chunk);
+            err = bio_write_block(dev, bounce, block, chunk >> dev->block_shift);
             if (err < 0) {
-                goto err;
-            } else if ((size_t)err != dev->block_size) {
+                break;
+            } else if ((size_t)err != chunk) {
                 err = ERR_IO;
-                goto err;
+                break;
             }
 
-            buf += dev->block_size;
-            len -= dev->block_size;
-            bytes_written += dev->block_size;
-            block++;
+            buf += chunk;
+            len -= chunk;
+            bytes_written += chunk;
+            block += chunk >> dev->block_shift;
         }
+
+        if (bounce != temp)
+            free(bounce);
+        if (err < 0)
+            goto err;
     } else {
         uint32_t block_count = divpow2(len, dev->block_shift);
         err = bio_write_block(dev, buf, block, block_count);
@@ -299,6 +390,7 @@ static void bdev_dec_ref(bdev_t *dev) {
         if (dev->close)
             dev->close(dev);
 
+        free(dev->queue.batches);
         free(dev->name);
     }
 }
@@ -380,7 +472,7 @@ ssize_t bio_read_block(bdev_t *dev, void *buf, bnum_t block, uint count) {
     if (count == 0)
         return 0;
 
-    return dev->read_block(dev, buf, block, count);
+    return bio_queue_io(dev, BIO_OP_READ, buf, block, count);
 }
 
 ssize_t bio_write(bdev_t *dev, const void *buf, off_t offset, size_t len) {
@@ -408,7 +500,7 @@ ssize_t bio_write_block(bdev_t *dev, const void *buf, bnum_t block, uint count)
     if (count == 0)
         return 0;
 
-    return dev->write_block(dev, buf, block, count);
+    return bio_queue_io(dev, BIO_OP_WRITE, (void *)buf, block, count);
 }
 
 ssize_t bio_erase(bdev_t *dev, off_t offset, size_t len) {
@@ -434,6 +526,515 @@ int bio_ioctl(bdev_t *dev, int request, void *argp) {
     }
 }
 
+void bio_request_init(bio_request_t *req, enum bio_request_op op, bnum_t block, uint count,
+                      const iovec_t *iov, uint iov_cnt, bio_callback_t callback, void *cookie) {
+    DEBUG_ASSERT(req);
+
+    list_clear_node(&req->node);
+    req->dev = NULL;
+    req->op = op;
+    req->block = block;
+    req->count = count;
+    req->iov = iov;
+    req->iov_cnt = iov_cnt;
+    req->callback = callback;
+    req->cookie = cookie;
+    event_init(&req->event, false, 0);
+    req->result = 0;
+}
+
+/* run a request through the synchronous hooks. whole blocks go straight to
+ * the driver wherever the buffers allow it, only blocks split across segments
+ * or in memory the device can't use are copied through a bounce buffer. */
+static ssize_t bio_do_request(bio_request_t *req, uint *bounced) {
+    bdev_t *dev = req->dev;
+    size_t len = (size_t)req->count << dev->block_shift;
+    bool read = (req->op == BIO_OP_READ);
+    bool need_align = dev->flags & (read ? BIO_FLAG_CACHE_ALIGNED_READS : BIO_FLAG_CACHE_ALIGNED_WRITES);
+
+    uint8_t *bounce = NULL;
+    size_t bounce_len = 0;
+    bnum_t block = req->block;
+    size_t pos = 0;
+    uint i = 0;                 /* segment and offset in it that pos falls at */
+    size_t off = 0;
+    ssize_t err = 0;
+
+    while (pos < len) {
+        while (off == req->iov[i].iov_len) {
+            i++;
+            off = 0;
+        }
+
+        uint8_t *base = (uint8_t *)req->iov[i].iov_base + off;
+        size_t avail = req->iov[i].iov_len - off;
+        size_t n;
+
+        if (avail >= dev->block_size && (!need_align || IS_ALIGNED((uintptr_t)base, CACHE_LINE))) {
+            /* in place, running on into segments that continue the same buffer */
+            n = ROUNDDOWN(avail, dev->block_size);
+            for (uint j = i; n == avail && j + 1 < req->iov_cnt &&
+                    req->iov[j + 1].iov_base == base + avail; j++) {
+                avail += req->iov[j + 1].iov_len;
+                n = ROUNDDOWN(avail, dev->block_size);
+            }
+            n = MIN(n, len - pos);
+
+            if (read)
+                err = dev->read_block(dev, base, block, n >> dev->block_shift);
+            else
+                err = dev->write_block(dev, base, block, n >> dev->block_shift);
+        } else {
+            /* a block split across segments, or memory the device can't use */
+            n = (avail >= dev->block_size) ? MIN(ROUNDDOWN(avail, dev->block_size), BIO_BOUNCE_MAX) : dev->block_size;
+            n = MIN(n, len - pos);
+
+            if (n > bounce_len) {
+                free(bounce);
+                bounce = memalign(CACHE_LINE, n);
+                if (!bounce) {
+                    err = ERR_NO_MEMORY;
+                    break;
+                }
+                bounce_len = n;
+            }
+
+            if (read) {
+                err = dev->read_block(dev, bounce, block, n >> dev->block_shift);
+                if (err > 0)
+                    iovec_from_membuf(req->iov, req->iov_cnt, pos, bounce, err);
+            } else {
+                iovec_to_membuf(bounce, n, req->iov, req->iov_cnt, pos);
+                err = dev->write_block(dev, bounce, block, n >> dev->block_shift);
+            }
+            *bounced += n >> dev->block_shift;
+        }
+
+        if (err < 0)
+            break;
+
+        /* step over what was transferred */
+        pos += err;
+        block += err >> dev->block_shift;
+        for (size_t adv = err; adv > 0;) {
+            size_t step = MIN(adv, req->iov[i].iov_len - off);
+            off += step;
+            adv -= step;
+            if (adv > 0) {
+                i++;
+                off = 0;
+            }
+        }
+
+        if ((size_t)err != n)
+            break;
+    }
+
+    free(bounce);
+    return (err < 0) ? err : (ssize_t)pos;
+}
+
+/* plain first come first served */
+static void bio_sched_fifo_add(struct bio_queue *q, bio_request_t *req) {
+    list_add_tail(&q->pending, &req->node);
+}
+
+static bio_request_t *bio_sched_fifo_next(struct bio_queue *q, lk_bigtime_t now) {
+    return list_peek_head_type(&q->pending, bio_request_t, node);
+}
+
+/* keep the queue sorted by block, sweeping across the device in one direction */
+static void bio_sched_sorted_add(struct bio_queue *q, bio_request_t *req) {
+    bio_request_t *r;
+    list_for_every_entry(&q->pending, r, bio_request_t, node) {
+        if (r->block > req->block) {
+            list_add_before(&r->node, &req->node);
+            return;
+        }
+    }
+    list_add_tail(&q->pending, &req->node);
+}
+
+static bio_request_t *bio_sched_elevator_next(struct bio_queue *q, lk_bigtime_t now) {
+    bio_request_t *r;
+    list_for_every_entry(&q->pending, r, bio_request_t, node) {
+        if (r->block >= q->head)
+            return r;
+    }
+
+    /* nothing further along, start over from the lowest block */
+    return list_peek_head_type(&q->pending, bio_request_t, node);
+}
+
+static bio_request_t *bio_sched_deadline_next(struct bio_queue *q, lk_bigtime_t now) {
+    /* anything that has waited too long goes first, oldest first */
+    bio_request_t *r, *oldest = NULL;
+    list_for_every_entry(&q->pending, r, bio_request_t, node) {
+        lk_bigtime_t expire = (r->op == BIO_OP_READ) ? BIO_SCHED_READ_EXPIRE : BIO_SCHED_WRITE_EXPIRE;
+        if (now - r->queued >= expire && (!oldest || r->queued < oldest->queued))
+            oldest = r;
+    }
+    if (oldest)
+        return oldest;
+
+    return bio_sched_elevator_next(q, now);
+}
+
+static const struct bio_scheduler bio_schedulers[] = {
+    { "noop", false, false, &bio_sched_fifo_add, &bio_sched_fifo_next },
+    { "elevator", true, true, &bio_sched_sorted_add, &bio_sched_elevator_next },
+    { "deadline", true, true, &bio_sched_sorted_add, &bio_sched_deadline_next },
+};
+
+#define BIO_SCHED_DEFAULT (&bio_schedulers[2])
+
+/* whether requests go through the queue or straight to the driver */
+static bool bio_queue_holds(const bdev_t *dev) {
+    if (!dev->queue.sched->hold)
+        return false;
+
+    /* a device with a submit hook needs somewhere to keep its transfers */
+    return !dev->submit || dev->queue.batches;
+}
+
+/* how many transfers may be in flight at once, 0 for no limit */
+static uint bio_queue_depth(const bdev_t *dev) {
+    if (!bio_queue_holds(dev))
+        return 0;
+
+    return dev->submit ? BIO_SCHED_DEPTH : 1;
+}
+
+/* count a request that went straight to the driver */
+static void bio_queue_account(bdev_t *dev, uint count) {
+    struct bio_queue *q = &dev->queue;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&q->lock, state);
+    q->stats.requests++;
+    q->stats.dispatches++;
+    q->stats.blocks += count;
+    spin_unlock_irqrestore(&q->lock, state);
+}
+
+static void bio_queue_add(bdev_t *dev, bio_request_t *req) {
+    struct bio_queue *q = &dev->queue;
+
+    req->dev = dev;
+    req->result = 0;
+    req->queued = current_time_hires();
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&q->lock, state);
+    q->sched->add(q, req);
+    q->stats.requests++;
+    spin_unlock_irqrestore(&q->lock, state);
+}
+
+/* have a worker thread start transfers on a device */
+static void bio_queue_kick(bdev_t *dev) {
+    struct bio_queue *q = &dev->queue;
+    bool post = false;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&bio_workers.lock, state);
+    if (!q->kicked) {
+        q->kicked = true;
+        bdev_inc_ref(dev);
+        list_add_tail(&bio_workers.queue, &q->kick_node);
+        post = true;
+    }
+    spin_unlock_irqrestore(&bio_workers.lock, state);
+
+    if (post)
+        sem_post(&bio_workers.sem, false);
+}
+
+/* take the request the scheduler picks next and whatever it can be merged with */
+static void bio_queue_fill_batch_locked(bdev_t *dev, struct bio_batch *b) {
+    struct bio_queue *q = &dev->queue;
+    lk_bigtime_t now = current_time_hires();
+
+    bio_request_t *req = q->sched->next(q, now);
+    list_delete(&req->node);
+
+    b->members[0] = req;
+    b->count = 1;
+    b->bounced = 0;
+
+    bnum_t start = req->block;
+    uint blocks = req->count;
+    uint segs = req->iov_cnt;
+
+    if (q->sched->merge) {
+        uint max_blocks = BIO_SCHED_MAX_BYTES >> dev->block_shift;
+        bool grew = true;
+
+        while (grew && b->count < BIO_SCHED_MAX_MERGE) {
+            grew = false;
+
+            bio_request_t *r;
+            list_for_every_entry(&q->pending, r, bio_request_t, node) {
+                if (r->op != req->op || blocks + r->count > max_blocks ||
+                        segs + r->iov_cnt > BIO_SCHED_MAX_SEGS)
+                    continue;
+
+                if (r->block == start + blocks) {
+                    b->members[b->count] = r;
+                } else if (r->block + r->count == start) {
+                    memmove(&b->members[1], &b->members[0], b->count * sizeof(b->members[0]));
+                    b->members[0] = r;
+                    start = r->block;
+                } else {
+                    continue;
+                }
+
+                list_delete(&r->node);
+                b->count++;
+                blocks += r->count;
+                segs += r->iov_cnt;
+                grew = true;
+                break;
+            }
+        }
+    }
+
+    for (uint i = 0; i < b->count; i++) {
+        lk_bigtime_t wait = now - b->members[i]->queued;
+        q->stats.wait_total += wait;
+        q->stats.wait_max = MAX(q->stats.wait_max, wait);
+    }
+    q->stats.queued += b->count;
+    q->stats.dispatches++;
+    q->stats.merges += b->count - 1;
+    q->stats.blocks += blocks;
+    q->head = start + blocks;
+
+    /* a lone request moves with its own segments */
+    const iovec_t *iov = req->iov;
+    uint iov_cnt = req->iov_cnt;
+    if (b->count > 1) {
+        iov_cnt = 0;
+        for (uint i = 0; i < b->count; i++) {
+            memcpy(&b->iov[iov_cnt], b->members[i]->iov, b->members[i]->iov_cnt * sizeof(iovec_t));
+            iov_cnt += b->members[i]->iov_cnt;
+        }
+        iov = b->iov;
+    }
+
+    bio_request_init(&b->req, req->op, start, blocks, iov, iov_cnt, NULL, b);
+    b->req.dev = dev;
+}
+
+static bool bio_queue_run_one(bdev_t *dev);
+
+/* a transfer finished, hand each request in it its share of the result */
+static void bio_batch_finish(bdev_t *dev, struct bio_batch *b, ssize_t result) {
+    struct bio_queue *q = &dev->queue;
+
+    /* the batch may be reused as soon as the lock is dropped */
+    bio_request_t *members[BIO_SCHED_MAX_MERGE];
+    uint count = b->count;
+    memcpy(members, b->members, count * sizeof(members[0]));
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&q->lock, state);
+    q->inflight--;
+    q->stats.bounced += b->bounced;
+    if (dev->submit) {
+        b->next_free = q->free_batches;
+        q->free_batches = b;
+    }
+    bool pending = !list_is_empty(&q->pending);
+    spin_unlock_irqrestore(&q->lock, state);
+
+    /* keep the device busy */
+    if (dev->submit) {
+        while (bio_queue_run_one(dev))
+            ;
+    } else if (pending) {
+        bio_queue_kick(dev);
+    }
+
+    size_t left = (result > 0) ? (size_t)result : 0;
+    for (uint i = 0; i < count; i++) {
+        size_t len = (size_t)members[i]->count << dev->block_shift;
+        ssize_t r = result;
+        if (count > 1 && result >= 0)
+            r = left ? (ssize_t)MIN(left, len) : ERR_IO;
+        left -= MIN(left, len);
+
+        bio_request_complete(members[i], r);
+    }
+}
+
+static void bio_batch_callback(bio_request_t *req) {
+    struct bio_batch *b = req->cookie;
+    bio_batch_finish(req->dev, b, req->result);
+}
+
+/**
+ * Start the next transfer on a device if its scheduler allows another one
+ * in flight. Transfers on devices without a submit hook are done before
+ * this returns, so those may only be started from a thread.
+ *
+ * @return  false if there was nothing to start.
+ */
+static bool bio_queue_run_one(bdev_t *dev) {
+    struct bio_queue *q = &dev->queue;
+    struct bio_batch local;
+    struct bio_batch *b = &local;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&q->lock, state);
+
+    uint depth = bio_queue_depth(dev);
+    if (list_is_empty(&q->pending) || (depth && q->inflight >= depth)) {
+        spin_unlock_irqrestore(&q->lock, state);
+        return false;
+    }
+
+    if (dev->submit) {
+        b = q->free_batches;
+        DEBUG_ASSERT(b);
+        q->free_batches = b->next_free;
+    }
+    bio_queue_fill_batch_locked(dev, b);
+    q->inflight++;
+
+    /* let another worker take what could run alongside this */
+    bool more = !dev->submit && !list_is_empty(&q->pending) && (!depth || q->inflight < depth);
+
+    spin_unlock_irqrestore(&q->lock, state);
+
+    if (more)
+        bio_queue_kick(dev);
+
+    if (dev->submit) {
+        b->req.callback = &bio_batch_callback;
+        status_t err = dev->submit(dev, &b->req);
+        if (err < 0)
+            bio_request_complete(&b->req, err);
+    } else {
+        bio_batch_finish(dev, b, bio_do_request(&b->req, &b->bounced));
+    }
+
+    return true;
+}
+
+/* the synchronous block calls, through the queue if the device has one */
+static ssize_t bio_queue_io(bdev_t *dev, enum bio_request_op op, void *buf, bnum_t block, uint count) {
+    if (!bio_queue_holds(dev)) {
+        bio_queue_account(dev, count);
+        if (op == BIO_OP_READ)
+            return dev->read_block(dev, buf, block, count);
+        else
+            return dev->write_block(dev, buf, block, count);
+    }
+
+    iovec_t iov = { .iov_base = buf, .iov_len = (size_t)count << dev->block_shift };
+    bio_request_t req;
+    bio_request_init(&req, op, block, count, &iov, 1, NULL, NULL);
+    bio_queue_add(dev, &req);
+
+    /* move things along on this thread until ours has been started */
+    for (;;) {
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&dev->queue.lock, state);
+        bool queued = list_in_list(&req.node);
+        spin_unlock_irqrestore(&dev->queue.lock, state);
+
+        if (!queued || !bio_queue_run_one(dev))
+            break;
+    }
+
+    return bio_request_wait(&req);
+}
+
+static int bio_worker(void *arg) {
+    for (;;) {
+        sem_wait(&bio_workers.sem);
+
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&bio_workers.lock, state);
+        struct bio_queue *q = list_remove_head_type(&bio_workers.queue, struct bio_queue, kick_node);
+        DEBUG_ASSERT(q);
+        q->kicked = false;
+        spin_unlock_irqrestore(&bio_workers.lock, state);
+
+        /* one transfer, finishing it kicks the device again if there's more */
+        bdev_t *dev = containerof(q, bdev_t, queue);
+        bio_queue_run_one(dev);
+        bdev_dec_ref(dev);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief  Queue an asynchronous block request
+ *
+ * The request must have been set up with bio_request_init() and must not be
+ * touched again until it completes. Completion runs the request's callback
+ * if it has one, otherwise signals its event for bio_request_wait().
+ * May be called from a completion callback.
+ *
+ * @return  NO_ERROR if the request was queued, in which case it will
+ * complete, or an error if it was rejected.
+ */
+status_t bio_submit(bdev_t *dev, bio_request_t *req) {
+    DEBUG_ASSERT(dev && dev->ref > 0);
+    DEBUG_ASSERT(req);
+
+    LTRACEF("dev '%s', op %d, block %u, count %u, iov_cnt %u\n",
+            dev->name, req->op, req->block, req->count, req->iov_cnt);
+
+    /* unlike the synchronous calls, a request is all or nothing */
+    if (req->count == 0 || bio_trim_block_range(dev, req->block, req->count) != req->count)
+        return ERR_OUT_OF_RANGE;
+    if (iovec_size(req->iov, req->iov_cnt) != (ssize_t)((size_t)req->count << dev->block_shift))
+        return ERR_INVALID_ARGS;
+
+    event_unsignal(&req->event);
+
+    if (dev->submit && !bio_queue_holds(dev)) {
+        req->dev = dev;
+        req->result = 0;
+        bio_queue_account(dev, req->count);
+        return dev->submit(dev, req);
+    }
+
+    bio_queue_add(dev, req);
+
+    if (dev->submit) {
+        while (bio_queue_run_one(dev))
+            ;
+    } else {
+        bio_queue_kick(dev);
+    }
+
+    return NO_ERROR;
+}
+
+ssize_t bio_request_wait(bio_request_t *req) {
+    DEBUG_ASSERT(!req->callback);
+
+    event_wait(&req->event);
+    return req->result;
+}
+
+void bio_request_complete(bio_request_t *req, ssize_t result) {
+    LTRACEF("req %p, result %ld\n", req, (long)result);
+
+    req->result = result;
+
+    /* the callback may reuse the request, so only one or the other */
+    if (req->callback)
+        req->callback(req);
+    else
+        event_signal(&req->event, false);
+}
+
 void bio_initialize_bdev(bdev_t *dev,
                          const char *name,
                          size_t block_size,
@@ -507,6 +1108,19 @@ void bio_initialize_bdev(bdev_t *dev,
     dev->write_block = bio_default_write_block;
     dev->erase = bio_default_erase;
     dev->close = NULL;
+    dev->submit = NULL;
+
+    /* and an empty queue */
+    spin_lock_init(&dev->queue.lock);
+    list_initialize(&dev->queue.pending);
+    dev->queue.sched = BIO_SCHED_DEFAULT;
+    dev->queue.inflight = 0;
+    dev->queue.head = 0;
+    dev->queue.kicked = false;
+    list_clear_node(&dev->queue.kick_node);
+    dev->queue.batches = NULL;
+    dev->queue.free_batches = NULL;
+    memset(&dev->queue.stats, 0, sizeof(dev->queue.stats));
 }
 
 void bio_register_device(bdev_t *dev) {
@@ -514,6 +1128,19 @@ void bio_register_device(bdev_t *dev) {
 
     LTRACEF(" '%s'\n", dev->name);
 
+    /* room for the transfers the scheduler keeps in flight, without it the
+     * device's requests go straight to the driver */
+    if (dev->submit && !dev->queue.batches) {
+        struct bio_batch *batches = calloc(BIO_SCHED_DEPTH, sizeof(struct bio_batch));
+        if (batches) {
+            for (uint i = 0; i < BIO_SCHED_DEPTH; i++) {
+                batches[i].next_free = dev->queue.free_batches;
+                dev->queue.free_batches = &batches[i];
+            }
+            dev->queue.batches = batches;
+        }
+    }
+
     bdev_inc_ref(dev);
 
     mutex_acquire(&bdevs.lock);
@@ -534,27 +1161,90 @@ void bio_unregister_device(bdev_t *dev) {
     bdev_dec_ref(dev); // remove the ref the list used to have
 }
 
+status_t bio_set_scheduler(bdev_t *dev, const char *name) {
+    DEBUG_ASSERT(dev);
+
+    const struct bio_scheduler *sched = NULL;
+    for (size_t i = 0; i < countof(bio_schedulers); i++) {
+        if (!strcmp(bio_schedulers[i].name, name))
+            sched = &bio_schedulers[i];
+    }
+    if (!sched)
+        return ERR_NOT_FOUND;
+
+    status_t err = NO_ERROR;
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&dev->queue.lock, state);
+    if (!list_is_empty(&dev->queue.pending) || dev->queue.inflight)
+        err = ERR_BUSY;
+    else
+        dev->queue.sched = sched;
+    spin_unlock_irqrestore(&dev->queue.lock, state);
+
+    return err;
+}
+
+const char *bio_scheduler_name(bdev_t *dev) {
+    return dev->queue.sched->name;
+}
+
+void bio_get_queue_stats(bdev_t *dev, bio_queue_stats_t *stats) {
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&dev->queue.lock, state);
+    *stats = dev->queue.stats;
+    spin_unlock_irqrestore(&dev->queue.lock, state);
+}
+
+static void bio_dump_queue(bdev_t *dev) {
+    bio_queue_stats_t stats;
+    bio_get_queue_stats(dev, &stats);
+
+    printf("\t\tsched %s, requests %llu, transfers %llu, merges %llu, avg size %llu, bounced blocks %llu\n",
+           bio_scheduler_name(dev), stats.requests, stats.dispatches, stats.merges,
+           stats.dispatches ? (stats.blocks << dev->block_shift) / stats.dispatches : 0,
+           stats.bounced);
+    printf("\t\tqueued %llu, wait avg %llu usecs, max %llu usecs\n",
+           stats.queued, stats.queued ? stats.wait_total / stats.queued : 0, stats.wait_max);
+}
+
+void bio_dump_device(bdev_t *dev) {
+    printf("\t%s, size %lld, bsize %zd, ref %d",
+           dev->name, dev->total_size, dev->block_size, dev->ref);
+
+    if (!dev->geometry_count || !dev->geometry) {
+        printf(" (no erase geometry)\n");
+    } else {
+        for (size_t i = 0; i < dev->geometry_count; ++i) {
+            const bio_erase_geometry_info_t *geo = dev->geometry + i;
+            printf("\n\t\terase_region[%zu] : start %lld size %lld erase size %zu",
+                   i, geo->start, geo->size, geo->erase_size);
+
+        }
+        printf("\n");
+    }
+
+    bio_dump_queue(dev);
+}
+
 void bio_dump_devices(void) {
     printf("block devices:\n");
     bdev_t *entry;
     mutex_acquire(&bdevs.lock);
     list_for_every_entry(&bdevs.list, entry, bdev_t, node) {
+        bio_dump_device(entry);
+    }
+    mutex_release(&bdevs.lock);
+}
 
-        printf("\t%s, size %lld, bsize %zd, ref %d",
-               entry->name, entry->total_size, entry->block_size, entry->ref);
-
-        if (!entry->geometry_count || !entry->geometry) {
-            printf(" (no erase geometry)\n");
-        } else {
-            for (size_t i = 0; i < entry->geometry_count; ++i) {
-                const bio_erase_geometry_info_t *geo = entry->geometry + i;
-                printf("\n\t\terase_region[%zu] : start %lld size %lld erase size %zu",
-                       i, geo->start, geo->size, geo->erase_size);
-
-            }
-        }
+static void bio_init(uint level) {
+    for (uint i = 0; i < BIO_WORKER_THREADS; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "bio worker %u", i);
 
-        printf("\n");
+        thread_t *t = thread_create(name, &bio_worker, NULL, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+        if (t)
+            thread_detach_and_resume(t);
     }
-    mutex_release(&bdevs.lock);
 }
+
+LK_INIT_HOOK(libbio, &bio_init, LK_INIT_LEVEL_THREADING);
@@ -14,6 +14,9 @@
 #include <lk/console_cmd.h>
 #include <lib/bio.h>
 #include <platform.h>
+#include <rand.h>
+#include <kernel/semaphore.h>
+#include <kernel/spinlock.h>
 #include <kernel/thread.h>
 
 #if WITH_LIB_CKSUM
@@ -30,6 +33,7 @@
 #if LK_DEBUGLEVEL > 0
 static int cmd_bio(int argc, const console_cmd_args *argv);
 static int bio_test_device(bdev_t *device);
+static int bio_bench_device(bdev_t *device, bool write, uint blocks);
 
 STATIC_COMMAND_START
 STATIC_COMMAND("bio", "block io debug commands", &cmd_bio)
@@ -45,11 +49,13 @@ usage:
         printf("%s list\n", argv[0].str);
         printf("%s read <device> <address> <offset> <len>\n", argv[0].str);
         printf("%s write <device> <address> <offset> <len>\n", argv[0].str);
-        printf("%s dump <device> <offset> <len>\n", argv[0].str);
+        printf("%s dump <device> [<offset> <len>]\n", argv[0].str);
         printf("%s erase <device> <offset> <len>\n", argv[0].str);
         printf("%s ioctl <device> <request> <arg>\n", argv[0].str);
         printf("%s remove <device>\n", argv[0].str);
+        printf("%s sched <device> [noop|elevator|deadline]\n", argv[0].str);
         printf("%s test <device>\n", argv[0].str);
+        printf("%s bench <device> [read|write] [blocks per request]\n", argv[0].str);
 #if WITH_LIB_PARTITION
         printf("%s partscan <device> [offset]\n", argv[0].str);
 #endif
@@ -104,6 +110,18 @@ usage:
 
         rc = err;
     } else if (!strcmp(argv[1].str, "dump")) {
+        if (argc == 3) {
+            /* just the device and its queue stats */
+            bdev_t *dev = bio_open(argv[2].str);
+            if (!dev) {
+                printf("error opening block device\n");
+                return -1;
+            }
+
+            bio_dump_device(dev);
+            bio_close(dev);
+            return 0;
+        }
         if (argc < 5) {
             printf("not enough arguments:\n");
             goto usage;
@@ -193,6 +211,23 @@ usage:
         }
 
         bio_unregister_device(dev);
+        bio_close(dev);
+    } else if (!strcmp(argv[1].str, "sched")) {
+        if (argc < 3) goto notenoughargs;
+
+        bdev_t *dev = bio_open(argv[2].str);
+        if (!dev) {
+            printf("error opening block device\n");
+            return -1;
+        }
+
+        if (argc >= 4) {
+            rc = bio_set_scheduler(dev, argv[3].str);
+            if (rc < 0)
+                printf("error %d setting scheduler\n", rc);
+        }
+        printf("%s: scheduler %s\n", dev->name, bio_scheduler_name(dev));
+
         bio_close(dev);
     } else if (!strcmp(argv[1].str, "test")) {
         if (argc < 3) goto notenoughargs;
@@ -207,6 +242,20 @@ usage:
         bio_close(dev);
 
         rc = err;
+    } else if (!strcmp(argv[1].str, "bench")) {
+        if (argc < 3) goto notenoughargs;
+
+        bool write = (argc > 3 && !strcmp(argv[3].str, "write"));
+        uint blocks = (argc > 4) ? argv[4].u : 1;
+
+        bdev_t *dev = bio_open(argv[2].str);
+        if (!dev) {
+            printf("error opening block device\n");
+            return -1;
+        }
+
+        rc = bio_bench_device(dev, write, blocks);
+        bio_close(dev);
 #if WITH_LIB_PARTITION
     } else if (!strcmp(argv[1].str, "partscan")) {
         if (argc < 3) goto notenoughargs;
@@ -536,3 +585,151 @@ static int bio_test_device(bdev_t *device) {
 
     return 0;
 }
+
+#define BIO_BENCH_MAX_DEPTH 32
+#define BIO_BENCH_RUN_MS 1000
+#define BIO_BENCH_MAX_SAMPLES 16384
+
+struct bio_bench_slot {
+    bio_request_t req;
+    iovec_t iov;
+    lk_bigtime_t start;
+};
+
+/* completed requests, handed back from whatever context the driver completes in */
+static struct {
+    spin_lock_t lock;
+    struct list_node done;
+    semaphore_t sem;
+} bio_bench = {
+    .lock = SPIN_LOCK_INITIAL_VALUE,
+    .done = LIST_INITIAL_VALUE(bio_bench.done),
+};
+
+static void bio_bench_callback(bio_request_t *req) {
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&bio_bench.lock, state);
+    list_add_tail(&bio_bench.done, &req->node);
+    spin_unlock_irqrestore(&bio_bench.lock, state);
+
+    sem_post(&bio_bench.sem, false);
+}
+
+static status_t bio_bench_submit(bdev_t *device, struct bio_bench_slot *slot, bool write, uint blocks) {
+    bnum_t block = (rand() % (device->block_count / blocks)) * blocks;
+
+    bio_request_init(&slot->req, write ? BIO_OP_WRITE : BIO_OP_READ, block, blocks,
+                     &slot->iov, 1, &bio_bench_callback, slot);
+    slot->start = current_time_hires();
+
+    return bio_submit(device, &slot->req);
+}
+
+static int bio_bench_compare(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* keep a fixed number of random requests in flight for a while at each
+ * queue depth, reporting the rate they complete at and how long they took */
+static int bio_bench_device(bdev_t *device, bool write, uint blocks) {
+    if (blocks == 0 || device->block_count < blocks) {
+        printf("invalid request size\n");
+        return ERR_INVALID_ARGS;
+    }
+
+    size_t len = (size_t)blocks * device->block_size;
+    uint8_t *buf = memalign(DMA_ALIGNMENT, len * BIO_BENCH_MAX_DEPTH);
+    struct bio_bench_slot *slots = calloc(BIO_BENCH_MAX_DEPTH, sizeof(struct bio_bench_slot));
+    uint32_t *latency = malloc(BIO_BENCH_MAX_SAMPLES * sizeof(uint32_t));
+    if (!buf || !slots || !latency) {
+        free(buf);
+        free(slots);
+        free(latency);
+        return ERR_NO_MEMORY;
+    }
+
+    for (uint i = 0; i < BIO_BENCH_MAX_DEPTH; i++) {
+        slots[i].iov.iov_base = buf + i * len;
+        slots[i].iov.iov_len = len;
+    }
+    if (write)
+        memset(buf, 0x99, len * BIO_BENCH_MAX_DEPTH);
+
+    printf("%s bench on '%s', %zu bytes per request, %u msecs per queue depth\n",
+           write ? "write" : "read", device->name, len, BIO_BENCH_RUN_MS);
+
+    int rc = 0;
+    for (uint depth = 1; depth <= BIO_BENCH_MAX_DEPTH; depth *= 2) {
+        sem_init(&bio_bench.sem, 0);
+
+        uint samples = 0;
+        ulong completed = 0;
+        ulong errors = 0;
+        uint inflight = 0;
+
+        lk_bigtime_t start = current_time_hires();
+        lk_bigtime_t end = start + BIO_BENCH_RUN_MS * 1000ULL;
+
+        for (uint i = 0; i < depth; i++) {
+            if (bio_bench_submit(device, &slots[i], write, blocks) < 0)
+                errors++;
+            else
+                inflight++;
+        }
+
+        while (inflight > 0) {
+            sem_wait(&bio_bench.sem);
+
+            spin_lock_saved_state_t state;
+            spin_lock_irqsave(&bio_bench.lock, state);
+            bio_request_t *req = list_remove_head_type(&bio_bench.done, bio_request_t, node);
+            spin_unlock_irqrestore(&bio_bench.lock, state);
+
+            struct bio_bench_slot *slot = req->cookie;
+            lk_bigtime_t now = current_time_hires();
+            inflight--;
+
+            if (req->result != (ssize_t)len)
+                errors++;
+            else
+                completed++;
+            if (samples < BIO_BENCH_MAX_SAMPLES)
+                latency[samples++] = now - slot->start;
+
+            if (now < end) {
+                if (bio_bench_submit(device, slot, write, blocks) < 0)
+                    errors++;
+                else
+                    inflight++;
+            }
+        }
+
+        lk_bigtime_t elapsed = current_time_hires() - start;
+        sem_destroy(&bio_bench.sem);
+
+        if (samples == 0) {
+            printf("qd %2u: no requests completed\n", depth);
+            rc = ERR_IO;
+            break;
+        }
+
+        qsort(latency, samples, sizeof(uint32_t), &bio_bench_compare);
+
+        printf("qd %2u: %llu iops, latency usecs p50 %u p90 %u p99 %u max %u",
+               depth, completed * 1000000ULL / MAX(elapsed, 1ULL),
+               latency[(samples - 1) * 50 / 100], latency[(samples - 1) * 90 / 100],
+               latency[(samples - 1) * 99 / 100], latency[samples - 1]);
+        if (errors)
+            printf(", %lu errors", errors);
+        printf("\n");
+    }
+
+    free(buf);
+    free(slots);
+    free(latency);
+
+    return rc;
+}
@@ -8,6 +8,9 @@
 #pragma once
 
 #include <assert.h>
+#include <iovec.h>
+#include <kernel/event.h>
+#include <kernel/spinlock.h>
 #include <sys/types.h>
 #include <lk/list.h>
 
@@ -26,6 +29,42 @@ typedef struct bio_erase_geometry_info {
     size_t erase_shift;
 } bio_erase_geometry_info_t;
 
+struct bio_request;
+struct bio_scheduler;
+struct bio_batch;
+
+/* per device request queue statistics */
+typedef struct bio_queue_stats {
+    uint64_t requests;          /* requests handed to the device */
+    uint64_t dispatches;        /* transfers started on the device */
+    uint64_t merges;            /* requests that rode along in another's transfer */
+    uint64_t blocks;            /* blocks transferred */
+    uint64_t bounced;           /* blocks copied through a bounce buffer */
+    uint64_t queued;            /* requests that waited in the queue */
+    lk_bigtime_t wait_total;    /* usecs they spent there */
+    lk_bigtime_t wait_max;
+} bio_queue_stats_t;
+
+/* requests waiting for a device, ordered by a pluggable scheduler.
+ * private to lib/bio. */
+struct bio_queue {
+    spin_lock_t lock;
+    struct list_node pending;
+    const struct bio_scheduler *sched;
+    uint inflight;              /* transfers started and not yet complete */
+    bnum_t head;                /* block after the last transfer started */
+
+    /* waiting for a worker thread */
+    bool kicked;
+    struct list_node kick_node;
+
+    /* transfers in flight on devices with a submit hook */
+    struct bio_batch *batches;
+    struct bio_batch *free_batches;
+
+    bio_queue_stats_t stats;
+};
+
 typedef struct bdev {
     struct list_node node;
     volatile int ref;
@@ -53,8 +92,67 @@ typedef struct bdev {
     ssize_t (*erase)(struct bdev *, off_t offset, size_t len);
     int (*ioctl)(struct bdev *, int request, void *argp);
     void (*close)(struct bdev *);
+
+    /* optional, queue an asynchronous request and return without waiting.
+     * the driver calls bio_request_complete() when it finishes. devices
+     * without it are serviced by a pool of threads using read_block/write_block. */
+    status_t (*submit)(struct bdev *, struct bio_request *req);
+
+    struct bio_queue queue;
 } bdev_t;
 
+/* asynchronous block requests */
+enum bio_request_op {
+    BIO_OP_READ,
+    BIO_OP_WRITE,
+};
+
+typedef void (*bio_callback_t)(struct bio_request *req);
+
+typedef struct bio_request {
+    struct list_node node;      /* free for the driver to use while the request is queued */
+
+    bdev_t *dev;
+    enum bio_request_op op;
+    bnum_t block;
+    uint count;                 /* in blocks */
+
+    /* scatter/gather list covering exactly count blocks */
+    const iovec_t *iov;
+    uint iov_cnt;
+
+    /* called when the request completes, possibly from interrupt context.
+     * it may reuse or free the request. without a callback the event is
+     * signaled instead, for bio_request_wait(). */
+    bio_callback_t callback;
+    void *cookie;
+    event_t event;
+
+    ssize_t result;             /* bytes transferred or an error once complete */
+
+    lk_bigtime_t queued;        /* private to lib/bio */
+} bio_request_t;
+
+void bio_request_init(bio_request_t *req, enum bio_request_op op, bnum_t block, uint count,
+                      const iovec_t *iov, uint iov_cnt, bio_callback_t callback, void *cookie);
+
+/* queue a request. the device must stay open until it completes. */
+status_t bio_submit(bdev_t *dev, bio_request_t *req);
+
+/* block until a submitted request completes, returns its result */
+ssize_t bio_request_wait(bio_request_t *req);
+
+/* for drivers, finish a request handed to the submit hook */
+void bio_request_complete(bio_request_t *req, ssize_t result);
+
+/* pick the request scheduler of a device by name: "noop" passes requests
+ * straight to the driver, "elevator" sorts them by block and merges
+ * neighbours while the device is busy, "deadline" does the same but starts
+ * requests that have waited too long first. ERR_BUSY if requests are queued. */
+status_t bio_set_scheduler(bdev_t *dev, const char *name);
+const char *bio_scheduler_name(bdev_t *dev);
+void bio_get_queue_stats(bdev_t *dev, bio_queue_stats_t *stats);
+
 /* user api */
 bdev_t *bio_open(const char *name);
 void bio_close(bdev_t *dev);
@@ -80,6 +178,7 @@ void bio_initialize_bdev(bdev_t *dev,
 
 /* debug stuff */
 void bio_dump_devices(void);
+void bio_dump_device(bdev_t *dev);
 
 /* subdevice support */
 status_t bio_publish_subdevice(const char *parent_dev,
@@ -68,6 +68,9 @@ int create_membdev(const char *name, void *ptr, size_t len) {
     bio_initialize_bdev(&mem->dev, name, BLOCKSIZE, len / BLOCKSIZE, 0, NULL,
                         BIO_FLAGS_NONE);
 
+    /* nothing to gain from ordering or merging requests to memory */
+    bio_set_scheduler(&mem->dev, "noop");
+
     /* our bits */
     mem->ptr = ptr;
     mem->dev.read = mem_bdev_read;
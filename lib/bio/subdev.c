@@ -152,6 +152,9 @@ status_t bio_publish_subdevice(const char *parent_dev,
                         parent->block_size, block_count,
                         geometry_count, geometry, BIO_FLAGS_NONE);
 
+    /* requests are scheduled on the parent */
+    bio_set_scheduler(&sub->dev, "noop");
+
     sub->parent = parent;
     sub->dev.erase_byte = parent->erase_byte;
     sub->offset = startblock;
@@ -107,6 +107,60 @@ size_t cbuf_write(cbuf_t *cbuf, const void *_buf, size_t len, bool canreschedule
     return pos;
 }
 
+size_t cbuf_write_ahead(cbuf_t *cbuf, size_t offset, const void *_buf, size_t len) {
+    const char *buf = (const char *)_buf;
+
+    LTRACEF("offset %zu len %zu\n", offset, len);
+
+    DEBUG_ASSERT(cbuf);
+    DEBUG_ASSERT(buf || len == 0);
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&cbuf->lock, state);
+
+    // only the free space can be written, the same as cbuf_write
+    size_t avail = cbuf_space_avail(cbuf);
+    size_t pos = 0;
+    if (offset < avail) {
+        len = MIN(len, avail - offset);
+
+        // at most two passes to deal with wraparound
+        uint ptr = INC_POINTER(cbuf, cbuf->head, offset);
+        while (pos < len) {
+            size_t write_len = MIN(valpow2(cbuf->len_pow2) - ptr, len - pos);
+            memcpy(cbuf->buf + ptr, buf + pos, write_len);
+            ptr = INC_POINTER(cbuf, ptr, write_len);
+            pos += write_len;
+        }
+    }
+
+    spin_unlock_irqrestore(&cbuf->lock, state);
+
+    return pos;
+}
+
+size_t cbuf_commit(cbuf_t *cbuf, size_t len, bool canreschedule) {
+    LTRACEF("len %zu\n", len);
+
+    DEBUG_ASSERT(cbuf);
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&cbuf->lock, state);
+
+    len = MIN(len, cbuf_space_avail(cbuf));
+    cbuf->head = INC_POINTER(cbuf, cbuf->head, len);
+
+    if (cbuf->head != cbuf->tail)
+        event_signal(&cbuf->event, false);
+
+    spin_unlock_irqrestore(&cbuf->lock, state);
+
+    if (canreschedule)
+        thread_preempt();
+
+    return len;
+}
+
 size_t cbuf_read(cbuf_t *cbuf, void *_buf, size_t buflen, bool block) {
     char *buf = (char *)_buf;
 
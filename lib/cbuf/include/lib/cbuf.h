@@ -98,6 +98,31 @@ size_t cbuf_peek(cbuf_t *cbuf, iovec_t *regions);
  */
 size_t cbuf_write(cbuf_t *cbuf, const void *buf, size_t len, bool canreschedule);
 
+/**
+ * cbuf_write_ahead
+ * Copy data into the free space of the cbuf, offset bytes past the end of
+ * what is currently readable, without making any of it readable. Use
+ * cbuf_commit to publish it once everything in front of it has been written.
+ * @param[in] cbuf The cbuf instance to write to.
+ * @param[in] offset The number of bytes past the write position to start at.
+ * @param[in] buf A pointer to a buffer to read data from.
+ * @param[in] len The maximum number of bytes to copy.
+ * @return The number of bytes which were copied, fewer than len if the free
+ * space ends first.
+ */
+size_t cbuf_write_ahead(cbuf_t *cbuf, size_t offset, const void *buf, size_t len);
+
+/**
+ * cbuf_commit
+ * Make the next len bytes of free space readable, as is. Pairs with
+ * cbuf_write_ahead.
+ * @param[in] cbuf The cbuf instance to commit to.
+ * @param[in] len The maximum number of bytes to make readable.
+ * @param[in] canreschedule Rescheduling policy, as with cbuf_write.
+ * @return The number of bytes which were made readable.
+ */
+size_t cbuf_commit(cbuf_t *cbuf, size_t len, bool canreschedule);
+
 /**
  * cbuf_space_avail
  *
@@ -14,6 +14,7 @@
 #include <kernel/thread.h>
 #include <kernel/event.h>
 #include <lk/init.h>
+#include <lib/slab.h>
 
 struct dpc {
     struct list_node node;
@@ -23,6 +24,8 @@ struct dpc {
 };
 
 static struct list_node dpc_list = LIST_INITIAL_VALUE(dpc_list);
+static slab_cache_t dpc_cache =
+    SLAB_CACHE_INITIAL_VALUE(dpc_cache, "dpc", sizeof(struct dpc), __alignof(struct dpc), NULL, NULL);
 static event_t dpc_event;
 
 static int dpc_thread_routine(void *arg);
@@ -30,7 +33,7 @@ static int dpc_thread_routine(void *arg);
 status_t dpc_queue(dpc_callback cb, void *arg, uint flags) {
     struct dpc *dpc;
 
-    dpc = malloc(sizeof(struct dpc));
+    dpc = slab_cache_alloc(&dpc_cache);
 
     if (dpc == NULL)
         return ERR_NO_MEMORY;
@@ -59,7 +62,7 @@ static int dpc_thread_routine(void *arg) {
 //          dprintf("dpc calling %p, arg %p\n", dpc->cb, dpc->arg);
             dpc->cb(dpc->arg);
 
-            free(dpc);
+            slab_cache_free(&dpc_cache, dpc);
         }
     }
 
@@ -0,0 +1,334 @@
+/*
+ * Copyright (c) 2009-2015 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#include "dcache.h"
+
+#include <kernel/mutex.h>
+#include <lib/fs/fnv.h>
+#include <lib/slab.h>
+#include <lk/console_cmd.h>
+#include <lk/debug.h>
+#include <lk/err.h>
+#include <lk/list.h>
+#include <lk/trace.h>
+#include <stdio.h>
+#include <string.h>
+
+#define LOCAL_TRACE 0
+
+#define DCACHE_BUCKETS 256
+#define DCACHE_MAX_ENTRIES 1024
+
+struct dentry {
+    struct list_node hash_node;
+    struct list_node lru_node;
+    const void *mount;
+    fsnode_t dir;
+    fsnode_t node;
+    uint32_t hash;
+    bool negative;              /* the name doesn't exist in dir */
+    bool is_dir;
+    char name[FS_MAX_FILE_LEN];
+};
+
+struct dcache_stats {
+    ulong lookups;
+    ulong hits;
+    ulong negative_hits;
+    ulong evictions;
+    ulong invalidations;
+};
+
+static mutex_t dc_lock = MUTEX_INITIAL_VALUE(dc_lock);
+static struct list_node dc_hash[DCACHE_BUCKETS];
+static bool dc_initialized;
+static struct list_node dc_lru = LIST_INITIAL_VALUE(dc_lru);
+static uint dc_count;
+static uint dc_gen;             /* bumped on every invalidation */
+static struct dcache_stats dc_stats;
+
+static slab_cache_t dc_entry_cache =
+    SLAB_CACHE_INITIAL_VALUE(dc_entry_cache, "dcache", sizeof(struct dentry), 0, NULL, NULL);
+
+static uint32_t hash_name(const void *mount, fsnode_t dir, const char *name) {
+    /* fnv-1a over the mount pointer, the dir node and the name */
+    uint32_t h = fnv1a_buf(FNV1A_INIT, &mount, sizeof(mount));
+    h = fnv1a_buf(h, &dir, sizeof(dir));
+    return fnv1a_str(h, name);
+}
+
+static void init_locked(void) {
+    if (dc_initialized)
+        return;
+    dc_initialized = true;
+
+    for (uint i = 0; i < DCACHE_BUCKETS; i++)
+        list_initialize(&dc_hash[i]);
+}
+
+static struct dentry *find_locked(const void *mount, fsnode_t dir, const char *name, uint32_t hash) {
+    struct dentry *d;
+    list_for_every_entry(&dc_hash[hash % DCACHE_BUCKETS], d, struct dentry, hash_node) {
+        if (d->hash == hash && d->mount == mount && d->dir == dir && !strcmp(d->name, name))
+            return d;
+    }
+    return NULL;
+}
+
+static void free_entry_locked(struct dentry *d) {
+    list_delete(&d->hash_node);
+    list_delete(&d->lru_node);
+    dc_count--;
+    slab_cache_free(&dc_entry_cache, d);
+}
+
+static void insert_locked(const void *mount, fsnode_t dir, const char *name, uint32_t hash,
+                          bool negative, fsnode_t node, bool is_dir) {
+    struct dentry *d;
+    if (dc_count >= DCACHE_MAX_ENTRIES) {
+        /* recycle the least recently used entry */
+        d = list_peek_tail_type(&dc_lru, struct dentry, lru_node);
+        free_entry_locked(d);
+        dc_stats.evictions++;
+    }
+
+    d = slab_cache_alloc(&dc_entry_cache);
+    if (!d)
+        return;
+
+    d->mount = mount;
+    d->dir = dir;
+    d->node = node;
+    d->hash = hash;
+    d->negative = negative;
+    d->is_dir = is_dir;
+    strlcpy(d->name, name, sizeof(d->name));
+
+    list_add_head(&dc_hash[hash % DCACHE_BUCKETS], &d->hash_node);
+    list_add_head(&dc_lru, &d->lru_node);
+    dc_count++;
+}
+
+/* drop entries of a mount, all of them or only those in one dir */
+static void drop_locked(const void *mount, bool only_dir, fsnode_t dir, bool only_negative) {
+    struct dentry *d, *temp;
+    list_for_every_entry_safe(&dc_lru, d, temp, struct dentry, lru_node) {
+        if (mount && d->mount != mount)
+            continue;
+        if (only_dir && d->dir != dir)
+            continue;
+        if (only_negative && !d->negative)
+            continue;
+        free_entry_locked(d);
+        dc_stats.invalidations++;
+    }
+}
+
+static status_t lookup_name(const void *mount, const struct fs_api *api, fscookie *cookie,
+                            fsnode_t dir, const char *name, fsnode_t *node, bool *is_dir) {
+    uint32_t hash = hash_name(mount, dir, name);
+
+    mutex_acquire(&dc_lock);
+    init_locked();
+    dc_stats.lookups++;
+    struct dentry *d = find_locked(mount, dir, name, hash);
+    if (d) {
+        dc_stats.hits++;
+        list_delete(&d->lru_node);
+        list_add_head(&dc_lru, &d->lru_node);
+
+        status_t err = NO_ERROR;
+        if (d->negative) {
+            dc_stats.negative_hits++;
+            err = ERR_NOT_FOUND;
+        } else {
+            *node = d->node;
+            *is_dir = d->is_dir;
+        }
+        mutex_release(&dc_lock);
+        return err;
+    }
+    uint gen = dc_gen;
+    mutex_release(&dc_lock);
+
+    /* ask the fs without holding the lock, it may have to go to the disk */
+    status_t err = api->lookup(cookie, dir, name, node, is_dir);
+    LTRACEF("dir %#llx name '%s': err %d node %#llx\n", (unsigned long long)dir, name, err,
+            (err < 0) ? 0ULL : (unsigned long long)*node);
+
+    /* only remember answers, not i/o errors */
+    if (err < 0 && err != ERR_NOT_FOUND)
+        return err;
+
+    mutex_acquire(&dc_lock);
+    /* unless something changed while the lock was dropped */
+    if (gen == dc_gen && !find_locked(mount, dir, name, hash)) {
+        insert_locked(mount, dir, name, hash, err == ERR_NOT_FOUND,
+                      (err < 0) ? 0 : *node, (err < 0) ? false : *is_dir);
+    }
+    mutex_release(&dc_lock);
+
+    return err;
+}
+
+status_t dcache_walk(const void *mount, const struct fs_api *api, fscookie *cookie,
+                     const char *path, fsnode_t *node, bool *is_dir) {
+    if (!api->root || !api->lookup)
+        return ERR_NOT_SUPPORTED;
+
+    fsnode_t cur;
+    bool cur_is_dir = true;
+    status_t err = api->root(cookie, &cur);
+    if (err < 0)
+        return err;
+
+    const char *p = path;
+    for (;;) {
+        while (*p == '/')
+            p++;
+        if (*p == 0)
+            break;
+
+        /* can't go through a file */
+        if (!cur_is_dir)
+            return ERR_NOT_FOUND;
+
+        size_t len = strcspn(p, "/");
+        if (len >= FS_MAX_FILE_LEN)
+            return ERR_NOT_SUPPORTED;
+
+        char name[FS_MAX_FILE_LEN];
+        memcpy(name, p, len);
+        name[len] = 0;
+
+        err = lookup_name(mount, api, cookie, cur, name, &cur, &cur_is_dir);
+        if (err < 0)
+            return err;
+
+        p += len;
+    }
+
+    *node = cur;
+    *is_dir = cur_is_dir;
+    return NO_ERROR;
+}
+
+/* find the dir holding the last name in path, and the name */
+static status_t walk_parent(const void *mount, const struct fs_api *api, fscookie *cookie,
+                            const char *path, fsnode_t *dir, const char **name) {
+    char parent[FS_MAX_PATH_LEN];
+    strlcpy(parent, path, sizeof(parent));
+
+    char *sep = strrchr(parent, '/');
+    *name = path + (sep ? sep - parent + 1 : 0);
+    if (sep)
+        *sep = 0;
+    else
+        parent[0] = 0;
+
+    bool is_dir;
+    status_t err = dcache_walk(mount, api, cookie, parent, dir, &is_dir);
+    if (err < 0)
+        return err;
+    return is_dir ? NO_ERROR : ERR_NOT_DIR;
+}
+
+void dcache_created(const void *mount, const struct fs_api *api, fscookie *cookie, const char *path) {
+    if (!api->lookup)
+        return;
+
+    /* keep lookups already in flight from caching what they saw */
+    mutex_acquire(&dc_lock);
+    init_locked();
+    dc_gen++;
+    mutex_release(&dc_lock);
+
+    fsnode_t dir = 0;
+    const char *name;
+    status_t err = walk_parent(mount, api, cookie, path, &dir, &name);
+
+    /* the new name may have been cached as missing, perhaps spelled
+     * differently on a file system that ignores case */
+    mutex_acquire(&dc_lock);
+    dc_gen++;
+    drop_locked(mount, err >= 0, dir, true);
+    mutex_release(&dc_lock);
+}
+
+void dcache_removed(const void *mount, const struct fs_api *api, fscookie *cookie, const char *path) {
+    if (!api->lookup)
+        return;
+
+    mutex_acquire(&dc_lock);
+    init_locked();
+    dc_gen++;
+    mutex_release(&dc_lock);
+
+    fsnode_t dir = 0;
+    const char *name;
+    status_t err = walk_parent(mount, api, cookie, path, &dir, &name);
+
+    mutex_acquire(&dc_lock);
+    dc_gen++;
+    struct dentry *d = (err < 0) ? NULL : find_locked(mount, dir, name, hash_name(mount, dir, name));
+    if (d && !d->negative && !d->is_dir) {
+        /* a file, only names in its dir can refer to it */
+        drop_locked(mount, true, dir, false);
+    } else {
+        /* a dir whose node the fs may hand out again, forget everything
+         * that may have been cached beneath it */
+        drop_locked(mount, false, 0, false);
+    }
+    mutex_release(&dc_lock);
+}
+
+void dcache_forget_mount(const void *mount) {
+    mutex_acquire(&dc_lock);
+    init_locked();
+    drop_locked(mount, false, 0, false);
+    mutex_release(&dc_lock);
+}
+
+void dcache_drop(void) {
+    mutex_acquire(&dc_lock);
+    init_locked();
+    drop_locked(NULL, false, 0, false);
+    mutex_release(&dc_lock);
+}
+
+static int cmd_dcache(int argc, const console_cmd_args *argv) {
+    if (argc >= 2 && !strcmp(argv[1].str, "drop")) {
+        dcache_drop();
+    } else if (argc >= 2) {
+        printf("usage:\n");
+        printf("%s\n", argv[0].str);
+        printf("%s drop\n", argv[0].str);
+        return ERR_INVALID_ARGS;
+    }
+
+    mutex_acquire(&dc_lock);
+    struct dcache_stats s = dc_stats;
+    uint count = dc_count;
+    uint negative = 0;
+    struct dentry *d;
+    list_for_every_entry(&dc_lru, d, struct dentry, lru_node) {
+        if (d->negative)
+            negative++;
+    }
+    mutex_release(&dc_lock);
+
+    printf("dcache: %u of %u entries, %u negative\n", count, DCACHE_MAX_ENTRIES, negative);
+    printf("lookups %lu hits %lu (%lu%%) negative hits %lu\n",
+           s.lookups, s.hits, s.lookups ? s.hits * 100 / s.lookups : 0, s.negative_hits);
+    printf("evictions %lu invalidations %lu\n", s.evictions, s.invalidations);
+
+    return NO_ERROR;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("dcache", "path lookup cache stats and control", &cmd_dcache)
+STATIC_COMMAND_END(dcache);
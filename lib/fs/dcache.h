@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2009-2015 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#pragma once
+
+#include <lib/fs.h>
+#include <lk/compiler.h>
+#include <sys/types.h>
+
+/*
+ * Path lookup cache shared by every mount, private to lib/fs.
+ *
+ * Entries map a name in a directory to the node the file system found for
+ * it, or remember that the name doesn't exist. Only file systems that
+ * implement the node hooks in fs_api go through here, the rest keep walking
+ * whole paths themselves.
+ */
+
+__BEGIN_CDECLS
+
+/* resolve a path inside a mount to a node, ERR_NOT_SUPPORTED if the fs
+ * can't be walked a name at a time */
+status_t dcache_walk(const void *mount, const struct fs_api *api, fscookie *cookie,
+                     const char *path, fsnode_t *node, bool *is_dir);
+
+/* a file or dir was created at or removed from path */
+void dcache_created(const void *mount, const struct fs_api *api, fscookie *cookie, const char *path);
+void dcache_removed(const void *mount, const struct fs_api *api, fscookie *cookie, const char *path);
+
+/* drop everything cached for a mount that is going away */
+void dcache_forget_mount(const void *mount);
+
+/* drop everything */
+void dcache_drop(void);
+
+__END_CDECLS
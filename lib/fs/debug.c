@@ -90,6 +90,37 @@ static int cmd_fs_ioctl(int argc, const console_cmd_args *argv) {
             return fs_close_file(handle);
             break;
         }
+        case FS_IOCTL_GET_PAGE_LIST: {
+            if (argc < 4) {
+                printf("%s %s %lu <path>\n", argv[0].str, argv[1].str,
+                       argv[2].u);
+                return ERR_INVALID_ARGS;
+            }
+
+            int err;
+            filehandle *handle;
+            err = fs_open_file(argv[3].str, &handle);
+            if (err != NO_ERROR) {
+                printf("error %d opening file\n", err);
+                return err;
+            }
+
+            struct fs_page_list list;
+            err = fs_file_ioctl(handle, request, &list);
+            if (err != NO_ERROR) {
+                fs_close_file(handle);
+                return err;
+            }
+
+            printf("%s: %llu bytes in %zu pages of %zu bytes\n", argv[3].str, list.size,
+                   list.count, list.page_size);
+            for (size_t i = 0; i < list.count; i++) {
+                printf("\t%zu: %p\n", i, list.pages[i]);
+            }
+
+            return fs_close_file(handle);
+            break;
+        }
         default: {
             printf("error, unsupported ioctl: %d\n", request);
         }
@@ -98,6 +129,49 @@ static int cmd_fs_ioctl(int argc, const console_cmd_args *argv) {
     return ERR_NOT_SUPPORTED;
 }
 
+#define FS_BENCH_CHUNK (1024 * 1024)
+
+/* time sequential reads of a whole file, one chunk at a time */
+static int cmd_fs_bench(const char *path, uint passes) {
+    filehandle *handle;
+    int err = fs_open_file(path, &handle);
+    if (err < 0) {
+        printf("error %d opening file\n", err);
+        return err;
+    }
+
+    void *buf = malloc(FS_BENCH_CHUNK);
+    if (!buf) {
+        fs_close_file(handle);
+        return ERR_NO_MEMORY;
+    }
+
+    for (uint pass = 0; pass < passes; pass++) {
+        off_t total = 0;
+        lk_bigtime_t t = current_time_hires();
+        for (;;) {
+            ssize_t ret = fs_read_file(handle, buf, total, FS_BENCH_CHUNK);
+            if (ret < 0) {
+                printf("error %d reading file at offset %lld\n", (int)ret, total);
+                err = ret;
+                goto out;
+            }
+            if (ret == 0)
+                break;
+            total += ret;
+        }
+        t = current_time_hires() - t;
+
+        printf("pass %u: read %lld bytes in %llu usecs, %llu KB/sec\n", pass, total, t,
+               t ? (uint64_t)total * 1000000 / 1024 / t : 0);
+    }
+
+out:
+    free(buf);
+    fs_close_file(handle);
+    return err;
+}
+
 static int cmd_fs(int argc, const console_cmd_args *argv) {
     int rc = 0;
 
@@ -112,6 +186,7 @@ usage:
         printf("%s stat <path>\n", argv[0].str);
         printf("%s ioctl <request> [args...]\n", argv[0].str);
         printf("%s list\n", argv[0].str);
+        printf("%s bench <path> [passes]\n", argv[0].str);
         return -1;
     }
 
@@ -218,6 +293,11 @@ usage:
     } else if (!strcmp(argv[1].str, "list")) {
         printf("Implemented file systems:\n");
         fs_dump_list();
+    } else if (!strcmp(argv[1].str, "bench")) {
+        if (argc < 3)
+            goto notenoughargs;
+
+        rc = cmd_fs_bench(argv[2].str, (argc > 3) ? argv[3].u : 1);
     } else {
         printf("unrecognized subcommand\n");
         goto usage;
@@ -29,10 +29,10 @@ static int ext2_dir_lookup(ext2_t *ext2, struct ext2_inode *dir_inode, const cha
     file_blocknum = 0;
     for (;;) {
         /* read in the offset */
-        err = ext2_read_inode(ext2, dir_inode, buf, file_blocknum * EXT2_BLOCK_SIZE(ext2->sb), EXT2_BLOCK_SIZE(ext2->sb));
+        err = ext2_read_inode(ext2, dir_inode, NULL, buf, file_blocknum * EXT2_BLOCK_SIZE(ext2->sb), EXT2_BLOCK_SIZE(ext2->sb));
         if (err <= 0) {
             free(buf);
-            return -1;
+            return (err < 0) ? err : ERR_NOT_FOUND;
         }
 
         /* walk through the directory entries, looking for the one that matches */
@@ -168,6 +168,55 @@ nextcomponent:
     return 0;
 }
 
+/* node hooks for the fs layer, nodes are inode numbers */
+status_t ext2_root_node(fscookie *cookie, fsnode_t *node) {
+    *node = EXT2_ROOT_INO;
+    return 0;
+}
+
+status_t ext2_lookup_node(fscookie *cookie, fsnode_t dir, const char *name, fsnode_t *node, bool *is_dir) {
+    ext2_t *ext2 = (ext2_t *)cookie;
+    struct ext2_inode dir_inode;
+    struct ext2_inode inode;
+    inodenum_t inum;
+    int err;
+
+    LTRACEF("dir %u, name '%s'\n", (inodenum_t)dir, name);
+
+    err = ext2_load_inode(ext2, dir, &dir_inode);
+    if (err < 0)
+        return err;
+
+    err = ext2_dir_lookup(ext2, &dir_inode, name, &inum);
+    if (err < 0)
+        return err;
+
+    err = ext2_load_inode(ext2, inum, &inode);
+    if (err < 0)
+        return err;
+
+    /* follow symlinks here, relative to the dir they are in */
+    if (S_ISLNK(inode.i_mode)) {
+        char link[512];
+
+        err = ext2_read_link(ext2, &inode, link, sizeof(link));
+        if (err < 0)
+            return err;
+
+        err = ext2_walk(ext2, link, (link[0] == '/') ? &ext2->root_inode : &dir_inode, &inum, 1);
+        if (err < 0)
+            return err;
+
+        err = ext2_load_inode(ext2, inum, &inode);
+        if (err < 0)
+            return err;
+    }
+
+    *node = inum;
+    *is_dir = S_ISDIR(inode.i_mode);
+    return 0;
+}
+
 /* do a path parse, looking up each component */
 int ext2_lookup(ext2_t *ext2, const char *_path, inodenum_t *inum) {
     LTRACEF("path '%s', inum %p\n", _path, inum);
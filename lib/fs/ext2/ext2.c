@@ -57,6 +57,10 @@ static void endian_swap_superblock(struct ext2_super_block *sb) {
     LE32SWAP(sb->s_last_orphan);
     LE32SWAP(sb->s_default_mount_opts);
     LE32SWAP(sb->s_first_meta_bg);
+
+    /* ext4 */
+    LE16SWAP(sb->s_desc_size);
+    LE32SWAP(sb->s_blocks_count_hi);
 }
 
 static void endian_swap_inode(struct ext2_inode *inode) {
@@ -83,13 +87,58 @@ static void endian_swap_inode(struct ext2_inode *inode) {
     LE16SWAP(inode->i_gid_high);
 }
 
-static void endian_swap_group_desc(struct ext2_group_desc *gd) {
-    LE32SWAP(gd->bg_block_bitmap);
-    LE32SWAP(gd->bg_inode_bitmap);
-    LE32SWAP(gd->bg_inode_table);
-    LE16SWAP(gd->bg_free_blocks_count);
-    LE16SWAP(gd->bg_free_inodes_count);
-    LE16SWAP(gd->bg_used_dirs_count);
+/* incompat features a read only driver can live with */
+#define EXT2_INCOMPAT_READ_SUPP \
+    (EXT2_FEATURE_INCOMPAT_FILETYPE | EXT3_FEATURE_INCOMPAT_RECOVER | \
+     EXT4_FEATURE_INCOMPAT_EXTENTS | EXT4_FEATURE_INCOMPAT_64BIT | \
+     EXT4_FEATURE_INCOMPAT_MMP | EXT4_FEATURE_INCOMPAT_FLEX_BG | \
+     EXT4_FEATURE_INCOMPAT_CSUM_SEED | EXT4_FEATURE_INCOMPAT_LARGEDIR)
+
+/*
+ * Read the group descriptor table, which starts in the block after the
+ * superblock. Descriptors are 32 bytes, or s_desc_size with the 64bit
+ * feature. With flex_bg the bitmaps and inode tables of a group can live in
+ * another group, but since the descriptors carry absolute block numbers
+ * nothing else needs to change.
+ */
+static int read_group_descs(ext2_t *ext2) {
+    size_t desc_size = EXT2_MIN_DESC_SIZE;
+    bool is_64bit = ext2->sb.s_feature_incompat & EXT4_FEATURE_INCOMPAT_64BIT;
+    if (is_64bit) {
+        desc_size = ext2->sb.s_desc_size;
+        if (desc_size < EXT4_MIN_DESC_SIZE_64BIT || desc_size > EXT2_BLOCK_SIZE(ext2->sb))
+            return ERR_BAD_STATE;
+    }
+
+    size_t len = desc_size * ext2->s_group_count;
+    uint8_t *buf = malloc(len);
+    ext2->groups = calloc(ext2->s_group_count, sizeof(struct ext2_group));
+    if (!buf || !ext2->groups) {
+        free(buf);
+        return ERR_NO_MEMORY;
+    }
+
+    off_t offset = (off_t)(ext2->sb.s_first_data_block + 1) * EXT2_BLOCK_SIZE(ext2->sb);
+    ssize_t err = bio_read(ext2->dev, buf, offset, len);
+    if (err < (ssize_t)len) {
+        free(buf);
+        return (err < 0) ? (int)err : ERR_IO;
+    }
+
+    for (int i = 0; i < ext2->s_group_count; i++) {
+        const struct ext4_group_desc *gd = (const void *)(buf + i * desc_size);
+
+        ext2->groups[i].inode_table = LE32(gd->bg.bg_inode_table);
+        if (is_64bit)
+            ext2->groups[i].inode_table |= (blocknum_t)LE32(gd->bg_inode_table_hi) << 32;
+
+        LTRACEF("group %d: inode table %llu, free blocks %u, free inodes %u\n", i,
+                (unsigned long long)ext2->groups[i].inode_table,
+                LE16(gd->bg.bg_free_blocks_count), LE16(gd->bg.bg_free_inodes_count));
+    }
+
+    free(buf);
+    return 0;
 }
 
 status_t ext2_mount(bdev_t *dev, fscookie **cookie) {
@@ -100,7 +149,9 @@ status_t ext2_mount(bdev_t *dev, fscookie **cookie) {
     if (!dev)
         return ERR_NOT_FOUND;
 
-    ext2_t *ext2 = malloc(sizeof(ext2_t));
+    ext2_t *ext2 = calloc(1, sizeof(ext2_t));
+    if (!ext2)
+        return ERR_NO_MEMORY;
     ext2->dev = dev;
 
     err = bio_read(dev, &ext2->sb, 1024, sizeof(struct ext2_super_block));
@@ -112,11 +163,16 @@ status_t ext2_mount(bdev_t *dev, fscookie **cookie) {
     /* see if the superblock is good */
     if (ext2->sb.s_magic != EXT2_SUPER_MAGIC) {
         err = -1;
-        return err;
+        goto err;
     }
 
+    ext2->s_blocks_count = ext2->sb.s_blocks_count;
+    if (ext2->sb.s_feature_incompat & EXT4_FEATURE_INCOMPAT_64BIT)
+        ext2->s_blocks_count |= (blocknum_t)ext2->sb.s_blocks_count_hi << 32;
+
     /* calculate group count, rounded up */
-    ext2->s_group_count = (ext2->sb.s_blocks_count + ext2->sb.s_blocks_per_group - 1) / ext2->sb.s_blocks_per_group;
+    ext2->s_group_count = (ext2->s_blocks_count - ext2->sb.s_first_data_block +
+                           ext2->sb.s_blocks_per_group - 1) / ext2->sb.s_blocks_per_group;
 
     /* print some info */
     LTRACEF("rev level %d\n", ext2->sb.s_rev_level);
@@ -125,7 +181,7 @@ status_t ext2_mount(bdev_t *dev, fscookie **cookie) {
     LTRACEF("ro compat features 0x%x\n", ext2->sb.s_feature_ro_compat);
     LTRACEF("block size %d\n", EXT2_BLOCK_SIZE(ext2->sb));
     LTRACEF("inode size %d\n", EXT2_INODE_SIZE(ext2->sb));
-    LTRACEF("block count %d\n", ext2->sb.s_blocks_count);
+    LTRACEF("block count %llu\n", (unsigned long long)ext2->s_blocks_count);
     LTRACEF("blocks per group %d\n", ext2->sb.s_blocks_per_group);
     LTRACEF("group count %d\n", ext2->s_group_count);
     LTRACEF("inodes per group %d\n", ext2->sb.s_inodes_per_group);
@@ -133,39 +189,39 @@ status_t ext2_mount(bdev_t *dev, fscookie **cookie) {
     /* we only support dynamic revs */
     if (ext2->sb.s_rev_level > EXT2_DYNAMIC_REV) {
         err = -2;
-        return err;
+        goto err;
     }
 
-    /* make sure it doesn't have any ro features we don't support */
-    if (ext2->sb.s_feature_ro_compat & ~(EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER|EXT2_FEATURE_RO_COMPAT_LARGE_FILE)) {
+    /*
+     * ro_compat features only matter to writers, so they are all fine here.
+     * Anything incompatible we don't know how to read is not.
+     */
+    if (ext2->sb.s_feature_incompat & ~EXT2_INCOMPAT_READ_SUPP) {
+        dprintf(INFO, "ext2: unsupported incompat features 0x%x\n",
+                ext2->sb.s_feature_incompat & ~EXT2_INCOMPAT_READ_SUPP);
         err = -3;
-        return err;
+        goto err;
     }
+    if (ext2->sb.s_feature_incompat & EXT3_FEATURE_INCOMPAT_RECOVER)
+        dprintf(INFO, "ext2: journal needs recovery, recent changes may be missing\n");
 
-    /* read in all the group descriptors */
-    ext2->gd = malloc(sizeof(struct ext2_group_desc) * ext2->s_group_count);
-    err = bio_read(ext2->dev, (void *)ext2->gd,
-                   (EXT2_BLOCK_SIZE(ext2->sb) == 4096) ? 4096 : 2048,
-                   sizeof(struct ext2_group_desc) * ext2->s_group_count);
-    if (err < 0) {
-        err = -4;
-        return err;
+    /* the block cache only takes 32 bit block numbers */
+    if (ext2->s_blocks_count > UINT32_MAX) {
+        err = ERR_NOT_SUPPORTED;
+        goto err;
     }
 
-    int i;
-    for (i=0; i < ext2->s_group_count; i++) {
-        endian_swap_group_desc(&ext2->gd[i]);
-        LTRACEF("group %d:\n", i);
-        LTRACEF("\tblock bitmap %d\n", ext2->gd[i].bg_block_bitmap);
-        LTRACEF("\tinode bitmap %d\n", ext2->gd[i].bg_inode_bitmap);
-        LTRACEF("\tinode table %d\n", ext2->gd[i].bg_inode_table);
-        LTRACEF("\tfree blocks %d\n", ext2->gd[i].bg_free_blocks_count);
-        LTRACEF("\tfree inodes %d\n", ext2->gd[i].bg_free_inodes_count);
-        LTRACEF("\tused dirs %d\n", ext2->gd[i].bg_used_dirs_count);
-    }
+    /* read in all the group descriptors */
+    err = read_group_descs(ext2);
+    if (err < 0)
+        goto err;
 
     /* initialize the block cache */
-    ext2->cache = bcache_create(ext2->dev, EXT2_BLOCK_SIZE(ext2->sb), 4);
+    ext2->cache = bcache_create(ext2->dev, EXT2_BLOCK_SIZE(ext2->sb), BCACHE_SIZE_AUTO);
+    if (!ext2->cache) {
+        err = ERR_NO_MEMORY;
+        goto err;
+    }
 
     /* load the first inode */
     err = ext2_load_inode(ext2, EXT2_ROOT_INO, &ext2->root_inode);
@@ -181,6 +237,9 @@ status_t ext2_mount(bdev_t *dev, fscookie **cookie) {
 err:
     LTRACEF("exiting with err code %d\n", err);
 
+    if (ext2->cache)
+        bcache_destroy(ext2->cache);
+    free(ext2->groups);
     free(ext2);
     return err;
 }
@@ -190,7 +249,7 @@ status_t ext2_unmount(fscookie *cookie) {
     ext2_t *ext2 = (ext2_t *)cookie;
 
     bcache_destroy(ext2->cache);
-    free(ext2->gd);
+    free(ext2->groups);
     free(ext2);
 
     return 0;
@@ -202,7 +261,7 @@ static void get_inode_addr(ext2_t *ext2, inodenum_t num, blocknum_t *block, size
     uint32_t group = num / ext2->sb.s_inodes_per_group;
 
     // calculate the start of the inode table for the group it's in
-    *block = ext2->gd[group].bg_inode_table;
+    *block = ext2->groups[group].inode_table;
 
     // add the offset of the inode within the group
     size_t offset = (num % EXT2_INODES_PER_GROUP(ext2->sb)) * EXT2_INODE_SIZE(ext2->sb);
@@ -219,7 +278,7 @@ int ext2_load_inode(ext2_t *ext2, inodenum_t num, struct ext2_inode *inode) {
     size_t block_offset;
     get_inode_addr(ext2, num, &bnum, &block_offset);
 
-    LTRACEF("bnum %u, offset %zd\n", bnum, block_offset);
+    LTRACEF("bnum %llu, offset %zd\n", (unsigned long long)bnum, block_offset);
 
     /* get a pointer to the cache block */
     void *cache_ptr;
@@ -248,6 +307,10 @@ static const struct fs_api ext2_api = {
     .stat = ext2_stat_file,
     .read = ext2_read_file,
     .close = ext2_close_file,
+
+    .root = ext2_root_node,
+    .lookup = ext2_lookup_node,
+    .open_node = ext2_open_node,
 };
 
 STATIC_FS_IMPL(ext2, &ext2_api);
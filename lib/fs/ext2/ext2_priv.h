@@ -12,17 +12,23 @@
 #include <lib/fs.h>
 #include "ext2_fs.h"
 
-typedef uint32_t blocknum_t;
+typedef uint64_t blocknum_t;
 typedef uint32_t inodenum_t;
 typedef uint32_t groupnum_t;
 
+/* the parts of a group descriptor we use, with full width block numbers */
+struct ext2_group {
+    blocknum_t inode_table;
+};
+
 typedef struct {
     bdev_t *dev;
     bcache_t cache;
 
     struct ext2_super_block sb;
+    blocknum_t s_blocks_count;
     int s_group_count;
-    struct ext2_group_desc *gd;
+    struct ext2_group *groups;
     struct ext2_inode root_inode;
 } ext2_t;
 
@@ -31,12 +37,31 @@ struct cache_block {
     void *ptr;
 };
 
+/* a run of file blocks that are contiguous on disk */
+struct ext2_extent {
+    uint32_t file_block;
+    uint32_t len;
+    blocknum_t phys_block;
+};
+
+#define EXT2_EXTENT_CACHE_SIZE 4
+
+/* state kept across reads of an open file to make sequential reads cheap */
+struct ext2_read_state {
+    bcache_readahead_t ra;
+
+    /* the last few extents found, replaced round robin */
+    struct ext2_extent extents[EXT2_EXTENT_CACHE_SIZE];
+    uint next_extent;
+};
+
 /* open file handle */
 typedef struct {
     ext2_t *ext2;
 
     struct cache_block ind_cache[3]; // cache of indirect blocks as they're scanned
     struct ext2_inode inode;
+    struct ext2_read_state rs;
 } ext2_file_t;
 
 /* internal routines */
@@ -49,7 +74,7 @@ int ext2_get_block(ext2_t *ext2, void **ptr, blocknum_t bnum);
 int ext2_put_block(ext2_t *ext2, blocknum_t bnum);
 
 off_t ext2_file_len(ext2_t *ext2, struct ext2_inode *inode);
-ssize_t ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, void *buf, off_t offset, size_t len);
+ssize_t ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, struct ext2_read_state *rs, void *buf, off_t offset, size_t len);
 int ext2_read_link(ext2_t *ext2, struct ext2_inode *inode, char *str, size_t len);
 
 /* fs api */
@@ -59,6 +84,9 @@ status_t ext2_open_file(fscookie *cookie, const char *path, filecookie **fcookie
 ssize_t ext2_read_file(filecookie *fcookie, void *buf, off_t offset, size_t len);
 status_t ext2_close_file(filecookie *fcookie);
 status_t ext2_stat_file(filecookie *fcookie, struct file_stat *);
+status_t ext2_root_node(fscookie *cookie, fsnode_t *node);
+status_t ext2_lookup_node(fscookie *cookie, fsnode_t dir, const char *name, fsnode_t *node, bool *is_dir);
+status_t ext2_open_node(fscookie *cookie, fsnode_t node, filecookie **fcookie);
 
 /* mode stuff */
 #define S_IFMT      0170000
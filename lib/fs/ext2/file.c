@@ -16,16 +16,9 @@
 
 #define LOCAL_TRACE 0
 
-int ext2_open_file(fscookie *cookie, const char *path, filecookie **fcookie) {
-    ext2_t *ext2 = (ext2_t *)cookie;
+static int ext2_open_inode(ext2_t *ext2, inodenum_t inum, filecookie **fcookie) {
     int err;
 
-    /* do a path lookup */
-    inodenum_t inum;
-    err = ext2_lookup(ext2, path, &inum);
-    if (err < 0)
-        return err;
-
     /* create the file object */
     ext2_file_t *file = malloc(sizeof(ext2_file_t));
     memset(file, 0, sizeof(ext2_file_t));
@@ -43,6 +36,23 @@ int ext2_open_file(fscookie *cookie, const char *path, filecookie **fcookie) {
     return 0;
 }
 
+int ext2_open_file(fscookie *cookie, const char *path, filecookie **fcookie) {
+    ext2_t *ext2 = (ext2_t *)cookie;
+    int err;
+
+    /* do a path lookup */
+    inodenum_t inum;
+    err = ext2_lookup(ext2, path, &inum);
+    if (err < 0)
+        return err;
+
+    return ext2_open_inode(ext2, inum, fcookie);
+}
+
+status_t ext2_open_node(fscookie *cookie, fsnode_t node, filecookie **fcookie) {
+    return ext2_open_inode((ext2_t *)cookie, node, fcookie);
+}
+
 ssize_t ext2_read_file(filecookie *fcookie, void *buf, off_t offset, size_t len) {
     ext2_file_t *file = (ext2_file_t *)fcookie;
     int err;
@@ -54,7 +64,7 @@ ssize_t ext2_read_file(filecookie *fcookie, void *buf, off_t offset, size_t len)
     }
 
     // read from the inode
-    err = ext2_read_inode(file->ext2, &file->inode, buf, offset, len);
+    err = ext2_read_inode(file->ext2, &file->inode, &file->rs, buf, offset, len);
 
     return err;
 }
@@ -108,7 +118,7 @@ int ext2_read_link(ext2_t *ext2, struct ext2_inode *inode, char *str, size_t len
         return ERR_NO_MEMORY;
 
     if (linklen > 60) {
-        int err = ext2_read_inode(ext2, inode, str, 0, linklen);
+        int err = ext2_read_inode(ext2, inode, NULL, str, 0, linklen);
         if (err < 0)
             return err;
         str[linklen] = 0;
@@ -9,6 +9,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <lk/debug.h>
+#include <lk/err.h>
 #include <lk/trace.h>
 #include "ext2_priv.h"
 
@@ -76,10 +77,10 @@ static int ext2_calculate_block_pointer_pos(ext2_t *ext2, blocknum_t block_to_fi
 
 // This function returns a pointer to the cache block that corresponds to the indirect block pointer.
 static int ext2_get_indirect_block_pointer_cache_block(ext2_t *ext2, struct ext2_inode *inode,
-        blocknum_t **cache_block, uint32_t level, uint32_t pos[], uint *block_loaded) {
+        uint32_t **cache_block, uint32_t level, uint32_t pos[], uint *block_loaded) {
     uint32_t current_level = 0;
     uint current_block = 0, last_block;
-    blocknum_t *block = NULL;
+    uint32_t *block = NULL;
     int err;
 
     if ((level > 3) || (level == 0)) {
@@ -141,29 +142,230 @@ static blocknum_t file_block_to_fs_block(ext2_t *ext2, struct ext2_inode *inode,
         block = LE32(inode->i_block[fileblock]);
     } else {
         /* at least one level of indirection, get a pointer to the final indirect block table and dereference it */
-        blocknum_t *ind_table;
-        blocknum_t phys_block;
+        uint32_t *ind_table;
+        uint phys_block;
         err = ext2_get_indirect_block_pointer_cache_block(ext2, inode, &ind_table, level, pos, &phys_block);
         if (err < 0)
             return 0;
 
         /* dereference the final entry in the final table */
         block = LE32(ind_table[pos[level]]);
-        LTRACEF("block %u, indirect_block %u\n", block, phys_block);
+        LTRACEF("block %llu, indirect_block %u\n", (unsigned long long)block, phys_block);
 
         /* release the ref on the cache block */
         ext2_put_block(ext2, phys_block);
     }
 
-    LTRACEF("returning %u\n", block);
+    LTRACEF("returning %llu\n", (unsigned long long)block);
 
     return block;
 }
 
-ssize_t ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, void *_buf, off_t offset, size_t len) {
+/*
+ * Look up a file block in an extent tree. On success *ext covers fileblock,
+ * either as a run of blocks on disk or as a hole with phys_block 0 that
+ * reaches up to the next mapped block.
+ */
+static int ext4_find_extent(ext2_t *ext2, struct ext2_inode *inode, uint32_t fileblock, struct ext2_extent *ext) {
+    const struct ext4_extent_header *eh = (const void *)inode->i_block;
+    size_t node_size = sizeof(inode->i_block);
+    blocknum_t node_block = 0;
+    uint32_t next_start = UINT32_MAX;
+    int err = 0;
+
+    ext->file_block = fileblock;
+    ext->len = 0;
+    ext->phys_block = 0;
+
+    for (uint level = 0; ; level++) {
+        uint entries = LE16(eh->eh_entries);
+        if (LE16(eh->eh_magic) != EXT4_EXT_MAGIC || level > EXT4_EXT_MAX_DEPTH ||
+                entries > (node_size - sizeof(*eh)) / sizeof(struct ext4_extent)) {
+            err = ERR_BAD_STATE;
+            break;
+        }
+
+        if (LE16(eh->eh_depth) == 0) {
+            /* leaf, find the last extent starting at or before fileblock */
+            const struct ext4_extent *ex = (const void *)(eh + 1);
+            uint i = 0;
+            while (i < entries && LE32(ex[i].ee_block) <= fileblock)
+                i++;
+            if (i < entries)
+                next_start = LE32(ex[i].ee_block);
+
+            if (i > 0) {
+                const struct ext4_extent *e = &ex[i - 1];
+                uint32_t start = LE32(e->ee_block);
+                uint32_t len = LE16(e->ee_len);
+                bool uninit = len > EXT4_EXT_INIT_MAX_LEN;
+                if (uninit)
+                    len -= EXT4_EXT_INIT_MAX_LEN;
+
+                if (fileblock - start < len) {
+                    ext->file_block = start;
+                    ext->len = len;
+                    ext->phys_block = uninit ? 0 :
+                        ((blocknum_t)LE16(e->ee_start_hi) << 32 | LE32(e->ee_start_lo));
+                    break;
+                }
+            }
+
+            /* not mapped, a hole up to the next extent */
+            ext->file_block = fileblock;
+            ext->len = next_start - fileblock;
+            ext->phys_block = 0;
+            break;
+        }
+
+        /* index node, descend into the last child starting at or before fileblock */
+        const struct ext4_extent_idx *idx = (const void *)(eh + 1);
+        uint i = 0;
+        while (i < entries && LE32(idx[i].ei_block) <= fileblock)
+            i++;
+        if (i < entries)
+            next_start = MIN(next_start, LE32(idx[i].ei_block));
+        if (i == 0) {
+            ext->file_block = fileblock;
+            ext->len = next_start - fileblock;
+            ext->phys_block = 0;
+            break;
+        }
+
+        blocknum_t child = (blocknum_t)LE16(idx[i - 1].ei_leaf_hi) << 32 | LE32(idx[i - 1].ei_leaf_lo);
+        void *ptr;
+        err = ext2_get_block(ext2, &ptr, child);
+        if (err < 0)
+            break;
+        if (node_block)
+            ext2_put_block(ext2, node_block);
+        node_block = child;
+        node_size = EXT2_BLOCK_SIZE(ext2->sb);
+        eh = ptr;
+    }
+
+    if (node_block)
+        ext2_put_block(ext2, node_block);
+
+    LTRACEF("fileblock %u: err %d, extent %u len %u phys %llu\n", fileblock, err,
+            ext->file_block, ext->len, (unsigned long long)ext->phys_block);
+
+    return err;
+}
+
+/*
+ * Map a file block to a physical block, 0 for a hole, and return in *run how
+ * many blocks from there on, up to max_run, are contiguous on disk (or all
+ * holes). Runs found are remembered in the read state so sequential reads of
+ * extent files don't walk the tree for every block.
+ */
+static int ext2_map_block(ext2_t *ext2, struct ext2_inode *inode, struct ext2_read_state *rs,
+                          uint32_t fileblock, uint max_run, blocknum_t *phys, uint *run) {
+    struct ext2_extent ext;
+    bool found = false;
+
+    if (rs) {
+        for (uint i = 0; i < EXT2_EXTENT_CACHE_SIZE; i++) {
+            const struct ext2_extent *e = &rs->extents[i];
+            if (e->len > 0 && fileblock - e->file_block < e->len) {
+                ext = *e;
+                found = true;
+                break;
+            }
+        }
+    }
+
+    if (!found) {
+        if (inode->i_flags & EXT4_EXTENTS_FL) {
+            int err = ext4_find_extent(ext2, inode, fileblock, &ext);
+            if (err < 0)
+                return err;
+        } else {
+            /* block pointers, see how far the blocks stay contiguous */
+            ext.file_block = fileblock;
+            ext.phys_block = file_block_to_fs_block(ext2, inode, fileblock);
+            ext.len = 1;
+            while (ext.len < max_run) {
+                blocknum_t next = file_block_to_fs_block(ext2, inode, fileblock + ext.len);
+                if (ext.phys_block == 0 ? next != 0 : next != ext.phys_block + ext.len)
+                    break;
+                ext.len++;
+            }
+        }
+
+        if (rs) {
+            rs->extents[rs->next_extent] = ext;
+            rs->next_extent = (rs->next_extent + 1) % EXT2_EXTENT_CACHE_SIZE;
+        }
+    }
+
+    uint32_t skip = fileblock - ext.file_block;
+    *phys = ext.phys_block ? ext.phys_block + skip : 0;
+    *run = MIN(ext.len - skip, max_run);
+
+    return 0;
+}
+
+/* prefetch whatever the read-ahead state wants, one run of contiguous
+ * blocks at a time */
+static void ext2_readahead(ext2_t *ext2, struct ext2_inode *inode, struct ext2_read_state *rs, uint file_block) {
+    if (!rs)
+        return;
+
+    uint start;
+    uint count = bcache_readahead(ext2->cache, &rs->ra, file_block, &start);
+    if (count == 0)
+        return;
+
+    /* don't read past the end of the file */
+    off_t file_size = ext2_file_len(ext2, inode);
+    uint file_blocks = (file_size + EXT2_BLOCK_SIZE(ext2->sb) - 1) / EXT2_BLOCK_SIZE(ext2->sb);
+    if (start >= file_blocks)
+        return;
+    count = MIN(count, file_blocks - start);
+
+    while (count > 0) {
+        blocknum_t phys_block;
+        uint run;
+        if (ext2_map_block(ext2, inode, rs, start, count, &phys_block, &run) < 0)
+            return;
+
+        if (phys_block != 0)
+            bcache_prefetch(ext2->cache, phys_block, run);
+
+        start += run;
+        count -= run;
+    }
+}
+
+/* read a single file block through the block cache. the block the caller
+ * is waiting for is read before any read-ahead is started. */
+static int ext2_read_file_block(ext2_t *ext2, struct ext2_inode *inode, struct ext2_read_state *rs,
+                                uint file_block, void *buf) {
+    blocknum_t phys_block;
+    uint run;
+
+    int err = ext2_map_block(ext2, inode, rs, file_block, 1, &phys_block, &run);
+    if (err < 0)
+        return err;
+
+    if (phys_block == 0) {
+        memset(buf, 0, EXT2_BLOCK_SIZE(ext2->sb));
+    } else {
+        err = ext2_read_block(ext2, buf, phys_block);
+        if (err < 0)
+            return err;
+    }
+
+    ext2_readahead(ext2, inode, rs, file_block);
+    return 0;
+}
+
+ssize_t ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, struct ext2_read_state *rs, void *_buf, off_t offset, size_t len) {
     int err = 0;
     size_t bytes_read = 0;
     uint8_t *buf = _buf;
+    const size_t block_size = EXT2_BLOCK_SIZE(ext2->sb);
 
     /* calculate the file size */
     off_t file_size = ext2_file_len(ext2, inode);
@@ -179,23 +381,20 @@ ssize_t ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, void *_buf, off_
         return 0;
 
     /* calculate the starting file block */
-    uint file_block = offset / EXT2_BLOCK_SIZE(ext2->sb);
+    uint file_block = offset / block_size;
 
     /* handle partial first block */
-    if ((offset % EXT2_BLOCK_SIZE(ext2->sb)) != 0) {
-        uint8_t temp[EXT2_BLOCK_SIZE(ext2->sb)];
+    if ((offset % block_size) != 0) {
+        uint8_t temp[block_size];
 
         /* calculate the block and read it */
-        blocknum_t phys_block = file_block_to_fs_block(ext2, inode, file_block);
-        if (phys_block == 0) {
-            memset(temp, 0, EXT2_BLOCK_SIZE(ext2->sb));
-        } else {
-            ext2_read_block(ext2, temp, phys_block);
-        }
+        err = ext2_read_file_block(ext2, inode, rs, file_block, temp);
+        if (err < 0)
+            goto done;
 
         /* copy out what we need */
-        size_t block_offset = offset % EXT2_BLOCK_SIZE(ext2->sb);
-        size_t tocopy = MIN(len, EXT2_BLOCK_SIZE(ext2->sb) - block_offset);
+        size_t block_offset = offset % block_size;
+        size_t tocopy = MIN(len, block_size - block_offset);
         memcpy(buf, temp + block_offset, tocopy);
 
         /* increment our stuff */
@@ -205,34 +404,49 @@ ssize_t ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, void *_buf, off_
         buf += tocopy;
     }
 
-    /* handle middle blocks */
-    while (len >= EXT2_BLOCK_SIZE(ext2->sb)) {
-        /* calculate the block and read it */
-        blocknum_t phys_block = file_block_to_fs_block(ext2, inode, file_block);
+    /*
+     * handle middle blocks. Runs that are contiguous on disk go to the
+     * device as one read straight into the caller's buffer, which skips the
+     * block cache entirely. Single blocks go through the cache so the
+     * read-ahead can batch them up.
+     */
+    while (len >= block_size) {
+        blocknum_t phys_block;
+        uint run;
+        err = ext2_map_block(ext2, inode, rs, file_block, len / block_size, &phys_block, &run);
+        if (err < 0)
+            goto done;
+
+        size_t run_bytes = run * block_size;
         if (phys_block == 0) {
-            memset(buf, 0, EXT2_BLOCK_SIZE(ext2->sb));
+            memset(buf, 0, run_bytes);
+        } else if (run == 1) {
+            err = ext2_read_file_block(ext2, inode, rs, file_block, buf);
         } else {
-            ext2_read_block(ext2, buf, phys_block);
+            ssize_t ret = bio_read(ext2->dev, buf, (off_t)phys_block * block_size, run_bytes);
+            if (ret < 0)
+                err = ret;
+            else if ((size_t)ret < run_bytes)
+                err = ERR_IO;
         }
+        if (err < 0)
+            goto done;
 
         /* increment our stuff */
-        file_block++;
-        len -= EXT2_BLOCK_SIZE(ext2->sb);
-        bytes_read += EXT2_BLOCK_SIZE(ext2->sb);
-        buf += EXT2_BLOCK_SIZE(ext2->sb);
+        file_block += run;
+        len -= run_bytes;
+        bytes_read += run_bytes;
+        buf += run_bytes;
     }
 
     /* handle partial last block */
     if (len > 0) {
-        uint8_t temp[EXT2_BLOCK_SIZE(ext2->sb)];
+        uint8_t temp[block_size];
 
         /* calculate the block and read it */
-        blocknum_t phys_block = file_block_to_fs_block(ext2, inode, file_block);
-        if (phys_block == 0) {
-            memset(temp, 0, EXT2_BLOCK_SIZE(ext2->sb));
-        } else {
-            ext2_read_block(ext2, temp, phys_block);
-        }
+        err = ext2_read_file_block(ext2, inode, rs, file_block, temp);
+        if (err < 0)
+            goto done;
 
         /* copy out what we need */
         memcpy(buf, temp, len);
@@ -241,8 +455,9 @@ ssize_t ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, void *_buf, off_
         bytes_read += len;
     }
 
+done:
     LTRACEF("err %d, bytes_read %zu\n", err, bytes_read);
 
-    return (err < 0) ? err : (ssize_t)bytes_read;
+    /* return what we got before any error */
+    return (bytes_read > 0) ? (ssize_t)bytes_read : err;
 }
-
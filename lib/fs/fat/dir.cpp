@@ -11,6 +11,7 @@
 #include <lk/cpp.h>
 #include <lk/err.h>
 #include <lk/trace.h>
+#include <ctype.h>
 #include <endian.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -39,6 +40,268 @@ struct fat_dir_cookie {
 
 namespace {
 
+// pull the interesting fields out of a short file name entry
+void fat_parse_dir_entry(fat_fs *fat, const uint8_t *ent, dir_entry *entry) {
+    entry->length = fat_read32(ent, 0x1c);
+    entry->attributes = (fat_attribute)ent[0x0B];
+    entry->start_cluster = fat_read16(ent, 0x1a);
+    if (fat->info().fat_bits == 32) {
+        // fat32 keeps the high half of the cluster number in what used to be reserved
+        entry->start_cluster |= (uint32_t)fat_read16(ent, 0x14) << 16;
+    }
+}
+
+// fill out a short file name entry
+void fat_fill_dir_entry(fat_fs *fat, uint8_t *ent, const uint8_t short_name[11], fat_attribute attributes,
+                        uint32_t start_cluster, uint32_t length) {
+    memset(ent, 0, DIR_ENTRY_LENGTH);
+    memcpy(ent, short_name, 11);
+    ent[0x0B] = (uint8_t)attributes;
+
+    // no clock to go by, stamp everything with the epoch, 1980-01-01
+    const uint16_t date = (1 << 5) | 1;
+    fat_write16(ent, 0x10, date); // creation
+    fat_write16(ent, 0x12, date); // last access
+    fat_write16(ent, 0x18, date); // last write
+
+    if (fat->info().fat_bits == 32) {
+        fat_write16(ent, 0x14, start_cluster >> 16);
+    }
+    fat_write16(ent, 0x1a, start_cluster);
+    fat_write32(ent, 0x1c, length);
+}
+
+// sector holding the byte at offset into a dir
+status_t fat_dir_sector(fat_fs *fat, uint32_t dir_cluster, uint32_t offset, bnum_t *sector) {
+    const auto &info = fat->info();
+
+    if (dir_cluster == 0) {
+        // linear fat12/16 root dir
+        if (offset >= info.root_dir_sectors * info.bytes_per_sector) {
+            return ERR_OUT_OF_RANGE;
+        }
+        *sector = info.root_start_sector + offset / info.bytes_per_sector;
+        return NO_ERROR;
+    }
+
+    uint32_t cluster = file_offset_to_cluster(fat, dir_cluster, offset);
+    if (is_eof_cluster(cluster)) {
+        return ERR_OUT_OF_RANGE;
+    }
+    *sector = fat_sector_for_cluster(fat, cluster) + (offset % info.bytes_per_cluster) / info.bytes_per_sector;
+    return NO_ERROR;
+}
+
+// call modify on the 32 byte entry at offset into a dir. modify returns
+// whether it changed anything.
+template <typename F>
+status_t fat_modify_dir_entry(fat_fs *fat, uint32_t dir_cluster, uint32_t offset, F modify) {
+    DEBUG_ASSERT(fat->lock.is_held());
+    DEBUG_ASSERT((offset % DIR_ENTRY_LENGTH) == 0);
+
+    bnum_t sector;
+    status_t err = fat_dir_sector(fat, dir_cluster, offset, &sector);
+    if (err < 0) {
+        return err;
+    }
+
+    void *ptr;
+    err = bcache_get_block(fat->bcache(), &ptr, sector);
+    if (err < 0) {
+        return err;
+    }
+
+    if (modify((uint8_t *)ptr + offset % fat->info().bytes_per_sector)) {
+        bcache_mark_block_dirty(fat->bcache(), sector);
+    }
+    bcache_put_block(fat->bcache(), sector);
+
+    return NO_ERROR;
+}
+
+// call fn with the byte offset of every 32 byte slot of a dir, including free
+// and deleted ones, until it returns true. ERR_NOT_FOUND if it never does.
+template <typename F>
+status_t fat_scan_dir(fat_fs *fat, uint32_t dir_cluster, F fn) {
+    DEBUG_ASSERT(fat->lock.is_held());
+
+    file_block_iterator dbi(fat, dir_cluster);
+    status_t err = dbi.next_sectors(0);
+
+    const uint32_t bytes_per_sector = fat->info().bytes_per_sector;
+    for (uint32_t sector = 0; err >= 0; sector++) {
+        for (uint32_t offset = 0; offset < bytes_per_sector; offset += DIR_ENTRY_LENGTH) {
+            if (fn(sector * bytes_per_sector + offset, dbi.get_bcache_ptr(offset))) {
+                return NO_ERROR;
+            }
+        }
+        err = dbi.next_sector();
+    }
+
+    return (err == ERR_OUT_OF_RANGE) ? ERR_NOT_FOUND : err;
+}
+
+bool fat_is_free_entry(const uint8_t *ent) {
+    return ent[0] == 0 || ent[0] == 0xE5;
+}
+
+// characters allowed in a short name besides upper case letters and digits
+bool fat_short_name_char(char c) {
+    return (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+           (c != 0 && strchr("!#$%&'()-@^_`{}~", c));
+}
+
+bool fat_valid_name(const char *name) {
+    const size_t len = strlen(name);
+    if (len == 0 || len >= MAX_FILE_NAME_LEN) {
+        return false;
+    }
+    if (!strcmp(name, ".") || !strcmp(name, "..")) {
+        return false;
+    }
+    // windows strips trailing dots and spaces, so names can't end in them
+    if (name[len - 1] == '.' || name[len - 1] == ' ') {
+        return false;
+    }
+    for (const char *c = name; *c; c++) {
+        if ((uint8_t)*c < 0x20 || strchr("\"*/:<>?\\|", *c)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// is name already a plain upper case 8.3 name, that needs no long name
+bool fat_exact_short_name(const char *name, uint8_t short_name[11]) {
+    memset(short_name, ' ', 11);
+
+    size_t pos = 0;
+    size_t len = 0;
+    bool ext = false;
+    for (const char *c = name; *c; c++) {
+        if (*c == '.') {
+            if (ext || len == 0) {
+                return false;
+            }
+            ext = true;
+            pos = 8;
+            len = 0;
+            continue;
+        }
+        if (!fat_short_name_char(*c) || len == (ext ? 3 : 8)) {
+            return false;
+        }
+        short_name[pos++] = *c;
+        len++;
+    }
+
+    return !ext || len > 0;
+}
+
+// come up with a unique BASIS~N short name for a long name
+status_t fat_generate_short_name(fat_fs *fat, uint32_t dir_cluster, const char *name, uint8_t short_name[11]) {
+    // basis name, upper cased with anything that isn't allowed turned into _
+    char base[8];
+    size_t base_len = 0;
+    char ext[3];
+    size_t ext_len = 0;
+
+    const char *last_dot = strrchr(name, '.');
+    if (last_dot == name) {
+        // a leading dot doesn't start an extension
+        last_dot = nullptr;
+    }
+
+    auto convert = [](char c) -> char {
+        c = toupper(c);
+        return fat_short_name_char(c) ? c : '_';
+    };
+
+    for (const char *c = name; *c && c != last_dot && base_len < sizeof(base); c++) {
+        if (*c == ' ' || *c == '.') {
+            continue;
+        }
+        base[base_len++] = convert(*c);
+    }
+    if (last_dot) {
+        for (const char *c = last_dot + 1; *c && ext_len < sizeof(ext); c++) {
+            if (*c == ' ' || *c == '.') {
+                continue;
+            }
+            ext[ext_len++] = convert(*c);
+        }
+    }
+    if (base_len == 0) {
+        base[base_len++] = '_';
+    }
+
+    for (uint32_t n = 1; n < 1000000; n++) {
+        char tail[8];
+        const size_t tail_len = snprintf(tail, sizeof(tail), "~%u", n);
+        const size_t keep = MIN(base_len, 8 - tail_len);
+
+        memset(short_name, ' ', 11);
+        memcpy(short_name, base, keep);
+        memcpy(short_name + keep, tail, tail_len);
+        memcpy(short_name + 8, ext, ext_len);
+
+        // see if anything in the dir already has this short name
+        bool taken = false;
+        status_t err = fat_scan_dir(fat, dir_cluster, [&](uint32_t, const uint8_t *ent) {
+            if (ent[0] == 0) {
+                return true;
+            }
+            if (ent[0] != 0xE5 && ent[0x0B] != (uint8_t)fat_attribute::lfn && !memcmp(ent, short_name, 11)) {
+                taken = true;
+                return true;
+            }
+            return false;
+        });
+        if (err < 0 && err != ERR_NOT_FOUND) {
+            return err;
+        }
+        if (!taken) {
+            return NO_ERROR;
+        }
+    }
+
+    return ERR_ALREADY_EXISTS;
+}
+
+uint8_t fat_short_name_checksum(const uint8_t short_name[11]) {
+    uint8_t sum = 0;
+    for (size_t i = 0; i < 11; i++) {
+        sum = ((sum & 1) << 7) + (sum >> 1) + short_name[i];
+    }
+    return sum;
+}
+
+// fill out long name entry number sequence (1 based) of count for name
+void fat_fill_lfn_entry(uint8_t *ent, const char *name, size_t name_len, uint32_t sequence, uint32_t count,
+                        uint8_t checksum) {
+    memset(ent, 0, DIR_ENTRY_LENGTH);
+    ent[0] = sequence | ((sequence == count) ? 0x40 : 0);
+    ent[0x0B] = (uint8_t)fat_attribute::lfn;
+    ent[0x0D] = checksum;
+
+    // 13 characters per entry, nul terminated if there is room and padded with 0xffff
+    const size_t table[] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+    size_t pos = (sequence - 1) * 13;
+    for (auto off : table) {
+        uint16_t c;
+        if (pos < name_len) {
+            // TODO: properly deal with utf8 -> unicode
+            c = (uint8_t)name[pos];
+        } else if (pos == name_len) {
+            c = 0;
+        } else {
+            c = 0xffff;
+        }
+        fat_write16(ent, off, c);
+        pos++;
+    }
+}
+
 // walk one entry into the dir, starting at byte offset into the directory block iterator.
 // both dbi and offset will be modified during the call.
 // filles out the entry and returns a pointer into the passed in buffer in out_filename.
@@ -184,10 +447,7 @@ status_t fat_find_next_entry(fat_fs *fat, file_block_iterator &dbi, uint32_t &of
             LTRACEF("found filename '%s'\n", *out_filename);
 
             // fill out the passed in dir entry and exit
-            uint16_t target_cluster = fat_read16(ent, 0x1a);
-            entry->length = fat_read32(ent, 0x1c);
-            entry->attributes = (fat_attribute)ent[0x0B];
-            entry->start_cluster = target_cluster;
+            fat_parse_dir_entry(fat, ent, entry);
             return NO_ERROR;
         }
 
@@ -236,15 +496,415 @@ status_t fat_find_file_in_dir(fat_fs *fat, uint32_t starting_cluster, const char
 
         // see if we've matched an entry
         if (filenamelen == namelen && !strnicmp(name, filename, filenamelen)) {
-            // we have, return with a good status
-            *found_offset = offset;
+            // we have, return the byte offset of the short entry within the dir
+            *found_offset = dbi.get_sector_inc_count() * fat->info().bytes_per_sector +
+                            offset - DIR_ENTRY_LENGTH;
             return NO_ERROR;
         }
     }
 }
 
+// the root dir has no entry of its own, make one up
+void fat_root_entry(fat_fs *fat, dir_entry *entry, dir_entry_location *loc) {
+    entry->attributes = fat_attribute::directory;
+    entry->length = 0;
+    if (fat->info().fat_bits == 32) {
+        entry->start_cluster = fat->info().root_cluster;
+    } else {
+        entry->start_cluster = 0;
+    }
+
+    // special case for the root dir
+    // 0:0 is not sufficient, since we could actually find a file in the root dir
+    // on a fat 12/16 volume (magic cluster 0) at offset 0. cluster 1 is never used
+    // so mark root dir as 1:0
+    loc->starting_dir_cluster = 1;
+    loc->dir_offset = 0;
+}
+
 } // namespace
 
+status_t fat_read_dir_entry(fat_fs *fat, const dir_entry_location &loc, dir_entry *entry) {
+    DEBUG_ASSERT(fat->lock.is_held());
+
+    if (loc.starting_dir_cluster == 1) {
+        dir_entry_location root_loc;
+        fat_root_entry(fat, entry, &root_loc);
+        return NO_ERROR;
+    }
+
+    file_block_iterator dbi(fat, loc.starting_dir_cluster);
+    status_t err = dbi.next_sectors(loc.dir_offset / fat->info().bytes_per_sector);
+    if (err < 0) {
+        return err;
+    }
+
+    // make sure the entry is still there
+    const uint8_t *ent = dbi.get_bcache_ptr(loc.dir_offset % fat->info().bytes_per_sector);
+    if (ent[0] == 0 || ent[0] == 0xE5 || ent[0x0B] == (uint8_t)fat_attribute::lfn) {
+        return ERR_NOT_FOUND;
+    }
+
+    fat_parse_dir_entry(fat, ent, entry);
+    return NO_ERROR;
+}
+
+status_t fat_update_dir_entry(fat_fs *fat, const dir_entry_location &loc, uint32_t start_cluster, uint32_t length) {
+    DEBUG_ASSERT(fat->lock.is_held());
+
+    LTRACEF("loc %u:%u start_cluster %u length %u\n", loc.starting_dir_cluster, loc.dir_offset, start_cluster, length);
+
+    // the root dir has no entry to update
+    if (loc.starting_dir_cluster == 1) {
+        return ERR_NOT_VALID;
+    }
+
+    return fat_modify_dir_entry(fat, loc.starting_dir_cluster, loc.dir_offset, [&](uint8_t *ent) {
+        if (fat->info().fat_bits == 32) {
+            fat_write16(ent, 0x14, start_cluster >> 16);
+        }
+        fat_write16(ent, 0x1a, start_cluster);
+        fat_write32(ent, 0x1c, length);
+        return true;
+    });
+}
+
+status_t fat_walk_parent(fat_fs *fat, const char *path, uint32_t *dir_cluster, const char **name) {
+    DEBUG_ASSERT(fat->lock.is_held());
+
+    const char *sep = strrchr(path, '/');
+    *name = sep ? sep + 1 : path;
+    if (**name == 0) {
+        return ERR_INVALID_ARGS;
+    }
+
+    // is the parent the root dir?
+    const char *c = path;
+    while (c < *name && *c == '/') {
+        c++;
+    }
+    if (c == *name) {
+        *dir_cluster = fat->info().root_cluster;
+        return NO_ERROR;
+    }
+
+    char parent[FS_MAX_PATH_LEN];
+    strlcpy(parent, path, MIN(sizeof(parent), (size_t)(sep - path) + 1));
+
+    dir_entry entry;
+    dir_entry_location loc;
+    status_t err = fat_walk(fat, parent, &entry, &loc);
+    if (err < 0) {
+        return err;
+    }
+    if (entry.attributes != fat_attribute::directory) {
+        return ERR_NOT_DIR;
+    }
+
+    *dir_cluster = entry.start_cluster;
+    return NO_ERROR;
+}
+
+status_t fat_add_dir_entry(fat_fs *fat, uint32_t dir_cluster, const char *name, fat_attribute attributes,
+                           uint32_t start_cluster, dir_entry_location *loc) {
+    DEBUG_ASSERT(fat->lock.is_held());
+
+    LTRACEF("dir_cluster %u name '%s' attributes %#hhx\n", dir_cluster, name, (uint8_t)attributes);
+
+    if (!fat_valid_name(name)) {
+        return ERR_INVALID_ARGS;
+    }
+
+    // names are case insensitive, so this also catches another spelling of it
+    dir_entry entry;
+    uint32_t found_offset;
+    status_t err = fat_find_file_in_dir(fat, dir_cluster, name, &entry, &found_offset);
+    if (err >= 0) {
+        return ERR_ALREADY_EXISTS;
+    } else if (err != ERR_NOT_FOUND) {
+        return err;
+    }
+
+    // pick a short name, and see how many long name entries go in front of it
+    uint8_t short_name[11];
+    const size_t name_len = strlen(name);
+    uint32_t lfn_count = 0;
+    if (!fat_exact_short_name(name, short_name)) {
+        err = fat_generate_short_name(fat, dir_cluster, name, short_name);
+        if (err < 0) {
+            return err;
+        }
+        lfn_count = (name_len + 12) / 13;
+    }
+    const uint32_t needed = lfn_count + 1;
+
+    // look for a long enough run of free slots
+    uint32_t run_start = 0;
+    uint32_t run = 0;
+    uint32_t dir_size = 0;
+    err = fat_scan_dir(fat, dir_cluster, [&](uint32_t offset, const uint8_t *ent) {
+        dir_size = offset + DIR_ENTRY_LENGTH;
+        if (!fat_is_free_entry(ent)) {
+            run = 0;
+            return false;
+        }
+        if (run++ == 0) {
+            run_start = offset;
+        }
+        return run == needed;
+    });
+    if (err == ERR_NOT_FOUND) {
+        // the dir is full, the fixed fat12/16 root can't grow
+        if (dir_cluster == 0) {
+            return ERR_NO_RESOURCES;
+        }
+
+        // add zeroed clusters to the end of the dir, building on any free run
+        // that reached its end
+        if (run == 0) {
+            run_start = dir_size;
+        }
+        const uint32_t dir_end = run_start + needed * DIR_ENTRY_LENGTH;
+        if (dir_end > 65536 * DIR_ENTRY_LENGTH) {
+            return ERR_NO_RESOURCES;
+        }
+
+        uint32_t last = dir_cluster;
+        for (;;) {
+            uint32_t next = fat_next_cluster_in_chain(fat, last);
+            if (is_eof_cluster(next)) {
+                break;
+            }
+            last = next;
+        }
+
+        while (dir_size < dir_end) {
+            uint32_t cluster, count;
+            err = fat_alloc_clusters(fat, last + 1, 1, &cluster, &count);
+            if (err < 0) {
+                return err;
+            }
+            err = fat_zero_cluster(fat, cluster);
+            if (err >= 0) {
+                err = fat_set_next_cluster(fat, last, cluster);
+            }
+            if (err < 0) {
+                fat_free_chain(fat, cluster);
+                return err;
+            }
+            last = cluster;
+            dir_size += fat->info().bytes_per_cluster;
+        }
+    } else if (err < 0) {
+        return err;
+    }
+
+    LTRACEF("using %u entries at offset %u, short name '%.11s'\n", needed, run_start, short_name);
+
+    // long name entries go in front of the short one, last piece of the name first
+    const uint8_t checksum = fat_short_name_checksum(short_name);
+    for (uint32_t i = 0; i < lfn_count; i++) {
+        err = fat_modify_dir_entry(fat, dir_cluster, run_start + i * DIR_ENTRY_LENGTH, [&](uint8_t *ent) {
+            fat_fill_lfn_entry(ent, name, name_len, lfn_count - i, lfn_count, checksum);
+            return true;
+        });
+        if (err < 0) {
+            return err;
+        }
+    }
+
+    const uint32_t offset = run_start + lfn_count * DIR_ENTRY_LENGTH;
+    err = fat_modify_dir_entry(fat, dir_cluster, offset, [&](uint8_t *ent) {
+        fat_fill_dir_entry(fat, ent, short_name, attributes, start_cluster, 0);
+        return true;
+    });
+    if (err < 0) {
+        return err;
+    }
+
+    loc->starting_dir_cluster = dir_cluster;
+    loc->dir_offset = offset;
+
+    return NO_ERROR;
+}
+
+status_t fat_mkdir(fscookie *cookie, const char *path) {
+    auto fat = (fat_fs *)cookie;
+
+    LTRACEF("cookie %p path '%s'\n", cookie, path);
+
+    AutoLock guard(fat->lock);
+
+    uint32_t parent_cluster;
+    const char *name;
+    status_t err = fat_walk_parent(fat, path, &parent_cluster, &name);
+    if (err < 0) {
+        return err;
+    }
+
+    // a new dir is a single zeroed cluster, placed near its parent
+    uint32_t cluster, count;
+    err = fat_alloc_clusters(fat, parent_cluster, 1, &cluster, &count);
+    if (err < 0) {
+        return err;
+    }
+    auto free_cleanup = lk::make_auto_call([&]() { fat_free_chain(fat, cluster); });
+
+    err = fat_zero_cluster(fat, cluster);
+    if (err < 0) {
+        return err;
+    }
+
+    // . and .. entries, .. is 0 when the parent is the root dir
+    const uint32_t dotdot_cluster = (parent_cluster == fat->info().root_cluster) ? 0 : parent_cluster;
+    err = fat_modify_dir_entry(fat, cluster, 0, [&](uint8_t *ent) {
+        fat_fill_dir_entry(fat, ent, (const uint8_t *)".          ", fat_attribute::directory, cluster, 0);
+        return true;
+    });
+    if (err < 0) {
+        return err;
+    }
+    err = fat_modify_dir_entry(fat, cluster, DIR_ENTRY_LENGTH, [&](uint8_t *ent) {
+        fat_fill_dir_entry(fat, ent, (const uint8_t *)"..         ", fat_attribute::directory, dotdot_cluster, 0);
+        return true;
+    });
+    if (err < 0) {
+        return err;
+    }
+
+    dir_entry_location loc;
+    err = fat_add_dir_entry(fat, parent_cluster, name, fat_attribute::directory, cluster, &loc);
+    if (err < 0) {
+        return err;
+    }
+
+    free_cleanup.cancel();
+    return NO_ERROR;
+}
+
+status_t fat_remove(fscookie *cookie, const char *path) {
+    auto fat = (fat_fs *)cookie;
+
+    LTRACEF("cookie %p path '%s'\n", cookie, path);
+
+    AutoLock guard(fat->lock);
+
+    dir_entry entry;
+    dir_entry_location loc;
+    status_t err = fat_walk(fat, path, &entry, &loc);
+    if (err < 0) {
+        return err;
+    }
+
+    // can't pull the entry out from under someone that has it open
+    if (fat->lookup_file(loc)) {
+        return ERR_BUSY;
+    }
+
+    if (entry.attributes == fat_attribute::directory) {
+        // only empty dirs, holding nothing but . and ..
+        bool empty = true;
+        err = fat_scan_dir(fat, entry.start_cluster, [&](uint32_t, const uint8_t *ent) {
+            if (ent[0] == 0) {
+                return true;
+            }
+            if (ent[0] == 0xE5 || ent[0] == '.' || ent[0x0B] == (uint8_t)fat_attribute::lfn ||
+                    ent[0x0B] == (uint8_t)fat_attribute::volume_id) {
+                return false;
+            }
+            empty = false;
+            return true;
+        });
+        if (err < 0 && err != ERR_NOT_FOUND) {
+            return err;
+        }
+        if (!empty) {
+            return ERR_NOT_ALLOWED;
+        }
+    }
+
+    // mark the short entry deleted, then the long name entries in front of it
+    uint8_t checksum = 0;
+    err = fat_modify_dir_entry(fat, loc.starting_dir_cluster, loc.dir_offset, [&](uint8_t *ent) {
+        checksum = fat_short_name_checksum(ent);
+        ent[0] = 0xE5;
+        return true;
+    });
+    if (err < 0) {
+        return err;
+    }
+
+    for (uint32_t offset = loc.dir_offset; offset > 0; ) {
+        offset -= DIR_ENTRY_LENGTH;
+
+        bool more = false;
+        err = fat_modify_dir_entry(fat, loc.starting_dir_cluster, offset, [&](uint8_t *ent) {
+            if (ent[0] == 0xE5 || ent[0x0B] != (uint8_t)fat_attribute::lfn || ent[0x0D] != checksum) {
+                return false;
+            }
+            // stop after the entry that starts the name
+            more = !(ent[0] & 0x40);
+            ent[0] = 0xE5;
+            return true;
+        });
+        if (err < 0 || !more) {
+            break;
+        }
+    }
+
+    // give back the clusters last, so a failure leaks them rather than
+    // leaving an entry pointing at free space
+    if (entry.start_cluster >= 2) {
+        err = fat_free_chain(fat, entry.start_cluster);
+        if (err < 0) {
+            return err;
+        }
+    }
+
+    return NO_ERROR;
+}
+
+status_t fat_root_node(fscookie *cookie, fsnode_t *node) {
+    auto fat = (fat_fs *)cookie;
+
+    dir_entry entry;
+    dir_entry_location loc;
+    fat_root_entry(fat, &entry, &loc);
+    *node = fat_loc_to_node(loc);
+
+    return NO_ERROR;
+}
+
+status_t fat_lookup_node(fscookie *cookie, fsnode_t dir, const char *name, fsnode_t *node, bool *is_dir) {
+    auto fat = (fat_fs *)cookie;
+
+    LTRACEF("dir %#llx name '%s'\n", (unsigned long long)dir, name);
+
+    AutoLock guard(fat->lock);
+
+    // find where the dir's own entry says it starts
+    dir_entry entry;
+    status_t err = fat_read_dir_entry(fat, fat_node_to_loc(dir), &entry);
+    if (err < 0) {
+        return err;
+    }
+    if (entry.attributes != fat_attribute::directory) {
+        return ERR_NOT_DIR;
+    }
+
+    const uint32_t dir_start_cluster = entry.start_cluster;
+    uint32_t found_offset;
+    err = fat_find_file_in_dir(fat, dir_start_cluster, name, &entry, &found_offset);
+    if (err < 0) {
+        return err;
+    }
+
+    *node = fat_loc_to_node({ dir_start_cluster, found_offset });
+    *is_dir = (entry.attributes == fat_attribute::directory);
+
+    return NO_ERROR;
+}
+
 status_t fat_walk(fat_fs *fat, const char *path, dir_entry *out_entry, dir_entry_location *loc) {
     LTRACEF("path %s\n", path);
 
@@ -361,20 +1021,7 @@ status_t fat_dir::opendir(fscookie *cookie, const char *name, dircookie **dcooki
 
     // special case for /
     if (name[0] == 0 || !strcmp(name, "/")) {
-        entry.attributes = fat_attribute::directory;
-        entry.length = 0;
-        if (fat->info().fat_bits == 32) {
-            entry.start_cluster = fat->info().root_cluster;
-        } else {
-            entry.start_cluster = 0;
-        }
-
-        // special case for the root dir
-        // 0:0 is not sufficient, since we could actually find a file in the root dir
-        // on a fat 12/16 volume (magic cluster 0) at offset 0. cluster 1 is never used
-        // so mark root dir as 1:0
-        loc.starting_dir_cluster = 1;
-        loc.dir_offset = 0;
+        fat_root_entry(fat, &entry, &loc);
     } else {
         status_t err = fat_walk(fat, name, &entry, &loc);
         if (err != NO_ERROR) {
@@ -382,6 +1029,30 @@ status_t fat_dir::opendir(fscookie *cookie, const char *name, dircookie **dcooki
         }
     }
 
+    return opendir_entry(fat, entry, loc, dcookie);
+}
+
+status_t fat_dir::opendir_node(fscookie *cookie, fsnode_t node, dircookie **dcookie) {
+    auto fat = (fat_fs *)cookie;
+
+    LTRACEF("cookie %p node %#llx dircookie %p\n", cookie, (unsigned long long)node, dcookie);
+
+    AutoLock guard(fat->lock);
+
+    const dir_entry_location loc = fat_node_to_loc(node);
+    dir_entry entry;
+    status_t err = fat_read_dir_entry(fat, loc, &entry);
+    if (err < 0) {
+        return err;
+    }
+
+    return opendir_entry(fat, entry, loc, dcookie);
+}
+
+status_t fat_dir::opendir_entry(fat_fs *fat, const dir_entry &entry, const dir_entry_location &loc,
+                                dircookie **dcookie) {
+    DEBUG_ASSERT(fat->lock.is_held());
+
     // if we walked and found a proper directory, it's a hit
     if (entry.attributes == fat_attribute::directory) {
         fat_dir *dir;
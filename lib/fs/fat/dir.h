@@ -25,10 +25,13 @@ public:
     virtual ~fat_dir();
 
     static status_t opendir(fscookie *cookie, const char *name, dircookie **dcookie);
+    static status_t opendir_node(fscookie *cookie, fsnode_t node, dircookie **dcookie);
     static status_t readdir(dircookie *dcookie, struct dirent *ent);
     static status_t closedir(dircookie *dcookie);
 
 private:
+    static status_t opendir_entry(fat_fs *fat, const dir_entry &entry, const dir_entry_location &loc,
+                                  dircookie **dcookie);
     status_t opendir_priv(const dir_entry &entry, const dir_entry_location &loc, fat_dir_cookie **out_cookie);
     status_t readdir_priv(fat_dir_cookie *cookie, struct dirent *ent);
     status_t closedir_priv(fat_dir_cookie *cookie, bool *last_ref);
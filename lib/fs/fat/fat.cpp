@@ -7,28 +7,139 @@
  * https://opensource.org/licenses/MIT
  */
 
+#include <lk/err.h>
 #include <lk/trace.h>
 #include <endian.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "fat_fs.h"
 #include "fat_priv.h"
 
 #define LOCAL_TRACE FAT_GLOBAL_TRACE(0)
 
-uint32_t fat_next_cluster_in_chain(fat_fs *fat, uint32_t cluster) {
-    DEBUG_ASSERT(fat->lock.is_held());
+namespace {
 
-    // offset in bytes into the FAT for this entry
-    uint32_t fat_offset;
+// offset in bytes into the FAT for this cluster's entry
+uint32_t fat_entry_offset(fat_fs *fat, uint32_t cluster) {
     if (fat->info().fat_bits == 32) {
-        fat_offset = cluster * 4;
+        return cluster * 4;
     } else if (fat->info().fat_bits == 16) {
-        fat_offset = cluster * 2;
+        return cluster * 2;
     } else {
-        fat_offset = cluster + (cluster / 2);
+        return cluster + (cluster / 2);
+    }
+}
+
+// write the len bytes of an entry into a copy of the FAT, touching each sector
+// the entry covers once. mask holds the bits of each byte that belong to the
+// entry, since 12 bit entries share a byte with their neighbor and are the
+// only ones that can straddle a sector.
+status_t fat_write_entry(fat_fs *fat, uint32_t fat_index, uint32_t fat_offset,
+                         const uint8_t *mask, const uint8_t *val, uint32_t len) {
+    const uint32_t bytes_per_sector = fat->info().bytes_per_sector;
+    const uint32_t fat_start = fat->info().reserved_sectors + fat_index * fat->info().sectors_per_fat;
+
+    for (uint32_t i = 0; i < len; ) {
+        const uint32_t sector = (fat_offset + i) / bytes_per_sector;
+        const uint32_t bnum = fat_start + sector;
+
+        void *cache_ptr;
+        int err = bcache_get_block(fat->bcache(), &cache_ptr, bnum);
+        if (err < 0) {
+            return err;
+        }
+
+        for (; i < len && (fat_offset + i) / bytes_per_sector == sector; i++) {
+            uint8_t *ptr = (uint8_t *)cache_ptr + (fat_offset + i) % bytes_per_sector;
+            *ptr = (*ptr & ~mask[i]) | (val[i] & mask[i]);
+        }
+
+        bcache_mark_block_dirty(fat->bcache(), bnum);
+        bcache_put_block(fat->bcache(), bnum);
+    }
+
+    return NO_ERROR;
+}
+
+// scan the whole FAT for free clusters
+status_t fat_load_free_map(fat_fs *fat) {
+    DEBUG_ASSERT(fat->lock.is_held());
+
+    auto &map = fat->free_map();
+    if (map.valid) {
+        return NO_ERROR;
+    }
+
+    const uint32_t end = fat->info().total_clusters + 2;
+    map.bits = (uint32_t *)calloc((end + 31) / 32, sizeof(uint32_t));
+    if (!map.bits) {
+        return ERR_NO_MEMORY;
+    }
+
+    map.free_count = 0;
+    for (uint32_t c = 2; c < end; c++) {
+        if (fat_next_cluster_in_chain(fat, c) == 0) {
+            map.bits[c / 32] |= 1U << (c % 32);
+            map.free_count++;
+        }
+    }
+    map.next = 2;
+    map.valid = true;
+
+    LTRACEF("%u of %u clusters free\n", map.free_count, fat->info().total_clusters);
+
+    return NO_ERROR;
+}
+
+bool fat_cluster_is_free(const fat_free_map &map, uint32_t cluster) {
+    return map.bits[cluster / 32] & (1U << (cluster % 32));
+}
+
+// find the first free cluster at or after start, wrapping around to 2
+uint32_t fat_find_free(fat_fs *fat, uint32_t start) {
+    const auto &map = fat->free_map();
+    const uint32_t end = fat->info().total_clusters + 2;
+
+    if (map.free_count == 0) {
+        return 0;
+    }
+
+    uint32_t c = start;
+    for (uint32_t scanned = 0; scanned < end + 32; ) {
+        if (c >= end) {
+            c = 2;
+        }
+
+        // skip over whole words of allocated clusters at a time
+        uint32_t word = map.bits[c / 32] >> (c % 32);
+        if (word == 0) {
+            uint32_t skip = 32 - (c % 32);
+            c += skip;
+            scanned += skip;
+            continue;
+        }
+
+        c += __builtin_ctz(word);
+        if (c >= 2 && c < end) {
+            return c;
+        }
+        scanned++;
+        c++;
     }
+
+    return 0;
+}
+
+} // namespace
+
+uint32_t fat_next_cluster_in_chain(fat_fs *fat, uint32_t cluster) {
+    DEBUG_ASSERT(fat->lock.is_held());
+
+    // offset in bytes into the FAT for this entry
+    uint32_t fat_offset = fat_entry_offset(fat, cluster);
     LTRACEF("cluster %#x, fat_offset %u\n", cluster, fat_offset);
 
     const uint32_t fat_sector = fat_offset / fat->info().bytes_per_sector;
@@ -138,10 +249,10 @@ uint32_t file_offset_to_cluster(fat_fs *fat, uint32_t start_cluster, off_t offse
 uint32_t fat_sector_for_cluster(fat_fs *fat, uint32_t cluster) {
     DEBUG_ASSERT(fat->lock.is_held());
 
-    // cluster 0 and 1 are undefined
+    // cluster 0 and 1 are undefined, so the data area holds clusters 2 through total_clusters + 1
     DEBUG_ASSERT(cluster >= 2);
-    DEBUG_ASSERT(cluster < fat->info().total_clusters);
-    if (cluster >= fat->info().total_clusters) {
+    DEBUG_ASSERT(cluster < fat->info().total_clusters + 2);
+    if (cluster < 2 || cluster >= fat->info().total_clusters + 2) {
         return 0;
     }
 
@@ -162,3 +273,165 @@ ssize_t fat_read_cluster(fat_fs *fat, void *buf, uint32_t cluster) {
 }
 
 
+
+status_t fat_set_next_cluster(fat_fs *fat, uint32_t cluster, uint32_t next_cluster) {
+    DEBUG_ASSERT(fat->lock.is_held());
+    DEBUG_ASSERT(cluster >= 2 && cluster < fat->info().total_clusters + 2);
+
+    LTRACEF("cluster %#x, next %#x\n", cluster, next_cluster);
+
+    const uint32_t fat_offset = fat_entry_offset(fat, cluster);
+
+    // lay the entry out as bytes once, little endian
+    uint8_t mask[4];
+    uint8_t val[4];
+    uint32_t len;
+    if (fat->info().fat_bits == 32) {
+        // the top nibble is reserved, leave it alone
+        const uint32_t v = next_cluster & 0x0fffffff;
+        len = 4;
+        for (uint32_t i = 0; i < 4; i++) {
+            mask[i] = (i == 3) ? 0x0f : 0xff;
+            val[i] = v >> (i * 8);
+        }
+    } else if (fat->info().fat_bits == 16) {
+        len = 2;
+        mask[0] = mask[1] = 0xff;
+        val[0] = next_cluster;
+        val[1] = next_cluster >> 8;
+    } else {
+        // 12 bit entries share a byte with their neighbor
+        const uint32_t v = next_cluster & 0xfff;
+        len = 2;
+        if (cluster & 1) {
+            mask[0] = 0xf0;
+            mask[1] = 0xff;
+            val[0] = v << 4;
+            val[1] = v >> 4;
+        } else {
+            mask[0] = 0xff;
+            mask[1] = 0x0f;
+            val[0] = v;
+            val[1] = v >> 8;
+        }
+    }
+
+    // keep every copy of the FAT in sync
+    for (uint32_t i = 0; i < fat->info().fat_count; i++) {
+        status_t err = fat_write_entry(fat, i, fat_offset, mask, val, len);
+        if (err < 0) {
+            return err;
+        }
+    }
+
+    return NO_ERROR;
+}
+
+status_t fat_alloc_clusters(fat_fs *fat, uint32_t hint, uint32_t count, uint32_t *first, uint32_t *allocated) {
+    DEBUG_ASSERT(fat->lock.is_held());
+    DEBUG_ASSERT(count > 0);
+
+    status_t err = fat_load_free_map(fat);
+    if (err < 0) {
+        return err;
+    }
+
+    auto &map = fat->free_map();
+    const uint32_t end = fat->info().total_clusters + 2;
+
+    // start where asked to, so a growing file stays contiguous, otherwise
+    // carry on from the last allocation
+    if (hint < 2 || hint >= end) {
+        hint = map.next;
+    }
+    uint32_t start = fat_find_free(fat, hint);
+    if (start == 0) {
+        return ERR_NO_RESOURCES;
+    }
+
+    // take as long a run as is free there
+    uint32_t len = 1;
+    while (len < count && start + len < end && fat_cluster_is_free(map, start + len)) {
+        len++;
+    }
+
+    LTRACEF("hint %u count %u: allocating %u at %u\n", hint, count, len, start);
+
+    // chain the run together and terminate it
+    for (uint32_t i = 0; i < len; i++) {
+        const uint32_t c = start + i;
+        err = fat_set_next_cluster(fat, c, (i == len - 1) ? EOF_CLUSTER : c + 1);
+        if (err < 0) {
+            // the entries written so far point into the run, leave them
+            // marked as used rather than risk handing them out twice
+            return err;
+        }
+        map.bits[c / 32] &= ~(1U << (c % 32));
+        map.free_count--;
+    }
+    map.next = start + len;
+
+    *first = start;
+    *allocated = len;
+
+    return NO_ERROR;
+}
+
+status_t fat_free_chain(fat_fs *fat, uint32_t cluster) {
+    DEBUG_ASSERT(fat->lock.is_held());
+
+    status_t err = fat_load_free_map(fat);
+    if (err < 0) {
+        return err;
+    }
+
+    auto &map = fat->free_map();
+    const uint32_t end = fat->info().total_clusters + 2;
+
+    // bound the walk in case the chain loops back on itself
+    for (uint32_t i = 0; i < fat->info().total_clusters; i++) {
+        if (cluster < 2 || cluster >= end || is_eof_cluster(cluster)) {
+            break;
+        }
+
+        const uint32_t next = fat_next_cluster_in_chain(fat, cluster);
+        err = fat_set_next_cluster(fat, cluster, 0);
+        if (err < 0) {
+            return err;
+        }
+        if (!fat_cluster_is_free(map, cluster)) {
+            map.bits[cluster / 32] |= 1U << (cluster % 32);
+            map.free_count++;
+        }
+
+        cluster = next;
+    }
+
+    return NO_ERROR;
+}
+
+status_t fat_free_space(fat_fs *fat, uint32_t *free_clusters) {
+    DEBUG_ASSERT(fat->lock.is_held());
+
+    status_t err = fat_load_free_map(fat);
+    if (err < 0) {
+        return err;
+    }
+
+    *free_clusters = fat->free_map().free_count;
+    return NO_ERROR;
+}
+
+status_t fat_zero_cluster(fat_fs *fat, uint32_t cluster) {
+    DEBUG_ASSERT(fat->lock.is_held());
+
+    const uint32_t sector = fat_sector_for_cluster(fat, cluster);
+    for (uint32_t i = 0; i < fat->info().sectors_per_cluster; i++) {
+        int err = bcache_zero_block(fat->bcache(), sector + i);
+        if (err < 0) {
+            return ERR_NO_MEMORY;
+        }
+    }
+
+    return NO_ERROR;
+}
@@ -30,6 +30,16 @@ struct fat_info {
     uint32_t root_entries = 0;
     uint32_t root_start_sector = 0;
     uint32_t root_dir_sectors = 0;
+    uint32_t fsinfo_sector = 0;
+};
+
+// in memory copy of which clusters are free, built by scanning the FAT the
+// first time something allocates or asks how much space is left
+struct fat_free_map {
+    uint32_t *bits = nullptr;   // one bit per cluster, set if free
+    uint32_t free_count = 0;
+    uint32_t next = 2;          // where to start looking for a free cluster
+    bool valid = false;
 };
 
 class fat_file;
@@ -41,11 +51,15 @@ public:
     // mount hook, creates a new fs instance and passes it back in fscookie
     static status_t mount(bdev_t *dev, fscookie **cookie);
     static status_t unmount(fscookie *cookie);
+    static status_t fs_stat(fscookie *cookie, struct fs_stat *stat);
 
     bdev_t *dev() { return dev_; }
     bcache_t bcache() { return bcache_; }
     const fat_info &info() const { return info_; }
 
+    // must be called with lock held
+    fat_free_map &free_map() { return free_map_; }
+
     // file list apis
     // must be called with lock held
     void add_to_file_list(fat_file *file);
@@ -58,6 +72,8 @@ private:
     fat_fs();
     ~fat_fs();
 
+    void update_fsinfo();
+
     bdev_t *dev_ = nullptr;
     bcache_t bcache_ = nullptr;
 
@@ -66,6 +82,8 @@ private:
 
     // data computed from BPB
     fat_info info_ {};
+
+    fat_free_map free_map_ {};
 };
 
 enum class fat_attribute : uint8_t {
@@ -94,6 +112,22 @@ inline uint16_t fat_read16(const void *_buffer, size_t offset) {
           (buffer[offset + 1] << 8);
 }
 
+inline void fat_write32(void *_buffer, size_t offset, uint32_t val) {
+    auto *buffer = (uint8_t *)_buffer;
+
+    buffer[offset] = val;
+    buffer[offset + 1] = val >> 8;
+    buffer[offset + 2] = val >> 16;
+    buffer[offset + 3] = val >> 24;
+}
+
+inline void fat_write16(void *_buffer, size_t offset, uint16_t val) {
+    auto *buffer = (uint8_t *)_buffer;
+
+    buffer[offset] = val;
+    buffer[offset + 1] = val >> 8;
+}
+
 // In fat32, clusters between 0x0fff.fff8 and 0x0fff.ffff are interpreted as
 // end of file.
 const uint32_t EOF_CLUSTER_BASE = 0x0ffffff8;
@@ -25,9 +25,20 @@ typedef void *fsfilecookie;
 uint32_t fat_next_cluster_in_chain(fat_fs *fat, uint32_t cluster);
 uint32_t file_offset_to_cluster(fat_fs *fat, uint32_t start_cluster, off_t offset);
 
+/* file allocation table updates */
+status_t fat_set_next_cluster(fat_fs *fat, uint32_t cluster, uint32_t next_cluster);
+
+// allocate up to count clusters as one contiguous run, starting at hint if it
+// is free or at the next free cluster after it. the run comes back chained
+// together and terminated, *allocated may be less than count.
+status_t fat_alloc_clusters(fat_fs *fat, uint32_t hint, uint32_t count, uint32_t *first, uint32_t *allocated);
+status_t fat_free_chain(fat_fs *fat, uint32_t cluster);
+status_t fat_free_space(fat_fs *fat, uint32_t *free_clusters);
+
 /* general io routines */
 uint32_t fat_sector_for_cluster(fat_fs *fat, uint32_t cluster);
 ssize_t fat_read_cluster(fat_fs *fat, void *buf, uint32_t cluster);
+status_t fat_zero_cluster(fat_fs *fat, uint32_t cluster);
 
 // general directory apis outside of an object
 struct dir_entry {
@@ -37,7 +48,8 @@ struct dir_entry {
     // TODO time
 };
 
-// used as a key for a file/dir in the open file table
+// used as a key for a file/dir in the open file table. dir_offset is the byte
+// offset of the short name entry within the dir.
 struct dir_entry_location {
     uint32_t starting_dir_cluster;
     uint32_t dir_offset;
@@ -48,3 +60,34 @@ inline bool operator==(const dir_entry_location &a, const dir_entry_location &b)
 }
 
 status_t fat_walk(fat_fs *fat, const char *path, dir_entry *out_entry, dir_entry_location *loc);
+
+// re-read the entry at a location, ERR_NOT_FOUND if it is gone
+status_t fat_read_dir_entry(fat_fs *fat, const dir_entry_location &loc, dir_entry *entry);
+
+// nodes handed to the fs layer are dir entry locations packed into 64 bits
+inline fsnode_t fat_loc_to_node(const dir_entry_location &loc) {
+    return ((fsnode_t)loc.starting_dir_cluster << 32) | loc.dir_offset;
+}
+
+inline dir_entry_location fat_node_to_loc(fsnode_t node) {
+    return { (uint32_t)(node >> 32), (uint32_t)node };
+}
+
+// write the start cluster and length back into the entry at a location
+status_t fat_update_dir_entry(fat_fs *fat, const dir_entry_location &loc, uint32_t start_cluster, uint32_t length);
+
+// find the dir that holds the last element of path, name points at that element
+status_t fat_walk_parent(fat_fs *fat, const char *path, uint32_t *dir_cluster, const char **name);
+
+// add an entry for name to the dir starting at dir_cluster, with a long name
+// in front of it if name doesn't fit in 8.3
+status_t fat_add_dir_entry(fat_fs *fat, uint32_t dir_cluster, const char *name, fat_attribute attributes,
+                           uint32_t start_cluster, dir_entry_location *loc);
+
+// fs layer hooks that change the namespace
+status_t fat_mkdir(fscookie *cookie, const char *path);
+status_t fat_remove(fscookie *cookie, const char *path);
+
+// fs layer node hooks
+status_t fat_root_node(fscookie *cookie, fsnode_t *node);
+status_t fat_lookup_node(fscookie *cookie, fsnode_t dir, const char *name, fsnode_t *node, bool *is_dir);
@@ -25,7 +25,9 @@
 #define LOCAL_TRACE FAT_GLOBAL_TRACE(0)
 
 fat_file::fat_file(fat_fs *f) : fs_(f) {}
-fat_file::~fat_file() = default;
+fat_file::~fat_file() {
+    free(runs_);
+}
 
 void fat_file::inc_ref() {
     ref_++;
@@ -54,6 +56,11 @@ status_t fat_file::open_file_priv(const dir_entry &entry, const dir_entry_locati
 
     LTRACEF("found file at location %u:%u\n", loc.starting_dir_cluster, loc.dir_offset);
 
+    // a different chain than what the run cache was built from
+    if (entry.start_cluster != start_cluster_) {
+        runs_valid_ = false;
+    }
+
     // move this out to the wrapper function so we can properly deal with dirs
     //
     // did we get a file?
@@ -93,6 +100,30 @@ status_t fat_file::open_file(fscookie *cookie, const char *path, filecookie **fc
         return err;
     }
 
+    return open_entry(fs, entry, loc, fcookie);
+}
+
+status_t fat_file::open_node(fscookie *cookie, fsnode_t node, filecookie **fcookie) {
+    fat_fs *fs = (fat_fs *)cookie;
+
+    LTRACEF("fscookie %p node %#llx fcookie %p\n", cookie, (unsigned long long)node, fcookie);
+
+    AutoLock guard(fs->lock);
+
+    const dir_entry_location loc = fat_node_to_loc(node);
+    dir_entry entry;
+    status_t err = fat_read_dir_entry(fs, loc, &entry);
+    if (err != NO_ERROR) {
+        return err;
+    }
+
+    return open_entry(fs, entry, loc, fcookie);
+}
+
+status_t fat_file::open_entry(fat_fs *fs, const dir_entry &entry, const dir_entry_location &loc,
+                              filecookie **fcookie) {
+    DEBUG_ASSERT(fs->lock.is_held());
+
     // we found it, see if there's an existing file object
     fat_file *file = fs->lookup_file(loc);
     if (!file) {
@@ -102,7 +133,7 @@ status_t fat_file::open_file(fscookie *cookie, const char *path, filecookie **fc
     DEBUG_ASSERT(file);
 
     // perform file object private open
-    err = file->open_file_priv(entry, loc);
+    status_t err = file->open_file_priv(entry, loc);
     if (err < 0) {
         delete file;
         return err;
@@ -151,15 +182,23 @@ ssize_t fat_file::read_file_priv(void *_buf, const off_t offset, size_t len) {
     LTRACEF("starting off logical cluster %u, sector within %u, offset within %u\n",
             logical_cluster, sector_within_cluster, offset_within_sector);
 
-    file_block_iterator fbi(fs_, start_cluster_);
+    // start the iterator at the cluster holding the offset rather than walking the chain to it
+    uint32_t cluster;
+    status_t err = map_cluster(logical_cluster, &cluster);
+    if (err < 0) {
+        return err;
+    }
+    file_block_iterator fbi(fs_, cluster);
 
     // move it forward to our index point
     // also loads the buffer
-    status_t err = fbi.next_sectors(logical_cluster * fs_->info().sectors_per_cluster + sector_within_cluster);
+    uint32_t file_sector = logical_cluster * fs_->info().sectors_per_cluster + sector_within_cluster;
+    err = fbi.next_sectors(sector_within_cluster);
     if (err < 0) {
         LTRACEF("error moving up to starting point!\n");
         return err;
     }
+    readahead(fbi, file_sector);
 
     ssize_t amount_read = 0;
     size_t buf_offset = 0; // offset into the output buffer
@@ -198,18 +237,440 @@ ssize_t fat_file::read_file_priv(void *_buf, const off_t offset, size_t len) {
             if (err < 0) {
                 return err;
             }
+            readahead(fbi, ++file_sector);
         }
     }
 
     return amount_read;
 }
 
+void fat_file::readahead(file_block_iterator &fbi, uint32_t file_sector) {
+    DEBUG_ASSERT(fs_->lock.is_held());
+
+    uint32_t start;
+    uint32_t count = bcache_readahead(fs_->bcache(), &ra_, file_sector, &start);
+    if (count == 0) {
+        return;
+    }
+
+    // trim to the end of the file
+    const uint32_t bytes_per_sector = fs_->info().bytes_per_sector;
+    uint32_t file_sectors = (length_ + bytes_per_sector - 1) / bytes_per_sector;
+    if (start >= file_sectors) {
+        return;
+    }
+    count = MIN(count, file_sectors - start);
+
+    fbi.prefetch(start - file_sector, count);
+}
+
 ssize_t fat_file::read_file(filecookie *fcookie, void *_buf, const off_t offset, size_t len) {
     fat_file *file = (fat_file *)fcookie;
 
     return file->read_file_priv(_buf, offset, len);
 }
 
+status_t fat_file::load_runs() {
+    DEBUG_ASSERT(fs_->lock.is_held());
+
+    if (runs_valid_) {
+        return NO_ERROR;
+    }
+
+    run_count_ = 0;
+    const uint32_t end = fs_->info().total_clusters + 2;
+    uint32_t cluster = start_cluster_;
+    for (uint32_t i = 0; cluster >= 2 && cluster < end; i++) {
+        // a chain longer than the volume loops back on itself
+        if (i == fs_->info().total_clusters) {
+            return ERR_BAD_STATE;
+        }
+
+        status_t err = append_run(cluster, 1);
+        if (err < 0) {
+            return err;
+        }
+        cluster = fat_next_cluster_in_chain(fs_, cluster);
+    }
+
+    LTRACEF("file %p: %u clusters in %u runs\n", this, mapped_clusters(), run_count_);
+
+    runs_valid_ = true;
+    return NO_ERROR;
+}
+
+status_t fat_file::append_run(uint32_t cluster, uint32_t len) {
+    // extend the last run if this picks up where it leaves off
+    if (run_count_ > 0) {
+        auto &last = runs_[run_count_ - 1];
+        if (last.cluster + last.len == cluster) {
+            last.len += len;
+            return NO_ERROR;
+        }
+    }
+
+    if (run_count_ == run_capacity_) {
+        uint32_t capacity = run_capacity_ ? run_capacity_ * 2 : 4;
+        auto *runs = (cluster_run *)realloc(runs_, capacity * sizeof(cluster_run));
+        if (!runs) {
+            return ERR_NO_MEMORY;
+        }
+        runs_ = runs;
+        run_capacity_ = capacity;
+    }
+
+    runs_[run_count_] = { mapped_clusters(), cluster, len };
+    run_count_++;
+
+    return NO_ERROR;
+}
+
+uint32_t fat_file::mapped_clusters() const {
+    if (run_count_ == 0) {
+        return 0;
+    }
+    const auto &last = runs_[run_count_ - 1];
+    return last.file_cluster + last.len;
+}
+
+status_t fat_file::map_cluster(uint32_t file_cluster, uint32_t *cluster) {
+    status_t err = load_runs();
+    if (err < 0) {
+        return err;
+    }
+
+    if (file_cluster >= mapped_clusters()) {
+        return ERR_OUT_OF_RANGE;
+    }
+
+    // find the last run that starts at or before file_cluster
+    uint32_t lo = 0;
+    uint32_t hi = run_count_;
+    while (hi - lo > 1) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (runs_[mid].file_cluster <= file_cluster) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    const auto &run = runs_[lo];
+    DEBUG_ASSERT(file_cluster >= run.file_cluster && file_cluster < run.file_cluster + run.len);
+    *cluster = run.cluster + (file_cluster - run.file_cluster);
+
+    return NO_ERROR;
+}
+
+status_t fat_file::grow_chain(uint32_t length) {
+    DEBUG_ASSERT(fs_->lock.is_held());
+
+    const uint32_t bytes_per_cluster = fs_->info().bytes_per_cluster;
+    const uint32_t needed = ((uint64_t)length + bytes_per_cluster - 1) / bytes_per_cluster;
+
+    status_t err = load_runs();
+    if (err < 0) {
+        return err;
+    }
+
+    const uint32_t old_clusters = mapped_clusters();
+    while (mapped_clusters() < needed) {
+        // ask for the rest in one go right after the current end, so a file
+        // written sequentially ends up contiguous
+        uint32_t last = 0;
+        if (run_count_ > 0) {
+            last = runs_[run_count_ - 1].cluster + runs_[run_count_ - 1].len - 1;
+        }
+
+        uint32_t first, count;
+        err = fat_alloc_clusters(fs_, last ? last + 1 : 0, needed - mapped_clusters(), &first, &count);
+        if (err < 0) {
+            break;
+        }
+
+        if (last) {
+            err = fat_set_next_cluster(fs_, last, first);
+            if (err < 0) {
+                fat_free_chain(fs_, first);
+                break;
+            }
+        } else {
+            start_cluster_ = first;
+        }
+
+        err = append_run(first, count);
+        if (err < 0) {
+            // the chain itself is fine, rebuild the cache from it to trim it
+            runs_valid_ = false;
+            break;
+        }
+    }
+
+    if (err < 0) {
+        // give back whatever earlier passes added, the caller won't use it
+        trim_chain(old_clusters);
+        return err;
+    }
+
+    return NO_ERROR;
+}
+
+status_t fat_file::shrink_chain(uint32_t length) {
+    DEBUG_ASSERT(fs_->lock.is_held());
+
+    const uint32_t bytes_per_cluster = fs_->info().bytes_per_cluster;
+    return trim_chain(((uint64_t)length + bytes_per_cluster - 1) / bytes_per_cluster);
+}
+
+status_t fat_file::trim_chain(uint32_t keep) {
+    DEBUG_ASSERT(fs_->lock.is_held());
+
+    status_t err = load_runs();
+    if (err < 0) {
+        return err;
+    }
+
+    if (keep >= mapped_clusters()) {
+        return NO_ERROR;
+    }
+
+    if (keep == 0) {
+        err = fat_free_chain(fs_, start_cluster_);
+        start_cluster_ = 0;
+    } else {
+        // terminate the chain after the last cluster we keep and free the rest
+        uint32_t last;
+        err = map_cluster(keep - 1, &last);
+        if (err < 0) {
+            return err;
+        }
+        const uint32_t next = fat_next_cluster_in_chain(fs_, last);
+        err = fat_set_next_cluster(fs_, last, EOF_CLUSTER);
+        if (err >= 0) {
+            err = fat_free_chain(fs_, next);
+        }
+    }
+
+    // drop the runs past the new end
+    while (run_count_ > 0 && runs_[run_count_ - 1].file_cluster >= keep) {
+        run_count_--;
+    }
+    if (run_count_ > 0) {
+        auto &last = runs_[run_count_ - 1];
+        last.len = MIN(last.len, keep - last.file_cluster);
+    }
+
+    return err;
+}
+
+status_t fat_file::update_dir_entry() {
+    return fat_update_dir_entry(fs_, dir_loc_, start_cluster_, length_);
+}
+
+ssize_t fat_file::write_locked(const void *_buf, uint32_t offset, size_t len) {
+    DEBUG_ASSERT(fs_->lock.is_held());
+    DEBUG_ASSERT((uint64_t)offset + len <= UINT32_MAX);
+
+    const uint8_t *buf = (const uint8_t *)_buf;
+    const uint32_t bytes_per_sector = fs_->info().bytes_per_sector;
+    const uint32_t bytes_per_cluster = fs_->info().bytes_per_cluster;
+    const uint32_t end = offset + len;
+    const uint32_t old_length = length_;
+    const uint32_t old_start_cluster = start_cluster_;
+
+    status_t err = grow_chain(end);
+
+    // anything between the old end of the file and the write reads back as
+    // zeros, so fill from there
+    uint32_t pos = MIN(offset, old_length);
+    while (err >= 0 && pos < end) {
+        uint32_t cluster;
+        err = map_cluster(pos / bytes_per_cluster, &cluster);
+        if (err < 0) {
+            break;
+        }
+
+        const bnum_t sector = fat_sector_for_cluster(fs_, cluster) + (pos % bytes_per_cluster) / bytes_per_sector;
+        const uint32_t sector_start = pos - (pos % bytes_per_sector);
+        const uint32_t sector_end = sector_start + bytes_per_sector;
+        const uint32_t chunk_end = MIN(sector_end, end);
+
+        // sectors past the old end of the file, or that get written in
+        // full, don't need to be read in first
+        if (sector_start >= old_length || (pos == sector_start && chunk_end == sector_end)) {
+            err = bcache_zero_block(fs_->bcache(), sector);
+            if (err < 0) {
+                err = ERR_NO_MEMORY;
+                break;
+            }
+        }
+
+        void *ptr;
+        err = bcache_get_block(fs_->bcache(), &ptr, sector);
+        if (err < 0) {
+            break;
+        }
+
+        // whatever was past the old end of the file in this sector is stale
+        if (old_length > sector_start && old_length < sector_end) {
+            memset((uint8_t *)ptr + (old_length - sector_start), 0, sector_end - old_length);
+        }
+
+        const uint32_t data_start = MAX(pos, offset);
+        if (data_start < chunk_end) {
+            uint8_t *dest = (uint8_t *)ptr + (data_start - sector_start);
+            if (buf) {
+                memcpy(dest, buf + (data_start - offset), chunk_end - data_start);
+            } else {
+                memset(dest, 0, chunk_end - data_start);
+            }
+        }
+
+        bcache_mark_block_dirty(fs_->bcache(), sector);
+        bcache_put_block(fs_->bcache(), sector);
+
+        pos = chunk_end;
+    }
+
+    if (err >= 0 && end > length_) {
+        length_ = end;
+    }
+
+    // the entry has to follow a new chain even if the write failed, or the clusters leak
+    if (length_ != old_length || start_cluster_ != old_start_cluster) {
+        status_t err2 = update_dir_entry();
+        if (err >= 0) {
+            err = err2;
+        }
+    }
+
+    if (err < 0) {
+        return err;
+    }
+
+    return len;
+}
+
+ssize_t fat_file::write_file_priv(const void *_buf, const off_t offset, size_t len) {
+    LTRACEF("file %p buf %p offset %lld len %zu\n", this, _buf, offset, len);
+
+    if (is_dir()) {
+        return ERR_NOT_FILE;
+    }
+
+    // negative offsets are invalid
+    if (offset < 0) {
+        return ERR_INVALID_ARGS;
+    }
+
+    if (len == 0) {
+        return 0;
+    }
+
+    // file lengths are 32 bits on disk
+    if ((uint64_t)offset + len > UINT32_MAX) {
+        return ERR_TOO_BIG;
+    }
+
+    AutoLock guard(fs_->lock);
+
+    return write_locked(_buf, offset, len);
+}
+
+ssize_t fat_file::write_file(filecookie *fcookie, const void *_buf, const off_t offset, size_t len) {
+    fat_file *file = (fat_file *)fcookie;
+
+    return file->write_file_priv(_buf, offset, len);
+}
+
+status_t fat_file::truncate_file_priv(uint64_t len) {
+    LTRACEF("file %p len %llu\n", this, (unsigned long long)len);
+
+    if (is_dir()) {
+        return ERR_NOT_FILE;
+    }
+
+    if (len > UINT32_MAX) {
+        return ERR_TOO_BIG;
+    }
+
+    AutoLock guard(fs_->lock);
+
+    if (len > length_) {
+        // zero fill out to the new length
+        ssize_t err = write_locked(nullptr, length_, len - length_);
+        return (err < 0) ? err : NO_ERROR;
+    } else if (len == length_) {
+        return NO_ERROR;
+    }
+
+    status_t err = shrink_chain(len);
+    length_ = len;
+
+    status_t err2 = update_dir_entry();
+    return (err < 0) ? err : err2;
+}
+
+status_t fat_file::truncate_file(filecookie *fcookie, uint64_t len) {
+    fat_file *file = (fat_file *)fcookie;
+
+    return file->truncate_file_priv(len);
+}
+
+status_t fat_file::create_file(fscookie *cookie, const char *path, filecookie **fcookie, uint64_t len) {
+    fat_fs *fs = (fat_fs *)cookie;
+
+    LTRACEF("fscookie %p path '%s' fcookie %p len %llu\n", cookie, path, fcookie, (unsigned long long)len);
+
+    if (len > UINT32_MAX) {
+        return ERR_TOO_BIG;
+    }
+
+    AutoLock guard(fs->lock);
+
+    uint32_t dir_cluster;
+    const char *name;
+    status_t err = fat_walk_parent(fs, path, &dir_cluster, &name);
+    if (err < 0) {
+        return err;
+    }
+
+    // new files start out empty with no clusters
+    dir_entry_location loc;
+    err = fat_add_dir_entry(fs, dir_cluster, name, fat_attribute::archive, 0, &loc);
+    if (err < 0) {
+        return err;
+    }
+
+    dir_entry entry;
+    err = fat_read_dir_entry(fs, loc, &entry);
+    if (err < 0) {
+        return err;
+    }
+
+    err = open_entry(fs, entry, loc, fcookie);
+    if (err < 0) {
+        return err;
+    }
+
+    if (len > 0) {
+        auto *file = (fat_file *)*fcookie;
+        ssize_t written = file->write_locked(nullptr, 0, len);
+        if (written < 0) {
+            // leave the file behind, empty
+            file->shrink_chain(0);
+            file->length_ = 0;
+            file->update_dir_entry();
+            if (file->dec_ref()) {
+                delete file;
+            }
+            return written;
+        }
+    }
+
+    return NO_ERROR;
+}
+
 status_t fat_file::stat_file_priv(struct file_stat *stat) {
     AutoLock guard(fs_->lock);
 
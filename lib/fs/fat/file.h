@@ -12,6 +12,7 @@
 #include "fat_priv.h"
 
 class fat_fs;
+class file_block_iterator;
 
 class fat_file {
 public:
@@ -23,7 +24,11 @@ public:
 
     // top level fs hooks
     static status_t open_file(fscookie *cookie, const char *path, filecookie **fcookie);
+    static status_t open_node(fscookie *cookie, fsnode_t node, filecookie **fcookie);
+    static status_t create_file(fscookie *cookie, const char *path, filecookie **fcookie, uint64_t len);
     static ssize_t read_file(filecookie *fcookie, void *_buf, const off_t offset, size_t len);
+    static ssize_t write_file(filecookie *fcookie, const void *_buf, const off_t offset, size_t len);
+    static status_t truncate_file(filecookie *fcookie, uint64_t len);
     static status_t stat_file(filecookie *fcookie, struct file_stat *stat);
     static status_t close_file(filecookie *fcookie);
 
@@ -32,12 +37,40 @@ public:
     list_node node_ = LIST_INITIAL_CLEARED_VALUE;
 
 private:
+    static status_t open_entry(fat_fs *fs, const dir_entry &entry, const dir_entry_location &loc,
+                               filecookie **fcookie);
+
     // private versions of the above
     status_t open_file_priv(const dir_entry &entry, const dir_entry_location &loc);
     ssize_t read_file_priv(void *_buf, const off_t offset, size_t len);
+    ssize_t write_file_priv(const void *_buf, const off_t offset, size_t len);
+    status_t truncate_file_priv(uint64_t len);
     status_t stat_file_priv(struct file_stat *stat);
     status_t close_file_priv(bool *last_ref);
 
+    // kick off read-ahead for the file sector the iterator is on
+    void readahead(file_block_iterator &fbi, uint32_t file_sector);
+
+    // cluster run cache maintenance
+    status_t load_runs();
+    status_t append_run(uint32_t cluster, uint32_t len);
+    uint32_t mapped_clusters() const;
+    status_t map_cluster(uint32_t file_cluster, uint32_t *cluster);
+
+    // make the cluster chain big enough for, or no bigger than, length bytes.
+    // a grow that fails leaves the chain as it was.
+    status_t grow_chain(uint32_t length);
+    status_t shrink_chain(uint32_t length);
+
+    // cut the cluster chain down to its first keep clusters
+    status_t trim_chain(uint32_t keep);
+
+    // write len bytes at offset, zeros if buf is null. must be called with the lock held.
+    ssize_t write_locked(const void *buf, uint32_t offset, size_t len);
+
+    // push our start cluster and length out to our dir entry
+    status_t update_dir_entry();
+
 protected:
     // increment the ref and add/remove the file from the fs list
     void inc_ref();
@@ -57,5 +90,21 @@ protected:
 
     // saved attributes from our dir entry
     fat_attribute attributes_ = fat_attribute(0);
+
+    // sequential read-ahead state, shared by everyone that has the file open
+    bcache_readahead_t ra_ {};
+
+    // the cluster chain as runs of physically contiguous clusters, sorted by
+    // position in the file. built the first time the file seeks or grows so
+    // that mapping an offset is a binary search instead of a chain walk.
+    struct cluster_run {
+        uint32_t file_cluster;  // index of the run's first cluster within the file
+        uint32_t cluster;
+        uint32_t len;
+    };
+    cluster_run *runs_ = nullptr;
+    uint32_t run_count_ = 0;
+    uint32_t run_capacity_ = 0;
+    bool runs_valid_ = false;
 };
 
@@ -70,6 +70,58 @@ status_t file_block_iterator::next_sectors(uint32_t sectors) {
     return load_current_bcache_block();
 }
 
+void file_block_iterator::prefetch(uint32_t ahead, uint32_t count) {
+    if (cluster == 0) {
+        // linear root dir, stop at the end of it
+        uint32_t start = sector_offset + ahead;
+        uint32_t end = fat->info().root_start_sector + fat->info().root_dir_sectors;
+        if (start < end) {
+            bcache_prefetch(fat->bcache(), start, MIN(count, end - start));
+        }
+        return;
+    }
+
+    // walk a private copy of the position so the iterator itself doesn't move
+    uint32_t c = cluster;
+    uint32_t s = sector_offset;
+    auto step = [&]() -> bool {
+        if (++s == fat->info().sectors_per_cluster) {
+            s = 0;
+            c = fat_next_cluster_in_chain(fat, c);
+            if (is_eof_cluster(c)) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    for (uint32_t i = 0; i < ahead; i++) {
+        if (!step()) {
+            return;
+        }
+    }
+
+    while (count > 0) {
+        bnum_t start = fat_sector_for_cluster(fat, c) + s;
+        uint32_t run = 1;
+        bool more = true;
+        while (run < count) {
+            more = step();
+            if (!more || fat_sector_for_cluster(fat, c) + s != start + run) {
+                break;
+            }
+            run++;
+        }
+
+        bcache_prefetch(fat->bcache(), start, run);
+
+        count -= run;
+        if (!more) {
+            break;
+        }
+    }
+}
+
 status_t file_block_iterator::load_current_bcache_block() {
     // close the current bcache
     put_bcache_block();
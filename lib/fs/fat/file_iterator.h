@@ -42,6 +42,10 @@ public:
     // move one sector
     status_t next_sector() { return next_sectors(1); }
 
+    // read count sectors into the block cache, starting ahead sectors past the
+    // current one. sectors in physically adjacent clusters go in one read.
+    void prefetch(uint32_t ahead, uint32_t count);
+
     // return the number of sectors this has moved forward during its lifetime
     uint32_t get_sector_inc_count() const { return sector_inc_count; }
     void reset_sector_inc_count() { sector_inc_count = 0; }
@@ -41,6 +41,7 @@ __NO_INLINE static void fat_dump(fat_fs *fat) {
     printf("root_entries %u\n", info.root_entries);
     printf("root_start_sector %u\n", info.root_start_sector);
     printf("root_dir_sectors %u\n", info.root_dir_sectors);
+    printf("fsinfo_sector %u\n", info.fsinfo_sector);
 }
 
 fat_fs::fat_fs() = default;
@@ -176,7 +177,7 @@ status_t fat_fs::mount(bdev_t *dev, fscookie **cookie) {
         // In FAT32, root directory acts much like a file and occupies a cluster chain starting generally
         // at cluster 2.
         info->root_cluster = fat_read32(bs, 0x2c);
-        if (info->root_cluster >= info->total_clusters) {
+        if (info->root_cluster >= info->total_clusters + 2) {
             printf("root cluster too large (%x > %x)\n", info->root_cluster, info->total_clusters);
             return ERR_NOT_VALID;
         }
@@ -188,14 +189,21 @@ status_t fat_fs::mount(bdev_t *dev, fscookie **cookie) {
         // read the active fat
         info->active_fat = (bs[0x28] & 0x80) ? 0 : (bs[0x28] & 0xf);
 
-        // TODO: read in fsinfo structure
+        // the fsinfo sector caches the free cluster count, we only ever write it
+        info->fsinfo_sector = fat_read16(bs, 0x30);
+        if (info->fsinfo_sector == 0xffff || info->fsinfo_sector >= info->reserved_sectors) {
+            info->fsinfo_sector = 0;
+        }
     } else {
         // On a FAT 12 or FAT 16 volumes the root directory is at a fixed position immediately after the File Allocation Tables
         info->root_start_sector = info->reserved_sectors + info->fat_count * info->sectors_per_fat;
     }
 
     info->bytes_per_cluster = info->sectors_per_cluster * info->bytes_per_sector;
-    fat->bcache_ = bcache_create(fat->dev(), info->bytes_per_sector, 16);
+    fat->bcache_ = bcache_create(fat->dev(), info->bytes_per_sector, BCACHE_SIZE_AUTO);
+    if (!fat->bcache_) {
+        return ERR_NO_MEMORY;
+    }
 
     // we're okay, cancel our cleanup of the fat structure
     ac2.cancel();
@@ -219,7 +227,10 @@ status_t fat_fs::unmount(fscookie *cookie) {
         // TODO: handle unmounting when files/dirs are active
         DEBUG_ASSERT(list_is_empty(&fat->file_list_));
 
+        fat->update_fsinfo();
+
         bcache_destroy(fat->bcache());
+        free(fat->free_map_.bits);
     }
 
     delete fat;
@@ -227,6 +238,51 @@ status_t fat_fs::unmount(fscookie *cookie) {
     return NO_ERROR;
 }
 
+// bring the free cluster count in the fsinfo sector up to date, if we know it
+void fat_fs::update_fsinfo() {
+    DEBUG_ASSERT(lock.is_held());
+
+    if (!free_map_.valid || info_.fsinfo_sector == 0) {
+        return;
+    }
+
+    void *ptr;
+    if (bcache_get_block(bcache_, &ptr, info_.fsinfo_sector) < 0) {
+        return;
+    }
+
+    // only if it looks like an fsinfo sector, and something changed
+    if (fat_read32(ptr, 0) == 0x41615252 && fat_read32(ptr, 0x1e4) == 0x61417272 &&
+            (fat_read32(ptr, 0x1e8) != free_map_.free_count || fat_read32(ptr, 0x1ec) != free_map_.next)) {
+        fat_write32(ptr, 0x1e8, free_map_.free_count);
+        fat_write32(ptr, 0x1ec, free_map_.next);
+        bcache_mark_block_dirty(bcache_, info_.fsinfo_sector);
+    }
+
+    bcache_put_block(bcache_, info_.fsinfo_sector);
+}
+
+status_t fat_fs::fs_stat(fscookie *cookie, struct fs_stat *stat) {
+    auto *fat = (fat_fs *)cookie;
+
+    AutoLock guard(fat->lock);
+
+    uint32_t free_clusters;
+    status_t err = fat_free_space(fat, &free_clusters);
+    if (err < 0) {
+        return err;
+    }
+
+    stat->free_space = (uint64_t)free_clusters * fat->info().bytes_per_cluster;
+    stat->total_space = (uint64_t)fat->info().total_clusters * fat->info().bytes_per_cluster;
+
+    // no inode table to run out of
+    stat->free_inodes = 0;
+    stat->total_inodes = 0;
+
+    return NO_ERROR;
+}
+
 void fat_fs::add_to_file_list(fat_file *file) {
     DEBUG_ASSERT(lock.is_held());
     DEBUG_ASSERT(!list_in_list(&file->node_));
@@ -251,25 +307,30 @@ fat_file *fat_fs::lookup_file(const dir_entry_location &loc) {
 
 static const struct fs_api fat_api = {
     .format = nullptr,
-    .fs_stat = nullptr,
+    .fs_stat = fat_fs::fs_stat,
 
     .mount = fat_fs::mount,
     .unmount = fat_fs::unmount,
     .open = fat_file::open_file,
-    .create = nullptr,
-    .remove = nullptr,
-    .truncate = nullptr,
+    .create = fat_file::create_file,
+    .remove = fat_remove,
+    .truncate = fat_file::truncate_file,
     .stat = fat_file::stat_file,
     .read = fat_file::read_file,
-    .write = nullptr,
+    .write = fat_file::write_file,
     .close = fat_file::close_file,
 
-    .mkdir = nullptr,
+    .mkdir = fat_mkdir,
     .opendir = fat_dir::opendir,
     .readdir = fat_dir::readdir,
     .closedir = fat_dir::closedir,
 
     .file_ioctl = nullptr,
+
+    .root = fat_root_node,
+    .lookup = fat_lookup_node,
+    .open_node = fat_file::open_node,
+    .opendir_node = fat_dir::opendir_node,
 };
 
 STATIC_FS_IMPL(fat, &fat_api);
@@ -206,11 +206,126 @@ bool test_fat_multi_open() {
     END_TEST;
 }
 
+bool test_fat_write_file() {
+    BEGIN_TEST;
+
+    ASSERT_EQ(NO_ERROR, fs_mount(test_path, "fat", test_device_name));
+    // clean up by unmounting no matter what happens here
+    auto unmount_cleanup = lk::make_auto_call([]() { fs_unmount(test_path); });
+
+    struct fs_stat fs_stat_before;
+    ASSERT_EQ(NO_ERROR, fs_stat_fs(test_path, &fs_stat_before));
+
+    // a name that needs a long file name entry, spanning a few clusters
+    const char *path = test_path "/a new file written by the test.dat";
+    const size_t len = 3 * 4096 + 100;
+    uint8_t *buf = new uint8_t[len];
+    uint8_t *readbuf = new uint8_t[len];
+    auto delete_buffers = lk::make_auto_call([&]() { delete[] buf; delete[] readbuf; });
+    for (size_t i = 0; i < len; i++) {
+        buf[i] = (uint8_t)(i * 7 + 3);
+    }
+
+    {
+        filehandle *handle = nullptr;
+        ASSERT_EQ(NO_ERROR, fs_create_file(path, &handle, 0));
+        auto closefile_cleanup = lk::make_auto_call([&]() { fs_close_file(handle); });
+
+        // can't create it twice, in any case
+        filehandle *handle2 = nullptr;
+        EXPECT_EQ(ERR_ALREADY_EXISTS, fs_create_file(test_path "/A NEW FILE WRITTEN BY THE TEST.DAT", &handle2, 0));
+
+        // write it in uneven pieces
+        ASSERT_EQ(1000, fs_write_file(handle, buf, 0, 1000));
+        ASSERT_EQ((ssize_t)(len - 1000), fs_write_file(handle, buf + 1000, 1000, len - 1000));
+
+        memset(readbuf, 0, len);
+        ASSERT_EQ((ssize_t)len, fs_read_file(handle, readbuf, 0, len));
+        EXPECT_EQ(0, memcmp(buf, readbuf, len));
+
+        // writing past the end leaves a gap of zeros
+        ASSERT_EQ(10, fs_write_file(handle, buf, len + 500, 10));
+        file_stat stat;
+        ASSERT_EQ(NO_ERROR, fs_stat_file(handle, &stat));
+        EXPECT_EQ(len + 510, stat.size);
+        ASSERT_EQ(510, fs_read_file(handle, readbuf, len, 510));
+        for (size_t i = 0; i < 500; i++) {
+            EXPECT_EQ(0, readbuf[i]);
+        }
+        EXPECT_EQ(0, memcmp(buf, readbuf + 500, 10));
+
+        // shrink it back down, the front of the file is untouched
+        ASSERT_EQ(NO_ERROR, fs_truncate_file(handle, 1234));
+        ASSERT_EQ(NO_ERROR, fs_stat_file(handle, &stat));
+        EXPECT_EQ(1234u, stat.size);
+        ASSERT_EQ(1234, fs_read_file(handle, readbuf, 0, len));
+        EXPECT_EQ(0, memcmp(buf, readbuf, 1234));
+
+        // can't remove it while it's open
+        EXPECT_EQ(ERR_BUSY, fs_remove_file(path));
+
+        closefile_cleanup.cancel();
+        ASSERT_EQ(NO_ERROR, fs_close_file(handle));
+    }
+
+    // it's still there after a remount
+    ASSERT_EQ(NO_ERROR, fs_unmount(test_path));
+    ASSERT_EQ(NO_ERROR, fs_mount(test_path, "fat", test_device_name));
+    EXPECT_TRUE(test_file_read(path, buf, 1234));
+
+    ASSERT_EQ(NO_ERROR, fs_remove_file(path));
+    filehandle *handle = nullptr;
+    EXPECT_EQ(ERR_NOT_FOUND, fs_open_file(path, &handle));
+
+    // everything it used is free again
+    struct fs_stat fs_stat_after;
+    ASSERT_EQ(NO_ERROR, fs_stat_fs(test_path, &fs_stat_after));
+    EXPECT_EQ(fs_stat_before.free_space, fs_stat_after.free_space);
+
+    unmount_cleanup.cancel();
+    ASSERT_EQ(NO_ERROR, fs_unmount(test_path));
+
+    END_TEST;
+}
+
+bool test_fat_make_dir() {
+    BEGIN_TEST;
+
+    ASSERT_EQ(NO_ERROR, fs_mount(test_path, "fat", test_device_name));
+    // clean up by unmounting no matter what happens here
+    auto unmount_cleanup = lk::make_auto_call([]() { fs_unmount(test_path); });
+
+    ASSERT_EQ(NO_ERROR, fs_make_dir(test_path "/newdir"));
+    EXPECT_EQ(ERR_ALREADY_EXISTS, fs_make_dir(test_path "/newdir"));
+
+    // put a file in it
+    filehandle *handle = nullptr;
+    ASSERT_EQ(NO_ERROR, fs_create_file(test_path "/newdir/HELLO.TXT", &handle, 0));
+    ASSERT_EQ((ssize_t)test_file_hello_size, fs_write_file(handle, test_file_hello, 0, test_file_hello_size));
+    ASSERT_EQ(NO_ERROR, fs_close_file(handle));
+    EXPECT_TRUE(test_file_read(test_path "/newdir/hello.txt", test_file_hello, test_file_hello_size));
+
+    // the dir has to be empty to go away
+    EXPECT_EQ(ERR_NOT_ALLOWED, fs_remove_file(test_path "/newdir"));
+    ASSERT_EQ(NO_ERROR, fs_remove_file(test_path "/newdir/hello.txt"));
+    ASSERT_EQ(NO_ERROR, fs_remove_file(test_path "/newdir"));
+
+    dirhandle *dhandle = nullptr;
+    EXPECT_EQ(ERR_NOT_FOUND, fs_open_dir(test_path "/newdir", &dhandle));
+
+    unmount_cleanup.cancel();
+    ASSERT_EQ(NO_ERROR, fs_unmount(test_path));
+
+    END_TEST;
+}
+
 BEGIN_TEST_CASE(fat)
     RUN_TEST(test_fat_mount)
     RUN_TEST(test_fat_dir_root)
     RUN_TEST(test_fat_read_file)
     RUN_TEST(test_fat_multi_open)
+    RUN_TEST(test_fat_write_file)
+    RUN_TEST(test_fat_make_dir)
 END_TEST_CASE(fat)
 
 } // namespace
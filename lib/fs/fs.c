@@ -15,7 +15,11 @@
 #include <stdlib.h>
 #include <lib/bio.h>
 #include <lk/init.h>
-#include <kernel/mutex.h>
+#include <kernel/rwlock.h>
+#include <arch/atomic.h>
+
+#include "dcache.h"
+#include "pagecache.h"
 
 #define LOCAL_TRACE 0
 
@@ -34,6 +38,7 @@ struct fs_mount {
 struct filehandle {
     filecookie *cookie;
     struct fs_mount *mount;
+    struct pc_file *pc; // page cache state, NULL if the file is read uncached
 };
 
 struct dirhandle {
@@ -41,7 +46,8 @@ struct dirhandle {
     struct fs_mount *mount;
 };
 
-static mutex_t mount_lock = MUTEX_INITIAL_VALUE(mount_lock);
+// lookups only read the mount list, mount and unmount take it for write
+static rwlock_t mount_lock = RWLOCK_INITIAL_VALUE(mount_lock);
 static struct list_node mounts = LIST_INITIAL_VALUE(mounts);
 static struct list_node fses = LIST_INITIAL_VALUE(fses);
 
@@ -65,12 +71,25 @@ void fs_dump_list(void) {
 
 void fs_dump_mounts(void) {
     printf("%-16s%s\n", "Filesystem", "Path");
-    mutex_acquire(&mount_lock);
+    rwlock_acquire_read(&mount_lock);
     struct fs_mount *mount;
     list_for_every_entry(&mounts, mount, struct fs_mount, node) {
         printf("%-16s%s\n", mount->fs->name, mount->path);
     }
-    mutex_release(&mount_lock);
+    rwlock_release_read(&mount_lock);
+}
+
+// take a ref to a mount unless its last ref is already gone and it is
+// about to be torn down
+static bool get_mount(struct fs_mount *mount) {
+    int ref = mount->ref;
+    while (ref > 0) {
+        int old = atomic_cmpxchg(&mount->ref, ref, ref + 1);
+        if (old == ref)
+            return true;
+        ref = old;
+    }
+    return false;
 }
 
 // find a mount structure based on the prefix of this path
@@ -82,7 +101,7 @@ static struct fs_mount *find_mount(const char *path, const char **trimmed_path)
     }
     size_t pathlen = strlen(path);
 
-    mutex_acquire(&mount_lock);
+    rwlock_acquire_read(&mount_lock);
     struct fs_mount *mount;
     list_for_every_entry(&mounts, mount, struct fs_mount, node) {
         // if the path is shorter than this mount point, no point continuing
@@ -100,6 +119,11 @@ static struct fs_mount *find_mount(const char *path, const char **trimmed_path)
                 continue;
             }
 
+            // being unmounted, pretend it is already gone
+            if (!get_mount(mount)) {
+                continue;
+            }
+
             // we got a match, skip forward to the next element
             if (trimmed_path) {
                 *trimmed_path = &path[mount->pathlen];
@@ -111,32 +135,35 @@ static struct fs_mount *find_mount(const char *path, const char **trimmed_path)
                 }
             }
 
-            mount->ref++;
-
-            mutex_release(&mount_lock);
+            rwlock_release_read(&mount_lock);
             return mount;
         }
     }
 
-    mutex_release(&mount_lock);
+    rwlock_release_read(&mount_lock);
     return NULL;
 }
 
 // decrement the ref to the mount structure, which may
 // cause an unmount operation
 static void put_mount(struct fs_mount *mount) {
-    mutex_acquire(&mount_lock);
-    if ((--mount->ref) == 0) {
+    // once the ref hits zero find_mount can no longer take a new one,
+    // so only the last put gets here
+    if (atomic_add(&mount->ref, -1) == 1) {
         LTRACEF("last ref, unmounting fs at '%s'\n", mount->path);
 
+        rwlock_acquire_write(&mount_lock);
         list_delete(&mount->node);
+        rwlock_release_write(&mount_lock);
+
+        pagecache_forget_mount(mount);
+        dcache_forget_mount(mount);
         mount->api->unmount(mount->cookie);
         free(mount->path);
         if (mount->dev)
             bio_close(mount->dev);
         free(mount);
     }
-    mutex_release(&mount_lock);
 }
 
 static status_t mount(const char *path, const char *device, const struct fs_impl *fs) {
@@ -192,7 +219,9 @@ static status_t mount(const char *path, const char *device, const struct fs_impl
     mount->fs = fs;
     mount->api = api;
 
+    rwlock_acquire_write(&mount_lock);
     list_add_head(&mounts, &mount->node);
+    rwlock_release_write(&mount_lock);
 
     return 0;
 
@@ -243,6 +272,57 @@ status_t fs_unmount(const char *path) {
     return 0;
 }
 
+// open a file, going through the dcache if the fs can be walked a name at a time
+static status_t open_path(struct fs_mount *mount, const char *path, filecookie **cookie) {
+    if (mount->api->open_node) {
+        fsnode_t node;
+        bool is_dir;
+        status_t err = dcache_walk(mount, mount->api, mount->cookie, path, &node, &is_dir);
+        if (err != ERR_NOT_SUPPORTED)
+            return (err < 0) ? err : mount->api->open_node(mount->cookie, node, cookie);
+    }
+
+    return mount->api->open(mount->cookie, path, cookie);
+}
+
+// the page cache knows a file by its node where the fs has them, so every name
+// that leads to the same file shares one copy, and by path otherwise. false if
+// the file can't be cached, because it isn't on a block device or can't be
+// walked to.
+static bool pagecache_key(struct fs_mount *mount, const char *path, fsnode_t *node, const char **key) {
+    if (!mount->dev)
+        return false;
+
+    bool is_dir;
+    status_t err = dcache_walk(mount, mount->api, mount->cookie, path, node, &is_dir);
+    if (err == ERR_NOT_SUPPORTED && !mount->api->lookup) {
+        *node = 0;
+        *key = path;
+        return true;
+    }
+
+    *key = NULL;
+    return err >= 0;
+}
+
+static struct pc_file *open_pagecache(struct fs_mount *mount, const char *path) {
+    fsnode_t node;
+    const char *key;
+    return pagecache_key(mount, path, &node, &key) ? pagecache_open(mount, node, key) : NULL;
+}
+
+static status_t opendir_path(struct fs_mount *mount, const char *path, dircookie **cookie) {
+    if (mount->api->opendir_node) {
+        fsnode_t node;
+        bool is_dir;
+        status_t err = dcache_walk(mount, mount->api, mount->cookie, path, &node, &is_dir);
+        if (err != ERR_NOT_SUPPORTED)
+            return (err < 0) ? err : mount->api->opendir_node(mount->cookie, node, cookie);
+    }
+
+    return mount->api->opendir(mount->cookie, path, cookie);
+}
+
 status_t fs_open_file(const char *path, filehandle **handle) {
     char temppath[FS_MAX_PATH_LEN];
 
@@ -259,7 +339,7 @@ status_t fs_open_file(const char *path, filehandle **handle) {
     LTRACEF("path %s temppath %s newpath %s\n", path, temppath, newpath);
 
     filecookie *cookie;
-    status_t err = mount->api->open(mount->cookie, newpath, &cookie);
+    status_t err = open_path(mount, newpath, &cookie);
     if (err < 0) {
         put_mount(mount);
         return err;
@@ -268,6 +348,7 @@ status_t fs_open_file(const char *path, filehandle **handle) {
     filehandle *f = malloc(sizeof(*f));
     f->cookie = cookie;
     f->mount = mount;
+    f->pc = open_pagecache(mount, newpath);
     *handle = f;
 
     return 0;
@@ -302,6 +383,7 @@ status_t fs_create_file(const char *path, filehandle **handle, uint64_t len) {
 
     filecookie *cookie;
     status_t err = mount->api->create(mount->cookie, newpath, &cookie, len);
+    dcache_created(mount, mount->api, mount->cookie, newpath);
     if (err < 0) {
         put_mount(mount);
         return err;
@@ -314,6 +396,9 @@ status_t fs_create_file(const char *path, filehandle **handle, uint64_t len) {
     }
     f->cookie = cookie;
     f->mount = mount;
+    f->pc = open_pagecache(mount, newpath);
+    // whatever was cached for this file is stale now
+    pagecache_invalidate(f->pc);
     *handle = f;
 
     return 0;
@@ -325,7 +410,9 @@ status_t fs_truncate_file(filehandle *handle, uint64_t len) {
     if (unlikely(!handle))
         return ERR_INVALID_ARGS;
 
-    return handle->mount->api->truncate(handle->cookie, len);
+    status_t err = handle->mount->api->truncate(handle->cookie, len);
+    pagecache_invalidate(handle->pc);
+    return err;
 }
 
 status_t fs_remove_file(const char *path) {
@@ -344,7 +431,15 @@ status_t fs_remove_file(const char *path) {
         return ERR_NOT_SUPPORTED;
     }
 
+    // find the file's page cache key while it can still be walked to
+    fsnode_t node;
+    const char *key;
+    bool cached = pagecache_key(mount, newpath, &node, &key);
+
     status_t err = mount->api->remove(mount->cookie, newpath);
+    if (cached)
+        pagecache_forget(mount, node, key);
+    dcache_removed(mount, mount->api, mount->cookie, newpath);
 
     put_mount(mount);
 
@@ -352,6 +447,9 @@ status_t fs_remove_file(const char *path) {
 }
 
 ssize_t fs_read_file(filehandle *handle, void *buf, off_t offset, size_t len) {
+    if (handle->pc)
+        return pagecache_read(handle->pc, handle->mount->api, handle->cookie, buf, offset, len);
+
     return handle->mount->api->read(handle->cookie, buf, offset, len);
 }
 
@@ -359,7 +457,19 @@ ssize_t fs_write_file(filehandle *handle, const void *buf, off_t offset, size_t
     if (!handle->mount->api->write)
         return ERR_NOT_SUPPORTED;
 
-    return handle->mount->api->write(handle->cookie, buf, offset, len);
+    ssize_t ret = handle->mount->api->write(handle->cookie, buf, offset, len);
+    pagecache_invalidate(handle->pc);
+    return ret;
+}
+
+status_t fs_map_file(filehandle *handle, struct vmm_aspace *aspace, off_t offset, size_t len,
+                     void **ptr, uint arch_mmu_flags) {
+    return pagecache_map(handle->pc, handle->mount->api, handle->cookie, aspace, offset, len,
+                         ptr, arch_mmu_flags);
+}
+
+status_t fs_unmap_file(filehandle *handle, struct vmm_aspace *aspace, void *ptr) {
+    return pagecache_unmap(handle->pc, aspace, ptr);
 }
 
 status_t fs_close_file(filehandle *handle) {
@@ -367,6 +477,7 @@ status_t fs_close_file(filehandle *handle) {
     if (err < 0)
         return err;
 
+    pagecache_close(handle->pc);
     put_mount(handle->mount);
     free(handle);
     return 0;
@@ -393,6 +504,7 @@ status_t fs_make_dir(const char *path) {
     }
 
     status_t err = mount->api->mkdir(mount->cookie, newpath);
+    dcache_created(mount, mount->api, mount->cookie, newpath);
 
     put_mount(mount);
 
@@ -420,7 +532,7 @@ status_t fs_open_dir(const char *path, dirhandle **handle) {
     }
 
     dircookie *cookie;
-    status_t err = mount->api->opendir(mount->cookie, newpath, &cookie);
+    status_t err = opendir_path(mount, newpath, &cookie);
     if (err < 0) {
         put_mount(mount);
         return err;
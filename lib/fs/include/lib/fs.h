@@ -21,6 +21,18 @@ enum fs_ioctl_num {
     FS_IOCTL_NULL = 0,
     FS_IOCTL_GET_FILE_ADDR,
     FS_IOCTL_IS_LINEAR,         // If supported, determine if the underlying device is in linear mode.
+    FS_IOCTL_GET_PAGE_LIST,     // If supported, fill in a struct fs_page_list for the file.
+};
+
+// The memory holding a file's data, for file systems that keep it in memory.
+// pages[i] is the kernel address of bytes i * page_size up to (i + 1) * page_size
+// of the file. The list belongs to the file and is only good until the file is
+// next written, truncated or closed.
+struct fs_page_list {
+    void *const *pages;
+    size_t count;
+    size_t page_size;
+    uint64_t size;
 };
 
 struct file_stat {
@@ -60,6 +72,14 @@ status_t fs_close_file(filehandle *handle) __NONNULL();
 status_t fs_stat_file(filehandle *handle, struct file_stat *) __NONNULL((1));
 status_t fs_truncate_file(filehandle *handle, uint64_t len) __NONNULL((1));
 
+/* map part of a file read only into an address space straight out of the page
+ * cache, without copying. offset must be page aligned. only files on block
+ * device backed mounts are cached, anything else is ERR_NOT_SUPPORTED. */
+struct vmm_aspace;
+status_t fs_map_file(filehandle *handle, struct vmm_aspace *aspace, off_t offset, size_t len,
+                     void **ptr, uint arch_mmu_flags) __NONNULL((1)) __NONNULL((2)) __NONNULL((5));
+status_t fs_unmap_file(filehandle *handle, struct vmm_aspace *aspace, void *ptr) __NONNULL((1)) __NONNULL((2));
+
 /* dir api */
 status_t fs_make_dir(const char *path) __NONNULL();
 status_t fs_open_dir(const char *path, dirhandle **handle) __NONNULL();
@@ -81,6 +101,7 @@ const char *trim_name(const char *_name);
 typedef struct fscookie fscookie;
 typedef struct filecookie filecookie;
 typedef struct dircookie dircookie;
+typedef uint64_t fsnode_t;
 struct bdev;
 
 struct fs_api {
@@ -104,6 +125,15 @@ struct fs_api {
     status_t (*closedir)(dircookie *) __NONNULL();
 
     status_t (*file_ioctl)(filecookie *, int, void *);
+
+    /* optional node based hooks. with these the fs layer walks paths one
+     * name at a time and caches what it finds. a node is whatever id the fs
+     * picks for a file or dir, it has to stay valid until the entry is
+     * removed. lookup returns ERR_NOT_FOUND for names that don't exist. */
+    status_t (*root)(fscookie *, fsnode_t *);
+    status_t (*lookup)(fscookie *, fsnode_t dir, const char *name, fsnode_t *node, bool *is_dir);
+    status_t (*open_node)(fscookie *, fsnode_t, filecookie **);
+    status_t (*opendir_node)(fscookie *, fsnode_t, dircookie **);
 };
 
 struct fs_impl {
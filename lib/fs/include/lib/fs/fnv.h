@@ -0,0 +1,29 @@
+/*
+ * Copyright (c) 2009-2015 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* 32 bit fnv-1a, used by the fs name and page caches to hash their keys */
+#define FNV1A_INIT 2166136261U
+
+static inline uint32_t fnv1a_buf(uint32_t h, const void *buf, size_t len) {
+    const uint8_t *p = (const uint8_t *)buf;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ p[i]) * 16777619U;
+    }
+    return h;
+}
+
+static inline uint32_t fnv1a_str(uint32_t h, const char *str) {
+    for (; *str; str++) {
+        h = (h ^ (uint8_t)*str) * 16777619U;
+    }
+    return h;
+}
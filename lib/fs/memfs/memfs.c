@@ -6,55 +6,247 @@
  * https://opensource.org/licenses/MIT
  */
 
+#include <assert.h>
 #include <string.h>
 #include <stdlib.h>
+#include <malloc.h>
 #include <lk/debug.h>
 #include <lk/err.h>
 #include <lk/trace.h>
 #include <lk/list.h>
 #include <lk/init.h>
 #include <lib/fs.h>
+#include <lib/fs/fnv.h>
 #include <kernel/mutex.h>
+#include <arch/defines.h>
+#if WITH_KERNEL_VM
+#include <kernel/vm.h>
+#endif
 
 #define LOCAL_TRACE 0
 
+#define MEMFS_HASH_BUCKETS 256
+
+/*
+ * Files keep their data in page sized chunks rather than one buffer, so
+ * growing a file never moves what is already there. A chunk that was never
+ * written is NULL and reads back as zeros.
+ *
+ * Every file and dir is in one hash table per mount, keyed by its parent and
+ * its name, so looking up a path costs one probe per path element no matter
+ * how many files there are.
+ */
+
+typedef struct memfs_node memfs_node_t;
+
 typedef struct {
-    struct list_node files;
+    struct list_node hash[MEMFS_HASH_BUCKETS];
     struct list_node dcookies;
 
+    memfs_node_t *root;
+
     mutex_t lock;
 } memfs_t;
 
-typedef struct {
-    struct list_node node;
+struct memfs_node {
+    struct list_node hash_node;
+    struct list_node sibling_node;  // in the parent's list of children
     memfs_t *fs;
+    memfs_node_t *parent;
 
     // name
     char *name;
+    uint32_t hash;
+
+    bool is_dir;
+    int ref;                        // open file and dir handles
 
-    // main data area
-    uint8_t *ptr;
+    // file data, page_count chunks of PAGE_SIZE
+    void **pages;
+    size_t page_count;
+    size_t page_capacity;
     size_t len;
-} memfs_file_t;
+
+    // dirs only
+    struct list_node children;
+};
 
 struct dircookie {
     struct list_node node;
     memfs_t *fs;
+    memfs_node_t *dir;
 
     // next entry that will be returned
-    memfs_file_t *next_file;
+    memfs_node_t *next_node;
 };
 
-static memfs_file_t *find_file(memfs_t *mem, const char *name) {
-    memfs_file_t *file;
-    list_for_every_entry(&mem->files, file, memfs_file_t, node) {
-        if (!strcmp(name, file->name))
-            return file;
+static void *alloc_chunk(void) {
+#if WITH_KERNEL_VM
+    void *ptr = pmm_alloc_kpage();
+#else
+    void *ptr = memalign(PAGE_SIZE, PAGE_SIZE);
+#endif
+    if (ptr)
+        memset(ptr, 0, PAGE_SIZE);
+    return ptr;
+}
+
+static void free_chunk(void *ptr) {
+#if WITH_KERNEL_VM
+    pmm_free_kpages(ptr, 1);
+#else
+    free(ptr);
+#endif
+}
+
+static uint32_t hash_name(const memfs_node_t *parent, const char *name, size_t len) {
+    // fnv-1a over the parent pointer and the name
+    uint32_t h = fnv1a_buf(FNV1A_INIT, &parent, sizeof(parent));
+    return fnv1a_buf(h, name, len);
+}
+
+static memfs_node_t *find_child(memfs_t *mem, memfs_node_t *parent, const char *name, size_t len) {
+    DEBUG_ASSERT(is_mutex_held(&mem->lock));
+
+    uint32_t hash = hash_name(parent, name, len);
+
+    memfs_node_t *node;
+    list_for_every_entry(&mem->hash[hash % MEMFS_HASH_BUCKETS], node, memfs_node_t, hash_node) {
+        if (node->hash == hash && node->parent == parent &&
+                !strncmp(node->name, name, len) && node->name[len] == 0)
+            return node;
     }
 
     return NULL;
 }
 
+// walk a path with the leading / already trimmed, "" is the root dir
+static memfs_node_t *find_node(memfs_t *mem, const char *path) {
+    memfs_node_t *node = mem->root;
+
+    for (;;) {
+        while (*path == '/')
+            path++;
+        if (*path == 0)
+            return node;
+
+        if (!node->is_dir)
+            return NULL;
+
+        size_t len = strcspn(path, "/");
+        node = find_child(mem, node, path, len);
+        if (!node)
+            return NULL;
+
+        path += len;
+    }
+}
+
+// find the dir that holds the last element of a path, and the name of it
+static status_t find_parent(memfs_t *mem, const char *path, memfs_node_t **parent, const char **name) {
+    const char *sep = strrchr(path, '/');
+    *name = sep ? sep + 1 : path;
+    if (**name == 0)
+        return ERR_INVALID_ARGS;
+
+    if (!sep) {
+        *parent = mem->root;
+        return NO_ERROR;
+    }
+
+    char dirpath[FS_MAX_PATH_LEN];
+    strlcpy(dirpath, path, MIN(sizeof(dirpath), (size_t)(sep - path) + 1));
+
+    *parent = find_node(mem, dirpath);
+    if (!*parent)
+        return ERR_NOT_FOUND;
+    if (!(*parent)->is_dir)
+        return ERR_NOT_DIR;
+
+    return NO_ERROR;
+}
+
+static memfs_node_t *alloc_node(memfs_t *mem, const char *name, bool is_dir) {
+    memfs_node_t *node = calloc(1, sizeof(*node));
+    if (!node)
+        return NULL;
+
+    node->name = strdup(name);
+    if (!node->name) {
+        free(node);
+        return NULL;
+    }
+    node->fs = mem;
+    node->is_dir = is_dir;
+    list_initialize(&node->children);
+
+    return node;
+}
+
+static void link_node(memfs_t *mem, memfs_node_t *parent, memfs_node_t *node) {
+    DEBUG_ASSERT(is_mutex_held(&mem->lock));
+
+    node->parent = parent;
+    node->hash = hash_name(parent, node->name, strlen(node->name));
+    list_add_head(&mem->hash[node->hash % MEMFS_HASH_BUCKETS], &node->hash_node);
+    list_add_tail(&parent->children, &node->sibling_node);
+}
+
+static void unlink_node(memfs_t *mem, memfs_node_t *node) {
+    DEBUG_ASSERT(is_mutex_held(&mem->lock));
+
+    // move any dir cookie that was about to return this node past it
+    dircookie *dcookie;
+    list_for_every_entry(&mem->dcookies, dcookie, dircookie, node) {
+        if (dcookie->next_node == node) {
+            dcookie->next_node = list_next_type(&node->parent->children, &node->sibling_node,
+                                                memfs_node_t, sibling_node);
+        }
+    }
+
+    list_delete(&node->hash_node);
+    list_delete(&node->sibling_node);
+}
+
+// drop the chunks past the first count
+static void trim_chunks(memfs_node_t *node, size_t count) {
+    for (size_t i = count; i < node->page_count; i++) {
+        if (node->pages[i])
+            free_chunk(node->pages[i]);
+    }
+    if (count < node->page_count)
+        node->page_count = count;
+}
+
+// make room in the chunk array for count chunks
+static status_t reserve_chunks(memfs_node_t *node, size_t count) {
+    if (count > node->page_capacity) {
+        // grow geometrically so appending stays cheap
+        size_t capacity = MAX(count, node->page_capacity * 2);
+        capacity = MAX(capacity, 8U);
+        void **pages = realloc(node->pages, capacity * sizeof(void *));
+        if (!pages)
+            return ERR_NO_MEMORY;
+        node->pages = pages;
+        node->page_capacity = capacity;
+    }
+
+    // new chunks start out as holes
+    for (size_t i = node->page_count; i < count; i++) {
+        node->pages[i] = NULL;
+    }
+    node->page_count = MAX(node->page_count, count);
+
+    return NO_ERROR;
+}
+
+static void free_node(memfs_node_t *node) {
+    trim_chunks(node, 0);
+    free(node->pages);
+    free(node->name);
+    free(node);
+}
+
 static status_t memfs_mount(struct bdev *dev, fscookie **cookie) {
     LTRACEF("dev %p, cookie %p\n", dev, cookie);
 
@@ -62,21 +254,22 @@ static status_t memfs_mount(struct bdev *dev, fscookie **cookie) {
     if (!mem)
         return ERR_NO_MEMORY;
 
-    list_initialize(&mem->files);
+    for (uint i = 0; i < MEMFS_HASH_BUCKETS; i++)
+        list_initialize(&mem->hash[i]);
     list_initialize(&mem->dcookies);
     mutex_init(&mem->lock);
 
+    mem->root = alloc_node(mem, "", true);
+    if (!mem->root) {
+        free(mem);
+        return ERR_NO_MEMORY;
+    }
+
     *cookie = (fscookie *)mem;
 
     return NO_ERROR;
 }
 
-static void free_file(memfs_file_t *file) {
-    free(file->ptr);
-    free(file->name);
-    free(file);
-}
-
 static status_t memfs_unmount(fscookie *cookie) {
     LTRACEF("cookie %p\n", cookie);
 
@@ -84,19 +277,46 @@ static status_t memfs_unmount(fscookie *cookie) {
 
     mutex_acquire(&mem->lock);
 
-    // free all the files
-    memfs_file_t *file;
-    while ((file = list_remove_head_type(&mem->files, memfs_file_t, node))) {
-        free_file(file);
+    // free all the files and dirs
+    for (uint i = 0; i < MEMFS_HASH_BUCKETS; i++) {
+        memfs_node_t *node;
+        while ((node = list_remove_head_type(&mem->hash[i], memfs_node_t, hash_node))) {
+            free_node(node);
+        }
     }
+    free_node(mem->root);
 
     mutex_release(&mem->lock);
 
+    mutex_destroy(&mem->lock);
     free(mem);
 
     return NO_ERROR;
 }
 
+static status_t create_node(memfs_t *mem, const char *path, bool is_dir, memfs_node_t **out) {
+    DEBUG_ASSERT(is_mutex_held(&mem->lock));
+
+    memfs_node_t *parent;
+    const char *name;
+    status_t err = find_parent(mem, path, &parent, &name);
+    if (err < 0)
+        return err;
+
+    // see if it already exists
+    if (find_child(mem, parent, name, strlen(name)))
+        return ERR_ALREADY_EXISTS;
+
+    memfs_node_t *node = alloc_node(mem, name, is_dir);
+    if (!node)
+        return ERR_NO_MEMORY;
+
+    link_node(mem, parent, node);
+
+    *out = node;
+    return NO_ERROR;
+}
+
 static status_t memfs_create(fscookie *cookie, const char *name, filecookie **fcookie, uint64_t len) {
     status_t err;
 
@@ -110,39 +330,22 @@ static status_t memfs_create(fscookie *cookie, const char *name, filecookie **fc
     // make sure we strip out any leading /
     name = trim_name(name);
 
-    // we can't handle directories right now, so fail if the file has a / in its name
-    if (strchr(name, '/'))
-        return ERR_NOT_SUPPORTED;
-
     mutex_acquire(&mem->lock);
 
-    // see if the file already exists
-    if (find_file(mem, name)) {
-        err = ERR_ALREADY_EXISTS;
+    memfs_node_t *file;
+    err = create_node(mem, name, false, &file);
+    if (err < 0)
         goto out;
-    }
 
-    // allocate a new file
-    memfs_file_t *file = malloc(sizeof(*file));
-    if (!file) {
-        err = ERR_NO_MEMORY;
-        goto out;
-    }
-
-    // allocate the space for it
-    file->ptr = calloc(1, len);
-    if (!file->ptr) {
-        free(file);
-        err = ERR_NO_MEMORY;
+    // the space is a hole until something is written to it
+    err = reserve_chunks(file, ROUNDUP(len, PAGE_SIZE) / PAGE_SIZE);
+    if (err < 0) {
+        unlink_node(mem, file);
+        free_node(file);
         goto out;
     }
     file->len = len;
-
-    // fill in some metadata and stuff it in the file list
-    file->name = strdup(name);
-    file->fs = mem;
-
-    list_add_tail(&mem->files, &file->node);
+    file->ref++;
 
     *fcookie = (filecookie *)file;
 
@@ -163,7 +366,9 @@ static status_t memfs_open(fscookie *cookie, const char *name, filecookie **fcoo
     name = trim_name(name);
 
     mutex_acquire(&mem->lock);
-    memfs_file_t *file = find_file(mem, name);
+    memfs_node_t *file = find_node(mem, name);
+    if (file)
+        file->ref++;
     mutex_release(&mem->lock);
 
     if (!file)
@@ -175,6 +380,8 @@ static status_t memfs_open(fscookie *cookie, const char *name, filecookie **fcoo
 }
 
 static status_t memfs_remove(fscookie *cookie, const char *name) {
+    status_t err;
+
     LTRACEF("cookie %p name '%s'\n", cookie, name);
 
     memfs_t *mem = (memfs_t *)cookie;
@@ -183,35 +390,57 @@ static status_t memfs_remove(fscookie *cookie, const char *name) {
     name = trim_name(name);
 
     mutex_acquire(&mem->lock);
-    memfs_file_t *file = find_file(mem, name);
-    if (file)
-        list_delete(&file->node);
-    mutex_release(&mem->lock);
+    memfs_node_t *node = find_node(mem, name);
+    if (!node || node == mem->root) {
+        err = node ? ERR_NOT_ALLOWED : ERR_NOT_FOUND;
+        goto out;
+    }
 
-    if (!file)
-        return ERR_NOT_FOUND;
+    // can't pull it out from under someone that has it open
+    if (node->ref > 0) {
+        err = ERR_BUSY;
+        goto out;
+    }
+
+    // dirs have to be empty
+    if (node->is_dir && !list_is_empty(&node->children)) {
+        err = ERR_NOT_ALLOWED;
+        goto out;
+    }
 
-    // XXX make sure there are no open file handles
-    free_file(file);
+    unlink_node(mem, node);
+    free_node(node);
+    err = NO_ERROR;
 
-    return NO_ERROR;
+out:
+    mutex_release(&mem->lock);
+
+    return err;
 }
 
 static status_t memfs_close(filecookie *fcookie) {
-    memfs_file_t *file = (memfs_file_t *)fcookie;
+    memfs_node_t *file = (memfs_node_t *)fcookie;
 
     LTRACEF("cookie %p name '%s'\n", fcookie, file->name);
 
+    mutex_acquire(&file->fs->lock);
+    DEBUG_ASSERT(file->ref > 0);
+    file->ref--;
+    mutex_release(&file->fs->lock);
+
     return NO_ERROR;
 }
 
-static ssize_t memfs_read(filecookie *fcookie, void *buf, off_t off, size_t len) {
-    LTRACEF("filecookie %p buf %p offset %lld len %zu\n", fcookie, buf, off, len);
+static ssize_t memfs_read(filecookie *fcookie, void *_buf, off_t off, size_t len) {
+    LTRACEF("filecookie %p buf %p offset %lld len %zu\n", fcookie, _buf, off, len);
 
-    memfs_file_t *file = (memfs_file_t *)fcookie;
+    memfs_node_t *file = (memfs_node_t *)fcookie;
+    uint8_t *buf = _buf;
 
     if (off < 0)
         return ERR_INVALID_ARGS;
+    if (file->is_dir)
+        return ERR_NOT_FILE;
 
     mutex_acquire(&file->fs->lock);
 
@@ -221,8 +450,19 @@ static ssize_t memfs_read(filecookie *fcookie, void *buf, off_t off, size_t len)
         len = file->len - off;
     }
 
-    // copy that floppy
-    memcpy(buf, file->ptr + off, len);
+    // copy that floppy, a chunk at a time
+    for (size_t pos = 0; pos < len; ) {
+        size_t index = (off + pos) / PAGE_SIZE;
+        size_t chunk_offset = (off + pos) % PAGE_SIZE;
+        size_t tocopy = MIN(PAGE_SIZE - chunk_offset, len - pos);
+
+        if (file->pages[index]) {
+            memcpy(buf + pos, (uint8_t *)file->pages[index] + chunk_offset, tocopy);
+        } else {
+            memset(buf + pos, 0, tocopy);
+        }
+        pos += tocopy;
+    }
 
     mutex_release(&file->fs->lock);
 
@@ -234,72 +474,109 @@ static status_t memfs_truncate(filecookie *fcookie, uint64_t len) {
 
     status_t rc = NO_ERROR;
 
-    memfs_file_t *file = (memfs_file_t *)fcookie;
+    memfs_node_t *file = (memfs_node_t *)fcookie;
+
+    if (file->is_dir)
+        return ERR_NOT_FILE;
+    if (len >= ULONG_MAX)
+        return ERR_NO_MEMORY;
 
     mutex_acquire(&file->fs->lock);
 
-    // Can't use truncate to grow a file.
+    size_t count = ROUNDUP(len, PAGE_SIZE) / PAGE_SIZE;
     if (len > file->len) {
-        rc = ERR_INVALID_ARGS;
-        goto finish;
-    }
+        // growing just adds holes
+        rc = reserve_chunks(file, count);
+        if (rc < 0)
+            goto finish;
+    } else {
+        trim_chunks(file, count);
 
-    // NOTE: Don't allow allocations smaller than 1b. Although realloc(..., 0)
-    // is okay, it may yield an invalid pointer (likely NULL) which might be
-    // dereferenced elsewhere.
-    void *ptr = realloc(file->ptr, len == 0 ? 1 : len);
-    if (unlikely(ptr == NULL)) {
-        rc = ERR_NO_MEMORY;
-        goto finish;
+        // zero what was past the new end in the last chunk, in case the file
+        // grows again
+        size_t tail = len % PAGE_SIZE;
+        if (tail && file->pages[count - 1])
+            memset((uint8_t *)file->pages[count - 1] + tail, 0, PAGE_SIZE - tail);
     }
 
     file->len = len;
-    file->ptr = ptr;
 
 finish:
     mutex_release(&file->fs->lock);
     return rc;
 }
 
-static ssize_t memfs_write(filecookie *fcookie, const void *buf, off_t off, size_t len) {
-    LTRACEF("filecookie %p buf %p offset %lld len %zu\n", fcookie, buf, off, len);
+static ssize_t memfs_write(filecookie *fcookie, const void *_buf, off_t off, size_t len) {
+    LTRACEF("filecookie %p buf %p offset %lld len %zu\n", fcookie, _buf, off, len);
 
-    memfs_file_t *file = (memfs_file_t *)fcookie;
+    memfs_node_t *file = (memfs_node_t *)fcookie;
+    const uint8_t *buf = _buf;
 
     if (off < 0)
         return ERR_INVALID_ARGS;
+    if (file->is_dir)
+        return ERR_NOT_FILE;
+    if ((uint64_t)off + len >= ULONG_MAX)
+        return ERR_NO_MEMORY;
 
     mutex_acquire(&file->fs->lock);
 
-    // see if this write will extend the file
-    if (off + len > file->len) {
-        void *ptr = realloc(file->ptr, off + len);
-        if (!ptr) {
-            mutex_release(&file->fs->lock);
-            return ERR_NO_MEMORY;
+    // make sure there are slots for every chunk this write touches
+    status_t err = reserve_chunks(file, ROUNDUP(off + len, PAGE_SIZE) / PAGE_SIZE);
+    if (err < 0) {
+        mutex_release(&file->fs->lock);
+        return err;
+    }
+
+    size_t pos;
+    for (pos = 0; pos < len; ) {
+        size_t index = (off + pos) / PAGE_SIZE;
+        size_t chunk_offset = (off + pos) % PAGE_SIZE;
+        size_t tocopy = MIN(PAGE_SIZE - chunk_offset, len - pos);
+
+        if (!file->pages[index]) {
+            file->pages[index] = alloc_chunk();
+            if (!file->pages[index])
+                break;
         }
 
-        file->ptr = ptr;
-        file->len = off + len;
+        memcpy((uint8_t *)file->pages[index] + chunk_offset, buf + pos, tocopy);
+        pos += tocopy;
+    }
+
+    // see if this write extended the file
+    if (off + pos > file->len) {
+        file->len = off + pos;
     }
 
-    memcpy(file->ptr + off, buf, len);
+    // drop the slots past the end if we ran out of memory partway
+    trim_chunks(file, ROUNDUP(file->len, PAGE_SIZE) / PAGE_SIZE);
 
     mutex_release(&file->fs->lock);
 
-    return len;
+    if (pos == 0 && len > 0)
+        return ERR_NO_MEMORY;
+
+    return pos;
 }
 
 static status_t memfs_stat(filecookie *fcookie, struct file_stat *stat) {
     LTRACEF("filecookie %p stat %p\n", fcookie, stat);
 
-    memfs_file_t *file = (memfs_file_t *)fcookie;
+    memfs_node_t *file = (memfs_node_t *)fcookie;
 
     mutex_acquire(&file->fs->lock);
 
     if (stat) {
-        stat->is_dir = false;
+        stat->is_dir = file->is_dir;
         stat->size = file->len;
+
+        size_t chunks = 0;
+        for (size_t i = 0; i < file->page_count; i++) {
+            if (file->pages[i])
+                chunks++;
+        }
+        stat->capacity = (uint64_t)chunks * PAGE_SIZE;
     }
 
     mutex_release(&file->fs->lock);
@@ -307,7 +584,65 @@ static status_t memfs_stat(filecookie *fcookie, struct file_stat *stat) {
     return NO_ERROR;
 }
 
+static status_t memfs_get_page_list(memfs_node_t *file, struct fs_page_list *list) {
+    if (file->is_dir)
+        return ERR_NOT_FILE;
+
+    mutex_acquire(&file->fs->lock);
+
+    // fill in the holes so every page of the file has memory behind it
+    for (size_t i = 0; i < file->page_count; i++) {
+        if (!file->pages[i]) {
+            file->pages[i] = alloc_chunk();
+            if (!file->pages[i]) {
+                mutex_release(&file->fs->lock);
+                return ERR_NO_MEMORY;
+            }
+        }
+    }
+
+    list->pages = file->pages;
+    list->count = file->page_count;
+    list->page_size = PAGE_SIZE;
+    list->size = file->len;
+
+    mutex_release(&file->fs->lock);
+
+    return NO_ERROR;
+}
+
+static status_t memfs_file_ioctl(filecookie *fcookie, int request, void *argp) {
+    LTRACEF("filecookie %p request %d argp %p\n", fcookie, request, argp);
+
+    memfs_node_t *file = (memfs_node_t *)fcookie;
+
+    switch (request) {
+        case FS_IOCTL_GET_PAGE_LIST:
+            return memfs_get_page_list(file, (struct fs_page_list *)argp);
+        default:
+            return ERR_NOT_SUPPORTED;
+    }
+}
+
+static status_t memfs_mkdir(fscookie *cookie, const char *name) {
+    LTRACEF("cookie %p name '%s'\n", cookie, name);
+
+    memfs_t *mem = (memfs_t *)cookie;
+
+    // make sure we strip out any leading /
+    name = trim_name(name);
+
+    mutex_acquire(&mem->lock);
+    memfs_node_t *dir;
+    status_t err = create_node(mem, name, true, &dir);
+    mutex_release(&mem->lock);
+
+    return err;
+}
+
 static status_t memfs_opendir(fscookie *cookie, const char *name, dircookie **dcookie) {
+    status_t err;
+
     LTRACEF("cookie %p name '%s' dircookie %p\n", cookie, name, dcookie);
 
     memfs_t *mem = (memfs_t *)cookie;
@@ -315,11 +650,7 @@ static status_t memfs_opendir(fscookie *cookie, const char *name, dircookie **dc
     // make sure we strip out any leading /
     name = trim_name(name);
 
-    // at the moment, we only support opening "" (with / stripped)
-    if (strcmp("", name))
-        return ERR_NOT_FOUND;
-
-    // allocate a dir cookie, point it at the first file, and stuff it in the dircookie jar
+    // allocate a dir cookie, point it at the first entry, and stuff it in the dircookie jar
     dircookie *dir = malloc(sizeof(*dir));
     if (!dir)
         return ERR_NO_MEMORY;
@@ -327,7 +658,17 @@ static status_t memfs_opendir(fscookie *cookie, const char *name, dircookie **dc
     dir->fs = mem;
 
     mutex_acquire(&mem->lock);
-    dir->next_file = list_peek_head_type(&mem->files, memfs_file_t, node);
+    memfs_node_t *node = find_node(mem, name);
+    if (!node || !node->is_dir) {
+        err = node ? ERR_NOT_DIR : ERR_NOT_FOUND;
+        mutex_release(&mem->lock);
+        free(dir);
+        return err;
+    }
+
+    node->ref++;
+    dir->dir = node;
+    dir->next_node = list_peek_head_type(&node->children, memfs_node_t, sibling_node);
     list_add_head(&mem->dcookies, &dir->node);
     mutex_release(&mem->lock);
 
@@ -346,10 +687,12 @@ static status_t memfs_readdir(dircookie *dcookie, struct dirent *ent) {
 
     mutex_acquire(&dcookie->fs->lock);
 
-    // return the next file in the list and bump the cursor
-    if (dcookie->next_file) {
-        strlcpy(ent->name, dcookie->next_file->name, sizeof(ent->name));
-        dcookie->next_file = list_next_type(&dcookie->fs->files, &dcookie->next_file->node, memfs_file_t, node);
+    // return the next entry in the dir and bump the cursor
+    memfs_node_t *node = dcookie->next_node;
+    if (node) {
+        strlcpy(ent->name, node->name, sizeof(ent->name));
+        dcookie->next_node = list_next_type(&dcookie->dir->children, &node->sibling_node,
+                                            memfs_node_t, sibling_node);
         err = NO_ERROR;
     } else {
         err = ERR_NOT_FOUND;
@@ -366,6 +709,7 @@ static status_t memfs_closedir(dircookie *dcookie) {
     // free the dircookie
     mutex_acquire(&dcookie->fs->lock);
     list_delete(&dcookie->node);
+    dcookie->dir->ref--;
     mutex_release(&dcookie->fs->lock);
 
     free(dcookie);
@@ -388,13 +732,12 @@ static const struct fs_api memfs_api = {
 
     .stat = memfs_stat,
 
-#if 0
-    status_t (*mkdir)(fscookie *, const char *);
-#endif
+    .mkdir = memfs_mkdir,
     .opendir = memfs_opendir,
     .readdir = memfs_readdir,
     .closedir = memfs_closedir,
 
+    .file_ioctl = memfs_file_ioctl,
 };
 
 STATIC_FS_IMPL(memfs, &memfs_api);
@@ -0,0 +1,666 @@
+/*
+ * Copyright (c) 2009-2015 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#include "pagecache.h"
+
+#if WITH_KERNEL_VM
+
+#include <assert.h>
+#include <kernel/mutex.h>
+#include <kernel/vm.h>
+#include <lib/fs/fnv.h>
+#include <lib/slab.h>
+#include <lk/console_cmd.h>
+#include <lk/debug.h>
+#include <lk/err.h>
+#include <lk/list.h>
+#include <lk/pow2.h>
+#include <lk/trace.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOCAL_TRACE 0
+
+/* the cache may grow to this fraction of the memory free when it starts up,
+ * and gives pages back whenever free memory drops under the low water mark */
+#define PC_MAX_SHIFT 2
+#define PC_LOW_WATER_SHIFT 5
+#define PC_RECLAIM_BATCH 16
+
+/* runs of at least this many pages that aren't cached are read straight
+ * into the caller's buffer instead of a page at a time through the cache */
+#define PC_DIRECT_PAGES 16
+
+#define PC_FILE_BUCKETS 64
+
+struct pc_file {
+    struct list_node node;      /* in a file hash bucket */
+    const void *mount;
+    fsnode_t fsnode;
+    char *path;                 /* NULL if the file is known by fsnode */
+    uint32_t hash;
+    int ref;                    /* open handles */
+    uint page_count;
+    uint gen;                   /* bumped whenever the file's pages are dropped */
+    struct list_node mappings;
+};
+
+struct pc_page {
+    struct list_node hash_node;
+    struct list_node lru_node;  /* on the lru while nobody has it pinned */
+    struct pc_file *file;       /* NULL once dropped from the cache while pinned */
+    uint64_t index;
+    vm_page_t *page;
+    void *va;
+    size_t valid;               /* bytes of file data, less than a page at the end */
+    int pin;
+};
+
+struct pc_mapping {
+    struct list_node node;
+    struct vmm_aspace *aspace;
+    void *base;
+    uint count;
+    struct pc_page *pages[];
+};
+
+struct pc_stats {
+    ulong lookups;
+    ulong hits;
+    ulong fills;
+    ulong evictions;
+    ulong pressure_evictions;
+    ulong invalidations;
+    ulong uncached_reads;
+    ulong direct_reads;
+};
+
+static mutex_t pc_lock = MUTEX_INITIAL_VALUE(pc_lock);
+static bool pc_initialized;
+static struct list_node pc_files[PC_FILE_BUCKETS];
+static struct list_node *pc_hash;
+static uint pc_hash_shift;
+static struct list_node pc_lru = LIST_INITIAL_VALUE(pc_lru);
+static size_t pc_pages;
+static size_t pc_max_pages;
+static size_t pc_low_water;
+static struct pc_stats pc_stats;
+
+static slab_cache_t pc_page_cache =
+    SLAB_CACHE_INITIAL_VALUE(pc_page_cache, "pagecache", sizeof(struct pc_page), 0, NULL, NULL);
+
+static uint32_t hash_key(const void *mount, fsnode_t node, const char *path) {
+    /* fnv-1a over the mount pointer and the path or the node */
+    uint32_t h = fnv1a_buf(FNV1A_INIT, &mount, sizeof(mount));
+    if (path) {
+        return fnv1a_str(h, path);
+    }
+    return fnv1a_buf(h, &node, sizeof(node));
+}
+
+static bool key_matches(const struct pc_file *f, uint32_t hash, const void *mount,
+                        fsnode_t node, const char *path) {
+    if (f->hash != hash || f->mount != mount)
+        return false;
+    if (path)
+        return f->path && !strcmp(f->path, path);
+    return !f->path && f->fsnode == node;
+}
+
+static inline uint page_bucket(const struct pc_file *f, uint64_t index) {
+    uint32_t h = f->hash ^ (uint32_t)index ^ (uint32_t)(index >> 32);
+    return (h * 0x9e3779b1U) >> (32 - pc_hash_shift);
+}
+
+static size_t pagecache_reclaim(size_t count);
+
+/* size the cache from free memory the first time somebody uses it */
+static bool pc_init_locked(void) {
+    if (pc_initialized)
+        return pc_hash != NULL;
+    pc_initialized = true;
+
+    size_t free_pages = pmm_count_free_pages();
+    pc_max_pages = free_pages >> PC_MAX_SHIFT;
+    pc_low_water = free_pages >> PC_LOW_WATER_SHIFT;
+
+    pc_hash_shift = MAX(log2_uint(round_up_pow2_u32(MAX(pc_max_pages, 2U))) - 1, 4U);
+    pc_hash = malloc(sizeof(struct list_node) << pc_hash_shift);
+    if (!pc_hash)
+        return false;
+
+    for (uint i = 0; i < (1U << pc_hash_shift); i++)
+        list_initialize(&pc_hash[i]);
+    for (uint i = 0; i < PC_FILE_BUCKETS; i++)
+        list_initialize(&pc_files[i]);
+
+    pmm_set_reclaim_hook(pagecache_reclaim);
+
+    LTRACEF("max pages %zu, low water %zu, %u buckets\n", pc_max_pages, pc_low_water, 1U << pc_hash_shift);
+    return true;
+}
+
+static void free_file_locked(struct pc_file *f) {
+    DEBUG_ASSERT(f->ref == 0 && f->page_count == 0);
+    DEBUG_ASSERT(list_is_empty(&f->mappings));
+
+    if (list_in_list(&f->node))
+        list_delete(&f->node);
+    free(f->path);
+    free(f);
+}
+
+static void free_page(struct pc_page *p) {
+    pmm_free_page(p->page);
+    slab_cache_free(&pc_page_cache, p);
+}
+
+/* take a page out of the cache. a pinned page stays around until the last
+ * pin goes, it just can't be found any more. */
+static void drop_page_locked(struct pc_page *p) {
+    struct pc_file *f = p->file;
+    DEBUG_ASSERT(f);
+
+    list_delete(&p->hash_node);
+    p->file = NULL;
+    pc_pages--;
+    f->page_count--;
+
+    if (p->pin == 0) {
+        list_delete(&p->lru_node);
+        free_page(p);
+    }
+
+    if (f->ref == 0 && f->page_count == 0 && list_is_empty(&f->mappings))
+        free_file_locked(f);
+}
+
+static size_t evict_locked(size_t count) {
+    size_t evicted = 0;
+    struct pc_page *p;
+
+    while (evicted < count && (p = list_peek_head_type(&pc_lru, struct pc_page, lru_node))) {
+        drop_page_locked(p);
+        evicted++;
+    }
+    pc_stats.evictions += evicted;
+    return evicted;
+}
+
+/* the pmm's reclaim hook, drops unpinned pages when an allocation runs short.
+ * the allocation may come from under pc_lock, or from a thread holding a
+ * lock that a pc_lock holder is waiting for, so only try for the lock. */
+static size_t pagecache_reclaim(size_t count) {
+    if (is_mutex_held(&pc_lock) || mutex_acquire_timeout(&pc_lock, 0) != NO_ERROR)
+        return 0;
+
+    size_t evicted = evict_locked(MAX(count, (size_t)PC_RECLAIM_BATCH));
+    pc_stats.pressure_evictions += evicted;
+
+    mutex_release(&pc_lock);
+    return evicted;
+}
+
+static void pin_page_locked(struct pc_page *p) {
+    if (p->pin++ == 0)
+        list_delete(&p->lru_node);
+}
+
+static void unpin_page_locked(struct pc_page *p) {
+    DEBUG_ASSERT(p->pin > 0);
+    if (--p->pin > 0)
+        return;
+
+    if (p->file)
+        list_add_tail(&pc_lru, &p->lru_node);
+    else
+        free_page(p);
+}
+
+static struct pc_page *lookup_page_locked(struct pc_file *f, uint64_t index) {
+    struct pc_page *p;
+    list_for_every_entry(&pc_hash[page_bucket(f, index)], p, struct pc_page, hash_node) {
+        if (p->file == f && p->index == index)
+            return p;
+    }
+    return NULL;
+}
+
+static void drop_file_pages_locked(struct pc_file *f) {
+    f->gen++;
+    if (f->page_count == 0)
+        return;
+
+    /* walk the whole table, files aren't expected to change often */
+    for (uint i = 0; i < (1U << pc_hash_shift) && f->page_count > 0; i++) {
+        struct pc_page *p, *temp;
+        list_for_every_entry_safe(&pc_hash[i], p, temp, struct pc_page, hash_node) {
+            if (p->file == f) {
+                pc_stats.invalidations++;
+                drop_page_locked(p);
+            }
+        }
+    }
+}
+
+/* drop a file's pages and make sure it can't be found again. it lives on for
+ * as long as handles or mappings still point at it. */
+static void forget_file_locked(struct pc_file *f) {
+    f->ref++;
+    drop_file_pages_locked(f);
+    list_delete(&f->node);
+    if (--f->ref == 0 && f->page_count == 0 && list_is_empty(&f->mappings))
+        free_file_locked(f);
+}
+
+/*
+ * Find a page of a file, reading it in if it isn't cached. Comes back pinned,
+ * NULL with *err == 0 past the end of the file. The lock is dropped while the
+ * file system reads, so two threads may read the same page and only the first
+ * one to finish gets to cache it.
+ */
+static struct pc_page *get_page(struct pc_file *f, const struct fs_api *api, filecookie *cookie,
+                                uint64_t index, status_t *err) {
+    *err = NO_ERROR;
+
+    mutex_acquire(&pc_lock);
+
+    pc_stats.lookups++;
+    struct pc_page *p = lookup_page_locked(f, index);
+    if (p) {
+        pc_stats.hits++;
+        pin_page_locked(p);
+        mutex_release(&pc_lock);
+        return p;
+    }
+
+    /* make room first if memory is short or the cache is full */
+    if (pc_pages >= pc_max_pages)
+        evict_locked(PC_RECLAIM_BATCH);
+    if (pmm_count_free_pages() < pc_low_water)
+        pc_stats.pressure_evictions += evict_locked(PC_RECLAIM_BATCH);
+
+    uint gen = f->gen;
+    mutex_release(&pc_lock);
+
+    p = slab_cache_alloc(&pc_page_cache);
+    vm_page_t *page = p ? pmm_alloc_page() : NULL;
+    if (!page) {
+        if (p)
+            slab_cache_free(&pc_page_cache, p);
+        *err = ERR_NO_MEMORY;
+        return NULL;
+    }
+
+    p->page = page;
+    p->va = paddr_to_kvaddr(vm_page_to_paddr(page));
+    p->index = index;
+    p->pin = 1;
+
+    ssize_t rc = api->read(cookie, p->va, (off_t)(index * PAGE_SIZE), PAGE_SIZE);
+    if (rc <= 0) {
+        free_page(p);
+        *err = (rc < 0) ? (status_t)rc : NO_ERROR;
+        return NULL;
+    }
+    p->valid = rc;
+    if (p->valid < PAGE_SIZE)
+        memset((uint8_t *)p->va + p->valid, 0, PAGE_SIZE - p->valid);
+
+    mutex_acquire(&pc_lock);
+    pc_stats.fills++;
+
+    struct pc_page *other = lookup_page_locked(f, index);
+    if (other) {
+        /* somebody beat us to it */
+        pin_page_locked(other);
+        mutex_release(&pc_lock);
+        free_page(p);
+        return other;
+    }
+
+    if (f->gen != gen) {
+        /* the file changed while we read, hand the data out uncached */
+        p->file = NULL;
+    } else {
+        p->file = f;
+        list_add_head(&pc_hash[page_bucket(f, index)], &p->hash_node);
+        pc_pages++;
+        f->page_count++;
+    }
+
+    mutex_release(&pc_lock);
+    return p;
+}
+
+/* how many pages from index on, up to max, aren't cached */
+static size_t uncached_run(struct pc_file *f, uint64_t index, size_t max) {
+    size_t run = 0;
+
+    mutex_acquire(&pc_lock);
+    while (run < max && !lookup_page_locked(f, index + run))
+        run++;
+    mutex_release(&pc_lock);
+
+    return run;
+}
+
+static void put_page(struct pc_page *p) {
+    mutex_acquire(&pc_lock);
+    unpin_page_locked(p);
+    mutex_release(&pc_lock);
+}
+
+struct pc_file *pagecache_open(const void *mount, fsnode_t node, const char *path) {
+    uint32_t hash = hash_key(mount, node, path);
+
+    mutex_acquire(&pc_lock);
+
+    struct pc_file *f = NULL;
+    if (!pc_init_locked())
+        goto out;
+
+    list_for_every_entry(&pc_files[hash % PC_FILE_BUCKETS], f, struct pc_file, node) {
+        if (key_matches(f, hash, mount, node, path)) {
+            f->ref++;
+            goto out;
+        }
+    }
+
+    f = calloc(1, sizeof(*f));
+    if (!f)
+        goto out;
+    if (path) {
+        f->path = strdup(path);
+        if (!f->path) {
+            free(f);
+            f = NULL;
+            goto out;
+        }
+    }
+    f->mount = mount;
+    f->fsnode = node;
+    f->hash = hash;
+    f->ref = 1;
+    list_initialize(&f->mappings);
+    list_add_head(&pc_files[hash % PC_FILE_BUCKETS], &f->node);
+
+out:
+    mutex_release(&pc_lock);
+    return f;
+}
+
+void pagecache_close(struct pc_file *f) {
+    if (!f)
+        return;
+
+    mutex_acquire(&pc_lock);
+    DEBUG_ASSERT(f->ref > 0);
+    if (--f->ref == 0 && f->page_count == 0 && list_is_empty(&f->mappings))
+        free_file_locked(f);
+    mutex_release(&pc_lock);
+}
+
+ssize_t pagecache_read(struct pc_file *f, const struct fs_api *api, filecookie *cookie,
+                       void *_buf, off_t offset, size_t len) {
+    if (!f)
+        return api->read(cookie, _buf, offset, len);
+    if (offset < 0)
+        return ERR_INVALID_ARGS;
+
+    uint8_t *buf = _buf;
+    size_t bytes = 0;
+
+    while (len > 0) {
+        uint64_t index = (uint64_t)offset / PAGE_SIZE;
+        size_t page_offset = (uint64_t)offset % PAGE_SIZE;
+
+        /* let a big read that nothing has cached yet go to the file system
+         * in one piece, where it can turn into large device transfers */
+        if (page_offset == 0 && len >= PC_DIRECT_PAGES * PAGE_SIZE) {
+            size_t run = uncached_run(f, index, len / PAGE_SIZE);
+            if (run >= PC_DIRECT_PAGES) {
+                mutex_acquire(&pc_lock);
+                pc_stats.direct_reads++;
+                mutex_release(&pc_lock);
+
+                ssize_t rc = api->read(cookie, buf, offset, run * PAGE_SIZE);
+                if (rc < 0)
+                    return bytes ? (ssize_t)bytes : rc;
+
+                buf += rc;
+                offset += rc;
+                len -= rc;
+                bytes += rc;
+
+                /* a short read is the end of the file */
+                if ((size_t)rc < run * PAGE_SIZE)
+                    break;
+                continue;
+            }
+        }
+
+        status_t err;
+        struct pc_page *p = get_page(f, api, cookie, index, &err);
+        if (!p) {
+            if (err == ERR_NO_MEMORY) {
+                /* no room to cache it, read the rest directly */
+                mutex_acquire(&pc_lock);
+                pc_stats.uncached_reads++;
+                mutex_release(&pc_lock);
+
+                ssize_t rc = api->read(cookie, buf, offset, len);
+                if (rc < 0)
+                    return bytes ? (ssize_t)bytes : rc;
+                bytes += rc;
+            } else if (err < 0 && bytes == 0) {
+                return err;
+            }
+            break;
+        }
+
+        size_t valid = p->valid;
+        size_t tocopy = (valid > page_offset) ? MIN(len, valid - page_offset) : 0;
+        memcpy(buf, (uint8_t *)p->va + page_offset, tocopy);
+        put_page(p);
+
+        buf += tocopy;
+        offset += tocopy;
+        len -= tocopy;
+        bytes += tocopy;
+
+        /* a short page is the end of the file */
+        if (valid < PAGE_SIZE && len > 0)
+            break;
+    }
+
+    return bytes;
+}
+
+void pagecache_invalidate(struct pc_file *f) {
+    if (!f)
+        return;
+
+    mutex_acquire(&pc_lock);
+    drop_file_pages_locked(f);
+    mutex_release(&pc_lock);
+}
+
+void pagecache_forget(const void *mount, fsnode_t node, const char *path) {
+    uint32_t hash = hash_key(mount, node, path);
+
+    mutex_acquire(&pc_lock);
+    if (pc_hash) {
+        struct pc_file *f, *temp;
+        list_for_every_entry_safe(&pc_files[hash % PC_FILE_BUCKETS], f, temp, struct pc_file, node) {
+            if (key_matches(f, hash, mount, node, path)) {
+                forget_file_locked(f);
+                break;
+            }
+        }
+    }
+    mutex_release(&pc_lock);
+}
+
+void pagecache_forget_mount(const void *mount) {
+    mutex_acquire(&pc_lock);
+    if (pc_hash) {
+        for (uint i = 0; i < PC_FILE_BUCKETS; i++) {
+            struct pc_file *f, *temp;
+            list_for_every_entry_safe(&pc_files[i], f, temp, struct pc_file, node) {
+                if (f->mount == mount)
+                    forget_file_locked(f);
+            }
+        }
+    }
+    mutex_release(&pc_lock);
+}
+
+status_t pagecache_map(struct pc_file *f, const struct fs_api *api, filecookie *cookie,
+                       struct vmm_aspace *aspace, off_t offset, size_t len, void **ptr,
+                       uint arch_mmu_flags) {
+    if (!f)
+        return ERR_NOT_SUPPORTED;
+    if (offset < 0 || !IS_PAGE_ALIGNED(offset) || len == 0)
+        return ERR_INVALID_ARGS;
+
+    uint count = ROUNDUP(len, PAGE_SIZE) / PAGE_SIZE;
+    struct pc_mapping *m = malloc(sizeof(*m) + count * sizeof(m->pages[0]));
+    paddr_t *pa = malloc(count * sizeof(paddr_t));
+    status_t err = NO_ERROR;
+    uint i = 0;
+    if (!m || !pa) {
+        err = ERR_NO_MEMORY;
+        goto out;
+    }
+
+    for (i = 0; i < count; i++) {
+        m->pages[i] = get_page(f, api, cookie, (uint64_t)offset / PAGE_SIZE + i, &err);
+        if (!m->pages[i]) {
+            if (err == NO_ERROR)
+                err = ERR_OUT_OF_RANGE;
+            goto out;
+        }
+        pa[i] = vm_page_to_paddr(m->pages[i]->page);
+    }
+
+    /* the pages are shared with every other reader */
+    arch_mmu_flags |= ARCH_MMU_FLAG_PERM_RO;
+    err = vmm_alloc_physical_etc(aspace, "pagecache", count * PAGE_SIZE, ptr, PAGE_SIZE_SHIFT,
+                                 pa, count, 0, arch_mmu_flags);
+    if (err < 0)
+        goto out;
+
+    m->aspace = aspace;
+    m->base = *ptr;
+    m->count = count;
+
+    mutex_acquire(&pc_lock);
+    list_add_tail(&f->mappings, &m->node);
+    mutex_release(&pc_lock);
+
+    free(pa);
+    return NO_ERROR;
+
+out:
+    if (m) {
+        while (i > 0)
+            put_page(m->pages[--i]);
+    }
+    free(m);
+    free(pa);
+    return err;
+}
+
+status_t pagecache_unmap(struct pc_file *f, struct vmm_aspace *aspace, void *ptr) {
+    if (!f)
+        return ERR_NOT_SUPPORTED;
+
+    mutex_acquire(&pc_lock);
+    struct pc_mapping *m;
+    bool found = false;
+    list_for_every_entry(&f->mappings, m, struct pc_mapping, node) {
+        if (m->aspace == aspace && m->base == ptr) {
+            list_delete(&m->node);
+            found = true;
+            break;
+        }
+    }
+    mutex_release(&pc_lock);
+
+    if (!found)
+        return ERR_NOT_FOUND;
+
+    vmm_free_region(aspace, (vaddr_t)ptr);
+
+    mutex_acquire(&pc_lock);
+    for (uint i = 0; i < m->count; i++)
+        unpin_page_locked(m->pages[i]);
+    mutex_release(&pc_lock);
+
+    free(m);
+    return NO_ERROR;
+}
+
+static int cmd_pagecache(int argc, const console_cmd_args *argv) {
+    if (argc >= 2 && !strcmp(argv[1].str, "drop")) {
+        mutex_acquire(&pc_lock);
+        size_t evicted = evict_locked(pc_pages);
+        mutex_release(&pc_lock);
+        printf("dropped %zu pages\n", evicted);
+        return NO_ERROR;
+    } else if (argc >= 3 && !strcmp(argv[1].str, "max")) {
+        mutex_acquire(&pc_lock);
+        pc_init_locked();
+        pc_max_pages = argv[2].u;
+        if (pc_pages > pc_max_pages)
+            evict_locked(pc_pages - pc_max_pages);
+        mutex_release(&pc_lock);
+    } else if (argc >= 2) {
+        printf("usage:\n");
+        printf("%s\n", argv[0].str);
+        printf("%s drop\n", argv[0].str);
+        printf("%s max <pages>\n", argv[0].str);
+        return ERR_INVALID_ARGS;
+    }
+
+    mutex_acquire(&pc_lock);
+    struct pc_stats s = pc_stats;
+    size_t pages = pc_pages;
+    size_t max_pages = pc_max_pages;
+    size_t pinned = 0;
+    uint files = 0;
+    if (pc_hash) {
+        for (uint i = 0; i < PC_FILE_BUCKETS; i++)
+            files += list_length(&pc_files[i]);
+        for (uint i = 0; i < (1U << pc_hash_shift); i++) {
+            struct pc_page *p;
+            list_for_every_entry(&pc_hash[i], p, struct pc_page, hash_node) {
+                if (p->pin > 0)
+                    pinned++;
+            }
+        }
+    }
+    mutex_release(&pc_lock);
+
+    printf("page cache: %zu of %zu pages (%zu KB), %zu pinned, %u files\n",
+           pages, max_pages, pages * PAGE_SIZE / 1024, pinned, files);
+    printf("lookups %lu hits %lu (%lu%%) fills %lu uncached reads %lu direct reads %lu\n",
+           s.lookups, s.hits, s.lookups ? s.hits * 100 / s.lookups : 0,
+           s.fills, s.uncached_reads, s.direct_reads);
+    printf("evictions %lu (memory pressure %lu) invalidations %lu\n",
+           s.evictions, s.pressure_evictions, s.invalidations);
+
+    return NO_ERROR;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("pagecache", "file page cache stats and control", &cmd_pagecache)
+STATIC_COMMAND_END(pagecache);
+
+#endif
@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2009-2015 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#pragma once
+
+#include <lib/fs.h>
+#include <lk/compiler.h>
+#include <lk/err.h>
+#include <sys/types.h>
+
+/*
+ * File data cache shared by every mount, private to lib/fs.
+ *
+ * Files are identified by their mount and the node the file system gives
+ * them, so every name that leads to the same file shares one copy. Mounts
+ * without node hooks identify files by path instead. Either way the cached
+ * pages outlive the handles that read them. Pages come straight from
+ * the pmm, sit on one global lru and are given back when free memory runs
+ * low, when a pmm allocation comes up short or the cache goes over its limit.
+ *
+ * Without the vm there is nothing to back the cache with, so every file is
+ * uncached and goes straight to the file system.
+ */
+
+__BEGIN_CDECLS
+
+struct pc_file;
+struct vmm_aspace;
+
+#if WITH_KERNEL_VM
+
+/* get a ref to the cache state for a file, NULL if it can't be cached. the
+ * file is known by node if path is NULL. */
+struct pc_file *pagecache_open(const void *mount, fsnode_t node, const char *path);
+void pagecache_close(struct pc_file *f);
+
+/* read through the cache, filling missing pages with api->read on cookie.
+ * long runs of missing pages are read straight into buf and not cached. */
+ssize_t pagecache_read(struct pc_file *f, const struct fs_api *api, filecookie *cookie,
+                       void *buf, off_t offset, size_t len);
+
+/* drop everything cached for a file after it changed */
+void pagecache_invalidate(struct pc_file *f);
+
+/* drop everything cached for a file that was removed, or a mount that is
+ * going away */
+void pagecache_forget(const void *mount, fsnode_t node, const char *path);
+void pagecache_forget_mount(const void *mount);
+
+/* map cached pages of a file into an address space, pinned until unmapped */
+status_t pagecache_map(struct pc_file *f, const struct fs_api *api, filecookie *cookie,
+                       struct vmm_aspace *aspace, off_t offset, size_t len, void **ptr,
+                       uint arch_mmu_flags);
+status_t pagecache_unmap(struct pc_file *f, struct vmm_aspace *aspace, void *ptr);
+
+#else
+
+static inline struct pc_file *pagecache_open(const void *mount, fsnode_t node, const char *path) { return NULL; }
+static inline void pagecache_close(struct pc_file *f) {}
+static inline ssize_t pagecache_read(struct pc_file *f, const struct fs_api *api, filecookie *cookie,
+                                     void *buf, off_t offset, size_t len) {
+    return api->read(cookie, buf, offset, len);
+}
+static inline void pagecache_invalidate(struct pc_file *f) {}
+static inline void pagecache_forget(const void *mount, fsnode_t node, const char *path) {}
+static inline void pagecache_forget_mount(const void *mount) {}
+static inline status_t pagecache_map(struct pc_file *f, const struct fs_api *api, filecookie *cookie,
+                                     struct vmm_aspace *aspace, off_t offset, size_t len, void **ptr,
+                                     uint arch_mmu_flags) {
+    return ERR_NOT_SUPPORTED;
+}
+static inline status_t pagecache_unmap(struct pc_file *f, struct vmm_aspace *aspace, void *ptr) {
+    return ERR_NOT_SUPPORTED;
+}
+
+#endif
+
+__END_CDECLS
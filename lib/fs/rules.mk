@@ -2,8 +2,12 @@ LOCAL_DIR := $(GET_LOCAL_DIR)
 
 MODULE := $(LOCAL_DIR)
 
+MODULE_DEPS += lib/slab
+
+MODULE_SRCS += $(LOCAL_DIR)/dcache.c
 MODULE_SRCS += $(LOCAL_DIR)/debug.c
 MODULE_SRCS += $(LOCAL_DIR)/fs.c
+MODULE_SRCS += $(LOCAL_DIR)/pagecache.c
 MODULE_SRCS += $(LOCAL_DIR)/shell.c
 MODULE_SRCS += $(LOCAL_DIR)/test.c
 
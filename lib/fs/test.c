@@ -10,6 +10,12 @@
 #include <string.h>
 #include <string.h>
 #include <stdio.h>
+#include <lk/console_cmd.h>
+#include <lk/err.h>
+#include <stdlib.h>
+#include <platform.h>
+
+#include "dcache.h"
 
 #if WITH_LIB_UNITTEST
 #include <lib/unittest.h>
@@ -62,3 +68,55 @@ RUN_TEST(test_path_normalize);
 END_TEST_CASE(fs_tests);
 
 #endif // WITH_LIB_UNITTEST
+
+#if LK_DEBUGLEVEL > 1
+/* time opening and closing a path, first with the lookup cache dropped before
+ * every open and then with it warm. paths that don't exist are fine, they
+ * time negative lookups. */
+static int cmd_fs_lookup_bench(int argc, const console_cmd_args *argv) {
+    if (argc < 2) {
+        printf("usage: %s <path> [iterations]\n", argv[0].str);
+        return ERR_INVALID_ARGS;
+    }
+    const char *path = argv[1].str;
+    uint iterations = (argc > 2) ? argv[2].u : 1000;
+    if (iterations == 0)
+        return ERR_INVALID_ARGS;
+
+    for (int warm = 0; warm <= 1; warm++) {
+        lk_bigtime_t total = 0;
+        lk_bigtime_t max = 0;
+        status_t err = NO_ERROR;
+
+        for (uint i = 0; i < iterations; i++) {
+            if (!warm)
+                dcache_drop();
+
+            lk_bigtime_t t = current_time_hires();
+            filehandle *handle;
+            err = fs_open_file(path, &handle);
+            if (err >= 0)
+                fs_close_file(handle);
+            t = current_time_hires() - t;
+
+            if (err < 0 && err != ERR_NOT_FOUND) {
+                printf("error %d opening %s\n", err, path);
+                return err;
+            }
+
+            total += t;
+            max = MAX(max, t);
+        }
+
+        printf("%s %s: %u opens, avg %llu usecs, max %llu usecs\n",
+               warm ? "warm" : "cold", (err < 0) ? "missing" : "found", iterations,
+               total / iterations, max);
+    }
+
+    return NO_ERROR;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("fs_lookup_bench", "time path lookups with the dcache cold and warm", &cmd_fs_lookup_bench)
+STATIC_COMMAND_END(fs_lookup_bench);
+#endif
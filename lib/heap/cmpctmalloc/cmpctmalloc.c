@@ -681,17 +681,14 @@ void cmpct_trim(void) {
     unlock();
 }
 
-void *cmpct_alloc(size_t size) {
-    if (size == 0u) return NULL;
-
-    if (size + sizeof(header_t) > (1u << HEAP_ALLOC_VIRTUAL_BITS)) return large_alloc(size);
-
+// Allocate from the buckets, called with the lock held.  size must be
+// non-zero and small enough to not need large_alloc.
+static void *alloc_locked(size_t size) {
     size_t rounded_up;
     int start_bucket = size_to_index_allocating(size, &rounded_up);
 
     rounded_up += sizeof(header_t);
 
-    lock();
     int bucket = find_nonempty_bucket(start_bucket);
     if (bucket == -1) {
         // Grow heap by at least 12% if we can.
@@ -700,7 +697,6 @@ void *cmpct_alloc(size_t size) {
                                 MAX(HEAP_GROW_SIZE, rounded_up)));
         while (heap_grow(growby, NULL) < 0) {
             if (growby <= rounded_up) {
-                unlock();
                 return NULL;
             }
             growby = MAX(growby >> 1, rounded_up);
@@ -730,10 +726,33 @@ void *cmpct_alloc(size_t size) {
     memset(result, ALLOC_FILL, size);
     memset(((char *)result) + size, PADDING_FILL, rounded_up - size - sizeof(header_t));
 #endif
+    return result;
+}
+
+void *cmpct_alloc(size_t size) {
+    if (size == 0u) return NULL;
+
+    if (size + sizeof(header_t) > (1u << HEAP_ALLOC_VIRTUAL_BITS)) return large_alloc(size);
+
+    lock();
+    void *result = alloc_locked(size);
     unlock();
     return result;
 }
 
+size_t cmpct_alloc_batch(size_t size, void **ptrs, size_t count) {
+    if (size == 0u || size + sizeof(header_t) > (1u << HEAP_ALLOC_VIRTUAL_BITS)) return 0;
+
+    size_t i;
+    lock();
+    for (i = 0; i < count; i++) {
+        ptrs[i] = alloc_locked(size);
+        if (!ptrs[i]) break;
+    }
+    unlock();
+    return i;
+}
+
 void *cmpct_memalign(size_t size, size_t alignment) {
     if (alignment < 8) return cmpct_alloc(size);
     size_t padded_size =
@@ -762,12 +781,11 @@ void *cmpct_memalign(size_t size, size_t alignment) {
     return payload;
 }
 
-void cmpct_free(void *payload) {
-    if (payload == NULL) return;
+// Return an allocation to the buckets, called with the lock held.
+static void free_locked(void *payload) {
     header_t *header = (header_t *)payload - 1;
     DEBUG_ASSERT(!is_tagged_as_free(header));  // Double free!
     size_t size = header->size;
-    lock();
     header_t *left = header->left;
     if (left != NULL && is_tagged_as_free(left)) {
         // Coalesce with left free object.
@@ -796,9 +814,29 @@ void cmpct_free(void *payload) {
             free_memory(header, left, size);
         }
     }
+}
+
+void cmpct_free(void *payload) {
+    if (payload == NULL) return;
+    lock();
+    free_locked(payload);
+    unlock();
+}
+
+void cmpct_free_batch(void **ptrs, size_t count) {
+    lock();
+    for (size_t i = 0; i < count; i++) {
+        if (ptrs[i]) free_locked(ptrs[i]);
+    }
     unlock();
 }
 
+size_t cmpct_usable_size(void *payload) {
+    if (payload == NULL) return 0;
+    header_t *header = (header_t *)payload - 1;
+    return header->size - sizeof(header_t);
+}
+
 void *cmpct_realloc(void *payload, size_t size) {
     if (payload == NULL) return cmpct_alloc(size);
     header_t *header = (header_t *)payload - 1;
@@ -16,6 +16,14 @@ void *cmpct_realloc(void *, size_t);
 void cmpct_free(void *);
 void *cmpct_memalign(size_t size, size_t alignment);
 
+/* allocate or free a batch of objects with one trip through the heap lock.
+ * cmpct_alloc_batch returns how many of count objects it allocated. */
+size_t cmpct_alloc_batch(size_t size, void **ptrs, size_t count);
+void cmpct_free_batch(void **ptrs, size_t count);
+
+/* bytes the allocation can actually hold, at least what was asked for */
+size_t cmpct_usable_size(void *);
+
 void cmpct_init(void);
 void cmpct_dump(void);
 void cmpct_test(void);
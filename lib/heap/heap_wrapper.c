@@ -17,6 +17,7 @@
 #include <kernel/spinlock.h>
 #include <lk/console_cmd.h>
 #include <lib/page_alloc.h>
+#include <arch/ops.h>
 
 #define LOCAL_TRACE 0
 
@@ -116,6 +117,173 @@ static inline void HEAP_TRIM(void) { dlmalloc_trim(0); }
 #error need to select valid heap implementation or provide wrapper
 #endif
 
+#if WITH_LIB_HEAP_CMPCTMALLOC
+/* per cpu magazines of small objects in front of the heap */
+#define HEAP_MAGAZINES 1
+#define HEAP_ALLOC_BATCH cmpct_alloc_batch
+#define HEAP_FREE_BATCH cmpct_free_batch
+#define HEAP_USABLE_SIZE cmpct_usable_size
+#else
+#define HEAP_MAGAZINES 0
+#endif
+
+#if HEAP_MAGAZINES
+/*
+ * Each cpu keeps a small stack of free objects for each size class. Most
+ * mallocs and frees of small objects are satisfied from it with interrupts
+ * off and only this cpu's own spinlock held, which nobody else takes outside
+ * of heap_trim and heap_dump. An empty magazine is refilled with a batch of
+ * objects in one trip through the heap lock and a full one flushes half of
+ * itself back the same way.
+ */
+#define HEAP_MAGAZINE_SIZE 32
+#define HEAP_MAGAZINE_BATCH (HEAP_MAGAZINE_SIZE / 2)
+
+static const size_t heap_magazine_class_size[] = {
+    16, 32, 48, 64, 96, 128, 192, 256, 384, 512,
+};
+#define HEAP_MAGAZINE_CLASSES countof(heap_magazine_class_size)
+#define HEAP_MAGAZINE_MAX_SIZE (heap_magazine_class_size[HEAP_MAGAZINE_CLASSES - 1])
+
+struct heap_magazine {
+    uint count;
+    void *objs[HEAP_MAGAZINE_SIZE];
+};
+
+static struct heap_percpu {
+    spin_lock_t lock;
+    struct heap_magazine mag[HEAP_MAGAZINE_CLASSES];
+    ulong hits;
+    ulong misses;
+} heap_percpu[SMP_MAX_CPUS];
+
+/* smallest class an allocation of size fits in */
+static int heap_magazine_alloc_class(size_t size) {
+    for (uint i = 0; i < HEAP_MAGAZINE_CLASSES; i++) {
+        if (size <= heap_magazine_class_size[i])
+            return i;
+    }
+    return -1;
+}
+
+/* largest class a free object of usable size can satisfy */
+static int heap_magazine_free_class(size_t usable) {
+    if (usable < heap_magazine_class_size[0] || usable > HEAP_MAGAZINE_MAX_SIZE)
+        return -1;
+    int i = HEAP_MAGAZINE_CLASSES - 1;
+    while (heap_magazine_class_size[i] > usable)
+        i--;
+    return i;
+}
+
+static void *heap_magazine_alloc(size_t size) {
+    int bucket = heap_magazine_alloc_class(size);
+    if (bucket < 0)
+        return NULL;
+
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    struct heap_percpu *pc = &heap_percpu[arch_curr_cpu_num()];
+    spin_lock(&pc->lock);
+
+    struct heap_magazine *mag = &pc->mag[bucket];
+    if (likely(mag->count > 0)) {
+        void *ptr = mag->objs[--mag->count];
+        pc->hits++;
+        spin_unlock_restore(&pc->lock, state, SPIN_LOCK_FLAG_INTERRUPTS);
+        return ptr;
+    }
+    pc->misses++;
+    spin_unlock_restore(&pc->lock, state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    /* refill from the heap with the lock dropped, we may well end up on
+     * another cpu by the time it returns */
+    void *batch[HEAP_MAGAZINE_BATCH];
+    size_t count = HEAP_ALLOC_BATCH(heap_magazine_class_size[bucket], batch, HEAP_MAGAZINE_BATCH);
+    if (count == 0)
+        return NULL;
+
+    void *ptr = batch[--count];
+
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    pc = &heap_percpu[arch_curr_cpu_num()];
+    spin_lock(&pc->lock);
+    mag = &pc->mag[bucket];
+    while (count > 0 && mag->count < HEAP_MAGAZINE_SIZE)
+        mag->objs[mag->count++] = batch[--count];
+    spin_unlock_restore(&pc->lock, state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    if (count > 0)
+        HEAP_FREE_BATCH(batch, count);
+
+    return ptr;
+}
+
+static bool heap_magazine_free(void *ptr) {
+    int bucket = heap_magazine_free_class(HEAP_USABLE_SIZE(ptr));
+    if (bucket < 0)
+        return false;
+
+    void *batch[HEAP_MAGAZINE_BATCH];
+    size_t count = 0;
+
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    struct heap_percpu *pc = &heap_percpu[arch_curr_cpu_num()];
+    spin_lock(&pc->lock);
+
+    struct heap_magazine *mag = &pc->mag[bucket];
+    if (unlikely(mag->count == HEAP_MAGAZINE_SIZE)) {
+        /* full, send the oldest half back to the heap */
+        count = HEAP_MAGAZINE_BATCH;
+        memcpy(batch, mag->objs, sizeof(void *) * count);
+        memmove(mag->objs, &mag->objs[count], sizeof(void *) * (mag->count - count));
+        mag->count -= count;
+    }
+    mag->objs[mag->count++] = ptr;
+
+    spin_unlock_restore(&pc->lock, state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    if (count > 0)
+        HEAP_FREE_BATCH(batch, count);
+
+    return true;
+}
+
+/* give everything sitting in the magazines back to the heap */
+static void heap_magazine_drain(void) {
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        struct heap_percpu *pc = &heap_percpu[cpu];
+
+        for (uint bucket = 0; bucket < HEAP_MAGAZINE_CLASSES; bucket++) {
+            void *batch[HEAP_MAGAZINE_SIZE];
+
+            spin_lock_saved_state_t state;
+            spin_lock_irqsave(&pc->lock, state);
+            size_t count = pc->mag[bucket].count;
+            memcpy(batch, pc->mag[bucket].objs, sizeof(void *) * count);
+            pc->mag[bucket].count = 0;
+            spin_unlock_irqrestore(&pc->lock, state);
+
+            if (count > 0)
+                HEAP_FREE_BATCH(batch, count);
+        }
+    }
+}
+
+static void heap_magazine_dump(void) {
+    printf("\tper cpu magazines:\n");
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        struct heap_percpu *pc = &heap_percpu[cpu];
+
+        printf("\t\tcpu %u: hits %lu misses %lu, cached", cpu, pc->hits, pc->misses);
+        for (uint bucket = 0; bucket < HEAP_MAGAZINE_CLASSES; bucket++)
+            printf(" %zu:%u", heap_magazine_class_size[bucket], pc->mag[bucket].count);
+        printf("\n");
+    }
+}
+#endif // HEAP_MAGAZINES
+
 static void heap_free_delayed_list(void) {
     struct list_node list;
 
@@ -146,6 +314,10 @@ void heap_trim(void) {
         heap_free_delayed_list();
     }
 
+#if HEAP_MAGAZINES
+    heap_magazine_drain();
+#endif
+
     HEAP_TRIM();
 }
 
@@ -157,7 +329,13 @@ void *malloc(size_t size) {
         heap_free_delayed_list();
     }
 
+#if HEAP_MAGAZINES
+    void *ptr = heap_magazine_alloc(size);
+    if (!ptr)
+        ptr = HEAP_MALLOC(size);
+#else
     void *ptr = HEAP_MALLOC(size);
+#endif
     if (heap_trace)
         printf("caller %p malloc %zu -> %p\n", __GET_CALLER(), size, ptr);
     return ptr;
@@ -185,7 +363,15 @@ void *calloc(size_t count, size_t size) {
         heap_free_delayed_list();
     }
 
+#if HEAP_MAGAZINES
+    void *ptr = heap_magazine_alloc(count * size);
+    if (ptr)
+        memset(ptr, 0, count * size);
+    else
+        ptr = HEAP_CALLOC(count, size);
+#else
     void *ptr = HEAP_CALLOC(count, size);
+#endif
     if (heap_trace)
         printf("caller %p calloc %zu, %zu -> %p\n", __GET_CALLER(), count, size, ptr);
     return ptr;
@@ -210,6 +396,10 @@ void free(void *ptr) {
     if (heap_trace)
         printf("caller %p free %p\n", __GET_CALLER(), ptr);
 
+#if HEAP_MAGAZINES
+    if (ptr && heap_magazine_free(ptr))
+        return;
+#endif
     HEAP_FREE(ptr);
 }
 
@@ -230,6 +420,10 @@ void heap_delayed_free(void *ptr) {
 static void heap_dump(void) {
     HEAP_DUMP();
 
+#if HEAP_MAGAZINES
+    heap_magazine_dump();
+#endif
+
     printf("\tdelayed free list:\n");
     spin_lock_saved_state_t state;
     spin_lock_irqsave(&delayed_free_lock, state);
@@ -70,3 +70,41 @@ ssize_t iovec_to_membuf (uint8_t *buf, uint buf_len, const iovec_t *iov, uint io
 
     return (ssize_t) buf_pos;
 }
+
+/*
+ *  Copy single buffer into portion of iovec started from
+ *  given position
+ */
+ssize_t iovec_from_membuf (const iovec_t *iov, uint iov_cnt, uint iov_pos, const uint8_t *buf, uint buf_len) {
+    uint buf_pos = 0;
+
+    if (!buf || !iov)
+        return (ssize_t) ERR_INVALID_ARGS;
+
+    /* for all iovec */
+    for (uint i = 0; i < iov_cnt; i++, iov++) {
+
+        if  (iov_pos >= iov->iov_len) {
+            iov_pos -= iov->iov_len; /* skip whole chunks */
+            continue;
+        }
+
+        /* calc room left in current iov, limited to what is left in the buffer */
+        size_t to_copy = (size_t) (iov->iov_len - iov_pos);
+        if (to_copy > buf_len)
+            to_copy = buf_len;
+
+        /* copy data in */
+        memcpy ((uint8_t *)iov->iov_base + iov_pos, buf + buf_pos, to_copy);
+
+        buf_pos += to_copy;
+        buf_len -= to_copy;
+
+        if (buf_len == 0)
+            break;
+
+        iov_pos  = 0;
+    }
+
+    return (ssize_t) buf_pos;
+}
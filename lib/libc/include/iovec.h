@@ -23,5 +23,8 @@ ssize_t iovec_size(const iovec_t *iov, uint iov_cnt);
 ssize_t iovec_to_membuf(uint8_t *buf, uint buf_len,
                         const iovec_t *iov, uint iov_cnt, uint iov_pos);
 
+ssize_t iovec_from_membuf(const iovec_t *iov, uint iov_cnt, uint iov_pos,
+                          const uint8_t *buf, uint buf_len);
+
 __END_CDECLS
 
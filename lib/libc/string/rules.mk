@@ -13,6 +13,7 @@ C_STRING_OPS := \
 	strcmp \
 	strcoll \
 	strcpy \
+	strcspn \
 	strdup \
 	strerror \
 	strlcat \
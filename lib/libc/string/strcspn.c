@@ -0,0 +1,26 @@
+/*
+ * Copyright (c) 2008 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#include <string.h>
+#include <sys/types.h>
+
+size_t
+strcspn(char const *s, char const *reject) {
+    const char *p;
+    const char *r;
+    size_t count = 0;
+
+    for (p = s; *p != '\0'; ++p) {
+        for (r = reject; *r != '\0'; ++r) {
+            if (*p == *r)
+                return count;
+        }
+        ++count;
+    }
+
+    return count;
+}
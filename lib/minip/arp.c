@@ -8,6 +8,8 @@
 
 #include "minip-internal.h"
 
+#include <errno.h>
+#include <lk/err.h>
 #include <lk/list.h>
 #include <string.h>
 #include <malloc.h>
@@ -15,31 +17,178 @@
 #include <kernel/thread.h>
 #include <kernel/mutex.h>
 #include <lk/trace.h>
+#include <platform.h>
 
 #define LOCAL_TRACE 0
+
+/*
+ * Neighbor table. Sending to a host whose mac address isn't known yet never
+ * waits: the packet is parked on the host's entry, a request goes out and the
+ * parked packets are sent when the reply comes in. A single net timer resends
+ * requests that go unanswered and ages out entries. An entry that hasn't been
+ * heard from in a while is re-probed with unicast requests, and keeps being
+ * used meanwhile, before it is dropped.
+ */
+#define ARP_HASH_BUCKETS 16
+#define ARP_MAX_ENTRIES 64
+#define ARP_MAX_PENDING 16          /* packets parked per unresolved host */
+#define ARP_MAX_REQUESTS 3          /* requests sent before giving up on a host */
+#define ARP_RETRY_INTERVAL 100      /* msecs between requests */
+#define ARP_FAILED_HOLD 1000        /* msecs sends fail fast after a host didn't answer */
+#define ARP_ENTRY_TIMEOUT (5 * 60 * 1000) /* msecs a mac is trusted without hearing from it */
+#define ARP_MAX_PROBES 3            /* unicast requests sent before dropping a stale host */
+
+enum arp_state {
+    ARP_STATE_RESOLVING,
+    ARP_STATE_VALID,
+    ARP_STATE_FAILED,
+    ARP_STATE_PROBING,
+};
+
 typedef struct {
     struct list_node node;
     uint32_t addr;
     uint8_t mac[6];
+    uint8_t state;
+    uint8_t requests;               /* sent while resolving or probing */
+    lk_time_t updated;              /* last heard from, or last request sent while resolving or probing */
+    struct list_node pending;       /* pktbufs waiting for the mac */
+    uint pending_count;
 } arp_entry_t;
 
-static struct list_node arp_list = LIST_INITIAL_VALUE(arp_list);
+static struct list_node arp_table[ARP_HASH_BUCKETS];
+static uint arp_count;
 static mutex_t arp_mutex = MUTEX_INITIAL_VALUE(arp_mutex);
 
-void arp_cache_init(void) {}
+static net_timer_t arp_timer;
+static bool arp_timer_armed;
+static lk_time_t arp_timer_due;
+
+static struct {
+    ulong hits;
+    ulong misses;
+    ulong queued;
+    ulong queue_drops;
+    ulong requests;
+    ulong failures;
+    ulong expired;
+    ulong evictions;
+} arp_stats;
 
-static void mru_update(struct list_node *entry) {
-    if (arp_list.next == entry)
+static void arp_timer_cb(void *arg);
+
+void arp_cache_init(void) {
+    for (uint i = 0; i < ARP_HASH_BUCKETS; i++)
+        list_initialize(&arp_table[i]);
+}
+
+static struct list_node *arp_bucket(uint32_t addr) {
+    /* fibonacci hashing, the top bits of the product mix in every byte */
+    return &arp_table[(addr * 2654435761U) >> 28];
+}
+
+static arp_entry_t *arp_find_locked(uint32_t addr) {
+    arp_entry_t *arp;
+    list_for_every_entry(arp_bucket(addr), arp, arp_entry_t, node) {
+        if (arp->addr == addr)
+            return arp;
+    }
+    return NULL;
+}
+
+/* make sure the timer goes off no later than due */
+static void arp_timer_arm_locked(lk_time_t due) {
+    if (arp_timer_armed && !TIME_GT(arp_timer_due, due))
         return;
 
-    list_delete(entry);
-    list_add_head(&arp_list, entry);
+    arp_timer_armed = true;
+    arp_timer_due = due;
+    lk_time_t now = current_time();
+    net_timer_set(&arp_timer, arp_timer_cb, NULL, TIME_GT(due, now) ? due - now : 0);
+}
+
+static lk_time_t arp_entry_due(const arp_entry_t *arp) {
+    switch (arp->state) {
+        case ARP_STATE_RESOLVING:
+        case ARP_STATE_PROBING:
+            return arp->updated + ARP_RETRY_INTERVAL;
+        case ARP_STATE_FAILED:
+            return arp->updated + ARP_FAILED_HOLD;
+        default:
+            return arp->updated + ARP_ENTRY_TIMEOUT;
+    }
+}
+
+/* move an entry's parked packets to list, to be sent or freed without the lock */
+static void arp_take_pending_locked(arp_entry_t *arp, struct list_node *list) {
+    pktbuf_t *p;
+    while ((p = list_remove_head_type(&arp->pending, pktbuf_t, list)) != NULL)
+        list_add_tail(list, &p->list);
+    arp->pending_count = 0;
+}
+
+static void arp_free_locked(arp_entry_t *arp, struct list_node *drop) {
+    arp_take_pending_locked(arp, drop);
+    list_delete(&arp->node);
+    arp_count--;
+    free(arp);
+}
+
+static void arp_free_pkts(struct list_node *list) {
+    pktbuf_t *p;
+    while ((p = list_remove_head_type(list, pktbuf_t, list)) != NULL)
+        pktbuf_free(p, true);
+}
+
+static void arp_transmit(pktbuf_t *p, const uint8_t mac[6]) {
+    if (p->next && !(minip_eth_features & MINIP_ETH_FEATURE_SG) && minip_linearize(p) < 0) {
+        pktbuf_free(p, true);
+        return;
+    }
+
+    struct eth_hdr *eth = (struct eth_hdr *)p->data;
+    mac_addr_copy(eth->dst_mac, mac);
+    minip_tx_handler(minip_tx_arg, p);
+}
+
+/* a new entry, making room by throwing out the stalest settled one if the table is full */
+static arp_entry_t *arp_alloc_locked(uint32_t addr, struct list_node *drop) {
+    if (arp_count >= ARP_MAX_ENTRIES) {
+        arp_entry_t *victim = NULL;
+        arp_entry_t *arp;
+        for (uint i = 0; i < ARP_HASH_BUCKETS; i++) {
+            list_for_every_entry(&arp_table[i], arp, arp_entry_t, node) {
+                if (arp->state == ARP_STATE_RESOLVING)
+                    continue;
+                if (!victim || TIME_GT(victim->updated, arp->updated))
+                    victim = arp;
+            }
+        }
+        if (!victim)
+            return NULL;
+
+        arp_free_locked(victim, drop);
+        arp_stats.evictions++;
+    }
+
+    arp_entry_t *arp = malloc(sizeof(arp_entry_t));
+    if (!arp)
+        return NULL;
+
+    memset(arp, 0, sizeof(*arp));
+    arp->addr = addr;
+    list_initialize(&arp->pending);
+    list_add_head(arp_bucket(addr), &arp->node);
+    arp_count++;
+
+    return arp;
 }
 
 void arp_cache_update(uint32_t addr, const uint8_t mac[6]) {
     arp_entry_t *arp;
     ipv4_t ip;
-    bool found = false;
+    struct list_node send = LIST_INITIAL_VALUE(send);
+    struct list_node drop = LIST_INITIAL_VALUE(drop);
 
     ip.u = addr;
 
@@ -48,75 +197,65 @@ void arp_cache_update(uint32_t addr, const uint8_t mac[6]) {
         return;
     }
 
-    /* If the entry is in the cache update the address and move
-     * it to head */
     mutex_acquire(&arp_mutex);
-    list_for_every_entry(&arp_list, arp, arp_entry_t, node) {
-        if (arp->addr == addr) {
-            arp->addr = addr;
-            mru_update(&arp->node);
-            found = true;
-            break;
-        }
-    }
-
-    if (!found) {
+    arp = arp_find_locked(addr);
+    if (!arp) {
         LTRACEF("Adding %u.%u.%u.%u -> %02x:%02x:%02x:%02x:%02x:%02x to cache\n",
                 ip.b[0], ip.b[1], ip.b[2], ip.b[3],
                 mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
-        arp = malloc(sizeof(arp_entry_t));
+        arp = arp_alloc_locked(addr, &drop);
         if (arp == NULL) {
             goto err;
         }
-
-        arp->addr = addr;
-        mac_addr_copy(arp->mac, mac);
-        list_add_head(&arp_list, &arp->node);
     }
 
-err:
-    mutex_release(&arp_mutex);
-    return;
-}
+    mac_addr_copy(arp->mac, mac);
+    arp->state = ARP_STATE_VALID;
+    arp->updated = current_time();
 
-/* Looks up and returns a MAC address based on the provided ip addr */
-uint8_t *arp_cache_lookup(uint32_t addr) {
-    arp_entry_t *arp = NULL;
-    uint8_t *ret = NULL;
+    /* whatever was waiting on the answer can go now */
+    arp_take_pending_locked(arp, &send);
 
-    /* If the entry is in the cache update the address and move
-     * it to head */
-    mutex_acquire(&arp_mutex);
-    list_for_every_entry(&arp_list, arp, arp_entry_t, node) {
-        if (arp->addr == addr) {
-            mru_update(&arp->node);
-            ret = arp->mac;
-            break;
-        }
-    }
+    arp_timer_arm_locked(arp_entry_due(arp));
+
+err:
     mutex_release(&arp_mutex);
 
-    return ret;
+    pktbuf_t *p;
+    while ((p = list_remove_head_type(&send, pktbuf_t, list)) != NULL)
+        arp_transmit(p, mac);
+    arp_free_pkts(&drop);
 }
 
 void arp_cache_dump(void) {
     int i = 0;
     arp_entry_t *arp;
+    static const char *state_names[] = { "resolving", "valid", "failed", "probing" };
 
-    if (!list_is_empty(&arp_list)) {
-        list_for_every_entry(&arp_list, arp, arp_entry_t, node) {
-            ipv4_t ip;
-            ip.u = arp->addr;
-            printf("%2d: %u.%u.%u.%u -> %02x:%02x:%02x:%02x:%02x:%02x\n",
-                   i++, ip.b[0], ip.b[1], ip.b[2], ip.b[3],
-                   arp->mac[0], arp->mac[1], arp->mac[2], arp->mac[3], arp->mac[4], arp->mac[5]);
+    mutex_acquire(&arp_mutex);
+    lk_time_t now = current_time();
+    if (arp_count > 0) {
+        for (uint b = 0; b < ARP_HASH_BUCKETS; b++) {
+            list_for_every_entry(&arp_table[b], arp, arp_entry_t, node) {
+                ipv4_t ip;
+                ip.u = arp->addr;
+                printf("%2d: %u.%u.%u.%u -> %02x:%02x:%02x:%02x:%02x:%02x %s, age %u ms, %u pending\n",
+                       i++, ip.b[0], ip.b[1], ip.b[2], ip.b[3],
+                       arp->mac[0], arp->mac[1], arp->mac[2], arp->mac[3], arp->mac[4], arp->mac[5],
+                       state_names[arp->state], (uint)(now - arp->updated), arp->pending_count);
+            }
         }
     } else {
         printf("The arp table is empty\n");
     }
+    printf("hits %lu misses %lu queued %lu queue drops %lu requests %lu failures %lu expired %lu evictions %lu\n",
+           arp_stats.hits, arp_stats.misses, arp_stats.queued, arp_stats.queue_drops,
+           arp_stats.requests, arp_stats.failures, arp_stats.expired, arp_stats.evictions);
+    mutex_release(&arp_mutex);
 }
 
-int arp_send_request(uint32_t addr) {
+/* ask who has addr, broadcast or straight to the mac we think it has */
+static int arp_send_request_to(uint32_t addr, const uint8_t mac[6]) {
     pktbuf_t *p;
     struct eth_hdr *eth;
     struct arp_pkt *arp;
@@ -127,7 +266,7 @@ int arp_send_request(uint32_t addr) {
 
     eth = pktbuf_prepend(p, sizeof(struct eth_hdr));
     arp = pktbuf_append(p, sizeof(struct arp_pkt));
-    minip_build_mac_hdr(eth, bcast_mac, ETH_TYPE_ARP);
+    minip_build_mac_hdr(eth, mac, ETH_TYPE_ARP);
 
     arp->htype = htons(0x0001);
     arp->ptype = htons(0x0800);
@@ -137,38 +276,163 @@ int arp_send_request(uint32_t addr) {
     arp->spa = minip_get_ipaddr();
     arp->tpa = addr;
     minip_get_macaddr(arp->sha);
-    mac_addr_copy(arp->tha, bcast_mac);
+    mac_addr_copy(arp->tha, mac);
 
     minip_tx_handler(minip_tx_arg, p);
     return 0;
 }
 
-static void handle_arp_timeout_cb(void *arg) {
-    *(bool *)arg = true;
+int arp_send_request(uint32_t addr) {
+    return arp_send_request_to(addr, bcast_mac);
 }
 
-const uint8_t *arp_get_dest_mac(uint32_t host) {
-    const uint8_t *dst_mac = NULL;
-    bool arp_timeout = false;
-    net_timer_t arp_timeout_timer;
+/* resend unanswered requests, give up on hosts that never answer and re-probe
+ * or age out the rest */
+static void arp_timer_cb(void *arg) {
+    struct {
+        uint32_t addr;
+        uint8_t mac[6];
+    } resend[ARP_MAX_ENTRIES];
+    uint resend_count = 0;
+    struct list_node drop = LIST_INITIAL_VALUE(drop);
 
-    if (host == IPV4_BCAST) {
-        return bcast_mac;
-    }
+    mutex_acquire(&arp_mutex);
+    arp_timer_armed = false;
 
-    dst_mac = arp_cache_lookup(host);
-    if (dst_mac == NULL) {
-        arp_send_request(host);
-        memset(&arp_timeout_timer, 0, sizeof(arp_timeout_timer));
-        net_timer_set(&arp_timeout_timer, handle_arp_timeout_cb, &arp_timeout, 100);
-        while (!arp_timeout) {
-            dst_mac = arp_cache_lookup(host);
-            if (dst_mac) {
-                net_timer_cancel(&arp_timeout_timer);
-                break;
+    lk_time_t now = current_time();
+    bool have_next = false;
+    lk_time_t next = 0;
+    for (uint b = 0; b < ARP_HASH_BUCKETS; b++) {
+        arp_entry_t *arp, *temp;
+        list_for_every_entry_safe(&arp_table[b], arp, temp, arp_entry_t, node) {
+            if (TIME_GT(arp_entry_due(arp), now))
+                goto schedule;
+
+            switch (arp->state) {
+                case ARP_STATE_RESOLVING:
+                    if (arp->requests < ARP_MAX_REQUESTS) {
+                        arp->requests++;
+                        arp->updated = now;
+                        resend[resend_count].addr = arp->addr;
+                        mac_addr_copy(resend[resend_count++].mac, bcast_mac);
+                        arp_stats.requests++;
+                        break;
+                    }
+                    /* no answer, drop what was waiting and fail sends for a while */
+                    LTRACEF("no answer from %u.%u.%u.%u\n", IPV4_SPLIT(arp->addr));
+                    arp_take_pending_locked(arp, &drop);
+                    arp->state = ARP_STATE_FAILED;
+                    arp->updated = now;
+                    arp_stats.failures++;
+                    break;
+                case ARP_STATE_FAILED:
+                    arp_free_locked(arp, &drop);
+                    continue;
+                case ARP_STATE_VALID:
+                    /* not heard from in a while, check it is still there
+                     * without taking it away from the senders using it */
+                    arp->state = ARP_STATE_PROBING;
+                    arp->requests = 0;
+                /* fallthrough */
+                case ARP_STATE_PROBING:
+                    if (arp->requests < ARP_MAX_PROBES) {
+                        arp->requests++;
+                        arp->updated = now;
+                        resend[resend_count].addr = arp->addr;
+                        mac_addr_copy(resend[resend_count++].mac, arp->mac);
+                        arp_stats.requests++;
+                        break;
+                    }
+                    arp_free_locked(arp, &drop);
+                    arp_stats.expired++;
+                    continue;
+            }
+
+schedule:
+            if (!have_next || TIME_GT(next, arp_entry_due(arp))) {
+                next = arp_entry_due(arp);
+                have_next = true;
             }
         }
     }
 
-    return dst_mac;
+    if (have_next)
+        arp_timer_arm_locked(next);
+    mutex_release(&arp_mutex);
+
+    for (uint i = 0; i < resend_count; i++)
+        arp_send_request_to(resend[i].addr, resend[i].mac);
+    arp_free_pkts(&drop);
+}
+
+status_t arp_send_pkt(uint32_t host, pktbuf_t *p) {
+    uint8_t mac[6];
+    struct list_node drop = LIST_INITIAL_VALUE(drop);
+    status_t err = NO_ERROR;
+    bool request = false;
+
+    if (host == IPV4_BCAST || host == minip_get_broadcast()) {
+        arp_transmit(p, bcast_mac);
+        return NO_ERROR;
+    }
+
+    mutex_acquire(&arp_mutex);
+    arp_entry_t *arp = arp_find_locked(host);
+    if (arp && (arp->state == ARP_STATE_VALID || arp->state == ARP_STATE_PROBING)) {
+        arp_stats.hits++;
+        mac_addr_copy(mac, arp->mac);
+        mutex_release(&arp_mutex);
+
+        arp_transmit(p, mac);
+        return NO_ERROR;
+    }
+
+    if (arp && arp->state == ARP_STATE_FAILED) {
+        list_add_tail(&drop, &p->list);
+        err = -EHOSTUNREACH;
+        goto done;
+    }
+
+    if (!arp) {
+        /* first we've heard of it, ask around */
+        arp_stats.misses++;
+        arp = arp_alloc_locked(host, &drop);
+        if (!arp) {
+            list_add_tail(&drop, &p->list);
+            err = ERR_NO_MEMORY;
+            goto done;
+        }
+        arp->state = ARP_STATE_RESOLVING;
+        arp->requests = 1;
+        arp->updated = current_time();
+        arp_stats.requests++;
+        request = true;
+        arp_timer_arm_locked(arp_entry_due(arp));
+    }
+
+    /* what a chain points at may be gone by the time the reply comes in */
+    if (minip_linearize(p) < 0) {
+        list_add_tail(&drop, &p->list);
+        err = ERR_TOO_BIG;
+        goto done;
+    }
+
+    /* park it until the reply comes in, making room by dropping the oldest */
+    if (arp->pending_count >= ARP_MAX_PENDING) {
+        list_add_tail(&drop, &list_remove_head_type(&arp->pending, pktbuf_t, list)->list);
+        arp->pending_count--;
+        arp_stats.queue_drops++;
+    }
+    list_add_tail(&arp->pending, &p->list);
+    arp->pending_count++;
+    arp_stats.queued++;
+
+done:
+    mutex_release(&arp_mutex);
+
+    if (request)
+        arp_send_request(host);
+    arp_free_pkts(&drop);
+
+    return err;
 }
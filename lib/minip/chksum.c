@@ -9,19 +9,80 @@
 #include "minip-internal.h"
 
 /* XXX alternate implementation, merge */
+/* Sums 32 bits at a time into a 64 bit accumulator and folds once at the end,
+ * which comes out the same as summing the 16 bit words. _buf must be 16 bit
+ * aligned.
+ */
 uint16_t ones_sum16(uint32_t sum, const void *_buf, int len) {
-    const uint16_t *buf = _buf;
+    const uint8_t *buf = _buf;
+    uint64_t acc = sum;
 
-    while (len >= 2) {
-        sum += *buf++;
-        if (sum & 0x80000000)
-            sum = (sum & 0xffff) + (sum >> 16);
+    if (((uintptr_t)buf & 2) && len >= 2) {
+        acc += *(const uint16_t *)buf;
+        buf += 2;
+        len -= 2;
+    }
+
+    while (len >= 16) {
+        const uint32_t *w = (const uint32_t *)buf;
+        acc += (uint64_t)w[0] + w[1] + w[2] + w[3];
+        buf += 16;
+        len -= 16;
+    }
+
+    while (len >= 4) {
+        acc += *(const uint32_t *)buf;
+        buf += 4;
+        len -= 4;
+    }
+
+    if (len >= 2) {
+        acc += *(const uint16_t *)buf;
+        buf += 2;
         len -= 2;
     }
 
     if (len) {
-        uint16_t temp = htons((*(uint8_t *)buf) << 8);
-        sum += temp;
+        uint16_t temp = htons((*buf) << 8);
+        acc += temp;
+    }
+
+    while (acc >> 16)
+        acc = (acc & 0xffff) + (acc >> 16);
+
+    return acc;
+}
+
+static inline uint32_t swap_sum16(uint32_t sum) {
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return ((sum & 0xff) << 8) | (sum >> 8);
+}
+
+/* sum a pktbuf chain as if it were one buffer. Bytes starting at an odd
+ * offset land in the other half of each word, which in ones complement
+ * arithmetic is their own sum byte swapped. Buffers that reference caller
+ * memory can start on an odd address, sum those from the next byte on so
+ * the word loads stay aligned.
+ */
+uint16_t ones_sum16_pktbuf(uint32_t sum, const pktbuf_t *p) {
+    bool odd = false;
+
+    for (; p; p = p->next) {
+        const uint8_t *data = p->data;
+        size_t len = p->dlen;
+        uint32_t s;
+
+        if (((uintptr_t)data & 1) && len > 1)
+            s = ones_sum16(0, data, 1) + swap_sum16(ones_sum16(0, data + 1, len - 1));
+        else
+            s = ones_sum16(0, data, len);
+
+        if (odd)
+            s = swap_sum16(s);
+        sum += s;
+        if (len & 1)
+            odd = !odd;
     }
 
     while (sum >> 16)
@@ -40,6 +40,12 @@ void minip_start_dhcp(void);
 /* ethernet driver install hook */
 void minip_set_eth(tx_func_t tx_handler, void *tx_arg, const uint8_t *macaddr);
 
+/* what the installed driver can do with a packet beyond a flat buffer */
+#define MINIP_ETH_FEATURE_SG       (1<<0) // sends pktbuf chains
+#define MINIP_ETH_FEATURE_TX_CSUM  (1<<1) // finishes PKTBUF_FLAG_CKSUM_PARTIAL checksums
+#define MINIP_ETH_FEATURE_TSO4     (1<<2) // segments PKTBUF_FLAG_GSO_TCPV4 packets
+void minip_set_eth_features(uint32_t features);
+
 /* check or wait for minip to be configured */
 bool minip_is_configured(void);
 status_t minip_wait_for_configured(lk_time_t timeout);
@@ -62,6 +68,10 @@ void minip_set_hostname(const char *name);
 const char *minip_get_hostname(void);
 void minip_set_configured(void); // set by dhcp or static init to signal minip is ready to be used
 
+/* drop percent of the packets sent to our own address and delay the rest,
+ * to test the protocols over a bad link without one */
+void minip_set_loopback_loss(uint percent, lk_time_t delay);
+
 /* udp */
 typedef struct udp_socket udp_socket_t;
 
@@ -81,6 +91,35 @@ status_t tcp_close(tcp_socket_t *socket);
 ssize_t tcp_read(tcp_socket_t *socket, void *buf, size_t len);
 ssize_t tcp_write(tcp_socket_t *socket, const void *buf, size_t len);
 
+/* receive the next piece of the stream in a pktbuf the caller frees, without
+ * copying it when it arrived in order. returns its length */
+ssize_t tcp_read_pktbuf(tcp_socket_t *socket, pktbuf_t **p);
+
+/* queue len bytes of buf, at most 4MB, to be sent from where they are. done
+ * is called once they have all been acked or the socket is destroyed, and the
+ * nic has let go of every segment sent from them, after which buf is the
+ * caller's again. It runs with the socket locked or from the net timer thread,
+ * so it must not block or call back into tcp. On an error buf isn't used and
+ * done isn't called. */
+typedef void (*tcp_write_done_t)(void *arg);
+ssize_t tcp_write_ref(tcp_socket_t *socket, const void *buf, size_t len, tcp_write_done_t done, void *arg);
+
+/* bytes the application moved through a socket and how many of them tcp
+ * copied on the way */
+typedef struct tcp_copy_stats {
+    uint64_t tx_bytes;
+    uint64_t tx_copied;
+    uint64_t rx_bytes;
+    uint64_t rx_copied;
+} tcp_copy_stats_t;
+status_t tcp_get_copy_stats(tcp_socket_t *socket, tcp_copy_stats_t *stats);
+
+/* resize a socket's receive and transmit buffers, 0 to leave one alone.
+ * sizes are clamped to 4KB..4MB and the receive side is rounded up to a power
+ * of two. the transmit side can't change while tcp_write data is unacked.
+ * on a listen socket sets the sizes of the sockets it accepts. */
+status_t tcp_set_buffer_sizes(tcp_socket_t *socket, size_t rx_size, size_t tx_size);
+
 static inline status_t tcp_accept(tcp_socket_t *listen_socket, tcp_socket_t **accept_socket) {
     return tcp_accept_timeout(listen_socket, accept_socket, INFINITE_TIME);
 }
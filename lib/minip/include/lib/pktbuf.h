@@ -38,6 +38,10 @@ typedef struct pktbuf {
     pktbuf_free_callback cb;
     void *cb_args;
     u8 *buffer;
+    struct pktbuf *next; // next buffer of a scatter-gather chain
+    u16 csum_start;      // CKSUM_PARTIAL: where the checksum starts, from buffer
+    u16 csum_offset;     // CKSUM_PARTIAL: where it goes, from csum_start
+    u16 gso_size;        // GSO_TCPV4: payload bytes per segment on the wire
 } pktbuf_t;
 
 typedef struct pktbuf_pool_object {
@@ -52,6 +56,10 @@ typedef struct pktbuf_pool_object {
 #define PKTBUF_FLAG_CKSUM_UDP_GOOD (1<<2)
 #define PKTBUF_FLAG_EOF            (1<<3)
 #define PKTBUF_FLAG_CACHED         (1<<4)
+/* tx: the checksum field holds the pseudo header sum, the nic finishes it */
+#define PKTBUF_FLAG_CKSUM_PARTIAL  (1<<5)
+/* tx: a tcp super segment the nic cuts into gso_size pieces */
+#define PKTBUF_FLAG_GSO_TCPV4      (1<<6)
 
 /* Return the physical address offset of data in the packet */
 static inline u32 pktbuf_data_phys(pktbuf_t *p) {
@@ -72,14 +80,35 @@ static inline u32 pktbuf_avail_tail(pktbuf_t *p) {
 pktbuf_t *pktbuf_alloc(void);
 pktbuf_t *pktbuf_alloc_empty(void);
 
+// wrap len bytes of caller memory in a chain of pktbufs without copying it.
+// The memory must stay untouched until the chain is freed. cb, if set, is called
+// with cb_args as each pktbuf of the chain is freed, which a driver may do from
+// its interrupt handler.
+pktbuf_t *pktbuf_alloc_ref(const void *buf, size_t len, pktbuf_free_callback cb, void *cb_args);
+
+// move the buffer of a pool packet into a new pktbuf and give p a fresh pool
+// buffer in its place, so a driver can requeue p while the data lives on.
+// Never blocks, returns NULL if p isn't a pool buffer or the pool is empty.
+pktbuf_t *pktbuf_take(pktbuf_t *p);
+
 /* Add a buffer to an existing packet buffer */
 void pktbuf_add_buffer(pktbuf_t *p, u8 *buf, u32 len, uint32_t header_sz,
                        uint32_t flags, pktbuf_free_callback cb, void *cb_args);
 
-// return packet buffer to buffer pool
+// return packet buffer to buffer pool, along with the rest of its chain
 // returns number of threads woken up
 int pktbuf_free(pktbuf_t *p, bool reschedule);
 
+// append the chain next to the end of the chain p
+void pktbuf_chain(pktbuf_t *p, pktbuf_t *next);
+
+// total data length of a chain
+size_t pktbuf_chain_len(const pktbuf_t *p);
+
+// copy the rest of a chain into the tail of its first buffer and free it.
+// returns the number of bytes copied or ERR_TOO_BIG if they don't fit
+ssize_t pktbuf_linearize(pktbuf_t *p);
+
 // extend buffer by sz bytes, copied from data
 void pktbuf_append_data(pktbuf_t *p, const void *data, size_t sz);
 
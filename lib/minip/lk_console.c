@@ -66,6 +66,7 @@ static int cmd_minip(int argc, const console_cmd_args *argv) {
 minip_usage:
         printf("minip commands\n");
         printf("mi [a]rp                        dump arp table\n");
+        printf("mi [l]oss <percent> [delay]     drop and delay packets sent to ourselves\n");
         printf("mi [s]tatus                     print ip status\n");
         printf("mi [t]est [dest] [port] [cnt]   send <cnt> test packets to the dest:port\n");
     } else {
@@ -81,8 +82,17 @@ minip_usage:
                 printf("netmask: %u.%u.%u.%u\n", IPV4_SPLIT(minip_get_netmask()));
                 printf("broadcast: %u.%u.%u.%u\n", IPV4_SPLIT(minip_get_broadcast()));
                 printf("gateway: %u.%u.%u.%u\n", IPV4_SPLIT(minip_get_gateway()));
+                minip_tx_dump();
+                minip_loopback_dump();
             }
             break;
+            case 'l':
+                if (argc < 3) {
+                    goto minip_usage;
+                }
+                minip_set_loopback_loss(argv[2].u, (argc > 3) ? argv[3].u : 0);
+                minip_loopback_dump();
+                break;
             case 't': {
                 uint32_t count = 1;
                 uint32_t host = 0x0100000A; // 10.0.0.1
@@ -88,6 +88,13 @@ enum {
 
 extern tx_func_t minip_tx_handler;
 extern void *minip_tx_arg;
+extern uint32_t minip_eth_features;
+
+/* flatten a pktbuf chain in place, counting the bytes copied */
+status_t minip_linearize(pktbuf_t *p);
+/* the MINIP_ETH_FEATURE_* bits a packet to dest can rely on */
+uint32_t minip_tx_features(uint32_t dest);
+void minip_tx_dump(void);
 
 typedef struct udp_hdr udp_hdr_t;
 static const uint8_t bcast_mac[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
@@ -100,14 +107,20 @@ typedef union {
 // ARP cache
 void arp_cache_init(void);
 void arp_cache_update(uint32_t addr, const uint8_t mac[6]);
-uint8_t *arp_cache_lookup(uint32_t addr);
 void arp_cache_dump(void);
 int arp_send_request(uint32_t addr);
-const uint8_t *arp_get_dest_mac(uint32_t host);
+/* send a packet with its ethernet header built but for the destination to host
+ * on the local link, or park it until host answers an arp request. Always takes
+ * the packet */
+status_t arp_send_pkt(uint32_t host, pktbuf_t *p);
+
+// loopback of packets sent to our own address
+void minip_loopback_dump(void);
 
 uint16_t rfc1701_chksum(const uint8_t *buf, size_t len);
 uint16_t rfc768_chksum(struct ipv4_hdr *ipv4, udp_hdr_t *udp);
 uint16_t ones_sum16(uint32_t sum, const void *_buf, int len);
+uint16_t ones_sum16_pktbuf(uint32_t sum, const pktbuf_t *p);
 
 // Helper methods for building headers
 void minip_build_mac_hdr(struct eth_hdr *pkt, const uint8_t *dst, uint16_t type);
@@ -118,8 +131,6 @@ status_t minip_ipv4_send(pktbuf_t *p, uint32_t dest_addr, uint8_t proto);
 void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip);
 void udp_input(pktbuf_t *p, uint32_t src_ip);
 
-const uint8_t *get_dest_mac(uint32_t host);
-
 // timers
 typedef void (*net_timer_callback_t)(void *);
 
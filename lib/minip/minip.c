@@ -23,7 +23,12 @@
 #include <lk/list.h>
 #include <lk/init.h>
 #include <kernel/event.h>
+#include <kernel/mutex.h>
+#include <kernel/semaphore.h>
+#include <kernel/spinlock.h>
 #include <kernel/thread.h>
+#include <platform.h>
+#include <rand.h>
 
 // TODO
 // 1. Tear endian code out into something that flips words before/after tx/rx calls
@@ -45,6 +50,12 @@ static event_t minip_configured_event = EVENT_INITIAL_VALUE(minip_configured_eve
 /* This function is called by minip to send packets */
 tx_func_t minip_tx_handler;
 void *minip_tx_arg;
+uint32_t minip_eth_features;
+
+/* pktbuf chains flattened for a driver or the loopback that can't take them */
+static spin_lock_t linearize_lock = SPIN_LOCK_INITIAL_VALUE;
+static uint64_t linearized_pkts;
+static uint64_t linearized_bytes;
 
 static void dump_mac_address(const uint8_t *mac);
 static void dump_ipv4_addr(uint32_t addr);
@@ -160,6 +171,44 @@ void minip_set_eth(tx_func_t tx_handler, void *tx_arg, const uint8_t *macaddr) {
     mac_addr_copy(minip_mac, macaddr);
 }
 
+void minip_set_eth_features(uint32_t features) {
+    minip_eth_features = features;
+}
+
+uint32_t minip_tx_features(uint32_t dest) {
+    /* the loopback flattens chains and takes partial checksums on trust, it
+     * can't cut up a super segment */
+    if (dest == minip_ip && minip_ip != IPV4_NONE)
+        return MINIP_ETH_FEATURE_TX_CSUM;
+
+    return minip_eth_features;
+}
+
+status_t minip_linearize(pktbuf_t *p) {
+    ssize_t len = pktbuf_linearize(p);
+    if (len <= 0)
+        return len;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&linearize_lock, state);
+    linearized_pkts++;
+    linearized_bytes += len;
+    spin_unlock_irqrestore(&linearize_lock, state);
+
+    return NO_ERROR;
+}
+
+void minip_tx_dump(void) {
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&linearize_lock, state);
+    uint64_t pkts = linearized_pkts;
+    uint64_t bytes = linearized_bytes;
+    spin_unlock_irqrestore(&linearize_lock, state);
+
+    printf("tx: eth features 0x%x, linearized %llu bytes in %llu pkts\n",
+           minip_eth_features, bytes, pkts);
+}
+
 static uint16_t ipv4_payload_len(struct ipv4_hdr *pkt) {
     return (pkt->len - ((pkt->ver_ihl >> 4) * 5));
 }
@@ -186,107 +235,149 @@ void minip_build_ipv4_hdr(struct ipv4_hdr *ipv4, uint32_t dst, uint8_t proto, ui
     ipv4->chksum = rfc1701_chksum((uint8_t *) ipv4, sizeof(struct ipv4_hdr));
 }
 
-static int send_arp_request(uint32_t addr) {
-    pktbuf_t *p;
-    struct eth_hdr *eth;
-    struct arp_pkt *arp;
+/*
+ * Packets sent to our own address are turned around on a thread of their
+ * own rather than handed to the driver. Optionally drops and delays them so
+ * the tcp recovery paths can be exercised without a real lossy link.
+ */
+#define LOOPBACK_QUEUE_LEN 64
+
+static struct {
+    mutex_t lock;
+    semaphore_t sem;
+    thread_t *thread;
+    uint head, count;
+    struct {
+        pktbuf_t *p;
+        lk_time_t due;
+    } queue[LOOPBACK_QUEUE_LEN];
+
+    uint loss_percent;
+    lk_time_t delay;
+
+    ulong sent;
+    ulong dropped;
+} loopback = {
+    .lock = MUTEX_INITIAL_VALUE(loopback.lock),
+};
+
+static int loopback_thread(void *arg) {
+    for (;;) {
+        sem_wait(&loopback.sem);
+
+        mutex_acquire(&loopback.lock);
+        DEBUG_ASSERT(loopback.count > 0);
+        pktbuf_t *p = loopback.queue[loopback.head].p;
+        lk_time_t due = loopback.queue[loopback.head].due;
+        loopback.head = (loopback.head + 1) % LOOPBACK_QUEUE_LEN;
+        loopback.count--;
+        mutex_release(&loopback.lock);
+
+        lk_time_t now = current_time();
+        if (TIME_GT(due, now)) {
+            thread_sleep(due - now);
+        }
 
-    if ((p = pktbuf_alloc()) == NULL) {
-        return -1;
+        minip_rx_driver_callback(p);
+        pktbuf_free(p, true);
     }
 
-    eth = pktbuf_prepend(p, sizeof(struct eth_hdr));
-    arp = pktbuf_append(p, sizeof(struct arp_pkt));
-    minip_build_mac_hdr(eth, bcast_mac, ETH_TYPE_ARP);
-
-    arp->htype = htons(0x0001);
-    arp->ptype = htons(0x0800);
-    arp->hlen = 6;
-    arp->plen = 4;
-    arp->oper = htons(ARP_OPER_REQUEST);
-    arp->spa = minip_ip;
-    arp->tpa = addr;
-    mac_addr_copy(arp->sha, minip_mac);
-    mac_addr_copy(arp->tha, bcast_mac);
-
-    minip_tx_handler(minip_tx_arg, p);
     return 0;
 }
 
-static void handle_arp_timeout_cb(void *arg) {
-    *(bool *)arg = true;
-}
+static void loopback_send(pktbuf_t *p) {
+    DEBUG_ASSERT((p->flags & PKTBUF_FLAG_GSO_TCPV4) == 0);
 
-const uint8_t *get_dest_mac(uint32_t host) {
-    uint8_t *dst_mac = NULL;
-    bool arp_timeout = false;
-    net_timer_t arp_timeout_timer;
+    /* the receive path only parses flat packets */
+    if (minip_linearize(p) < 0) {
+        pktbuf_free(p, true);
+        return;
+    }
 
-    if (host == IPV4_BCAST) {
-        return bcast_mac;
+    /* the data never left memory, a checksum left for the nic can't be wrong */
+    if (p->flags & PKTBUF_FLAG_CKSUM_PARTIAL) {
+        p->flags &= ~PKTBUF_FLAG_CKSUM_PARTIAL;
+        p->flags |= PKTBUF_FLAG_CKSUM_TCP_GOOD | PKTBUF_FLAG_CKSUM_UDP_GOOD;
     }
 
-    dst_mac = arp_cache_lookup(host);
-    if (dst_mac == NULL) {
-        send_arp_request(host);
-        memset(&arp_timeout_timer, 0, sizeof(arp_timeout_timer));
-        net_timer_set(&arp_timeout_timer, handle_arp_timeout_cb, &arp_timeout, 100);
-        while (!arp_timeout) {
-            dst_mac = arp_cache_lookup(host);
-            if (dst_mac) {
-                net_timer_cancel(&arp_timeout_timer);
-                break;
-            }
-        }
+    mutex_acquire(&loopback.lock);
+    if (!loopback.thread) {
+        sem_init(&loopback.sem, 0);
+        loopback.thread = thread_create("minip loopback", loopback_thread, NULL,
+                                        HIGH_PRIORITY, DEFAULT_STACK_SIZE);
+        thread_detach_and_resume(loopback.thread);
+    }
+
+    if (loopback.count == LOOPBACK_QUEUE_LEN ||
+            (loopback.loss_percent && (uint)(rand() % 100) < loopback.loss_percent)) {
+        loopback.dropped++;
+        mutex_release(&loopback.lock);
+        pktbuf_free(p, true);
+        return;
     }
 
-    return dst_mac;
+    uint i = (loopback.head + loopback.count) % LOOPBACK_QUEUE_LEN;
+    loopback.queue[i].p = p;
+    loopback.queue[i].due = current_time() + loopback.delay;
+    loopback.count++;
+    loopback.sent++;
+    mutex_release(&loopback.lock);
+
+    sem_post(&loopback.sem, true);
+}
+
+void minip_set_loopback_loss(uint percent, lk_time_t delay) {
+    mutex_acquire(&loopback.lock);
+    loopback.loss_percent = MIN(percent, 100U);
+    loopback.delay = delay;
+    mutex_release(&loopback.lock);
+}
+
+void minip_loopback_dump(void) {
+    mutex_acquire(&loopback.lock);
+    printf("loopback: loss %u%% delay %u ms, sent %lu dropped %lu queued %u\n",
+           loopback.loss_percent, (uint)loopback.delay, loopback.sent, loopback.dropped,
+           loopback.count);
+    mutex_release(&loopback.lock);
 }
 
 status_t minip_ipv4_send(pktbuf_t *p, uint32_t dest_addr, uint8_t proto) {
-    status_t ret = 0;
-    size_t data_len = p->dlen;
-    const uint8_t *dst_mac;
+    size_t data_len = pktbuf_chain_len(p);
 
     struct ipv4_hdr *ip = pktbuf_prepend(p, sizeof(struct ipv4_hdr));
     struct eth_hdr *eth = pktbuf_prepend(p, sizeof(struct eth_hdr));
 
-    // are we sending a broadcast packet?
-    if (dest_addr == IPV4_BCAST || dest_addr == minip_broadcast) {
-        dst_mac = bcast_mac;
-        goto ready;
+    // to ourselves?
+    if (dest_addr == minip_ip && minip_ip != IPV4_NONE) {
+        minip_build_mac_hdr(eth, minip_mac, ETH_TYPE_IPV4);
+        minip_build_ipv4_hdr(ip, dest_addr, proto, data_len);
+        loopback_send(p);
+        return 0;
     }
 
     // is this a local subnet packet or do we need to send to the router?
+    // broadcasts stay on the link
     uint32_t target_addr = dest_addr;
-    if ((dest_addr & minip_netmask) != (minip_ip & minip_netmask)) {
+    if (dest_addr != IPV4_BCAST && dest_addr != minip_broadcast &&
+            (dest_addr & minip_netmask) != (minip_ip & minip_netmask)) {
         // need to use the gateway
         if (minip_gateway == IPV4_NONE) {
+            pktbuf_free(p, true);
             return ERR_NOT_FOUND; // TODO: better error code
         }
 
         target_addr = minip_gateway;
     }
 
-    dst_mac = arp_get_dest_mac(target_addr);
-    if (!dst_mac) {
-        pktbuf_free(p, true);
-        ret = -EHOSTUNREACH;
-        goto err;
-    }
-
-ready:
     if (LOCAL_TRACE) {
         printf("sending ipv4\n");
     }
 
-    minip_build_mac_hdr(eth, dst_mac, ETH_TYPE_IPV4);
+    // the destination mac is filled in once arp knows it
+    minip_build_mac_hdr(eth, bcast_mac, ETH_TYPE_IPV4);
     minip_build_ipv4_hdr(ip, dest_addr, proto, data_len);
 
-    minip_tx_handler(minip_tx_arg, p);
-
-err:
-    return ret;
+    return arp_send_pkt(target_addr, p);
 }
 
 /* Swap the dst/src ip addresses and send an ICMP ECHO REPLY with the same payload.
@@ -311,7 +402,7 @@ static void send_ping_reply(uint32_t ipaddr, struct icmp_pkt *req, size_t reqdat
 
     len = sizeof(struct icmp_pkt) + reqdatalen;
 
-    minip_build_mac_hdr(eth, arp_cache_lookup(ipaddr), ETH_TYPE_IPV4);
+    minip_build_mac_hdr(eth, bcast_mac, ETH_TYPE_IPV4);
     minip_build_ipv4_hdr(ip, ipaddr, IP_PROTO_ICMP, len);
 
     icmp->type = ICMP_ECHO_REPLY;
@@ -320,7 +411,7 @@ static void send_ping_reply(uint32_t ipaddr, struct icmp_pkt *req, size_t reqdat
     icmp->chksum = 0;
     icmp->chksum = rfc1701_chksum((uint8_t *) icmp, len);
 
-    minip_tx_handler(minip_tx_arg, p);
+    arp_send_pkt(ipaddr, p);
 }
 
 static void dump_ipv4_addr(uint32_t addr) {
@@ -438,6 +529,11 @@ __NO_INLINE static int handle_arp_pkt(pktbuf_t *p) {
             struct arp_pkt *rarp;
 
             if (memcmp(&arp->tpa, &minip_ip, sizeof(minip_ip)) == 0) {
+                /* they'll likely talk to us next, save asking them back */
+                uint32_t addr;
+                memcpy(&addr, &arp->spa, sizeof(addr)); // unaligned word
+                arp_cache_update(addr, arp->sha);
+
                 if ((rp = pktbuf_alloc()) == NULL) {
                     break;
                 }
@@ -9,6 +9,7 @@
 
 #include <assert.h>
 #include <lk/debug.h>
+#include <lk/err.h>
 #include <lk/trace.h>
 #include <printf.h>
 #include <string.h>
@@ -46,6 +47,20 @@ static void *get_pool_object(void) {
 
 }
 
+/* Same, but give up rather than wait for the pool to refill. */
+static void *try_get_pool_object(void) {
+    pool_t *entry;
+    spin_lock_saved_state_t state;
+
+    if (sem_trywait(&pktbuf_sem) != NO_ERROR)
+        return NULL;
+    spin_lock_irqsave(&lock, state);
+    entry = pool_alloc(&pktbuf_pool);
+    spin_unlock_irqrestore(&lock, state);
+
+    return entry;
+}
+
 /* Return an object to thje pktbuf object pool. */
 static void free_pool_object(pktbuf_pool_object_t *entry, bool reschedule) {
     DEBUG_ASSERT(entry);
@@ -129,19 +144,129 @@ void pktbuf_reset(pktbuf_t *p, uint32_t header_sz) {
 pktbuf_t *pktbuf_alloc_empty(void) {
     pktbuf_t *p = (pktbuf_t *) get_pool_object();
 
+    memset(p, 0, sizeof(pktbuf_t));
     p->flags = PKTBUF_FLAG_EOF;
     return p;
 }
 
+/* Reference memory owned by the caller. A buffer that crosses into physically
+ * discontiguous pages is split so each pktbuf maps to a single dma range.
+ */
+pktbuf_t *pktbuf_alloc_ref(const void *buf, size_t len, pktbuf_free_callback cb, void *cb_args) {
+    DEBUG_ASSERT(buf);
+    DEBUG_ASSERT(len > 0);
+
+    pktbuf_t *head = NULL;
+    const u8 *ptr = buf;
+    while (len > 0) {
+        size_t chunk = len;
+#if WITH_KERNEL_VM
+        vaddr_t va = (vaddr_t)ptr;
+        paddr_t pa = vaddr_to_paddr((void *)ptr);
+        size_t contig = PAGE_SIZE - (va % PAGE_SIZE);
+        while (contig < len &&
+                vaddr_to_paddr((void *)(va + contig)) == pa - (va % PAGE_SIZE) + contig) {
+            contig += PAGE_SIZE;
+        }
+        chunk = MIN(contig, len);
+#endif
+
+        pktbuf_t *p = pktbuf_alloc_empty();
+        pktbuf_add_buffer(p, (u8 *)ptr, chunk, 0, 0, cb, cb_args);
+        p->dlen = chunk;
+
+        if (head)
+            pktbuf_chain(head, p);
+        else
+            head = p;
+
+        ptr += chunk;
+        len -= chunk;
+    }
+
+    return head;
+}
+
+pktbuf_t *pktbuf_take(pktbuf_t *p) {
+    DEBUG_ASSERT(p);
+
+    if (p->cb != free_pktbuf_buf_cb || p->next)
+        return NULL;
+
+    pktbuf_t *q = try_get_pool_object();
+    if (!q)
+        return NULL;
+
+    void *buf = try_get_pool_object();
+    if (!buf) {
+        free_pool_object((pktbuf_pool_object_t *)q, false);
+        return NULL;
+    }
+
+    *q = *p;
+    list_clear_node(&q->list);
+    pktbuf_add_buffer(p, buf, PKTBUF_SIZE, PKTBUF_MAX_HDR, 0, free_pktbuf_buf_cb, NULL);
+
+    return q;
+}
+
 int pktbuf_free(pktbuf_t *p, bool reschedule) {
     DEBUG_ASSERT(p);
 
-    if (p->cb) {
-        p->cb(p->buffer, p->cb_args);
+    int count = 0;
+    while (p) {
+        pktbuf_t *next = p->next;
+
+        if (p->cb) {
+            p->cb(p->buffer, p->cb_args);
+        }
+        free_pool_object((pktbuf_pool_object_t *)p, false);
+        count++;
+
+        p = next;
     }
-    free_pool_object((pktbuf_pool_object_t *)p, false);
 
-    return 1;
+    return count;
+}
+
+void pktbuf_chain(pktbuf_t *p, pktbuf_t *next) {
+    DEBUG_ASSERT(p);
+    DEBUG_ASSERT(next);
+
+    while (p->next)
+        p = p->next;
+
+    p->next = next;
+    p->flags &= ~PKTBUF_FLAG_EOF;
+}
+
+size_t pktbuf_chain_len(const pktbuf_t *p) {
+    size_t len = 0;
+
+    for (; p; p = p->next)
+        len += p->dlen;
+
+    return len;
+}
+
+ssize_t pktbuf_linearize(pktbuf_t *p) {
+    DEBUG_ASSERT(p);
+
+    if (!p->next)
+        return 0;
+
+    size_t len = pktbuf_chain_len(p->next);
+    if (pktbuf_avail_tail(p) < len)
+        return ERR_TOO_BIG;
+
+    for (pktbuf_t *q = p->next; q; q = q->next)
+        pktbuf_append_data(p, q->data, q->dlen);
+
+    pktbuf_free(p->next, false);
+    p->next = NULL;
+    p->flags |= PKTBUF_FLAG_EOF;
+
+    return len;
 }
 
 void pktbuf_append_data(pktbuf_t *p, const void *data, size_t sz) {
@@ -198,9 +323,9 @@ void pktbuf_consume_tail(pktbuf_t *p, size_t sz) {
 }
 
 void pktbuf_dump(pktbuf_t *p) {
-    printf("pktbuf data %p, buffer %p, dlen %u, data offset %lu, phys_base %p\n",
+    printf("pktbuf data %p, buffer %p, dlen %u, data offset %lu, phys_base %p, next %p, flags 0x%x\n",
            p->data, p->buffer, p->dlen, (uintptr_t) p->data - (uintptr_t) p->buffer,
-           (void *)p->phys_base);
+           (void *)p->phys_base, p->next, p->flags);
 }
 
 static void pktbuf_init(uint level) {
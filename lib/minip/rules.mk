@@ -6,7 +6,8 @@ MODULE_DEPS := \
 	lib/cbuf \
 	lib/iovec \
 	lib/libcpp \
-	lib/pool
+	lib/pool \
+	lib/slab
 
 MODULE_SRCS += \
 	$(LOCAL_DIR)/arp.c \
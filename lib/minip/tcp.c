@@ -13,15 +13,20 @@
 #include <lk/compiler.h>
 #include <stdlib.h>
 #include <lk/err.h>
+#include <stddef.h>
 #include <string.h>
 #include <sys/types.h>
 #include <lk/console_cmd.h>
 #include <lib/cbuf.h>
+#include <lib/slab.h>
 #include <kernel/mutex.h>
+#include <kernel/rwlock.h>
 #include <kernel/semaphore.h>
+#include <kernel/thread.h>
 #include <arch/ops.h>
 #include <platform.h>
 #include <arch/atomic.h>
+#include <lk/pow2.h>
 
 #define LOCAL_TRACE 0
 
@@ -44,11 +49,32 @@ typedef struct tcp_pseudo_header {
     uint16_t tcp_length;
 } __PACKED tcp_pseudo_header_t;
 
-typedef struct tcp_mss_option {
-    uint8_t kind; /* 0x2 */
-    uint8_t len;  /* 0x4 */
-    uint16_t mss;
-} __PACKED tcp_mss_option_t;
+enum {
+    TCP_OPTION_EOL = 0,
+    TCP_OPTION_NOP = 1,
+    TCP_OPTION_MSS = 2,
+    TCP_OPTION_WINDOW_SCALE = 3,     // rfc 7323
+    TCP_OPTION_SACK_PERMITTED = 4,   // rfc 2018
+    TCP_OPTION_SACK = 5,
+};
+
+#define TCP_MAX_SACK_BLOCKS (4) // as many as fit in the 40 bytes of options
+#define TCP_MAX_SEQ_RANGES (8)
+
+/* a span of sequence space, end exclusive */
+typedef struct tcp_seq_range {
+    uint32_t start;
+    uint32_t end;
+} tcp_seq_range_t;
+
+/* what we understood from the options of an incoming segment */
+typedef struct tcp_options {
+    uint16_t mss;           // 0 if not present
+    int      window_scale;  // -1 if not present
+    bool     sack_permitted;
+    uint     sack_count;
+    tcp_seq_range_t sack[TCP_MAX_SACK_BLOCKS];
+} tcp_options_t;
 
 typedef enum tcp_state {
     STATE_CLOSED,
@@ -73,6 +99,28 @@ typedef enum tcp_flags {
     PKT_URG = 32
 } tcp_flags_t;
 
+/* caller memory queued by tcp_write_ref, sent from where it is until acked */
+typedef struct tcp_tx_ref {
+    struct list_node node;
+    uint32_t seq; // where buf starts in the stream
+    const uint8_t *buf;
+    uint32_t len;
+    volatile int inflight; // pktbufs pointing into buf that the nic hasn't freed yet
+    tcp_write_done_t done;
+    void *arg;
+} tcp_tx_ref_t;
+
+/* the ring tcp_write copies into. Segments point into it, so each span counts
+ * the pktbufs still out on it, separately for the two laps of the ring a span
+ * can have bytes of at once */
+#define TCP_TX_RING_SPANS (8)
+typedef struct tcp_tx_ring {
+    struct list_node node; // on the retired list once the socket lets go of it
+    uint32_t span_size;
+    volatile int inflight[TCP_TX_RING_SPANS][2];
+    uint8_t buf[];
+} tcp_tx_ring_t;
+
 typedef struct tcp_socket {
     struct list_node node;
 
@@ -87,6 +135,11 @@ typedef struct tcp_socket {
 
     uint32_t mss;
 
+    /* negotiated on the syn, zero if they didn't offer window scaling */
+    uint8_t  snd_wscale; // shift of the windows they advertise
+    uint8_t  rcv_wscale; // shift of the windows we advertise
+    bool     sack_ok;
+
     /* rx */
     uint32_t rx_win_size;
     uint32_t rx_win_low;
@@ -95,18 +148,56 @@ typedef struct tcp_socket {
     cbuf_t   rx_buffer;
     event_t  rx_event;
     int      rx_full_mss_count; // number of packets we have received in a row with a full mss
+    tcp_seq_range_t rx_ooo[TCP_MAX_SEQ_RANGES]; // out of order data parked in rx_buffer past its head
+    uint     rx_ooo_count;
+    uint32_t rx_ooo_recent; // sequence of the latest out of order segment, its range is reported first
+    struct list_node rx_pkts; // in order segments kept in their pktbufs, ahead of rx_buffer
+    uint32_t rx_pkt_bytes;
+    uint     rx_pkt_count;
     net_timer_t ack_delay_timer;
 
     /* tx */
     uint32_t tx_win_low;  // low side of the acked window
     uint32_t tx_win_high; // tx_win_low + their advertised window size
     uint32_t tx_highest_seq; // highest sequence we have txed them
-    uint8_t  *tx_buffer;  // our outgoing buffer
-    uint32_t tx_buffer_size; // size of tx_buffer
-    uint32_t tx_buffer_offset; // offset into the buffer to append new data to
+    uint32_t tx_next_seq; // next sequence to send, behind tx_highest_seq after a timeout
+    tcp_tx_ring_t *tx_ring; // our outgoing buffer
+    uint32_t tx_buffer_size; // size of the ring
+    uint32_t tx_buffer_start; // where the first unacked ring byte is in the ring
+    uint     tx_buffer_lap; // parity of the lap of the ring tx_buffer_start is on
+    uint32_t tx_buffer_offset; // bytes queued past tx_win_low, ring and refs
+    uint32_t tx_ring_used; // of those, bytes in the ring
+    struct list_node tx_refs; // tcp_tx_ref_t in stream order, the ring holds the bytes between them
     event_t  tx_event;
+    event_t  tx_empty_event; // everything written has been acked
     net_timer_t retransmit_timer;
 
+    /* congestion control, reno with newreno partial acks */
+    uint32_t cwnd;
+    uint32_t ssthresh;
+    uint32_t dup_acks;
+    bool     in_recovery;
+    uint32_t recover; // tx_highest_seq when fast recovery started
+    tcp_seq_range_t tx_sacked[TCP_MAX_SEQ_RANGES]; // what they've selectively acked past tx_win_low
+    uint     tx_sacked_count;
+    uint32_t sack_rexmit_next; // holes below this were already resent in this recovery
+
+    /* round trip time estimation (rfc 6298), one segment timed at a time */
+    uint32_t srtt;    // usecs, 0 until the first sample
+    uint32_t rttvar;  // usecs
+    lk_time_t rto;    // msecs
+    bool     rtt_timing;
+    uint32_t rtt_seq; // sample taken when this is acked
+    lk_bigtime_t rtt_start;
+
+    /* stats */
+    uint32_t retransmits;
+    uint32_t fast_retransmits;
+    uint32_t timeouts;
+    uint32_t sack_retransmits;
+    uint32_t rx_ooo_segments;
+    tcp_copy_stats_t copies;
+
     /* listen accept */
     semaphore_t accept_sem;
     struct tcp_socket *accepted;
@@ -120,10 +211,24 @@ typedef struct tcp_socket {
 #define DEFAULT_MSS (1460)
 #define DEFAULT_RX_WINDOW_SIZE (8192)
 #define DEFAULT_TX_BUFFER_SIZE (8192)
-
-#define RETRANSMIT_TIMEOUT (50)
+#define TCP_TX_MAX_PIECES (16) // pieces of the ring and refs a segment is gathered from
+#define TCP_TX_REAP_INTERVAL (1) // msecs between checks on memory the nic still holds
+#define TCP_RX_MAX_PKTS (32)   // received pktbufs a socket may hold on to, 2 pool objects each
+#define TCP_TSO_MAX_SIZE (0xffff - sizeof(struct ipv4_hdr) - 60) // super segment payload, leaves room for any options
+#define TCP_MIN_BUFFER_SIZE (4096)
+#define TCP_MAX_BUFFER_SIZE (4 * 1024 * 1024)
+
+/* always offered, enough to advertise the largest buffer a socket may grow to */
+#define TCP_WINDOW_SCALE (6)
+STATIC_ASSERT(((TCP_MAX_BUFFER_SIZE - 1) >> TCP_WINDOW_SCALE) <= 0xffff);
+
+#define TCP_INITIAL_RTO (1000)
+#define TCP_MIN_RTO (200)
+#define TCP_MAX_RTO (60000)
+#define TCP_DUP_ACK_THRESHOLD (3)
 #define DELAYED_ACK_TIMEOUT (50)
 #define TIME_WAIT_TIMEOUT (60000) // 1 minute
+#define CLOSE_LINGER_TIMEOUT (30000)
 
 #define FORCE_TCP_CHECKSUM (false)
 
@@ -132,8 +237,11 @@ typedef struct tcp_socket {
 #define SEQUENCE_GT(a, b) ((int32_t)((a) - (b)) > 0)
 #define SEQUENCE_LT(a, b) ((int32_t)((a) - (b)) < 0)
 
-static mutex_t tcp_socket_list_lock = MUTEX_INITIAL_VALUE(tcp_socket_list_lock);
+/* every incoming segment looks up its socket, only open and close modify the list */
+static rwlock_t tcp_socket_list_lock = RWLOCK_INITIAL_VALUE(tcp_socket_list_lock);
 static struct list_node tcp_socket_list = LIST_INITIAL_VALUE(tcp_socket_list);
+static slab_cache_t tcp_socket_cache =
+    SLAB_CACHE_INITIAL_VALUE(tcp_socket_cache, "tcp_socket_t", sizeof(tcp_socket_t), __alignof(tcp_socket_t), NULL, NULL);
 
 static bool tcp_debug = false;
 
@@ -141,13 +249,18 @@ static bool tcp_debug = false;
 static tcp_socket_t *lookup_socket(ipv4_addr remote_ip, ipv4_addr local_ip, uint16_t remote_port, uint16_t local_port);
 static void add_socket_to_list(tcp_socket_t *s);
 static void remove_socket_from_list(tcp_socket_t *s);
-static tcp_socket_t *create_tcp_socket(bool alloc_buffers);
-static status_t tcp_send(ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip, uint16_t src_port, const void *buf,
-                         size_t len, tcp_flags_t flags, const void *options, size_t options_length, uint32_t ack, uint32_t sequence, uint16_t window_size);
-static status_t tcp_socket_send(tcp_socket_t *s, const void *data, size_t len, tcp_flags_t flags, const void *options, size_t options_length, uint32_t sequence);
-static void handle_data(tcp_socket_t *s, const void *data, size_t len, uint32_t sequence);
+static tcp_socket_t *create_tcp_socket(bool alloc_buffers, uint32_t rx_size, uint32_t tx_size);
+static status_t tcp_send(ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip, uint16_t src_port, pktbuf_t *data,
+                         tcp_flags_t flags, const void *options, size_t options_length, uint32_t ack, uint32_t sequence, uint16_t window_size,
+                         uint32_t mss);
+static status_t tcp_socket_send(tcp_socket_t *s, pktbuf_t *data, tcp_flags_t flags, const void *options, size_t options_length, uint32_t sequence);
+static uint32_t tcp_socket_send_tx(tcp_socket_t *s, uint32_t offset, uint32_t len, tcp_flags_t flags);
+static void handle_data(tcp_socket_t *s, pktbuf_t *p, uint32_t sequence);
 static void send_ack(tcp_socket_t *s);
-static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size);
+static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size, size_t data_len, const tcp_options_t *opts);
+static ssize_t tcp_write_pending_data(tcp_socket_t *s);
+static ssize_t tcp_retransmit(tcp_socket_t *s);
+static ssize_t tcp_sack_retransmit(tcp_socket_t *s);
 static void handle_retransmit_timeout(void *_s);
 static void handle_time_wait_timeout(void *_s);
 static void handle_delayed_ack_timeout(void *_s);
@@ -156,9 +269,9 @@ static void tcp_wakeup_waiters(tcp_socket_t *s);
 static void inc_socket_ref(tcp_socket_t *s);
 static bool dec_socket_ref(tcp_socket_t *s);
 
-static uint16_t cksum_pheader(const tcp_pseudo_header_t *pheader, const void *buf, size_t len) {
+static uint16_t cksum_pheader(const tcp_pseudo_header_t *pheader, const pktbuf_t *p) {
     uint16_t checksum = ones_sum16(0, pheader, sizeof(*pheader));
-    return ~ones_sum16(checksum, buf, len);
+    return ~ones_sum16_pktbuf(checksum, p);
 }
 
 __NO_INLINE static void dump_tcp_header(const tcp_header_t *header) {
@@ -209,17 +322,28 @@ static void dump_socket(tcp_socket_t *s) {
         printf("\trx: wsize %u wlo %u whi %u (%u)\n",
                s->rx_win_size, s->rx_win_low, s->rx_win_high,
                s->rx_win_high - s->rx_win_low);
-        printf("\ttx: wlo %u whi %u (%u) highest_seq %u (%u) bufsize %u bufoff %u\n",
+        printf("\ttx: wlo %u whi %u (%u) highest_seq %u (%u) bufsize %u bufoff %u ring %u\n",
                s->tx_win_low, s->tx_win_high, s->tx_win_high - s->tx_win_low,
                s->tx_highest_seq, s->tx_highest_seq - s->tx_win_low,
-               s->tx_buffer_size, s->tx_buffer_offset);
+               s->tx_buffer_size, s->tx_buffer_offset, s->tx_ring_used);
+        printf("\tcwnd %u ssthresh %u%s srtt %u rttvar %u usecs rto %u msecs\n",
+               s->cwnd, s->ssthresh, s->in_recovery ? " (recovery)" : "",
+               s->srtt, s->rttvar, (uint)s->rto);
+        printf("\tretransmits %u fast %u sack %u timeouts %u\n",
+               s->retransmits, s->fast_retransmits, s->sack_retransmits, s->timeouts);
+        printf("\twscale %u/%u%s, ooo segments %u, %u ranges held, %u sacked ranges\n",
+               s->snd_wscale, s->rcv_wscale, s->sack_ok ? " sack" : "",
+               s->rx_ooo_segments, s->rx_ooo_count, s->tx_sacked_count);
+        printf("\tcopied tx %llu of %llu bytes, rx %llu of %llu bytes, %u rx pkts held (%u bytes)\n",
+               s->copies.tx_copied, s->copies.tx_bytes, s->copies.rx_copied, s->copies.rx_bytes,
+               s->rx_pkt_count, s->rx_pkt_bytes);
     }
 }
 
 static tcp_socket_t *lookup_socket(ipv4_addr remote_ip, ipv4_addr local_ip, uint16_t remote_port, uint16_t local_port) {
     LTRACEF_LEVEL(2, "remote ip 0x%x local ip 0x%x remote port %u local port %u\n", remote_ip, local_ip, remote_port, local_port);
 
-    mutex_acquire(&tcp_socket_list_lock);
+    rwlock_acquire_read(&tcp_socket_list_lock);
 
     /* XXX replace with something faster, like a hash table */
     tcp_socket_t *s = NULL;
@@ -255,7 +379,7 @@ out:
     if (s)
         inc_socket_ref(s);
 
-    mutex_release(&tcp_socket_list_lock);
+    rwlock_release_read(&tcp_socket_list_lock);
 
     return s;
 }
@@ -264,23 +388,162 @@ static void add_socket_to_list(tcp_socket_t *s) {
     DEBUG_ASSERT(s);
     DEBUG_ASSERT(s->ref > 0); // we should have implicitly bumped the ref when creating the socket
 
-    mutex_acquire(&tcp_socket_list_lock);
+    rwlock_acquire_write(&tcp_socket_list_lock);
 
     list_add_head(&tcp_socket_list, &s->node);
 
-    mutex_release(&tcp_socket_list_lock);
+    rwlock_release_write(&tcp_socket_list_lock);
 }
 
 static void remove_socket_from_list(tcp_socket_t *s) {
     DEBUG_ASSERT(s);
     DEBUG_ASSERT(s->ref > 0);
 
-    mutex_acquire(&tcp_socket_list_lock);
+    rwlock_acquire_write(&tcp_socket_list_lock);
 
     DEBUG_ASSERT(list_in_list(&s->node));
     list_delete(&s->node);
 
-    mutex_release(&tcp_socket_list_lock);
+    rwlock_release_write(&tcp_socket_list_lock);
+}
+
+/* tx memory the socket is done with but the nic may still be reading, given
+ * back once the last pktbuf pointing into it has been freed. Drivers free tx
+ * pktbufs from their interrupt handlers, so all the free callback does is drop
+ * a count, and a timer comes around to see what's free */
+static struct list_node tcp_tx_retired_refs = LIST_INITIAL_VALUE(tcp_tx_retired_refs);
+static struct list_node tcp_tx_retired_rings = LIST_INITIAL_VALUE(tcp_tx_retired_rings);
+static mutex_t tcp_tx_retired_lock = MUTEX_INITIAL_VALUE(tcp_tx_retired_lock);
+static net_timer_t tcp_tx_reap_timer;
+static bool tcp_tx_reap_armed; // setting a queued net timer again pushes it out
+
+static void tcp_tx_inflight_put(void *buf, void *arg) {
+    atomic_add((volatile int *)arg, -1);
+}
+
+/* wrap len bytes of tx memory in a chain of pktbufs that each hold a count on
+ * *inflight until they're freed */
+static pktbuf_t *tcp_tx_alloc_ref(const void *buf, size_t len, volatile int *inflight) {
+    pktbuf_t *p = pktbuf_alloc_ref(buf, len, tcp_tx_inflight_put, (void *)inflight);
+    for (pktbuf_t *q = p; q; q = q->next)
+        atomic_add(inflight, 1);
+    return p;
+}
+
+static tcp_tx_ring_t *tcp_tx_ring_alloc(uint32_t size) {
+    tcp_tx_ring_t *ring = malloc(sizeof(*ring) + size);
+    if (!ring)
+        return NULL;
+
+    memset(ring, 0, sizeof(*ring));
+    ring->span_size = (size + TCP_TX_RING_SPANS - 1) / TCP_TX_RING_SPANS;
+    return ring;
+}
+
+static bool tcp_tx_ring_busy(tcp_tx_ring_t *ring) {
+    for (uint i = 0; i < TCP_TX_RING_SPANS; i++) {
+        if (ring->inflight[i][0] || ring->inflight[i][1])
+            return true;
+    }
+    return false;
+}
+
+static void tcp_tx_reap(void *arg);
+
+static void tcp_tx_reap_arm(void) {
+    DEBUG_ASSERT(is_mutex_held(&tcp_tx_retired_lock));
+
+    if (!tcp_tx_reap_armed) {
+        tcp_tx_reap_armed = true;
+        net_timer_set(&tcp_tx_reap_timer, tcp_tx_reap, NULL, TCP_TX_REAP_INTERVAL);
+    }
+}
+
+static void tcp_tx_reap(void *arg) {
+    struct list_node refs = LIST_INITIAL_VALUE(refs);
+    struct list_node rings = LIST_INITIAL_VALUE(rings);
+
+    mutex_acquire(&tcp_tx_retired_lock);
+    tcp_tx_reap_armed = false;
+    tcp_tx_ref_t *r, *rtemp;
+    list_for_every_entry_safe(&tcp_tx_retired_refs, r, rtemp, tcp_tx_ref_t, node) {
+        if (r->inflight == 0) {
+            list_delete(&r->node);
+            list_add_tail(&refs, &r->node);
+        }
+    }
+    tcp_tx_ring_t *ring, *ringtemp;
+    list_for_every_entry_safe(&tcp_tx_retired_rings, ring, ringtemp, tcp_tx_ring_t, node) {
+        if (!tcp_tx_ring_busy(ring)) {
+            list_delete(&ring->node);
+            list_add_tail(&rings, &ring->node);
+        }
+    }
+    if (!list_is_empty(&tcp_tx_retired_refs) || !list_is_empty(&tcp_tx_retired_rings))
+        tcp_tx_reap_arm();
+    mutex_release(&tcp_tx_retired_lock);
+
+    while ((r = list_remove_head_type(&refs, tcp_tx_ref_t, node)) != NULL) {
+        r->done(r->arg);
+        free(r);
+    }
+    while ((ring = list_remove_head_type(&rings, tcp_tx_ring_t, node)) != NULL)
+        free(ring);
+}
+
+/* the socket is done with a ref, hand it back now or once the nic is */
+static void tcp_tx_ref_release(tcp_tx_ref_t *r) {
+    if (r->inflight == 0) {
+        r->done(r->arg);
+        free(r);
+        return;
+    }
+
+    mutex_acquire(&tcp_tx_retired_lock);
+    list_add_tail(&tcp_tx_retired_refs, &r->node);
+    tcp_tx_reap_arm();
+    mutex_release(&tcp_tx_retired_lock);
+}
+
+static void tcp_tx_ring_release(tcp_tx_ring_t *ring) {
+    if (!ring)
+        return;
+
+    if (!tcp_tx_ring_busy(ring)) {
+        free(ring);
+        return;
+    }
+
+    mutex_acquire(&tcp_tx_retired_lock);
+    list_add_tail(&tcp_tx_retired_rings, &ring->node);
+    tcp_tx_reap_arm();
+    mutex_release(&tcp_tx_retired_lock);
+}
+
+/* which slot of a ring span counts the segments sent from the byte at pos,
+ * bytes behind tx_buffer_start are a lap ahead of it */
+static uint tcp_tx_ring_lap(tcp_socket_t *s, uint32_t pos) {
+    return (pos >= s->tx_buffer_start) ? s->tx_buffer_lap : !s->tx_buffer_lap;
+}
+
+/* how many of len free ring bytes from pos can be written over, stopping at a
+ * span a segment from the ring's previous lap is still out on */
+static uint32_t tcp_tx_ring_writable(tcp_socket_t *s, uint32_t pos, uint32_t len) {
+    tcp_tx_ring_t *ring = s->tx_ring;
+    uint32_t ok = 0;
+    while (ok < len) {
+        uint span = pos / ring->span_size;
+        if (ring->inflight[span][!tcp_tx_ring_lap(s, pos)])
+            break;
+
+        uint32_t span_end = MIN((span + 1) * ring->span_size, s->tx_buffer_size);
+        uint32_t n = MIN(len - ok, span_end - pos);
+        ok += n;
+        pos += n;
+        if (pos == s->tx_buffer_size)
+            pos = 0;
+    }
+    return ok;
 }
 
 static void inc_socket_ref(tcp_socket_t *s) {
@@ -300,13 +563,22 @@ static bool dec_socket_ref(tcp_socket_t *s) {
     if (oldval == 1) {
         LTRACEF("destroying socket\n");
         event_destroy(&s->tx_event);
+        event_destroy(&s->tx_empty_event);
         event_destroy(&s->rx_event);
         event_destroy(&s->connect_event);
 
+        pktbuf_t *p;
+        while ((p = list_remove_head_type(&s->rx_pkts, pktbuf_t, list)) != NULL)
+            pktbuf_free(p, true);
+
+        tcp_tx_ref_t *r;
+        while ((r = list_remove_head_type(&s->tx_refs, tcp_tx_ref_t, node)) != NULL)
+            tcp_tx_ref_release(r);
+
         free(s->rx_buffer_raw);
-        free(s->tx_buffer);
+        tcp_tx_ring_release(s->tx_ring);
 
-        free(s);
+        slab_cache_free(&tcp_socket_cache, s);
     }
     return (oldval == 1);
 }
@@ -328,6 +600,195 @@ static void tcp_timer_cancel(tcp_socket_t *s, net_timer_t *timer) {
         dec_socket_ref(s);
 }
 
+static inline uint32_t tcp_initial_cwnd(uint32_t mss) {
+    /* rfc 3390 */
+    return MIN(4 * mss, MAX(2 * mss, 4380U));
+}
+
+static uint32_t get_be32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint8_t *put_be32(uint8_t *p, uint32_t val) {
+    p[0] = val >> 24;
+    p[1] = val >> 16;
+    p[2] = val >> 8;
+    p[3] = val;
+    return p + 4;
+}
+
+static void tcp_parse_options(const uint8_t *opt, size_t len, tcp_options_t *o) {
+    memset(o, 0, sizeof(*o));
+    o->window_scale = -1;
+
+    size_t i = 0;
+    while (i < len) {
+        uint8_t kind = opt[i];
+        if (kind == TCP_OPTION_EOL)
+            break;
+        if (kind == TCP_OPTION_NOP) {
+            i++;
+            continue;
+        }
+
+        /* everything else is kind, length, data */
+        if (i + 1 >= len || opt[i + 1] < 2 || i + opt[i + 1] > len) {
+            LTRACEF("malformed option %u at %zu\n", kind, i);
+            break;
+        }
+        uint8_t olen = opt[i + 1];
+        const uint8_t *data = &opt[i + 2];
+
+        switch (kind) {
+            case TCP_OPTION_MSS:
+                if (olen == 4)
+                    o->mss = (data[0] << 8) | data[1];
+                break;
+            case TCP_OPTION_WINDOW_SCALE:
+                if (olen == 3)
+                    o->window_scale = MIN(data[0], 14); // rfc 7323 section 2.3
+                break;
+            case TCP_OPTION_SACK_PERMITTED:
+                if (olen == 2)
+                    o->sack_permitted = true;
+                break;
+            case TCP_OPTION_SACK:
+                for (uint b = 0; b < (olen - 2U) / 8 && o->sack_count < TCP_MAX_SACK_BLOCKS; b++) {
+                    o->sack[o->sack_count].start = get_be32(data + b * 8);
+                    o->sack[o->sack_count].end = get_be32(data + b * 8 + 4);
+                    o->sack_count++;
+                }
+                break;
+        }
+        i += olen;
+    }
+}
+
+/* options for a syn, the window scale and sack ones only if the syn we're
+ * answering offered them too */
+static size_t tcp_syn_options(uint8_t *buf, bool window_scale, bool sack) {
+    size_t len = 0;
+
+    buf[len++] = TCP_OPTION_MSS;
+    buf[len++] = 4;
+    buf[len++] = DEFAULT_MSS >> 8;
+    buf[len++] = DEFAULT_MSS & 0xff;
+    if (window_scale) {
+        buf[len++] = TCP_OPTION_NOP;
+        buf[len++] = TCP_OPTION_WINDOW_SCALE;
+        buf[len++] = 3;
+        buf[len++] = TCP_WINDOW_SCALE;
+    }
+    if (sack) {
+        buf[len++] = TCP_OPTION_NOP;
+        buf[len++] = TCP_OPTION_NOP;
+        buf[len++] = TCP_OPTION_SACK_PERMITTED;
+        buf[len++] = 2;
+    }
+
+    return len;
+}
+
+/* take what the other side offered in its syn */
+static void tcp_apply_syn_options(tcp_socket_t *s, const tcp_options_t *opts) {
+    if (opts->mss)
+        s->mss = MIN(s->mss, MAX(opts->mss, 64U));
+    if (opts->window_scale >= 0) {
+        /* both sides have to offer it for either to use it */
+        s->snd_wscale = opts->window_scale;
+        s->rcv_wscale = TCP_WINDOW_SCALE;
+    }
+    s->sack_ok = opts->sack_permitted;
+    s->cwnd = tcp_initial_cwnd(s->mss);
+}
+
+/* add [start, end) to a sorted list of disjoint ranges, merging any it
+ * touches. returns the index it ended up in, or -1 if the list is full. */
+static int seq_range_add(tcp_seq_range_t *r, uint *count, uint32_t start, uint32_t end) {
+    uint i = 0;
+    while (i < *count && SEQUENCE_LT(r[i].end, start))
+        i++;
+
+    if (i < *count && SEQUENCE_LTE(r[i].start, end)) {
+        /* overlaps or abuts r[i], grow it and swallow whatever it now reaches */
+        if (SEQUENCE_LT(start, r[i].start))
+            r[i].start = start;
+        if (SEQUENCE_GT(end, r[i].end))
+            r[i].end = end;
+
+        uint j = i + 1;
+        while (j < *count && SEQUENCE_LTE(r[j].start, r[i].end)) {
+            if (SEQUENCE_GT(r[j].end, r[i].end))
+                r[i].end = r[j].end;
+            j++;
+        }
+        memmove(&r[i + 1], &r[j], (*count - j) * sizeof(*r));
+        *count -= j - i - 1;
+        return i;
+    }
+
+    if (*count == TCP_MAX_SEQ_RANGES)
+        return -1;
+
+    memmove(&r[i + 1], &r[i], (*count - i) * sizeof(*r));
+    r[i].start = start;
+    r[i].end = end;
+    (*count)++;
+    return i;
+}
+
+static uint32_t seq_range_total(const tcp_seq_range_t *r, uint count) {
+    uint32_t total = 0;
+    for (uint i = 0; i < count; i++)
+        total += r[i].end - r[i].start;
+    return total;
+}
+
+/* forget everything below seq */
+static void seq_range_trim(tcp_seq_range_t *r, uint *count, uint32_t seq) {
+    uint i = 0;
+    while (i < *count && SEQUENCE_LTE(r[i].end, seq))
+        i++;
+
+    memmove(&r[0], &r[i], (*count - i) * sizeof(*r));
+    *count -= i;
+
+    if (*count > 0 && SEQUENCE_LT(r[0].start, seq))
+        r[0].start = seq;
+}
+
+/* a sack option describing the out of order data we're holding, rfc 2018 section 4 */
+static size_t tcp_sack_option(tcp_socket_t *s, uint8_t *buf) {
+    if (!s->sack_ok || s->rx_ooo_count == 0)
+        return 0;
+
+    /* the block holding the latest segment goes first */
+    uint first = 0;
+    for (uint i = 0; i < s->rx_ooo_count; i++) {
+        if (SEQUENCE_GTE(s->rx_ooo_recent, s->rx_ooo[i].start) && SEQUENCE_LT(s->rx_ooo_recent, s->rx_ooo[i].end))
+            first = i;
+    }
+
+    uint8_t *b = buf + 4;
+    b = put_be32(b, s->rx_ooo[first].start);
+    b = put_be32(b, s->rx_ooo[first].end);
+    uint blocks = 1;
+    for (uint i = 0; i < s->rx_ooo_count && blocks < TCP_MAX_SACK_BLOCKS; i++) {
+        if (i == first)
+            continue;
+        b = put_be32(b, s->rx_ooo[i].start);
+        b = put_be32(b, s->rx_ooo[i].end);
+        blocks++;
+    }
+
+    buf[0] = TCP_OPTION_NOP;
+    buf[1] = TCP_OPTION_NOP;
+    buf[2] = TCP_OPTION_SACK;
+    buf[3] = 2 + blocks * 8;
+
+    return 4 + blocks * 8;
+}
+
 void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip) {
     if (unlikely(tcp_debug))
         TRACEF("p %p (len %u), src_ip 0x%x, dst_ip 0x%x\n", p, p->dlen, src_ip, dst_ip);
@@ -348,6 +809,10 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip) {
         TRACEF("REJECT: packet too large for buffer\n");
         return;
     }
+    if (header_len < sizeof(tcp_header_t)) {
+        TRACEF("REJECT: header length %zu too short\n", header_len);
+        return;
+    }
 
     /* checksum */
     if (FORCE_TCP_CHECKSUM || (p->flags & PKTBUF_FLAG_CKSUM_TCP_GOOD) == 0) {
@@ -360,7 +825,7 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip) {
         pheader.protocol = IP_PROTO_TCP;
         pheader.tcp_length = htons(p->dlen);
 
-        uint16_t checksum = cksum_pheader(&pheader, p->data, p->dlen);
+        uint16_t checksum = cksum_pheader(&pheader, p);
         if (checksum != 0) {
             TRACEF("REJECT: failed checksum, header says 0x%x, we got 0x%x\n", header->checksum, checksum);
             return;
@@ -377,6 +842,8 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip) {
     header->urg_pointer = ntohs(header->urg_pointer);
 
     /* get some data from the packet */
+    tcp_options_t opts;
+    tcp_parse_options((const uint8_t *)(header + 1), header_len - sizeof(tcp_header_t), &opts);
     uint8_t packet_flags = header->length_flags & 0x3f;
     size_t data_len = p->dlen - header_len;
     uint32_t highest_sequence = header->seq_num + ((data_len > 0) ? (data_len - 1) : 0);
@@ -421,8 +888,8 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip) {
             if (s->accepted != NULL)
                 goto done;
 
-            /* make a new accept socket */
-            tcp_socket_t *accept_socket = create_tcp_socket(true);
+            /* make a new accept socket, with the buffers set on the listen socket */
+            tcp_socket_t *accept_socket = create_tcp_socket(true, s->rx_win_size, s->tx_buffer_size);
             if (!accept_socket)
                 goto done;
 
@@ -440,19 +907,16 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip) {
             /* remember their sequence */
             accept_socket->rx_win_low = header->seq_num + 1;
             accept_socket->rx_win_high = accept_socket->rx_win_low + accept_socket->rx_win_size - 1;
+            tcp_apply_syn_options(accept_socket, &opts);
 
             /* save this socket and wake anyone up that is waiting to accept */
             s->accepted = accept_socket;
             sem_post(&s->accept_sem, true);
 
-            /* set up a mss option for sending back */
-            tcp_mss_option_t mss_option;
-            mss_option.kind = 0x2;
-            mss_option.len = 0x4;
-            mss_option.mss = ntohs(s->mss); // XXX make sure we fit in their mss
-
             /* send a response */
-            tcp_socket_send(accept_socket, NULL, 0, PKT_ACK|PKT_SYN, &mss_option, sizeof(mss_option),
+            uint8_t options[12];
+            size_t options_len = tcp_syn_options(options, opts.window_scale >= 0, opts.sack_permitted);
+            tcp_socket_send(accept_socket, NULL, PKT_ACK|PKT_SYN, options, options_len,
                             accept_socket->tx_win_low);
 
             /* SYN consumed a sequence */
@@ -474,8 +938,9 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip) {
                     goto send_reset;
                 }
 
-                s->tx_win_high = s->tx_win_low + header->win_size;
+                s->tx_win_high = s->tx_win_low + ((uint32_t)header->win_size << s->snd_wscale);
                 s->tx_highest_seq = s->tx_win_low;
+                s->tx_next_seq = s->tx_win_low;
 
                 s->state = STATE_ESTABLISHED;
             } else {
@@ -507,10 +972,13 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip) {
             // remember their sequence
             s->rx_win_low = header->seq_num + 1;
             s->rx_win_high = s->rx_win_low + s->rx_win_size - 1;
+            tcp_apply_syn_options(s, &opts);
 
+            // the window on a syn is never scaled
             s->tx_win_low++;
             s->tx_win_high = s->tx_win_low + header->win_size;
             s->tx_highest_seq = s->tx_win_low;
+            s->tx_next_seq = s->tx_win_low;
 
             s->state = STATE_ESTABLISHED;
 
@@ -525,12 +993,12 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip) {
         case STATE_ESTABLISHED:
             if (packet_flags & PKT_ACK) {
                 /* they're acking us */
-                handle_ack(s, header->ack_num, header->win_size);
+                handle_ack(s, header->ack_num, (uint32_t)header->win_size << s->snd_wscale, data_len, &opts);
             }
 
             if (data_len > 0) {
                 LTRACEF("new data, len %zu\n", data_len);
-                handle_data(s, p->data, p->dlen, header->seq_num);
+                handle_data(s, p, header->seq_num);
             }
 
             if ((packet_flags & PKT_FIN) && SEQUENCE_GTE(s->rx_win_low, highest_sequence)) {
@@ -551,7 +1019,7 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip) {
         case STATE_CLOSE_WAIT:
             if (packet_flags & PKT_ACK) {
                 /* they're acking us */
-                handle_ack(s, header->ack_num, header->win_size);
+                handle_ack(s, header->ack_num, (uint32_t)header->win_size << s->snd_wscale, data_len, &opts);
             }
             if (packet_flags & PKT_FIN) {
                 /* they must have missed our ack, ack them again */
@@ -621,11 +1089,14 @@ send_reset:
     LTRACEF("SEND RST\n");
     if (!(packet_flags & PKT_RST)) {
         tcp_send(src_ip, header->source_port, dst_ip, header->dest_port,
-                 NULL, 0, PKT_RST, NULL, 0, 0, header->ack_num, 0);
+                 NULL, PKT_RST, NULL, 0, 0, header->ack_num, 0, 0);
     }
 }
 
-static void handle_data(tcp_socket_t *s, const void *data, size_t len, uint32_t sequence) {
+static void handle_data(tcp_socket_t *s, pktbuf_t *p, uint32_t sequence) {
+    const void *data = p->data;
+    size_t len = p->dlen;
+
     if (unlikely(tcp_debug))
         TRACEF("data %p, len %zu, sequence %u\n", data, len, sequence);
 
@@ -634,68 +1105,116 @@ static void handle_data(tcp_socket_t *s, const void *data, size_t len, uint32_t
     DEBUG_ASSERT(data);
     DEBUG_ASSERT(len > 0);
 
-    /* see if it matches our current window */
-    uint32_t sequence_top = sequence + len - 1;
-    if (SEQUENCE_LTE(sequence, s->rx_win_low) && SEQUENCE_GTE(sequence_top, s->rx_win_low)) {
-        /* it intersects the bottom of our window, so it's in order */
+    /* clip it to our window */
+    uint32_t start = sequence;
+    uint32_t end = sequence + len;
+    if (SEQUENCE_LTE(end, s->rx_win_low) || SEQUENCE_GTE(start, s->rx_win_high)) {
+        // completely out of our window, drop
+        // duplicately ack the last thing we really got
+        send_ack(s);
+        return;
+    }
+    if (SEQUENCE_LT(start, s->rx_win_low))
+        start = s->rx_win_low;
+    if (SEQUENCE_GT(end, s->rx_win_high))
+        end = s->rx_win_high;
 
-        /* copy the data we need to our cbuf */
-        size_t offset = sequence - s->rx_win_low;
-        size_t copy_len = MIN(s->rx_win_high - s->rx_win_low, len - offset);
+    const uint8_t *buf = (const uint8_t *)data + (start - sequence);
 
-        DEBUG_ASSERT(offset < len);
+    if (start != s->rx_win_low) {
+        /* out of order, park it in the buffer where it will end up and tell
+         * them what we have so they only resend the hole */
+        size_t copied = cbuf_write_ahead(&s->rx_buffer, start - s->rx_win_low, buf, end - start);
+        s->copies.rx_copied += copied;
+        if (copied > 0 && seq_range_add(s->rx_ooo, &s->rx_ooo_count, start, start + copied) >= 0)
+            s->rx_ooo_recent = start;
+        s->rx_ooo_segments++;
 
-        LTRACEF("copying from offset %zu, len %zu\n", offset, copy_len);
+        LTRACEF("out of order %u..%u, %u ranges held\n", start, end, s->rx_ooo_count);
 
-        s->rx_win_low += copy_len;
+        send_ack(s);
+        return;
+    }
 
-        cbuf_write(&s->rx_buffer, (uint8_t *)data + offset, copy_len, false);
-        event_signal(&s->rx_event, true);
+    /* it intersects the bottom of our window, so it's in order. If it's all
+     * new and nothing is waiting in rx_buffer, keep the pktbuf itself and leave
+     * the driver a fresh buffer in its place */
+    size_t copy_len;
+    pktbuf_t *q;
+    if (start == sequence && end == sequence + len &&
+            cbuf_space_used(&s->rx_buffer) == 0 && s->rx_ooo_count == 0 &&
+            s->rx_pkt_count < TCP_RX_MAX_PKTS && (q = pktbuf_take(p)) != NULL) {
+        LTRACEF("keeping pktbuf %p, len %zu\n", q, len);
+
+        list_add_tail(&s->rx_pkts, &q->list);
+        s->rx_pkt_bytes += len;
+        s->rx_pkt_count++;
+        copy_len = len;
+    } else {
+        LTRACEF("copying from offset %u, len %u\n", start - sequence, end - start);
 
-        /* keep a counter if they've been sending a full mss */
-        if (copy_len >= s->mss) {
-            s->rx_full_mss_count++;
-        } else {
-            s->rx_full_mss_count = 0;
+        copy_len = cbuf_write(&s->rx_buffer, buf, end - start, false);
+        s->copies.rx_copied += copy_len;
+    }
+    s->rx_win_low += copy_len;
+
+    /* it may have filled a hole, pull in whatever was parked behind it */
+    bool filled = false;
+    if (s->rx_ooo_count > 0) {
+        seq_range_trim(s->rx_ooo, &s->rx_ooo_count, s->rx_win_low);
+        if (s->rx_ooo_count > 0 && s->rx_ooo[0].start == s->rx_win_low) {
+            s->rx_win_low += cbuf_commit(&s->rx_buffer, s->rx_ooo[0].end - s->rx_win_low, false);
+            seq_range_trim(s->rx_ooo, &s->rx_ooo_count, s->rx_win_low);
         }
+        filled = true;
+    }
 
-        /* immediately ack if we're more than halfway into our buffer or they've sent 2 or more full packets */
-        if (s->rx_full_mss_count >= 2 ||
-                (int)(s->rx_win_low + s->rx_win_size - s->rx_win_high) > (int)s->rx_win_size / 2) {
-            send_ack(s);
-            s->rx_full_mss_count = 0;
-        } else {
-            tcp_timer_set(s, &s->ack_delay_timer, &handle_delayed_ack_timeout, DELAYED_ACK_TIMEOUT);
-        }
+    event_signal(&s->rx_event, true);
+
+    /* keep a counter if they've been sending a full mss */
+    if (copy_len >= s->mss) {
+        s->rx_full_mss_count++;
     } else {
-        // either out of order or completely out of our window, drop
-        // duplicately ack the last thing we really got
+        s->rx_full_mss_count = 0;
+    }
+
+    /* immediately ack if we're more than halfway into our buffer, they've sent 2 or more
+     * full packets, or they're repairing a loss */
+    if (filled || s->rx_full_mss_count >= 2 ||
+            (int)(s->rx_win_low + s->rx_win_size - s->rx_win_high) > (int)s->rx_win_size / 2) {
         send_ack(s);
+        s->rx_full_mss_count = 0;
+    } else {
+        tcp_timer_set(s, &s->ack_delay_timer, &handle_delayed_ack_timeout, DELAYED_ACK_TIMEOUT);
     }
 }
 
-static status_t tcp_socket_send(tcp_socket_t *s, const void *data, size_t len, tcp_flags_t flags,
+/* send a segment, with data chained on behind the headers if there is any.
+ * the data chain is consumed either way */
+static status_t tcp_socket_send(tcp_socket_t *s, pktbuf_t *data, tcp_flags_t flags,
                                 const void *options, size_t options_length, uint32_t sequence) {
     DEBUG_ASSERT(s);
     DEBUG_ASSERT(is_mutex_held(&s->lock));
-    DEBUG_ASSERT(len == 0 || data);
     DEBUG_ASSERT(options_length == 0 || options);
     DEBUG_ASSERT((options_length % 4) == 0);
 
-    // calculate the new right edge of the rx window
-    uint32_t rx_win_high = s->rx_win_low + s->rx_win_size - cbuf_space_used(&s->rx_buffer) - 1;
+    // calculate the new right edge of the rx window, in the units we advertise it in.
+    // the window on a syn is never scaled
+    uint shift = (flags & PKT_SYN) ? 0 : s->rcv_wscale;
+    uint32_t space = s->rx_win_size - cbuf_space_used(&s->rx_buffer) - s->rx_pkt_bytes - 1;
+    uint32_t win_size = MIN(space >> shift, 0xffffU);
+    uint32_t rx_win_high = s->rx_win_low + (win_size << shift);
 
     LTRACEF("rx_win_low %u rx_win_size %u read_buf_len %zu, new win high %u\n",
             s->rx_win_low, s->rx_win_size, cbuf_space_used(&s->rx_buffer), rx_win_high);
 
-    uint16_t win_size;
     if (SEQUENCE_GTE(rx_win_high, s->rx_win_high)) {
         s->rx_win_high = rx_win_high;
-        win_size = rx_win_high - s->rx_win_low;
     } else {
         // the window size has shrunk, but we can't move the
-        // right edge of the window backwards
-        win_size = s->rx_win_high - s->rx_win_low;
+        // right edge of the window backwards, short of what the
+        // scale can't express
+        win_size = (s->rx_win_high - s->rx_win_low) >> shift;
     }
 
     // we are piggybacking a pending ACK, so clear the delayed ACK timer
@@ -703,12 +1222,88 @@ static status_t tcp_socket_send(tcp_socket_t *s, const void *data, size_t len, t
         tcp_timer_cancel(s, &s->ack_delay_timer);
     }
 
-    status_t err = tcp_send(s->remote_ip, s->remote_port, s->local_ip, s->local_port, data, len, flags,
-                            options, options_length, (flags & PKT_ACK) ? s->rx_win_low : 0, sequence, win_size);
+    status_t err = tcp_send(s->remote_ip, s->remote_port, s->local_ip, s->local_port, data, flags,
+                            options, options_length, (flags & PKT_ACK) ? s->rx_win_low : 0, sequence, win_size, s->mss);
 
     return err;
 }
 
+/* send len bytes of queued data, starting offset bytes past tx_win_low, gathered
+ * from the ring and the refs without copying. Each piece is counted against
+ * the ref or ring span it came from until the nic frees it. returns how much
+ * of it fit in a segment's worth of pieces */
+static uint32_t tcp_socket_send_tx(tcp_socket_t *s, uint32_t offset, uint32_t len, tcp_flags_t flags) {
+    DEBUG_ASSERT(offset + len <= s->tx_buffer_offset);
+
+    pktbuf_t *data = NULL;
+    uint pieces = 0;
+    uint32_t sent = 0;
+    uint32_t stop = offset + len;
+
+    /* walk the queue from tx_win_low, alternating runs of ring bytes and refs */
+    uint32_t pos = 0;
+    uint32_t ring = s->tx_buffer_start;
+    tcp_tx_ref_t *r = list_peek_head_type(&s->tx_refs, tcp_tx_ref_t, node);
+    while (pos < stop && pieces < TCP_TX_MAX_PIECES) {
+        uint32_t ref_pos = r ? r->seq - s->tx_win_low : s->tx_buffer_offset;
+
+        if (r && ref_pos == pos) {
+            uint32_t end = pos + r->len;
+            if (end > offset) {
+                uint32_t from = MAX(pos, offset);
+                uint32_t n = MIN(end, stop) - from;
+                pktbuf_t *p = tcp_tx_alloc_ref(r->buf + (from - pos), n, &r->inflight);
+                if (data)
+                    pktbuf_chain(data, p);
+                else
+                    data = p;
+                pieces++;
+                sent += n;
+            }
+            r = list_next_type(&s->tx_refs, &r->node, tcp_tx_ref_t, node);
+            pos = end;
+        } else {
+            uint32_t end = ref_pos;
+            if (end > offset) {
+                uint32_t from = MAX(pos, offset);
+                uint32_t n = MIN(end, stop) - from;
+                uint32_t at = ring + (from - pos);
+                if (at >= s->tx_buffer_size)
+                    at -= s->tx_buffer_size;
+
+                /* a piece per span, wrapping at the end of the ring */
+                while (n > 0 && pieces < TCP_TX_MAX_PIECES) {
+                    uint span = at / s->tx_ring->span_size;
+                    uint32_t span_end = MIN((span + 1) * s->tx_ring->span_size, s->tx_buffer_size);
+                    uint32_t run = MIN(n, span_end - at);
+                    pktbuf_t *p = tcp_tx_alloc_ref(s->tx_ring->buf + at, run,
+                                                   &s->tx_ring->inflight[span][tcp_tx_ring_lap(s, at)]);
+                    if (data)
+                        pktbuf_chain(data, p);
+                    else
+                        data = p;
+                    pieces++;
+                    sent += run;
+                    n -= run;
+                    at += run;
+                    if (at == s->tx_buffer_size)
+                        at = 0;
+                }
+                if (n > 0)
+                    break;
+            }
+            ring += end - pos;
+            if (ring >= s->tx_buffer_size)
+                ring -= s->tx_buffer_size;
+            pos = end;
+        }
+    }
+
+    tcp_socket_send(s, data, flags, NULL, 0, s->tx_win_low + offset);
+
+    return sent;
+}
+
 static void send_ack(tcp_socket_t *s) {
     DEBUG_ASSERT(s);
     DEBUG_ASSERT(is_mutex_held(&s->lock));
@@ -716,18 +1311,30 @@ static void send_ack(tcp_socket_t *s) {
     if (s->state != STATE_ESTABLISHED && s->state != STATE_CLOSE_WAIT && s->state != STATE_FIN_WAIT_2)
         return;
 
-    tcp_socket_send(s, NULL, 0, PKT_ACK, NULL, 0, s->tx_win_low);
+    /* say what we're holding past the hole, if anything */
+    uint8_t options[4 + TCP_MAX_SACK_BLOCKS * 8];
+    size_t options_len = tcp_sack_option(s, options);
+
+    tcp_socket_send(s, NULL, PKT_ACK, options_len ? options : NULL, options_len, s->tx_win_low);
 }
 
-static status_t tcp_send(ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip, uint16_t src_port, const void *buf,
-                         size_t len, tcp_flags_t flags, const void *options, size_t options_length, uint32_t ack, uint32_t sequence, uint16_t window_size) {
-    DEBUG_ASSERT(len == 0 || buf);
+static status_t tcp_send(ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip, uint16_t src_port, pktbuf_t *data,
+                         tcp_flags_t flags, const void *options, size_t options_length, uint32_t ack, uint32_t sequence, uint16_t window_size,
+                         uint32_t mss) {
     DEBUG_ASSERT(options_length == 0 || options);
     DEBUG_ASSERT((options_length % 4) == 0);
 
     pktbuf_t *p = pktbuf_alloc();
-    if (!p)
+    if (!p) {
+        if (data)
+            pktbuf_free(data, true);
         return ERR_NO_MEMORY;
+    }
+
+    /* options can push the headers past the room pktbuf_alloc leaves in front */
+    size_t headroom = sizeof(struct eth_hdr) + sizeof(struct ipv4_hdr) + sizeof(tcp_header_t) + options_length;
+    if (headroom > PKTBUF_MAX_HDR)
+        pktbuf_reset(p, headroom);
 
     tcp_header_t *header = pktbuf_prepend(p, sizeof(tcp_header_t) + options_length);
     DEBUG_ASSERT(header);
@@ -744,21 +1351,35 @@ static status_t tcp_send(ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip
     if (options)
         memcpy(header + 1, options, options_length);
 
-    /* append the data */
-    if (len > 0)
-        pktbuf_append_data(p, buf, len);
+    /* chain the data on rather than copy it */
+    if (data)
+        pktbuf_chain(p, data);
 
-    /* compute the checksum */
-    /* XXX get the tx ckecksum capability from the nic */
-    if (FORCE_TCP_CHECKSUM || true) {
-        tcp_pseudo_header_t pheader;
-        pheader.source_addr = src_ip;
-        pheader.dest_addr = dest_ip;
-        pheader.zero = 0;
-        pheader.protocol = IP_PROTO_TCP;
-        pheader.tcp_length = htons(p->dlen);
+    size_t tcp_length = pktbuf_chain_len(p);
+    uint32_t features = minip_tx_features(dest_ip);
+
+    /* more than a segment's worth is for the nic to cut up */
+    if (mss > 0 && tcp_length - sizeof(tcp_header_t) - options_length > mss) {
+        DEBUG_ASSERT(features & MINIP_ETH_FEATURE_TSO4);
+        p->flags |= PKTBUF_FLAG_GSO_TCPV4;
+        p->gso_size = mss;
+    }
 
-        header->checksum = cksum_pheader(&pheader, p->data, p->dlen);
+    /* compute the checksum, or as much of it as the nic wants */
+    tcp_pseudo_header_t pheader;
+    pheader.source_addr = src_ip;
+    pheader.dest_addr = dest_ip;
+    pheader.zero = 0;
+    pheader.protocol = IP_PROTO_TCP;
+    pheader.tcp_length = htons(tcp_length);
+
+    if (!FORCE_TCP_CHECKSUM && (features & MINIP_ETH_FEATURE_TX_CSUM)) {
+        header->checksum = ones_sum16(0, &pheader, sizeof(pheader));
+        p->flags |= PKTBUF_FLAG_CKSUM_PARTIAL;
+        p->csum_start = (u8 *)header - p->buffer;
+        p->csum_offset = offsetof(tcp_header_t, checksum);
+    } else {
+        header->checksum = cksum_pheader(&pheader, p);
     }
 
     if (LOCAL_TRACE) {
@@ -771,7 +1392,46 @@ static status_t tcp_send(ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip
     return err;
 }
 
-static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size) {
+/* fold a round trip time sample into the estimate, rfc 6298 section 2 */
+static void tcp_rtt_sample(tcp_socket_t *s, uint32_t rtt) {
+    rtt = MAX(rtt, 1U);
+
+    if (s->srtt == 0) {
+        s->srtt = rtt;
+        s->rttvar = rtt / 2;
+    } else {
+        uint32_t delta = (s->srtt > rtt) ? s->srtt - rtt : rtt - s->srtt;
+        s->rttvar = (3 * s->rttvar + delta) / 4;
+        s->srtt = (7 * s->srtt + rtt) / 8;
+    }
+
+    /* the clock granularity is a msec */
+    uint32_t rto = s->srtt + MAX(1000U, 4 * s->rttvar);
+    s->rto = MIN(MAX((rto + 999) / 1000, (uint32_t)TCP_MIN_RTO), (uint32_t)TCP_MAX_RTO);
+
+    LTRACEF("s %p rtt %u srtt %u rttvar %u rto %u\n", s, rtt, s->srtt, s->rttvar, (uint)s->rto);
+}
+
+/* fold the sack blocks of an ack into what we know they hold, returns true
+ * if they told us about anything new */
+static bool tcp_update_sacked(tcp_socket_t *s, uint32_t ack, const tcp_options_t *opts) {
+    uint32_t before = seq_range_total(s->tx_sacked, s->tx_sacked_count);
+
+    for (uint i = 0; i < opts->sack_count; i++) {
+        uint32_t start = opts->sack[i].start;
+        uint32_t end = opts->sack[i].end;
+
+        /* ignore anything that isn't past the ack and within what we've sent */
+        if (SEQUENCE_LTE(end, start) || SEQUENCE_LTE(start, ack) || SEQUENCE_GT(end, s->tx_highest_seq))
+            continue;
+
+        seq_range_add(s->tx_sacked, &s->tx_sacked_count, start, end);
+    }
+
+    return seq_range_total(s->tx_sacked, s->tx_sacked_count) != before;
+}
+
+static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size, size_t data_len, const tcp_options_t *opts) {
     LTRACEF("socket %p ack sequence %u, win_size %u\n", s, sequence, win_size);
 
     DEBUG_ASSERT(s);
@@ -779,12 +1439,47 @@ static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size) {
 
     LTRACEF("s %p, tx_win_low %u tx_win_high %u tx_highest_seq %u bufsize %u offset %u\n",
             s, s->tx_win_low, s->tx_win_high, s->tx_highest_seq, s->tx_buffer_size, s->tx_buffer_offset);
-    if (SEQUENCE_LTE(sequence, s->tx_win_low)) {
+    if (SEQUENCE_LT(sequence, s->tx_win_low)) {
         /* they're acking stuff we've already received an ack for */
         return;
     } else if (SEQUENCE_GT(sequence, s->tx_highest_seq)) {
         /* they're acking stuff we haven't sent */
         return;
+    }
+
+    bool sacked_more = s->sack_ok && tcp_update_sacked(s, sequence, opts);
+
+    if (sequence == s->tx_win_low) {
+        /* nothing new acked, but the window may have moved */
+        uint32_t old_win_high = s->tx_win_high;
+        s->tx_win_high = s->tx_win_low + win_size;
+
+        /* a bare ack for the same thing with nothing else changed, or with
+         * more selectively acked, means a segment after the one they want
+         * arrived, rfc 5681 section 2 and rfc 6675 section 2 */
+        if (data_len == 0 && (s->tx_win_high == old_win_high || sacked_more) &&
+                s->tx_highest_seq != s->tx_win_low) {
+            s->dup_acks++;
+
+            if (s->in_recovery) {
+                /* each one means another segment left the network, use it
+                 * for the next hole if we know of one */
+                if (!s->sack_ok || tcp_sack_retransmit(s) == 0)
+                    s->cwnd += s->mss;
+            } else if (s->dup_acks == TCP_DUP_ACK_THRESHOLD) {
+                /* fast retransmit, then fast recovery */
+                uint32_t flight = s->tx_highest_seq - s->tx_win_low;
+                s->ssthresh = MAX(flight / 2, 2 * s->mss);
+                s->recover = s->tx_highest_seq;
+                s->in_recovery = true;
+                s->fast_retransmits++;
+
+                s->sack_rexmit_next = s->tx_win_low + tcp_retransmit(s);
+                s->cwnd = s->ssthresh + TCP_DUP_ACK_THRESHOLD * s->mss;
+            }
+        }
+
+        tcp_write_pending_data(s);
     } else {
         /* their ack is somewhere in our window */
         uint32_t acked_len;
@@ -793,24 +1488,84 @@ static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size) {
 
         LTRACEF("acked len %u\n", acked_len);
 
-        DEBUG_ASSERT(acked_len <= s->tx_buffer_size);
         DEBUG_ASSERT(acked_len <= s->tx_buffer_offset);
 
-        memmove(s->tx_buffer, s->tx_buffer + acked_len, s->tx_buffer_offset - acked_len);
+        /* let go of the refs they've acked, the rest of it was in the ring */
+        uint32_t ref_acked = 0;
+        tcp_tx_ref_t *r;
+        while ((r = list_peek_head_type(&s->tx_refs, tcp_tx_ref_t, node)) != NULL &&
+                SEQUENCE_LT(r->seq, sequence)) {
+            uint32_t n = MIN(r->len, sequence - r->seq);
+            ref_acked += n;
+            if (n < r->len) {
+                r->seq += n;
+                r->buf += n;
+                r->len -= n;
+                break;
+            }
+            list_delete(&r->node);
+            tcp_tx_ref_release(r);
+        }
+
+        uint32_t ring_acked = acked_len - ref_acked;
+        DEBUG_ASSERT(ring_acked <= s->tx_ring_used);
 
+        s->tx_buffer_start += ring_acked;
+        if (s->tx_buffer_start >= s->tx_buffer_size) {
+            s->tx_buffer_start -= s->tx_buffer_size;
+            s->tx_buffer_lap = !s->tx_buffer_lap;
+        }
+        s->tx_ring_used -= ring_acked;
         s->tx_buffer_offset -= acked_len;
         s->tx_win_low += acked_len;
         s->tx_win_high = s->tx_win_low + win_size;
+        if (SEQUENCE_LT(s->tx_next_seq, s->tx_win_low))
+            s->tx_next_seq = s->tx_win_low;
+        seq_range_trim(s->tx_sacked, &s->tx_sacked_count, s->tx_win_low);
+
+        /* only segments sent once are timed, so this can't be a retransmission's ack */
+        if (s->rtt_timing && SEQUENCE_GTE(sequence, s->rtt_seq)) {
+            s->rtt_timing = false;
+            tcp_rtt_sample(s, current_time_hires() - s->rtt_start);
+        }
+
+        if (s->in_recovery) {
+            if (SEQUENCE_GTE(sequence, s->recover)) {
+                /* everything outstanding when the loss was seen is acked */
+                s->in_recovery = false;
+                s->cwnd = s->ssthresh;
+            } else {
+                /* partial ack, the segment after the one we resent is missing too */
+                if (SEQUENCE_LT(s->sack_rexmit_next, s->tx_win_low))
+                    s->sack_rexmit_next = s->tx_win_low;
+                if (!s->sack_ok || tcp_sack_retransmit(s) == 0)
+                    tcp_retransmit(s);
+                s->cwnd = ((s->cwnd > acked_len) ? s->cwnd - acked_len : 0) + s->mss;
+            }
+        } else if (s->cwnd < s->ssthresh) {
+            /* slow start */
+            s->cwnd += MIN(acked_len, s->mss);
+        } else {
+            /* congestion avoidance, about a segment per round trip */
+            s->cwnd += MAX(s->mss * s->mss / s->cwnd, 1U);
+        }
+        s->dup_acks = 0;
 
         /* cancel or reset our retransmit timer */
         if (s->tx_win_low == s->tx_highest_seq) {
             tcp_timer_cancel(s, &s->retransmit_timer);
         } else {
-            tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, RETRANSMIT_TIMEOUT);
+            tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, s->rto);
         }
 
-        /* we have opened the transmit buffer */
-        event_signal(&s->tx_event, true);
+        /* we may have opened the transmit buffer */
+        if (s->tx_buffer_offset < s->tx_buffer_size)
+            event_signal(&s->tx_event, true);
+        if (s->tx_buffer_offset == 0)
+            event_signal(&s->tx_empty_event, true);
+
+        /* and maybe the window */
+        tcp_write_pending_data(s);
     }
 }
 
@@ -821,31 +1576,69 @@ static ssize_t tcp_write_pending_data(tcp_socket_t *s) {
     DEBUG_ASSERT(s);
     DEBUG_ASSERT(is_mutex_held(&s->lock));
     DEBUG_ASSERT(s->tx_buffer_size > 0);
-    DEBUG_ASSERT(s->tx_buffer_offset <= s->tx_buffer_size);
+    DEBUG_ASSERT(s->tx_ring_used <= s->tx_buffer_size);
 
-    /* do we have any new data to send? */
-    uint32_t outstanding = (s->tx_highest_seq - s->tx_win_low);
-    uint32_t pending = s->tx_buffer_offset - outstanding;
-    LTRACEF("outstanding %u, pending %u\n", outstanding, pending);
+    /* we may have the smaller of their window and the congestion window in flight */
+    uint32_t window = MIN(s->cwnd, s->tx_win_high - s->tx_win_low);
+    uint32_t buffer_end = s->tx_win_low + s->tx_buffer_offset;
+    bool idle = (s->tx_highest_seq == s->tx_win_low);
+
+    /* with tso, as many full segments as a super segment holds go out at once */
+    uint32_t seg_size = s->mss;
+    if (minip_tx_features(s->remote_ip) & MINIP_ETH_FEATURE_TSO4)
+        seg_size = TCP_TSO_MAX_SIZE / s->mss * s->mss;
 
     /* send packets that cover the pending area of the window */
     uint32_t offset = 0;
-    while (offset < pending) {
-        uint32_t tosend = MIN(s->mss, pending - offset);
+    while (SEQUENCE_LT(s->tx_next_seq, buffer_end)) {
+        uint32_t in_flight = s->tx_next_seq - s->tx_win_low;
+        if (in_flight >= window)
+            break;
 
-        tcp_socket_send(s, s->tx_buffer + outstanding + offset, tosend, PKT_ACK|PKT_PSH, NULL, 0, s->tx_highest_seq);
-        s->tx_highest_seq += tosend;
+        uint32_t pending = buffer_end - s->tx_next_seq;
+        uint32_t tosend = MIN(MIN(seg_size, pending), window - in_flight);
+
+        /* don't chop the data into runts to fit the window, wait for acks to open it */
+        if (tosend < MIN(s->mss, pending) && in_flight > 0)
+            break;
+
+        /* nor leave one at the end of a super segment */
+        if (tosend > s->mss && tosend < pending)
+            tosend -= tosend % s->mss;
+
+        tosend = tcp_socket_send_tx(s, in_flight, tosend, PKT_ACK|PKT_PSH);
+
+        if (s->tx_next_seq == s->tx_highest_seq) {
+            /* new data, time it if nothing else is */
+            if (!s->rtt_timing) {
+                s->rtt_timing = true;
+                s->rtt_seq = s->tx_next_seq + tosend;
+                s->rtt_start = current_time_hires();
+            }
+        } else {
+            /* going back over data after a timeout */
+            s->retransmits++;
+        }
+
+        /* a resent segment can run on past what was sent before */
+        if (SEQUENCE_GT(s->tx_next_seq + tosend, s->tx_highest_seq))
+            s->tx_highest_seq = s->tx_next_seq + tosend;
+        s->tx_next_seq += tosend;
         offset += tosend;
     }
 
-    /* reset the retransmit timer if we sent anything */
-    if (offset > 0) {
-        tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, RETRANSMIT_TIMEOUT);
+    /* start the retransmit timer if it wasn't running */
+    if (offset > 0 && idle) {
+        tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, s->rto);
+    } else if (idle && s->tx_buffer_offset > 0) {
+        /* their window is shut with data waiting, probe it when the timer goes off */
+        tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, s->rto);
     }
 
     return offset;
 }
 
+/* resend the first unacked segment */
 static ssize_t tcp_retransmit(tcp_socket_t *s) {
     DEBUG_ASSERT(s);
     DEBUG_ASSERT(is_mutex_held(&s->lock));
@@ -861,11 +1654,51 @@ static ssize_t tcp_retransmit(tcp_socket_t *s) {
     uint32_t tosend = MIN(s->mss, outstanding);
 
     LTRACEF("s %p, tosend %u seq %u\n", s, tosend, s->tx_win_low);
-    tcp_socket_send(s, s->tx_buffer, tosend, PKT_ACK|PKT_PSH, NULL, 0, s->tx_win_low);
+    tosend = tcp_socket_send_tx(s, 0, tosend, PKT_ACK|PKT_PSH);
+
+    /* karn, a timed segment may have been resent */
+    s->rtt_timing = false;
+    s->retransmits++;
 
     return tosend;
 }
 
+/* resend the first hole below what they've selectively acked that we haven't
+ * already resent during this recovery, rfc 6675 section 4 in spirit */
+static ssize_t tcp_sack_retransmit(tcp_socket_t *s) {
+    DEBUG_ASSERT(s);
+    DEBUG_ASSERT(is_mutex_held(&s->lock));
+
+    if (s->state != STATE_ESTABLISHED && s->state != STATE_CLOSE_WAIT)
+        return 0;
+
+    uint32_t seq = s->sack_rexmit_next;
+    if (SEQUENCE_LT(seq, s->tx_win_low))
+        seq = s->tx_win_low;
+
+    for (uint i = 0; i < s->tx_sacked_count; i++) {
+        const tcp_seq_range_t *r = &s->tx_sacked[i];
+        if (SEQUENCE_LT(seq, r->start)) {
+            /* a hole */
+            uint32_t tosend = MIN(s->mss, r->start - seq);
+
+            LTRACEF("s %p, hole at %u, tosend %u\n", s, seq, tosend);
+            tosend = tcp_socket_send_tx(s, seq - s->tx_win_low, tosend, PKT_ACK|PKT_PSH);
+
+            s->sack_rexmit_next = seq + tosend;
+            s->rtt_timing = false;
+            s->retransmits++;
+            s->sack_retransmits++;
+
+            return tosend;
+        }
+        if (SEQUENCE_LT(seq, r->end))
+            seq = r->end;
+    }
+
+    return 0;
+}
+
 static void handle_retransmit_timeout(void *_s) {
     tcp_socket_t *s = _s;
 
@@ -875,10 +1708,37 @@ static void handle_retransmit_timeout(void *_s) {
 
     mutex_acquire(&s->lock);
 
-    if (tcp_retransmit(s) == 0)
+    if (s->state != STATE_ESTABLISHED && s->state != STATE_CLOSE_WAIT)
         goto done;
 
-    tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, RETRANSMIT_TIMEOUT);
+    uint32_t outstanding = s->tx_highest_seq - s->tx_win_low;
+    if (outstanding == 0) {
+        if (s->tx_buffer_offset == 0)
+            goto done;
+
+        /* their window is shut, push a byte past it to get it reopened */
+        tcp_socket_send_tx(s, 0, 1, PKT_ACK);
+        s->tx_highest_seq++;
+        s->tx_next_seq = s->tx_highest_seq;
+    } else {
+        /* rfc 5681 section 3.1, start over from a segment once the loss is repaired */
+        s->ssthresh = MAX(outstanding / 2, 2 * s->mss);
+        s->cwnd = s->mss;
+        s->in_recovery = false;
+        s->dup_acks = 0;
+        s->timeouts++;
+
+        /* they may have thrown away what they selectively acked, rfc 2018 section 8 */
+        s->tx_sacked_count = 0;
+
+        /* rfc 6298 section 5, back off and resend from the first unacked byte */
+        s->rto = MIN(s->rto * 2, (lk_time_t)TCP_MAX_RTO);
+        s->rtt_timing = false;
+        s->tx_next_seq = s->tx_win_low;
+        tcp_write_pending_data(s);
+    }
+
+    tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, s->rto);
 
 done:
     mutex_release(&s->lock);
@@ -924,6 +1784,7 @@ static void tcp_wakeup_waiters(tcp_socket_t *s) {
     // wake up any waiters
     event_signal(&s->rx_event, true);
     event_signal(&s->tx_event, true);
+    event_signal(&s->tx_empty_event, true);
     event_signal(&s->connect_event, true);
 }
 
@@ -945,34 +1806,45 @@ static void tcp_remote_close(tcp_socket_t *s) {
     tcp_wakeup_waiters(s);
 }
 
-static tcp_socket_t *create_tcp_socket(bool alloc_buffers) {
+static tcp_socket_t *create_tcp_socket(bool alloc_buffers, uint32_t rx_size, uint32_t tx_size) {
     tcp_socket_t *s;
 
-    s = calloc(1, sizeof(tcp_socket_t));
+    s = slab_cache_alloc(&tcp_socket_cache);
     if (!s)
         return NULL;
 
+    memset(s, 0, sizeof(*s));
+
     mutex_init(&s->lock);
     s->ref = 1; // start with the ref already bumped
 
     s->state = STATE_CLOSED;
-    s->rx_win_size = DEFAULT_RX_WINDOW_SIZE;
+    s->rx_win_size = rx_size;
     event_init(&s->rx_event, false, 0);
+    list_initialize(&s->rx_pkts);
 
     s->mss = DEFAULT_MSS;
 
     s->tx_win_low = rand();
     s->tx_win_high = s->tx_win_low;
     s->tx_highest_seq = s->tx_win_low;
+    s->tx_next_seq = s->tx_win_low;
     event_init(&s->tx_event, true, 0);
+    event_init(&s->tx_empty_event, true, 0);
+    list_initialize(&s->tx_refs);
+
+    /* no threshold until the first loss */
+    s->cwnd = tcp_initial_cwnd(s->mss);
+    s->ssthresh = UINT32_MAX;
+    s->rto = TCP_INITIAL_RTO;
 
+    s->tx_buffer_size = tx_size;
     if (alloc_buffers) {
         // XXX check for error
         s->rx_buffer_raw = malloc(s->rx_win_size);
         cbuf_initialize_etc(&s->rx_buffer, s->rx_win_size, s->rx_buffer_raw);
 
-        s->tx_buffer_size = DEFAULT_TX_BUFFER_SIZE;
-        s->tx_buffer = malloc(s->tx_buffer_size);
+        s->tx_ring = tcp_tx_ring_alloc(s->tx_buffer_size);
     }
 
     sem_init(&s->accept_sem, 0);
@@ -988,7 +1860,7 @@ status_t tcp_connect(tcp_socket_t **handle, uint32_t addr, uint16_t port) {
     if (!handle)
         return ERR_INVALID_ARGS;
 
-    s = create_tcp_socket(true);
+    s = create_tcp_socket(true, DEFAULT_RX_WINDOW_SIZE, DEFAULT_TX_BUFFER_SIZE);
     if (!s)
         return ERR_NO_MEMORY;
 
@@ -1014,13 +1886,11 @@ status_t tcp_connect(tcp_socket_t **handle, uint32_t addr, uint16_t port) {
     s->state = STATE_SYN_SENT;
     add_socket_to_list(s);
 
-    /* set up a mss option for sending back */
-    tcp_mss_option_t mss_option;
-    mss_option.kind = 0x2;
-    mss_option.len = 0x4;
-    mss_option.mss = ntohs(s->mss);
+    /* offer everything we can do */
+    uint8_t options[12];
+    size_t options_len = tcp_syn_options(options, true, true);
 
-    tcp_send(s->remote_ip, s->remote_port, s->local_ip, s->local_port, NULL, 0, PKT_SYN, &mss_option, 0x4, 0, s->tx_win_low, s->rx_win_size);
+    tcp_socket_send(s, NULL, PKT_SYN, options, options_len, s->tx_win_low);
 
     // TODO: handle retransmit
 
@@ -1049,7 +1919,7 @@ status_t tcp_open_listen(tcp_socket_t **handle, uint16_t port) {
     if (!handle)
         return ERR_INVALID_ARGS;
 
-    s = create_tcp_socket(false);
+    s = create_tcp_socket(false, DEFAULT_RX_WINDOW_SIZE, DEFAULT_TX_BUFFER_SIZE);
     if (!s)
         return ERR_NO_MEMORY;
 
@@ -1093,6 +1963,122 @@ status_t tcp_accept_timeout(tcp_socket_t *listen_socket, tcp_socket_t **accept_s
     return NO_ERROR;
 }
 
+status_t tcp_set_buffer_sizes(tcp_socket_t *socket, size_t rx_size, size_t tx_size) {
+    if (!socket)
+        return ERR_INVALID_ARGS;
+
+    /* the rx buffer is a cbuf, so a power of two */
+    if (rx_size)
+        rx_size = round_up_pow2_u32(MIN(MAX(rx_size, (size_t)TCP_MIN_BUFFER_SIZE), (size_t)TCP_MAX_BUFFER_SIZE));
+    if (tx_size)
+        tx_size = MIN(MAX(tx_size, (size_t)TCP_MIN_BUFFER_SIZE), (size_t)TCP_MAX_BUFFER_SIZE);
+
+    tcp_socket_t *s = socket;
+    inc_socket_ref(s);
+    mutex_acquire(&s->lock);
+
+    status_t err = NO_ERROR;
+    uint8_t *rx_raw = NULL;
+    tcp_tx_ring_t *tx_ring = NULL;
+
+    if (!s->rx_buffer_raw) {
+        /* a listen socket, pass them on to the sockets it accepts */
+        if (rx_size)
+            s->rx_win_size = rx_size;
+        if (tx_size)
+            s->tx_buffer_size = tx_size;
+        goto out;
+    }
+
+    if (rx_size == s->rx_win_size)
+        rx_size = 0;
+    if (tx_size == s->tx_buffer_size)
+        tx_size = 0;
+
+    /* whatever hasn't been read yet has to fit, and we can't take back window
+     * we've already offered them */
+    if (rx_size && rx_size - 1 < cbuf_space_used(&s->rx_buffer) + s->rx_pkt_bytes +
+            (s->rx_win_high - s->rx_win_low)) {
+        err = ERR_BAD_STATE;
+        goto out;
+    }
+    /* nor move data that hasn't been acked, retransmits are sent from the ring */
+    if (tx_size && s->tx_ring_used > 0) {
+        err = ERR_BAD_STATE;
+        goto out;
+    }
+
+    if (rx_size && !(rx_raw = malloc(rx_size))) {
+        err = ERR_NO_MEMORY;
+        goto out;
+    }
+    if (tx_size && !(tx_ring = tcp_tx_ring_alloc(tx_size))) {
+        free(rx_raw);
+        err = ERR_NO_MEMORY;
+        goto out;
+    }
+
+    if (rx_raw) {
+        iovec_t regions[2];
+        cbuf_peek(&s->rx_buffer, regions);
+
+        uint8_t *old = s->rx_buffer_raw;
+        cbuf_initialize_etc(&s->rx_buffer, rx_size, rx_raw);
+        cbuf_write(&s->rx_buffer, regions[0].iov_base, regions[0].iov_len, false);
+        cbuf_write(&s->rx_buffer, regions[1].iov_base, regions[1].iov_len, false);
+        free(old);
+
+        s->rx_buffer_raw = rx_raw;
+        s->rx_win_size = rx_size;
+
+        /* out of order data didn't come along, they'll have to send it again */
+        s->rx_ooo_count = 0;
+    }
+
+    if (tx_ring) {
+        /* segments the nic hasn't sent yet may still point into the old one */
+        tcp_tx_ring_release(s->tx_ring);
+
+        s->tx_ring = tx_ring;
+        s->tx_buffer_size = tx_size;
+        s->tx_buffer_start = 0;
+        s->tx_buffer_lap = 0;
+
+        if (s->tx_buffer_offset < s->tx_buffer_size)
+            event_signal(&s->tx_event, true);
+        else
+            event_unsignal(&s->tx_event);
+    }
+
+    /* tell them if the window opened */
+    if (rx_raw)
+        send_ack(s);
+
+out:
+    mutex_release(&s->lock);
+    dec_socket_ref(s);
+
+    return err;
+}
+
+/* after a read, quiet the event if nothing is left and tell them if the window opened */
+static void tcp_read_done(tcp_socket_t *s) {
+    DEBUG_ASSERT(is_mutex_held(&s->lock));
+
+    /* if we've used up the last byte in the read buffer, unsignal the read event */
+    size_t remaining_bytes = cbuf_space_used(&s->rx_buffer) + s->rx_pkt_bytes;
+    if (s->state == STATE_ESTABLISHED && remaining_bytes == 0) {
+        event_unsignal(&s->rx_event);
+    }
+
+    /* we've read something, make sure the other end knows that our window is opening */
+    uint32_t new_rx_win_size = s->rx_win_size - remaining_bytes;
+
+    /* if we've opened it enough, send an ack */
+    if (new_rx_win_size >= s->mss && s->rx_win_high - s->rx_win_low < s->mss)
+        send_ack(s);
+}
+
 ssize_t tcp_read(tcp_socket_t *socket, void *buf, size_t len) {
     LTRACEF("socket %p, buf %p, len %zu\n", socket, buf, len);
     if (!socket)
@@ -1112,8 +2098,24 @@ retry:
 
     mutex_acquire(&s->lock);
 
-    /* try to read some data from the receive buffer, even if we're closed */
-    ret = cbuf_read(&s->rx_buffer, buf, len, false);
+    /* the segments kept in pktbufs come first, then the receive buffer, even if we're closed */
+    size_t off = 0;
+    pktbuf_t *p;
+    while (off < len && (p = list_peek_head_type(&s->rx_pkts, pktbuf_t, list)) != NULL) {
+        size_t n = MIN(len - off, p->dlen);
+        memcpy((uint8_t *)buf + off, pktbuf_consume(p, n), n);
+        s->rx_pkt_bytes -= n;
+        off += n;
+
+        if (p->dlen == 0) {
+            list_delete(&p->list);
+            s->rx_pkt_count--;
+            pktbuf_free(p, true);
+        }
+    }
+    off += cbuf_read(&s->rx_buffer, (uint8_t *)buf + off, len - off, false);
+
+    ret = off;
     if (ret == 0) {
         /* check to see if we've closed */
         if (s->state != STATE_ESTABLISHED) {
@@ -1127,18 +2129,66 @@ retry:
         goto retry;
     }
 
-    /* if we've used up the last byte in the read buffer, unsignal the read event */
-    size_t remaining_bytes = cbuf_space_used(&s->rx_buffer);
-    if (s->state == STATE_ESTABLISHED && remaining_bytes == 0) {
+    s->copies.rx_bytes += ret;
+    s->copies.rx_copied += ret;
+
+    tcp_read_done(s);
+
+out:
+    mutex_release(&s->lock);
+    dec_socket_ref(s);
+
+    return ret;
+}
+
+ssize_t tcp_read_pktbuf(tcp_socket_t *socket, pktbuf_t **pkt) {
+    LTRACEF("socket %p\n", socket);
+    if (!socket || !pkt)
+        return ERR_INVALID_ARGS;
+
+    tcp_socket_t *s = socket;
+    inc_socket_ref(s);
+
+    ssize_t ret = 0;
+retry:
+    /* block on available data */
+    event_wait(&s->rx_event);
+
+    mutex_acquire(&s->lock);
+
+    pktbuf_t *p = list_remove_head_type(&s->rx_pkts, pktbuf_t, list);
+    if (p) {
+        /* hand over a segment as it arrived */
+        s->rx_pkt_bytes -= p->dlen;
+        s->rx_pkt_count--;
+        ret = p->dlen;
+    } else if (cbuf_space_used(&s->rx_buffer) > 0) {
+        /* it went through the receive buffer, copy some of it back out */
+        p = pktbuf_alloc();
+        if (!p) {
+            ret = ERR_NO_MEMORY;
+            goto out;
+        }
+        p->dlen = cbuf_read(&s->rx_buffer, p->data, pktbuf_avail_tail(p), false);
+        s->copies.rx_copied += p->dlen;
+        ret = p->dlen;
+    } else {
+        /* check to see if we've closed */
+        if (s->state != STATE_ESTABLISHED) {
+            ret = ERR_CHANNEL_CLOSED;
+            goto out;
+        }
+
+        /* we must have raced with another thread */
         event_unsignal(&s->rx_event);
+        mutex_release(&s->lock);
+        goto retry;
     }
 
-    /* we've read something, make sure the other end knows that our window is opening */
-    uint32_t new_rx_win_size = s->rx_win_size - remaining_bytes;
+    s->copies.rx_bytes += ret;
+    *pkt = p;
 
-    /* if we've opened it enough, send an ack */
-    if (new_rx_win_size >= s->mss && s->rx_win_high - s->rx_win_low < s->mss)
-        send_ack(s);
+    tcp_read_done(s);
 
 out:
     mutex_release(&s->lock);
@@ -1177,21 +2227,43 @@ ssize_t tcp_write(tcp_socket_t *socket, const void *buf, size_t len) {
         }
 
         DEBUG_ASSERT(s->tx_buffer_size > 0);
-        DEBUG_ASSERT(s->tx_buffer_offset <= s->tx_buffer_size);
+        DEBUG_ASSERT(s->tx_ring_used <= s->tx_buffer_offset);
 
-        /* figure out how much data to copy in */
-        size_t to_copy = MIN(s->tx_buffer_size - s->tx_buffer_offset, len - off);
+        /* figure out how much data to copy in. refs count against the buffer
+         * size too, so there is always at least this much room in the ring */
+        size_t space = (s->tx_buffer_offset < s->tx_buffer_size) ? s->tx_buffer_size - s->tx_buffer_offset : 0;
+        size_t to_copy = MIN(space, len - off);
         if (to_copy == 0) {
+            event_unsignal(&s->tx_event);
             mutex_release(&s->lock);
             continue;
         }
 
-        memcpy(s->tx_buffer + s->tx_buffer_offset, (uint8_t *)buf + off, to_copy);
+        uint32_t pos = s->tx_buffer_start + s->tx_ring_used;
+        if (pos >= s->tx_buffer_size)
+            pos -= s->tx_buffer_size;
+
+        /* acked bytes may still be on their way out of the nic, wait for it
+         * to let go of them before writing over them */
+        to_copy = tcp_tx_ring_writable(s, pos, to_copy);
+        if (to_copy == 0) {
+            mutex_release(&s->lock);
+            thread_sleep(TCP_TX_REAP_INTERVAL);
+            continue;
+        }
+
+        size_t first = MIN(to_copy, s->tx_buffer_size - pos);
+        memcpy(s->tx_ring->buf + pos, (const uint8_t *)buf + off, first);
+        memcpy(s->tx_ring->buf, (const uint8_t *)buf + off + first, to_copy - first);
+        s->tx_ring_used += to_copy;
         s->tx_buffer_offset += to_copy;
+        s->copies.tx_bytes += to_copy;
+        s->copies.tx_copied += to_copy;
+        event_unsignal(&s->tx_empty_event);
 
         /* if this has completely filled it, unsignal the event */
-        DEBUG_ASSERT(s->tx_buffer_offset <= s->tx_buffer_size);
-        if (s->tx_buffer_offset == s->tx_buffer_size) {
+        DEBUG_ASSERT(s->tx_ring_used <= s->tx_buffer_size);
+        if (s->tx_buffer_offset >= s->tx_buffer_size) {
             event_unsignal(&s->tx_event);
         }
 
@@ -1207,6 +2279,82 @@ ssize_t tcp_write(tcp_socket_t *socket, const void *buf, size_t len) {
     return len;
 }
 
+ssize_t tcp_write_ref(tcp_socket_t *socket, const void *buf, size_t len, tcp_write_done_t done, void *arg) {
+    LTRACEF("socket %p, buf %p, len %zu\n", socket, buf, len);
+    if (!socket || !done)
+        return ERR_INVALID_ARGS;
+    if (len == 0)
+        return 0;
+    if (!buf)
+        return ERR_INVALID_ARGS;
+    if (len > TCP_MAX_BUFFER_SIZE)
+        return ERR_TOO_BIG;
+
+    tcp_tx_ref_t *r = malloc(sizeof(*r));
+    if (!r)
+        return ERR_NO_MEMORY;
+    r->buf = buf;
+    r->len = len;
+    r->inflight = 0;
+    r->done = done;
+    r->arg = arg;
+
+    tcp_socket_t *s = socket;
+    inc_socket_ref(s);
+
+    for (;;) {
+        /* wait for the tx buffer to open up */
+        event_wait(&s->tx_event);
+
+        mutex_acquire(&s->lock);
+
+        /* check to see if we've closed */
+        if (s->state != STATE_ESTABLISHED && s->state != STATE_CLOSE_WAIT) {
+            mutex_release(&s->lock);
+            dec_socket_ref(s);
+            free(r);
+            return ERR_CHANNEL_CLOSED;
+        }
+
+        if (s->tx_buffer_offset < s->tx_buffer_size)
+            break;
+
+        event_unsignal(&s->tx_event);
+        mutex_release(&s->lock);
+    }
+
+    /* it goes in whole, even past the buffer size */
+    r->seq = s->tx_win_low + s->tx_buffer_offset;
+    list_add_tail(&s->tx_refs, &r->node);
+    s->tx_buffer_offset += len;
+    s->copies.tx_bytes += len;
+    event_unsignal(&s->tx_empty_event);
+
+    if (s->tx_buffer_offset >= s->tx_buffer_size) {
+        event_unsignal(&s->tx_event);
+    }
+
+    /* send as much data as we can */
+    tcp_write_pending_data(s);
+
+    mutex_release(&s->lock);
+    dec_socket_ref(s);
+
+    return len;
+}
+
+status_t tcp_get_copy_stats(tcp_socket_t *socket, tcp_copy_stats_t *stats) {
+    if (!socket || !stats)
+        return ERR_INVALID_ARGS;
+
+    tcp_socket_t *s = socket;
+    mutex_acquire(&s->lock);
+    *stats = s->copies;
+    mutex_release(&s->lock);
+
+    return NO_ERROR;
+}
+
 status_t tcp_close(tcp_socket_t *socket) {
     if (!socket)
         return ERR_INVALID_ARGS;
@@ -1218,6 +2366,19 @@ status_t tcp_close(tcp_socket_t *socket) {
 
     LTRACEF("socket %p, state %d (%s), ref %d\n", s, s->state, tcp_state_to_string(s->state), s->ref);
 
+    /* the congestion window may be holding back data already written, let
+     * it go out before the FIN, for a while at least */
+    lk_time_t linger_start = current_time();
+    while ((s->state == STATE_ESTABLISHED || s->state == STATE_CLOSE_WAIT) && s->tx_buffer_offset > 0) {
+        lk_time_t waited = current_time() - linger_start;
+        if (waited >= CLOSE_LINGER_TIMEOUT)
+            break;
+
+        mutex_release(&s->lock);
+        event_wait_timeout(&s->tx_empty_event, CLOSE_LINGER_TIMEOUT - waited);
+        mutex_acquire(&s->lock);
+    }
+
     status_t err;
     switch (s->state) {
         case STATE_CLOSED:
@@ -1237,14 +2398,14 @@ status_t tcp_close(tcp_socket_t *socket) {
         case STATE_SYN_RCVD:
         case STATE_ESTABLISHED:
             s->state = STATE_FIN_WAIT_1;
-            tcp_socket_send(s, NULL, 0, PKT_ACK|PKT_FIN, NULL, 0, s->tx_win_low);
+            tcp_socket_send(s, NULL, PKT_ACK|PKT_FIN, NULL, 0, s->tx_win_low);
             s->tx_win_low++;
 
             /* stick around and wait for them to FIN us */
             break;
         case STATE_CLOSE_WAIT:
             s->state = STATE_LAST_ACK;
-            tcp_socket_send(s, NULL, 0, PKT_ACK|PKT_FIN, NULL, 0, s->tx_win_low);
+            tcp_socket_send(s, NULL, PKT_ACK|PKT_FIN, NULL, 0, s->tx_win_low);
             s->tx_win_low++;
 
             // XXX set up fin retransmit timer here
@@ -1291,12 +2452,12 @@ usage:
 
     if (!strcmp(argv[1].str, "sockets")) {
 
-        mutex_acquire(&tcp_socket_list_lock);
+        rwlock_acquire_read(&tcp_socket_list_lock);
         tcp_socket_t *s = NULL;
         list_for_every_entry(&tcp_socket_list, s, tcp_socket_t, node) {
             dump_socket(s);
         }
-        mutex_release(&tcp_socket_list_lock);
+        rwlock_release_read(&tcp_socket_list_lock);
     } else if (!strcmp(argv[1].str, "listenclose")) {
         /* listen for a connection, accept it, then immediately close it */
         if (argc < 3) goto notenoughargs;
@@ -33,7 +33,6 @@ typedef struct udp_socket {
     uint32_t host;
     uint16_t sport;
     uint16_t dport;
-    const uint8_t *mac;
 } udp_socket_t;
 
 typedef struct udp_hdr {
@@ -74,7 +73,6 @@ status_t udp_open(uint32_t host, uint16_t sport, uint16_t dport, udp_socket_t **
     LTRACEF("host %u.%u.%u.%u sport %u dport %u handle %p\n",
             IPV4_SPLIT(host), sport, dport, handle);
     udp_socket_t *socket;
-    const uint8_t *dst_mac;
 
     if (handle == NULL) {
         return -EINVAL;
@@ -85,16 +83,9 @@ status_t udp_open(uint32_t host, uint16_t sport, uint16_t dport, udp_socket_t **
         return -ENOMEM;
     }
 
-    dst_mac = arp_get_dest_mac(host);
-    if (dst_mac == NULL) {
-        free(socket);
-        return -EHOSTUNREACH;
-    }
-
     socket->host = host;
     socket->sport = sport;
     socket->dport = dport;
-    socket->mac = dst_mac;
 
     *handle = socket;
 
@@ -141,7 +132,8 @@ status_t udp_send_iovec(const iovec_t *iov, uint iov_count, udp_socket_t *handle
     udp->len        = htons(sizeof(udp_hdr_t) + len);
     udp->chksum     = 0;
 
-    minip_build_mac_hdr(eth, handle->mac, ETH_TYPE_IPV4);
+    // the destination mac is filled in once arp knows it
+    minip_build_mac_hdr(eth, bcast_mac, ETH_TYPE_IPV4);
     minip_build_ipv4_hdr(ip, handle->host, IP_PROTO_UDP, len + sizeof(udp_hdr_t));
 
 #if (MINIP_USE_UDP_CHECKSUM != 0)
@@ -150,7 +142,7 @@ status_t udp_send_iovec(const iovec_t *iov, uint iov_count, udp_socket_t *handle
 
     LTRACEF("packet paylod len %ld\n", len);
 
-    minip_tx_handler(minip_tx_arg, p);
+    ret = arp_send_pkt(handle->host, p);
 
     return ret;
 }
@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#pragma once
+
+#include <kernel/spinlock.h>
+#include <lk/compiler.h>
+#include <lk/list.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Object caches for fixed size objects, carved out of single pages.
+ *
+ * Each cpu allocates from and frees into its own slab under its own lock,
+ * the cache wide lock is only taken to swap a cpu's slab for another one.
+ * Objects are laid out at a different cache color offset in successive slabs
+ * so the same object in different slabs doesn't land on the same cache lines.
+ *
+ * If a constructor is given, objects are constructed once when their slab is
+ * created and handed out in that state. They should be freed back in the same
+ * state. The destructor runs when a completely free slab is reclaimed.
+ *
+ * Allocation must be from thread context. Freeing only takes spinlocks and
+ * never gives pages back, so it may be done inside a critical section.
+ */
+
+__BEGIN_CDECLS
+
+#define SLAB_CACHE_MAGIC (0x736c6162)  // 'slab'
+
+typedef void (*slab_ctor_t)(void *obj);
+typedef void (*slab_dtor_t)(void *obj);
+
+struct slab;
+
+typedef struct slab_cache {
+    uint32_t magic;
+    const char *name;
+    size_t size;
+    size_t align;
+    slab_ctor_t ctor;
+    slab_dtor_t dtor;
+
+    /* layout, worked out when the first slab is created */
+    size_t slot;            /* distance between objects */
+    size_t link;            /* offset of the free list link inside a free object */
+    size_t first;           /* offset of the first object in an uncolored slab */
+    uint objs_per_slab;
+    uint colors;
+    uint next_color;
+
+    /* slabs not currently owned by a cpu */
+    spin_lock_t lock;
+    struct list_node partial;
+    struct list_node full;
+    struct list_node empty;
+    uint slab_count;
+
+    struct {
+        spin_lock_t lock;
+        struct slab *slab;
+        ulong allocs;
+        ulong frees;
+        ulong refills;
+    } cpu[SMP_MAX_CPUS];
+
+    struct list_node node;  /* in the list of all caches */
+    bool allocated;
+} slab_cache_t;
+
+#define SLAB_CACHE_INITIAL_VALUE(c, _name, _size, _align, _ctor, _dtor) \
+{ \
+    .magic = SLAB_CACHE_MAGIC, \
+    .name = _name, \
+    .size = _size, \
+    .align = _align, \
+    .ctor = _ctor, \
+    .dtor = _dtor, \
+    .lock = SPIN_LOCK_INITIAL_VALUE, \
+    .partial = LIST_INITIAL_VALUE((c).partial), \
+    .full = LIST_INITIAL_VALUE((c).full), \
+    .empty = LIST_INITIAL_VALUE((c).empty), \
+    .node = LIST_INITIAL_CLEARED_VALUE, \
+}
+
+/* set up a cache in caller provided storage, or allocate one */
+void slab_cache_init(slab_cache_t *cache, const char *name, size_t size, size_t align,
+                     slab_ctor_t ctor, slab_dtor_t dtor);
+slab_cache_t *slab_cache_create(const char *name, size_t size, size_t align,
+                                slab_ctor_t ctor, slab_dtor_t dtor);
+
+/* every object must have been freed. frees a cache from slab_cache_create. */
+void slab_cache_destroy(slab_cache_t *cache);
+
+void *slab_cache_alloc(slab_cache_t *cache);
+void slab_cache_free(slab_cache_t *cache, void *obj);
+
+/* give every completely free slab in every cache back to the page allocator.
+ * returns the number of pages freed. */
+size_t slab_reclaim(void);
+
+__END_CDECLS
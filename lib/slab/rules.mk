@@ -0,0 +1,11 @@
+LOCAL_DIR := $(GET_LOCAL_DIR)
+
+MODULE := $(LOCAL_DIR)
+
+MODULE_DEPS := \
+	lib/heap
+
+MODULE_SRCS += \
+	$(LOCAL_DIR)/slab.c
+
+include make/module.mk
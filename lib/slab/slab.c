@@ -0,0 +1,418 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#include <lib/slab.h>
+
+#include <arch/atomic.h>
+#include <arch/defines.h>
+#include <arch/ops.h>
+#include <assert.h>
+#include <kernel/mutex.h>
+#include <lib/page_alloc.h>
+#include <lk/console_cmd.h>
+#include <lk/debug.h>
+#include <lk/err.h>
+#include <lk/pow2.h>
+#include <lk/trace.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOCAL_TRACE 0
+
+#define SLAB_UNOWNED (-1)
+
+/* header at the start of every slab page */
+struct slab {
+    struct list_node node;      /* in one of the cache's lists while unowned */
+    slab_cache_t *cache;
+    void *free;                 /* free objects, linked through cache->link */
+    uint inuse;
+    volatile int owner;         /* cpu allocating from it, or SLAB_UNOWNED */
+};
+
+/* all caches that have created a slab, for slabinfo and reclaim */
+static mutex_t slab_caches_lock = MUTEX_INITIAL_VALUE(slab_caches_lock);
+static struct list_node slab_caches = LIST_INITIAL_VALUE(slab_caches);
+
+static inline struct slab *obj_to_slab(const void *obj) {
+    return (struct slab *)ROUNDDOWN((uintptr_t)obj, PAGE_SIZE);
+}
+
+static inline void **obj_link(const slab_cache_t *cache, void *obj) {
+    return (void **)((uint8_t *)obj + cache->link);
+}
+
+static inline void *slab_pop(slab_cache_t *cache, struct slab *s) {
+    void *obj = s->free;
+    s->free = *obj_link(cache, obj);
+    s->inuse++;
+    return obj;
+}
+
+static inline void slab_push(slab_cache_t *cache, struct slab *s, void *obj) {
+    *obj_link(cache, obj) = s->free;
+    s->free = obj;
+    s->inuse--;
+}
+
+void slab_cache_init(slab_cache_t *cache, const char *name, size_t size, size_t align,
+                     slab_ctor_t ctor, slab_dtor_t dtor) {
+    *cache = (slab_cache_t)SLAB_CACHE_INITIAL_VALUE(*cache, name, size, align, ctor, dtor);
+}
+
+slab_cache_t *slab_cache_create(const char *name, size_t size, size_t align,
+                                slab_ctor_t ctor, slab_dtor_t dtor) {
+    slab_cache_t *cache = malloc(sizeof(slab_cache_t));
+    if (!cache)
+        return NULL;
+
+    slab_cache_init(cache, name, size, align, ctor, dtor);
+    cache->allocated = true;
+
+    return cache;
+}
+
+/* work out where objects go in a slab, once */
+static status_t slab_cache_layout(slab_cache_t *cache) {
+    if (cache->objs_per_slab)
+        return NO_ERROR;
+
+    size_t align = MAX(cache->align, sizeof(void *));
+    DEBUG_ASSERT(ispow2(align));
+
+    /* the free list link lives past the object if a constructed object must
+     * survive being on the free list */
+    size_t link = 0;
+    size_t slot = MAX(cache->size, sizeof(void *));
+    if (cache->ctor) {
+        link = ROUNDUP(cache->size, sizeof(void *));
+        slot = link + sizeof(void *);
+    }
+    slot = ROUNDUP(slot, align);
+
+    size_t first = ROUNDUP(sizeof(struct slab), align);
+    if (first + slot > PAGE_SIZE)
+        return ERR_TOO_BIG;
+
+    uint count = (PAGE_SIZE - first) / slot;
+    size_t color_unit = MAX(align, CACHE_LINE);
+    size_t left_over = PAGE_SIZE - first - count * slot;
+
+    cache->link = link;
+    cache->slot = slot;
+    cache->first = first;
+    cache->colors = left_over / color_unit + 1;
+    cache->objs_per_slab = count;
+
+    LTRACEF("cache '%s': size %zu slot %zu, %u per slab, %u colors\n",
+            cache->name, cache->size, slot, count, cache->colors);
+
+    return NO_ERROR;
+}
+
+/* add a fresh slab to the cache's empty list */
+static status_t slab_cache_grow(slab_cache_t *cache) {
+    mutex_acquire(&slab_caches_lock);
+    status_t err = slab_cache_layout(cache);
+    if (err == NO_ERROR && !list_in_list(&cache->node))
+        list_add_tail(&slab_caches, &cache->node);
+    mutex_release(&slab_caches_lock);
+    if (err < 0)
+        return err;
+
+    struct slab *s = page_alloc(1, PAGE_ALLOC_ANY_ARENA);
+#if !WITH_KERNEL_VM
+    if (!s) {
+        /* other caches may be sitting on free slabs. with the vm the pmm
+         * does this itself for every allocation that comes up short. */
+        slab_reclaim();
+        s = page_alloc(1, PAGE_ALLOC_ANY_ARENA);
+    }
+#endif
+    if (!s)
+        return ERR_NO_MEMORY;
+
+    s->cache = cache;
+    s->free = NULL;
+    s->inuse = cache->objs_per_slab;
+    s->owner = SLAB_UNOWNED;
+    list_clear_node(&s->node);
+
+    uint color = (uint)atomic_add((volatile int *)&cache->next_color, 1) % cache->colors;
+    uint8_t *obj = (uint8_t *)s + cache->first + color * MAX(cache->align, CACHE_LINE);
+
+    /* push in reverse so objects are handed out in address order */
+    obj += cache->slot * (cache->objs_per_slab - 1);
+    for (uint i = 0; i < cache->objs_per_slab; i++) {
+        if (cache->ctor)
+            cache->ctor(obj);
+        slab_push(cache, s, obj);
+        obj -= cache->slot;
+    }
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&cache->lock, state);
+    list_add_head(&cache->empty, &s->node);
+    cache->slab_count++;
+    spin_unlock_irqrestore(&cache->lock, state);
+
+    return NO_ERROR;
+}
+
+/**
+ * @brief  Allocate an object from a cache
+ *
+ * @return  The object, or NULL if no memory could be found for a new slab.
+ */
+void *slab_cache_alloc(slab_cache_t *cache) {
+    DEBUG_ASSERT(cache->magic == SLAB_CACHE_MAGIC);
+
+    for (;;) {
+        spin_lock_saved_state_t state;
+        arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+        uint cpu = arch_curr_cpu_num();
+        spin_lock(&cache->cpu[cpu].lock);
+
+        struct slab *s = cache->cpu[cpu].slab;
+        if (likely(s && s->free)) {
+            void *obj = slab_pop(cache, s);
+            cache->cpu[cpu].allocs++;
+            spin_unlock_restore(&cache->cpu[cpu].lock, state, SPIN_LOCK_FLAG_INTERRUPTS);
+            return obj;
+        }
+
+        /* swap our full slab for a partially free or empty one */
+        spin_lock(&cache->lock);
+        if (s) {
+            s->owner = SLAB_UNOWNED;
+            list_add_head(&cache->full, &s->node);
+            cache->cpu[cpu].slab = NULL;
+        }
+
+        s = list_remove_head_type(&cache->partial, struct slab, node);
+        if (!s)
+            s = list_remove_head_type(&cache->empty, struct slab, node);
+
+        void *obj = NULL;
+        if (s) {
+            s->owner = cpu;
+            cache->cpu[cpu].slab = s;
+            cache->cpu[cpu].refills++;
+            cache->cpu[cpu].allocs++;
+            obj = slab_pop(cache, s);
+        }
+
+        spin_unlock(&cache->lock);
+        spin_unlock_restore(&cache->cpu[cpu].lock, state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+        if (obj)
+            return obj;
+
+        if (slab_cache_grow(cache) < 0)
+            return NULL;
+    }
+}
+
+/**
+ * @brief  Return an object to its cache
+ */
+void slab_cache_free(slab_cache_t *cache, void *obj) {
+    DEBUG_ASSERT(cache->magic == SLAB_CACHE_MAGIC);
+
+    if (!obj)
+        return;
+
+    struct slab *s = obj_to_slab(obj);
+    DEBUG_ASSERT(s->cache == cache);
+
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    /* ownership only changes with the owning cpu's lock and the cache lock
+     * both held, so recheck it once we hold either */
+    for (;;) {
+        int owner = s->owner;
+
+        if (owner != SLAB_UNOWNED) {
+            spin_lock(&cache->cpu[owner].lock);
+            if (likely(s->owner == owner)) {
+                slab_push(cache, s, obj);
+                cache->cpu[owner].frees++;
+                spin_unlock(&cache->cpu[owner].lock);
+                break;
+            }
+            spin_unlock(&cache->cpu[owner].lock);
+        } else {
+            spin_lock(&cache->lock);
+            if (likely(s->owner == SLAB_UNOWNED)) {
+                bool was_full = (s->free == NULL);
+                slab_push(cache, s, obj);
+                cache->cpu[arch_curr_cpu_num()].frees++;
+
+                if (s->inuse == 0) {
+                    list_delete(&s->node);
+                    list_add_head(&cache->empty, &s->node);
+                } else if (was_full) {
+                    list_delete(&s->node);
+                    list_add_head(&cache->partial, &s->node);
+                }
+                spin_unlock(&cache->lock);
+                break;
+            }
+            spin_unlock(&cache->lock);
+        }
+    }
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+}
+
+/* pull every completely free slab out of the cache */
+static void slab_cache_take_empty(slab_cache_t *cache, struct list_node *list) {
+    spin_lock_saved_state_t state;
+
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        spin_lock_irqsave(&cache->cpu[cpu].lock, state);
+        spin_lock(&cache->lock);
+        struct slab *s = cache->cpu[cpu].slab;
+        if (s && s->inuse == 0) {
+            s->owner = SLAB_UNOWNED;
+            cache->cpu[cpu].slab = NULL;
+            list_add_tail(list, &s->node);
+            cache->slab_count--;
+        }
+        spin_unlock(&cache->lock);
+        spin_unlock_irqrestore(&cache->cpu[cpu].lock, state);
+    }
+
+    spin_lock_irqsave(&cache->lock, state);
+    struct slab *s;
+    while ((s = list_remove_head_type(&cache->empty, struct slab, node))) {
+        list_add_tail(list, &s->node);
+        cache->slab_count--;
+    }
+    spin_unlock_irqrestore(&cache->lock, state);
+}
+
+static size_t slab_free_list(slab_cache_t *cache, struct list_node *list) {
+    size_t pages = 0;
+    struct slab *s;
+
+    while ((s = list_remove_head_type(list, struct slab, node))) {
+        if (cache->dtor) {
+            for (void *obj = s->free; obj; obj = *obj_link(cache, obj))
+                cache->dtor(obj);
+        }
+        page_free(s, 1);
+        pages++;
+    }
+
+    return pages;
+}
+
+size_t slab_reclaim(void) {
+    size_t pages = 0;
+
+    mutex_acquire(&slab_caches_lock);
+    slab_cache_t *cache;
+    list_for_every_entry(&slab_caches, cache, slab_cache_t, node) {
+        struct list_node list = LIST_INITIAL_VALUE(list);
+
+        slab_cache_take_empty(cache, &list);
+        pages += slab_free_list(cache, &list);
+    }
+    mutex_release(&slab_caches_lock);
+
+    LTRACEF("reclaimed %zu pages\n", pages);
+
+    return pages;
+}
+
+void slab_cache_destroy(slab_cache_t *cache) {
+    DEBUG_ASSERT(cache->magic == SLAB_CACHE_MAGIC);
+
+    struct list_node list = LIST_INITIAL_VALUE(list);
+
+    mutex_acquire(&slab_caches_lock);
+    slab_cache_take_empty(cache, &list);
+    if (list_in_list(&cache->node))
+        list_delete(&cache->node);
+    mutex_release(&slab_caches_lock);
+
+    slab_free_list(cache, &list);
+
+    if (cache->slab_count != 0)
+        panic("slab_cache_destroy: cache '%s' still has %u slabs with objects in use\n",
+              cache->name, cache->slab_count);
+
+    cache->magic = 0;
+    if (cache->allocated)
+        free(cache);
+}
+
+static void slab_cache_dump(slab_cache_t *cache) {
+    uint partial = 0, full = 0, empty = 0, owned = 0;
+    ulong inuse = 0, allocs = 0, frees = 0, refills = 0;
+    struct slab *s;
+
+    spin_lock_saved_state_t state;
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        spin_lock_irqsave(&cache->cpu[cpu].lock, state);
+        if (cache->cpu[cpu].slab) {
+            owned++;
+            inuse += cache->cpu[cpu].slab->inuse;
+        }
+        allocs += cache->cpu[cpu].allocs;
+        frees += cache->cpu[cpu].frees;
+        refills += cache->cpu[cpu].refills;
+        spin_unlock_irqrestore(&cache->cpu[cpu].lock, state);
+    }
+
+    spin_lock_irqsave(&cache->lock, state);
+    list_for_every_entry(&cache->partial, s, struct slab, node) {
+        partial++;
+        inuse += s->inuse;
+    }
+    list_for_every_entry(&cache->full, s, struct slab, node) {
+        full++;
+        inuse += s->inuse;
+    }
+    empty = list_length(&cache->empty);
+    uint slabs = cache->slab_count;
+    spin_unlock_irqrestore(&cache->lock, state);
+
+    printf("%-16s %6zu %6zu %5u %5u %7lu %7u %4u %4u %4u %4u %10lu %10lu %8lu\n",
+           cache->name, cache->size, cache->slot, cache->objs_per_slab, cache->colors,
+           inuse, slabs, owned, partial, full, empty, allocs, frees, refills);
+}
+
+static int cmd_slabinfo(int argc, const console_cmd_args *argv) {
+    if (argc >= 2 && !strcmp(argv[1].str, "reclaim")) {
+        printf("reclaimed %zu pages\n", slab_reclaim());
+        return NO_ERROR;
+    } else if (argc >= 2) {
+        printf("usage: %s [reclaim]\n", argv[0].str);
+        return ERR_INVALID_ARGS;
+    }
+
+    printf("%-16s %6s %6s %5s %5s %7s %7s %4s %4s %4s %4s %10s %10s %8s\n",
+           "name", "size", "slot", "objs", "color", "inuse", "slabs", "cpu", "part", "full", "free",
+           "allocs", "frees", "refills");
+
+    mutex_acquire(&slab_caches_lock);
+    slab_cache_t *cache;
+    list_for_every_entry(&slab_caches, cache, slab_cache_t, node) {
+        slab_cache_dump(cache);
+    }
+    mutex_release(&slab_caches_lock);
+
+    return NO_ERROR;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("slabinfo", "slab cache statistics", &cmd_slabinfo)
+STATIC_COMMAND_END(slab);
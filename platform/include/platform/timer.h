@@ -29,5 +29,9 @@ status_t platform_set_periodic_timer(platform_timer_callback callback, void *arg
 status_t platform_set_oneshot_timer (platform_timer_callback callback, void *arg, lk_time_t interval);
 void     platform_stop_timer(void);
 
+/* If the platform also sets PLATFORM_HAS_HIRES_TIMER its one-shot timer can be
+ * programmed with sub-millisecond precision */
+status_t platform_set_oneshot_timer_ns(platform_timer_callback callback, void *arg, lk_time_ns_t interval);
+
 __END_CDECLS
 
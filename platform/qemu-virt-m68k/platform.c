@@ -107,6 +107,7 @@ void platform_init(void) {
 
         /* start minip */
         minip_set_eth(virtio_net_send_minip_pkt, NULL, mac_addr);
+        minip_set_eth_features(virtio_net_get_minip_features());
 
         __UNUSED uint32_t ip_addr = IPV4(192, 168, 0, 99);
         __UNUSED uint32_t ip_mask = IPV4(255, 255, 255, 0);
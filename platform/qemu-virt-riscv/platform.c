@@ -199,6 +199,7 @@ void platform_init(void) {
 
         /* start minip */
         minip_set_eth(virtio_net_send_minip_pkt, NULL, mac_addr);
+        minip_set_eth_features(virtio_net_get_minip_features());
 
         virtio_net_start();
 
@@ -0,0 +1,17 @@
+/*
+ * Copyright (c) 2008 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#include <lk/compiler.h>
+#include <platform/time.h>
+
+/*
+ * default implementation for platforms that do not have a clock finer
+ * than a microsecond.
+ */
+__WEAK lk_time_ns_t current_time_ns(void) {
+    return current_time_hires() * 1000ULL;
+}